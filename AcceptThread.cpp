@@ -23,6 +23,7 @@
 #include "stringtools.h"
 #include "SelectThread.h"
 #include "Client.h"
+#include "EpollLoop.h"
 #include <memory.h>
 #ifndef _WIN32
 #include <errno.h>
@@ -89,7 +90,7 @@ void OutputCallback::operator() (const void* buf, size_t count)
 }
 
 CAcceptThread::CAcceptThread( unsigned int nWorkerThreadsPerMaster, unsigned short int uPort ) 
-	: error(false), s_v6(SOCKET_ERROR), s(SOCKET_ERROR)
+	: epoll_loop(NULL), s(SOCKET_ERROR), s_v6(SOCKET_ERROR), error(false)
 {
 	WorkerThreadsPerMaster=nWorkerThreadsPerMaster;
 
@@ -129,6 +130,13 @@ CAcceptThread::CAcceptThread( unsigned int nWorkerThreadsPerMaster, unsigned sho
 		}
 	}
 
+#ifdef __linux__
+	if (Server->getServerParameter("fastcgi_disable_epoll").empty())
+	{
+		epoll_loop = CEpollLoop::create();
+	}
+#endif
+
 	Server->Log("Server started up successfully!",LL_INFO);
 }
 
@@ -137,6 +145,9 @@ CAcceptThread::~CAcceptThread()
 	closesocket(s);
 	if (s_v6 != SOCKET_ERROR)
 		closesocket(s_v6);
+#ifdef __linux__
+	delete epoll_loop;
+#endif
 	Server->Log("Deleting SelectThreads..");
 	for(size_t i=0;i<SelectThreads.size();++i)
 	{
@@ -255,6 +266,14 @@ void CAcceptThread::operator()(bool single)
 
 void CAcceptThread::AddToSelectThread(CClient *client)
 {
+#ifdef __linux__
+	if (epoll_loop != NULL)
+	{
+		epoll_loop->AddClient(client);
+		return;
+	}
+#endif
+
 	for(size_t i=0;i<SelectThreads.size();++i)
 	{
 		if( SelectThreads[i]->FreeClients()>0 )
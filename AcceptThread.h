@@ -6,6 +6,7 @@
 
 class CSelectThread;
 class CClient;
+class CEpollLoop;
 
 class CAcceptThread
 {
@@ -24,6 +25,7 @@ private:
 	bool init_socket_v6(unsigned short port);
 
 	std::vector<CSelectThread*> SelectThreads;
+	CEpollLoop* epoll_loop;
 
 	SOCKET s;
 	SOCKET s_v6;
@@ -52,7 +52,7 @@ bool DatabaseCursor::reset()
 	is_shutdown = false;
 	transaction_lock = false;
 
-	query->setupStepping(timeoutms, false);
+	query->setupStepping(timeoutms, true);
 
 #ifdef LOG_READ_QUERIES
 	active_query = new ScopedAddActiveQuery(query);
@@ -63,6 +63,16 @@ bool DatabaseCursor::reset()
 bool DatabaseCursor::next(db_single_result &res)
 {
 	res.clear();
+	return step(&res);
+}
+
+bool DatabaseCursor::nextRow()
+{
+	return step(NULL);
+}
+
+bool DatabaseCursor::step(db_single_result* res)
+{
 	do
 	{
 		bool reset=false;
@@ -84,6 +94,58 @@ bool DatabaseCursor::next(db_single_result &res)
 	return false;
 }
 
+int DatabaseCursor::getColumnCount()
+{
+	return sqlite3_column_count(query->getPreparedStatement());
+}
+
+bool DatabaseCursor::isNull(int col)
+{
+	return sqlite3_column_type(query->getPreparedStatement(), col)==SQLITE_NULL;
+}
+
+int DatabaseCursor::getInt(int col)
+{
+	return sqlite3_column_int(query->getPreparedStatement(), col);
+}
+
+int64 DatabaseCursor::getInt64(int col)
+{
+	return sqlite3_column_int64(query->getPreparedStatement(), col);
+}
+
+double DatabaseCursor::getDouble(int col)
+{
+	return sqlite3_column_double(query->getPreparedStatement(), col);
+}
+
+const char* DatabaseCursor::getData(int col, size_t& size)
+{
+	sqlite3_stmt* ps = query->getPreparedStatement();
+	const void* data;
+	if(sqlite3_column_type(ps, col)==SQLITE_BLOB)
+	{
+		data = sqlite3_column_blob(ps, col);
+	}
+	else
+	{
+		data = sqlite3_column_text(ps, col);
+	}
+	size = static_cast<size_t>(sqlite3_column_bytes(ps, col));
+	return reinterpret_cast<const char*>(data);
+}
+
+std::string DatabaseCursor::getString(int col)
+{
+	size_t size;
+	const char* data = getData(col, size);
+	if(data==NULL)
+	{
+		return std::string();
+	}
+	return std::string(data, size);
+}
+
 bool DatabaseCursor::has_error(void)
 {
 	return _has_error;
@@ -15,6 +15,15 @@ public:
 
 	bool next(db_single_result &res);
 
+	bool nextRow();
+	int getColumnCount();
+	bool isNull(int col);
+	int getInt(int col);
+	int64 getInt64(int col);
+	double getDouble(int col);
+	const char* getData(int col, size_t& size);
+	std::string getString(int col);
+
 	bool reset();
 
 	bool has_error();
@@ -22,6 +31,8 @@ public:
 	virtual void shutdown();
 
 private:
+	bool step(db_single_result* res);
+
 	CQuery *query;
 
 	bool transaction_lock;
@@ -0,0 +1,282 @@
+/*************************************************************************
+*    UrBackup - Client/Server backup system
+*    Copyright (C) 2011-2016 Martin Raiber
+*
+*    This program is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU Affero General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU Affero General Public License for more details.
+*
+*    You should have received a copy of the GNU Affero General Public License
+*    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**************************************************************************/
+
+#ifdef __linux__
+
+#include "vld.h"
+
+#include "EpollLoop.h"
+#include "Client.h"
+#include "Server.h"
+#include "stringtools.h"
+#include "Interface/ThreadPool.h"
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <errno.h>
+
+namespace
+{
+	//Re-arm a busy connection after this many reads so that it cannot starve others
+	const size_t c_max_reads_per_event = 64;
+
+	const uint32_t c_client_events = EPOLLIN | EPOLLRDHUP | EPOLLET | EPOLLONESHOT;
+
+	const int c_max_events = 64;
+
+	class CEpollDispatcher : public IThread
+	{
+	public:
+		CEpollDispatcher(CEpollLoop* loop)
+			: loop(loop)
+		{}
+
+		virtual ~CEpollDispatcher() {}
+
+		void operator()()
+		{
+			(*loop)();
+			delete this;
+		}
+
+	private:
+		CEpollLoop* loop;
+	};
+
+	class CEpollClientTask : public IThread
+	{
+	public:
+		CEpollClientTask(CEpollLoop* loop, CClient* client)
+			: loop(loop), client(client)
+		{}
+
+		virtual ~CEpollClientTask() {}
+
+		void operator()()
+		{
+			loop->HandleClient(client);
+			delete this;
+		}
+
+	private:
+		CEpollLoop* loop;
+		CClient* client;
+	};
+}
+
+CEpollLoop* CEpollLoop::create()
+{
+	int epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epfd == -1)
+	{
+		Server->Log("Creating epoll instance failed. errno=" + convert(errno), LL_WARNING);
+		return NULL;
+	}
+
+	int stop_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (stop_fd == -1)
+	{
+		Server->Log("Creating eventfd failed. errno=" + convert(errno), LL_WARNING);
+		close(epfd);
+		return NULL;
+	}
+
+	//Level-triggered and not one-shot, so that the dispatcher sees it until it stops
+	epoll_event ev = {};
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, stop_fd, &ev) != 0)
+	{
+		Server->Log("Adding eventfd to epoll failed. errno=" + convert(errno), LL_WARNING);
+		close(stop_fd);
+		close(epfd);
+		return NULL;
+	}
+
+	CEpollLoop* ret = new CEpollLoop(epfd, stop_fd);
+
+	{
+		IScopedLock lock(ret->stop_mutex);
+		ret->running = Server->createThread(new CEpollDispatcher(ret), "fastcgi: epoll");
+	}
+
+	if (!ret->running)
+	{
+		Server->Log("Starting epoll thread failed", LL_WARNING);
+		delete ret;
+		return NULL;
+	}
+
+	return ret;
+}
+
+CEpollLoop::CEpollLoop(int epfd, int stop_fd)
+	: epfd(epfd), stop_fd(stop_fd), stop_mutex(Server->createMutex()),
+	stop_cond(Server->createCondition()), running(false), n_tasks(0)
+{
+}
+
+CEpollLoop::~CEpollLoop()
+{
+	Server->Log("waiting for epoll requests...");
+	{
+		IScopedLock lock(stop_mutex);
+		uint64_t val = 1;
+		if (write(stop_fd, &val, sizeof(val)) != sizeof(val))
+		{
+			Server->Log("Error waking up epoll thread. errno=" + convert(errno), LL_ERROR);
+		}
+
+		while (running || n_tasks > 0)
+		{
+			stop_cond->wait(&lock);
+		}
+	}
+
+	close(stop_fd);
+	close(epfd);
+
+	Server->destroy(stop_mutex);
+	Server->destroy(stop_cond);
+}
+
+bool CEpollLoop::AddClient(CClient *client)
+{
+	epoll_event ev = {};
+	ev.events = c_client_events;
+	ev.data.ptr = client;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, client->getSocket(), &ev) != 0)
+	{
+		Server->Log("Adding client to epoll failed. errno=" + convert(errno), LL_ERROR);
+		RemoveClient(client);
+		return false;
+	}
+	return true;
+}
+
+void CEpollLoop::operator()()
+{
+	epoll_event events[c_max_events];
+	bool stop = false;
+
+	while (!stop)
+	{
+		int rc = epoll_wait(epfd, events, c_max_events, -1);
+
+		if (rc < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+
+			Server->Log("epoll_wait error: " + convert(errno), LL_ERROR);
+			break;
+		}
+
+		for (int i = 0; i < rc; ++i)
+		{
+			if (events[i].data.ptr == NULL)
+			{
+				stop = true;
+				continue;
+			}
+
+			{
+				IScopedLock lock(stop_mutex);
+				++n_tasks;
+			}
+
+			//One-shot, so the connection is not reported again until the task re-arms it
+			Server->getThreadPool()->execute(new CEpollClientTask(this, static_cast<CClient*>(events[i].data.ptr)), "fastcgi: request");
+		}
+	}
+
+	IScopedLock lock(stop_mutex);
+	running = false;
+	stop_cond->notify_all();
+}
+
+void CEpollLoop::HandleClient(CClient *client)
+{
+	ReadClient(client);
+
+	IScopedLock lock(stop_mutex);
+	--n_tasks;
+	stop_cond->notify_all();
+}
+
+void CEpollLoop::ReadClient(CClient *client)
+{
+	CFastCGIProcessor processor;
+	SOCKET s = client->getSocket();
+
+	//The socket stays blocking for the response output, so only the reads do not wait
+	for (size_t i = 0; i < c_max_reads_per_event; ++i)
+	{
+		char buffer[WT_BUFFERSIZE];
+		_i32 rc = recv(s, buffer, WT_BUFFERSIZE, MSG_DONTWAIT | MSG_NOSIGNAL);
+
+		if (rc < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			else if (errno == EAGAIN
+				|| errno == EWOULDBLOCK)
+			{
+				break;
+			}
+
+			RemoveClient(client);
+			return;
+		}
+		else if (rc == 0)
+		{
+			//Server->Log("Client disconnected", LL_INFO);
+			RemoveClient(client);
+			return;
+		}
+
+		if (!processor.ProcessInput(client, buffer, rc))
+		{
+			RemoveClient(client);
+			return;
+		}
+	}
+
+	//Re-arming checks the current state, so data that arrived in the meantime is not lost
+	epoll_event ev = {};
+	ev.events = c_client_events;
+	ev.data.ptr = client;
+	if (epoll_ctl(epfd, EPOLL_CTL_MOD, s, &ev) != 0)
+	{
+		Server->Log("Re-arming client in epoll failed. errno=" + convert(errno), LL_ERROR);
+		RemoveClient(client);
+	}
+}
+
+void CEpollLoop::RemoveClient(CClient *client)
+{
+	epoll_ctl(epfd, EPOLL_CTL_DEL, client->getSocket(), NULL);
+	client->remove();
+	delete client;
+}
+
+#endif //__linux__
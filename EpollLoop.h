@@ -0,0 +1,53 @@
+#ifndef EPOLLLOOP_H
+#define EPOLLLOOP_H
+
+#ifdef __linux__
+
+#include "Interface/Thread.h"
+#include "Interface/Mutex.h"
+#include "Interface/Condition.h"
+#include "WorkerThread.h"
+#include <vector>
+
+class CClient;
+
+/*
+* Replacement for CSelectThread on Linux. All clients are in one
+* edge-triggered epoll set with EPOLLONESHOT. A single thread waits on it
+* and hands each ready connection to the thread pool, which starts more
+* threads when all of them are busy (e.g. with slow downloads or
+* long-polls). The task reads until EAGAIN, runs the complete requests and
+* then re-arms the connection. There is no per-thread client limit and idle
+* keep-alive connections do not need a thread.
+*/
+class CEpollLoop
+{
+public:
+	//Returns NULL if epoll is not available
+	static CEpollLoop* create();
+	~CEpollLoop();
+
+	bool AddClient(CClient *client);
+
+	void operator()();
+
+	void HandleClient(CClient *client);
+
+private:
+	CEpollLoop(int epfd, int stop_fd);
+
+	void ReadClient(CClient *client);
+	void RemoveClient(CClient *client);
+
+	int epfd;
+	int stop_fd;
+
+	IMutex* stop_mutex;
+	ICondition* stop_cond;
+	bool running;
+	size_t n_tasks;
+};
+
+#endif //__linux__
+
+#endif //EPOLLLOOP_H
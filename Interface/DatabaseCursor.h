@@ -8,6 +8,17 @@ class IDatabaseCursor
 public:
 	virtual bool next(db_single_result &res)=0;
 
+	//Typed access to the columns of the current row by position. Does not build
+	//a db_single_result. Data from getData() is only valid until the next call to nextRow()
+	virtual bool nextRow()=0;
+	virtual int getColumnCount()=0;
+	virtual bool isNull(int col)=0;
+	virtual int getInt(int col)=0;
+	virtual int64 getInt64(int col)=0;
+	virtual double getDouble(int col)=0;
+	virtual const char* getData(int col, size_t& size)=0;
+	virtual std::string getString(int col)=0;
+
 	virtual bool has_error()=0;
 
 	virtual bool reset() = 0;
@@ -34,6 +45,26 @@ public:
 		return cursor->next(res);
 	}
 
+	bool nextRow()
+	{
+		return cursor->nextRow();
+	}
+
+	int getInt(int col)
+	{
+		return cursor->getInt(col);
+	}
+
+	int64 getInt64(int col)
+	{
+		return cursor->getInt64(col);
+	}
+
+	std::string getString(int col)
+	{
+		return cursor->getString(col);
+	}
+
 	virtual bool has_error()
 	{
 		return cursor->has_error();
@@ -6,6 +6,30 @@
 
 class IThread;
 
+//The upper bits of a ticket tell which executor of the pool runs it
+const THREADPOOL_TICKET THREADPOOL_TICKET_TAG_MASK = 0xC0000000;
+const THREADPOOL_TICKET THREADPOOL_TICKET_TAG_THREAD = 0;
+const THREADPOOL_TICKET THREADPOOL_TICKET_TAG_WORK_STEALING = 0x80000000;
+const THREADPOOL_TICKET THREADPOOL_TICKET_TAG_TASK = 0xC0000000;
+
+struct SThreadPoolStats
+{
+	SThreadPoolStats()
+		: n_threads(0), n_idle_threads(0), queue_depth(0), max_queue_depth(0),
+		n_executed(0), n_steals(0), total_wait_us(0), max_wait_us(0)
+	{}
+
+	int64 n_threads;
+	int64 n_idle_threads;
+	int64 queue_depth;
+	int64 max_queue_depth;
+	int64 n_executed;
+	int64 n_steals;
+	//Time between execute() and start of the runnable
+	int64 total_wait_us;
+	int64 max_wait_us;
+};
+
 class IThreadPool : public IObject
 {
 public:
@@ -15,6 +39,11 @@ public:
 	virtual bool waitFor(std::vector<THREADPOOL_TICKET> tickets, int timems=-1)=0;
 	virtual bool waitFor(THREADPOOL_TICKET ticket, int timems=-1)=0;
 	virtual void Shutdown() = 0;
+
+	//Runs a short CPU-bound task on a fixed set of worker threads without starting a thread for it.
+	//The ticket works with isRunning/waitFor. The task must not block (e.g. wait for other tasks)
+	virtual THREADPOOL_TICKET executeTask(IThread *task, const std::string& name = std::string())=0;
+	virtual SThreadPoolStats getStats() = 0;
 };
 
 #endif //ITHREADPOOL_H_
\ No newline at end of file
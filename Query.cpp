@@ -345,7 +345,7 @@ db_results CQuery::Read(int *timeoutms)
 	do
 	{
 		bool reset=false;
-		err=step(res, timeoutms, tries, transaction_lock, reset);
+		err=step(&res, timeoutms, tries, transaction_lock, reset);
 		if(reset)
 		{
 			rows.clear();
@@ -385,7 +385,7 @@ namespace
 	}
 }
 
-int CQuery::step(db_single_result& res, int *timeoutms, int& tries, bool& transaction_lock, bool& reset)
+int CQuery::step(db_single_result* res, int *timeoutms, int& tries, bool& transaction_lock, bool& reset)
 {
 	int err=sqlite3_step(ps);
 	if( resultOkay(err) )
@@ -427,6 +427,11 @@ int CQuery::step(db_single_result& res, int *timeoutms, int& tries, bool& transa
 		}
 		else if( err==SQLITE_ROW )
 		{
+			if(res==NULL)
+			{
+				return err;
+			}
+
 			int column=0;
 			std::string column_name;
 			while( !(column_name=ustring_sqlite3_column_name(ps, column) ).empty() )
@@ -444,7 +449,7 @@ int CQuery::step(db_single_result& res, int *timeoutms, int& tries, bool& transa
 					data_size = sqlite3_column_bytes(ps, column);
 				}
 				std::string datastr(reinterpret_cast<const char*>(data), reinterpret_cast<const char*>(data)+data_size);				
-				res.insert( std::pair<std::string, std::string>(column_name, datastr) );
+				res->insert( std::pair<std::string, std::string>(column_name, datastr) );
 				++column;
 			}
 		}
@@ -480,6 +485,11 @@ IDatabaseCursor* CQuery::Cursor(int *timeoutms)
 	return cursor;
 }
 
+sqlite3_stmt* CQuery::getPreparedStatement(void)
+{
+	return ps;
+}
+
 std::string CQuery::getStatement(void)
 {
 	return stmt_str;
@@ -49,7 +49,9 @@ public:
 	void setupStepping(int *timeoutms, bool with_read_lock);
 	void shutdownStepping(int err, int *timeoutms, bool& transaction_lock);
 
-	int step(db_single_result& res, int *timeoutms, int& tries, bool& transaction_lock, bool& reset);
+	int step(db_single_result* res, int *timeoutms, int& tries, bool& transaction_lock, bool& reset);
+
+	sqlite3_stmt* getPreparedStatement(void);
 
 	bool resultOkay(int rc);
 
@@ -2,6 +2,7 @@
 #include "../stringtools.h"
 #include <regex>
 #include <iostream>
+#include <algorithm>
 
 enum CPPFileTokenType
 {
@@ -485,6 +486,103 @@ enum StatementType
 	StatementType_None
 };
 
+bool getSelectColumns(const std::string& sql, std::vector<std::string>& columns)
+{
+	std::string lsql=strlower(sql);
+	size_t select_pos=lsql.find("select");
+	if(select_pos==std::string::npos)
+	{
+		return false;
+	}
+
+	std::vector<std::string> exprs;
+	std::string curr;
+	int depth=0;
+	char quote=0;
+	for(size_t i=select_pos+6;i<sql.size();++i)
+	{
+		char ch=sql[i];
+		if(quote!=0)
+		{
+			if(ch==quote)
+				quote=0;
+		}
+		else if(ch=='\'' || ch=='"')
+		{
+			quote=ch;
+		}
+		else if(ch=='(')
+		{
+			++depth;
+		}
+		else if(ch==')')
+		{
+			--depth;
+		}
+		else if(depth==0)
+		{
+			if(ch==',')
+			{
+				exprs.push_back(curr);
+				curr.clear();
+				continue;
+			}
+			if(lsql.compare(i, 4, "from")==0 && isspace(sql[i-1])
+				&& (i+4==sql.size() || isspace(sql[i+4])) )
+			{
+				break;
+			}
+		}
+		curr+=ch;
+	}
+	exprs.push_back(curr);
+
+	for(size_t i=0;i<exprs.size();++i)
+	{
+		std::string expr=trim(exprs[i]);
+		if(i==0 && strlower(expr).find("distinct ")==0)
+		{
+			expr=trim(expr.substr(9));
+		}
+
+		if(expr.empty() || expr=="*"
+			|| (expr.size()>1 && expr.substr(expr.size()-2)==".*") )
+		{
+			return false;
+		}
+
+		size_t as_pos=strlower(expr).rfind(" as ");
+		if(as_pos!=std::string::npos)
+		{
+			expr=trim(expr.substr(as_pos+4));
+		}
+		else if(expr.find("(")==std::string::npos
+			&& expr.find(".")!=std::string::npos)
+		{
+			expr=expr.substr(expr.rfind(".")+1);
+		}
+		columns.push_back(expr);
+	}
+
+	return true;
+}
+
+std::string cursor_read(const ReturnType& rtype, size_t col)
+{
+	if(rtype.type=="int")
+	{
+		return "cur->getInt("+convert(col)+")";
+	}
+	else if(rtype.type=="int64")
+	{
+		return "cur->getInt64("+convert(col)+")";
+	}
+	else
+	{
+		return "cur->getString("+convert(col)+")";
+	}
+}
+
 std::string return_blob(size_t tabs, std::string value_name, std::string sql_name, std::string res_idx, bool do_return)
 {
 	std::string ret;
@@ -626,6 +724,28 @@ AnnotatedCode generateSqlFunction(IDatabase* db, AnnotatedCode input, GeneratedD
 	std::vector<ReturnType> params;
 	std::string parsedSql=parseSqlString(sql, params);
 
+	//Read the result columns by position via the typed cursor interface
+	//if the columns can be found in the select list
+	bool use_cursor=false;
+	std::vector<size_t> return_cols;
+	std::vector<std::string> select_columns;
+	if(stmt_type==StatementType_Select
+		&& !return_types.empty()
+		&& getSelectColumns(parsedSql, select_columns) )
+	{
+		use_cursor=true;
+		for(size_t i=0;i<return_types.size();++i)
+		{
+			std::vector<std::string>::iterator it=std::find(select_columns.begin(), select_columns.end(), return_types[i].name);
+			if(it==select_columns.end())
+			{
+				use_cursor=false;
+				break;
+			}
+			return_cols.push_back(it-select_columns.begin());
+		}
+	}
+
 	if(check)
 	{
 		IQuery *q=db->Prepare("EXPLAIN "+parsedSql, true);
@@ -798,7 +918,14 @@ AnnotatedCode generateSqlFunction(IDatabase* db, AnnotatedCode input, GeneratedD
 
 	if(stmt_type==StatementType_Select)
 	{
-		code+="\tdb_results res="+query_name+"->Read();\r\n";
+		if(use_cursor)
+		{
+			code+="\tIDatabaseCursor* cur="+query_name+"->Cursor();\r\n";
+		}
+		else
+		{
+			code+="\tdb_results res="+query_name+"->Read();\r\n";
+		}
 	}
 	else if(stmt_type==StatementType_Delete
 		|| stmt_type==StatementType_Insert
@@ -817,7 +944,16 @@ AnnotatedCode generateSqlFunction(IDatabase* db, AnnotatedCode input, GeneratedD
 		}
 	}
 
-	if(!params.empty())
+	std::string finish_cursor;
+	if(use_cursor)
+	{
+		finish_cursor+="\tcur->shutdown();\r\n";
+		if(!params.empty())
+		{
+			finish_cursor+="\t"+query_name+"->Reset();\r\n";
+		}
+	}
+	else if(!params.empty())
 	{
 		code+="\t"+query_name+"->Reset();\r\n";
 	}
@@ -827,7 +963,34 @@ AnnotatedCode generateSqlFunction(IDatabase* db, AnnotatedCode input, GeneratedD
 		code+="\treturn ret;\r\n";
 	}
 
-	if(return_vector)
+	if(return_vector && use_cursor)
+	{
+		code+="\t"+return_outer+" ret;\r\n";
+		code+="\twhile(cur->nextRow())\r\n";
+		code+="\t{\r\n";
+		if(use_struct)
+		{
+			std::string row_type=(classname.empty()?"":classname+"::")+struct_name;
+			code+="\t\tret.push_back("+row_type+"());\r\n";
+			code+="\t\t"+row_type+"& row=ret.back();\r\n";
+			if(gen_data.structures[struct_name].use_exist)
+			{
+				code+="\t\trow.exists=true;\r\n";
+			}
+			for(size_t i=0;i<return_types.size();++i)
+			{
+				code+="\t\trow."+return_types[i].name+"="+cursor_read(return_types[i], return_cols[i])+";\r\n";
+			}
+		}
+		else
+		{
+			code+="\t\tret.push_back("+cursor_read(return_types[0], return_cols[0])+");\r\n";
+		}
+		code+="\t}\r\n";
+		code+=finish_cursor;
+		code+="\treturn ret;\r\n";
+	}
+	else if(return_vector)
 	{
 		code+="\tstd::vector<";
 		if(use_struct)
@@ -959,13 +1122,27 @@ AnnotatedCode generateSqlFunction(IDatabase* db, AnnotatedCode input, GeneratedD
 			}
 		}
 		code+=" };\r\n";
-		code+="\tif(!res.empty())\r\n";
+		if(use_cursor)
+		{
+			code+="\tif(cur->nextRow())\r\n";
+		}
+		else
+		{
+			code+="\tif(!res.empty())\r\n";
+		}
 		code+="\t{\r\n";
 		if(use_exists)
 		{
 			code+="\t\tret.exists=true;\r\n";
 		}
-		if(!use_cond)
+		if(use_cursor)
+		{
+			for(size_t i=0;i<return_types.size();++i)
+			{
+				code+="\t\tret."+(use_cond ? std::string("value") : return_types[i].name)+"="+cursor_read(return_types[i], return_cols[i])+";\r\n";
+			}
+		}
+		else if(!use_cond)
 		{
 			for(size_t i=0;i<return_types.size();++i)
 			{
@@ -1007,8 +1184,31 @@ AnnotatedCode generateSqlFunction(IDatabase* db, AnnotatedCode input, GeneratedD
 			}
 		}
 		code+="\t}\r\n";
+		code+=finish_cursor;
 		code+="\treturn ret;\r\n";			
 	}
+	else if(return_types.size()==1 && use_cursor)
+	{
+		std::string type=return_types[0].type;
+		if(type=="string" || type=="blob")
+		{
+			code+="\tstd::string ret;\r\n";
+		}
+		else
+		{
+			code+="\t"+type+" ret=0;\r\n";
+		}
+		code+="\tif(cur->nextRow())\r\n";
+		code+="\t{\r\n";
+		code+="\t\tret="+cursor_read(return_types[0], return_cols[0])+";\r\n";
+		code+="\t}\r\n";
+		code+="\telse\r\n";
+		code+="\t{\r\n";
+		code+="\t\tassert(false);\r\n";
+		code+="\t}\r\n";
+		code+=finish_cursor;
+		code+="\treturn ret;\r\n";
+	}
 	else if(return_types.size()==1)
 	{
 		code+="\tassert(!res.empty());\r\n";
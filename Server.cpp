@@ -381,8 +381,12 @@ CServer::~CServer()
 
 void CServer::setServerParameters(const str_map &pServerParams)
 {
-	IScopedLock lock(param_mutex);
-	server_params=pServerParams;
+	{
+		IScopedLock lock(param_mutex);
+		server_params=pServerParams;
+	}
+
+	threadpool->setWorkStealing(getServerParameter("thread_pool_work_stealing")=="true");
 }
 
 std::string CServer::getServerParameter(const std::string &key)
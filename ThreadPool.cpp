@@ -23,6 +23,8 @@
 #include "stringtools.h"
 #include <math.h>
 #include <assert.h>
+#include <chrono>
+#include <thread>
 
 #if defined(_WIN32) && defined(_DEBUG)
 #include <Windows.h>
@@ -43,6 +45,17 @@ namespace
 		assert_process_priority();
 #endif
 	}
+
+	int64 getTimeUs()
+	{
+		return std::chrono::duration_cast<std::chrono::microseconds>(
+			std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+
+	THREADPOOL_TICKET ticketTag(THREADPOOL_TICKET ticket)
+	{
+		return ticket & THREADPOOL_TICKET_TAG_MASK;
+	}
 }
 
 CPoolThread::CPoolThread(CThreadPool *pMgr)
@@ -154,6 +167,10 @@ IThread * CThreadPool::getRunnable(THREADPOOL_TICKET *todel, bool del, bool& sto
 			ret=toexecute[0].runnable;
 			*todel=toexecute[0].ticket;
 			name = toexecute[0].name;
+			int64 wait_us = getTimeUs() - toexecute[0].enqueue_time;
+			total_wait_us += wait_us;
+			max_wait_us = (std::max)(max_wait_us, wait_us);
+			++n_executed;
 			toexecute.erase( toexecute.begin() );
 		}
 	}
@@ -183,7 +200,11 @@ CThreadPool::CThreadPool(size_t max_threads,
 	size_t max_waiting_threads, std::string idle_name)
 	: max_threads(max_threads), max_waiting_threads(max_waiting_threads), idle_name(idle_name),
 	nRunning(0), nThreads(0), currticket(0), dexit(false), mutex(Server->createMutex()),
-	cond(Server->createCondition())
+	cond(Server->createCondition()),
+	work_stealing(Server->getServerParameter("thread_pool_work_stealing")=="true"),
+	ws_executor(new WorkStealingExecutor(0, max_threads, max_waiting_threads, true,
+		THREADPOOL_TICKET_TAG_WORK_STEALING, idle_name)),
+	task_executor(NULL), max_queue_depth(0), n_executed(0), total_wait_us(0), max_wait_us(0)
 {
 
 }
@@ -192,6 +213,7 @@ CThreadPool::~CThreadPool()
 {	
 	delete mutex;
 	delete cond;
+	delete task_executor.load();
 }
 
 void CThreadPool::Shutdown(void)
@@ -220,6 +242,15 @@ void CThreadPool::Shutdown(void)
 		}
 		++max;
 	}
+
+	lock.relock(NULL);
+
+	ws_executor->shutdown(do_leak_check);
+
+	if (task_executor != NULL)
+	{
+		task_executor.load()->shutdown(do_leak_check);
+	}
 }
 
 bool CThreadPool::isRunningInt(THREADPOOL_TICKET ticket)
@@ -233,11 +264,75 @@ bool CThreadPool::isRunningInt(THREADPOOL_TICKET ticket)
 
 bool CThreadPool::isRunning(THREADPOOL_TICKET ticket)
 {
+	switch (ticketTag(ticket))
+	{
+	case THREADPOOL_TICKET_TAG_WORK_STEALING:
+		return ws_executor->isRunning(ticket);
+	case THREADPOOL_TICKET_TAG_TASK:
+		return getTaskExecutor()->isRunning(ticket);
+	}
+
 	IScopedLock lock(mutex);
 	return isRunningInt(ticket);
 }
 
 bool CThreadPool::waitFor(std::vector<THREADPOOL_TICKET> tickets, int timems)
+{
+	std::vector<THREADPOOL_TICKET> ws_tickets;
+	std::vector<THREADPOOL_TICKET> task_tickets;
+	for (size_t i = 0; i < tickets.size();)
+	{
+		switch (ticketTag(tickets[i]))
+		{
+		case THREADPOOL_TICKET_TAG_WORK_STEALING:
+			ws_tickets.push_back(tickets[i]);
+			tickets.erase(tickets.begin() + i);
+			break;
+		case THREADPOOL_TICKET_TAG_TASK:
+			task_tickets.push_back(tickets[i]);
+			tickets.erase(tickets.begin() + i);
+			break;
+		default:
+			++i;
+		}
+	}
+
+	if (ws_tickets.empty()
+		&& task_tickets.empty())
+	{
+		return waitForThreads(tickets, timems);
+	}
+
+	int64 starttime = Server->getTimeMS();
+
+	if (!tickets.empty()
+		&& !waitForThreads(tickets, timems))
+	{
+		return false;
+	}
+
+	int left = timems;
+	if (timems >= 0)
+	{
+		left = (std::max)(0, timems - static_cast<int>(Server->getTimeMS() - starttime));
+	}
+
+	if (!ws_tickets.empty()
+		&& !ws_executor->waitFor(ws_tickets, left))
+	{
+		return false;
+	}
+
+	if (timems >= 0)
+	{
+		left = (std::max)(0, timems - static_cast<int>(Server->getTimeMS() - starttime));
+	}
+
+	return task_tickets.empty()
+		|| getTaskExecutor()->waitFor(task_tickets, left);
+}
+
+bool CThreadPool::waitForThreads(std::vector<THREADPOOL_TICKET> tickets, int timems)
 {
 	int64 starttime;
 	if(timems>=0)
@@ -325,6 +420,11 @@ bool CThreadPool::waitFor(std::vector<THREADPOOL_TICKET> tickets, int timems)
 
 THREADPOOL_TICKET CThreadPool::execute(IThread *runnable, const std::string& name)
 {
+	if (work_stealing)
+	{
+		return ws_executor->execute(runnable, name);
+	}
+
 	IScopedLock lock(mutex);
 	size_t retries = 0;
 	while(nThreads>=nRunning
@@ -352,14 +452,15 @@ THREADPOOL_TICKET CThreadPool::execute(IThread *runnable, const std::string& nam
 		}
 	}
 
-	++currticket;
+	currticket = (currticket + 1) & ~THREADPOOL_TICKET_TAG_MASK;
 	while (running.find(currticket) != running.end()
 		|| currticket==ILLEGAL_THREADPOOL_TICKET)
 	{
-		++currticket;
+		currticket = (currticket + 1) & ~THREADPOOL_TICKET_TAG_MASK;
 	}
 
-	toexecute.push_back(SNewTask(runnable, currticket, name));
+	toexecute.push_back(SNewTask(runnable, currticket, name, getTimeUs()));
+	max_queue_depth = (std::max)(max_queue_depth, toexecute.size());
 	running.insert(std::pair<THREADPOOL_TICKET, SRunningConds>(currticket, SRunningConds()) );
 	++nRunning;
 	cond->notify_one();
@@ -379,3 +480,55 @@ bool CThreadPool::waitFor(THREADPOOL_TICKET ticket, int timems)
 	return waitFor(t, timems);
 }
 
+THREADPOOL_TICKET CThreadPool::executeTask(IThread * task, const std::string & name)
+{
+	return getTaskExecutor()->execute(task, name);
+}
+
+SThreadPoolStats CThreadPool::getStats()
+{
+	SThreadPoolStats ret;
+	{
+		IScopedLock lock(mutex);
+		ret.n_threads = nThreads;
+		ret.n_idle_threads = nThreads >= nRunning ? nThreads - nRunning : 0;
+		ret.queue_depth = toexecute.size();
+		ret.max_queue_depth = max_queue_depth;
+		ret.n_executed = n_executed;
+		ret.total_wait_us = total_wait_us;
+		ret.max_wait_us = max_wait_us;
+	}
+
+	ws_executor->addStats(ret);
+
+	if (task_executor != NULL)
+	{
+		task_executor.load()->addStats(ret);
+	}
+
+	return ret;
+}
+
+void CThreadPool::setWorkStealing(bool b)
+{
+	work_stealing = b;
+}
+
+WorkStealingExecutor * CThreadPool::getTaskExecutor()
+{
+	WorkStealingExecutor* ret = task_executor;
+	if (ret != NULL)
+	{
+		return ret;
+	}
+
+	IScopedLock lock(mutex);
+	if (task_executor == NULL)
+	{
+		size_t n_workers = (std::max)(static_cast<size_t>(std::thread::hardware_concurrency()), static_cast<size_t>(2));
+		task_executor = new WorkStealingExecutor(n_workers, n_workers, n_workers, false,
+			THREADPOOL_TICKET_TAG_TASK, "idle task worker");
+	}
+	return task_executor;
+}
+
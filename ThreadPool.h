@@ -2,8 +2,11 @@
 #include "Interface/Condition.h"
 #include "Interface/Thread.h"
 #include <deque>
+#include <memory>
+#include <atomic>
 
 #include "Interface/ThreadPool.h"
+#include "WorkStealingExecutor.h"
 
 class IThread;
 class CThreadPool;
@@ -40,11 +43,21 @@ public:
 
 	void Shutdown();
 
+	THREADPOOL_TICKET executeTask(IThread *task, const std::string& name = std::string());
+	SThreadPoolStats getStats();
+
+	//Runs new threads on a work stealing executor instead of the shared queue
+	void setWorkStealing(bool b);
+
 private:
 	IThread * getRunnable(THREADPOOL_TICKET *todel, bool del, bool& stop, std::string& name);
 
 	bool isRunningInt(THREADPOOL_TICKET ticket);
 
+	bool waitForThreads(std::vector<THREADPOOL_TICKET> tickets, int timems);
+
+	WorkStealingExecutor* getTaskExecutor();
+
 	size_t nThreads;
 	size_t nRunning;
 
@@ -52,13 +65,14 @@ private:
 
 	struct SNewTask
 	{
-		SNewTask(IThread* runnable, THREADPOOL_TICKET ticket, std::string name)
-			: runnable(runnable), ticket(ticket), name(name)
+		SNewTask(IThread* runnable, THREADPOOL_TICKET ticket, std::string name, int64 enqueue_time)
+			: runnable(runnable), ticket(ticket), name(name), enqueue_time(enqueue_time)
 		{}
 
 		IThread* runnable;
 		THREADPOOL_TICKET ticket;
 		std::string name;
+		int64 enqueue_time;
 	};
 
 	std::deque<SNewTask> toexecute;
@@ -84,4 +98,13 @@ private:
 	size_t max_threads;
 	size_t max_waiting_threads;
 	std::string idle_name;
+
+	std::atomic<bool> work_stealing;
+	std::unique_ptr<WorkStealingExecutor> ws_executor;
+	std::atomic<WorkStealingExecutor*> task_executor;
+
+	size_t max_queue_depth;
+	int64 n_executed;
+	int64 total_wait_us;
+	int64 max_wait_us;
 };
\ No newline at end of file
@@ -0,0 +1,471 @@
+/*************************************************************************
+*    UrBackup - Client/Server backup system
+*    Copyright (C) 2011-2016 Martin Raiber
+*
+*    This program is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU Affero General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU Affero General Public License for more details.
+*
+*    You should have received a copy of the GNU Affero General Public License
+*    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**************************************************************************/
+
+#include "WorkStealingExecutor.h"
+#include "Interface/Server.h"
+#include "stringtools.h"
+#include <math.h>
+#include <chrono>
+#include <algorithm>
+
+namespace
+{
+	//Executor and slot of the current thread if it is a worker
+	thread_local WorkStealingExecutor* curr_executor = NULL;
+	thread_local size_t curr_slot = 0;
+
+	int64 getTimeUs()
+	{
+		return std::chrono::duration_cast<std::chrono::microseconds>(
+			std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+
+	template<typename T>
+	void updateMax(std::atomic<T>& max_val, T val)
+	{
+		T curr = max_val.load(std::memory_order_relaxed);
+		while (val > curr
+			&& !max_val.compare_exchange_weak(curr, val, std::memory_order_relaxed))
+		{
+		}
+	}
+
+	class WorkStealingWorker : public IThread
+	{
+	public:
+		WorkStealingWorker(WorkStealingExecutor* executor, size_t slot)
+			: executor(executor), slot(slot)
+		{}
+
+		virtual ~WorkStealingWorker() {}
+
+		void operator()()
+		{
+			(*executor)(slot);
+			delete this;
+		}
+
+	private:
+		WorkStealingExecutor* executor;
+		size_t slot;
+	};
+}
+
+WorkStealingExecutor::SWorker::SWorker()
+	: mutex(Server->createMutex()), n_tasks(0)
+{
+}
+
+WorkStealingExecutor::WorkStealingExecutor(size_t min_workers, size_t max_workers, size_t max_idle_workers,
+	bool grow, THREADPOOL_TICKET ticket_tag, const std::string& idle_name)
+	: min_workers(min_workers), max_workers((std::min)(max_workers, max_chunks*SWorkerChunk::size)),
+	max_idle_workers(max_idle_workers), grow(grow), ticket_tag(ticket_tag), idle_name(idle_name),
+	n_slots(0), workers_mutex(Server->createMutex()), inject_mutex(Server->createMutex()), n_inject(0),
+	idle_mutex(Server->createMutex()), idle_cond(Server->createCondition()), curr_ticket(0),
+	n_workers(0), n_idle(0), n_queued(0), n_pending(0), dexit(false),
+	max_queue_depth(0), n_executed(0), n_steals(0), total_wait_us(0), max_wait_us(0)
+{
+	for (size_t i = 0; i < max_chunks; ++i)
+	{
+		chunks[i] = NULL;
+	}
+
+	for (size_t i = 0; i < n_ticket_shards; ++i)
+	{
+		ticket_shards[i].mutex.reset(Server->createMutex());
+		ticket_shards[i].cond.reset(Server->createCondition());
+	}
+
+	startWorkers();
+}
+
+WorkStealingExecutor::~WorkStealingExecutor()
+{
+	for (size_t i = 0; i < max_chunks; ++i)
+	{
+		delete chunks[i].load();
+	}
+}
+
+THREADPOOL_TICKET WorkStealingExecutor::execute(IThread * runnable, const std::string & name)
+{
+	THREADPOOL_TICKET ticket = newTicket();
+	STask task(runnable, ticket, name, getTimeUs());
+
+	++n_pending;
+
+	//Counted before the task is visible to the workers, otherwise a worker
+	//could take it and decrement n_queued first
+	size_t queued = ++n_queued;
+	updateMax(max_queue_depth, queued);
+
+	try
+	{
+		if (curr_executor == this)
+		{
+			//Tasks started by a worker run LIFO on the same worker, unless they get stolen
+			SWorker& self = getWorker(curr_slot);
+			IScopedLock lock(self.mutex.get());
+			self.tasks.push_back(task);
+			++self.n_tasks;
+		}
+		else
+		{
+			IScopedLock lock(inject_mutex.get());
+			inject_tasks.push_back(task);
+			++n_inject;
+		}
+	}
+	catch (...)
+	{
+		--n_queued;
+		--n_pending;
+		finishTicket(ticket);
+		throw;
+	}
+
+	wakeWorker();
+
+	if (grow
+		&& n_pending > n_workers)
+	{
+		startWorkers();
+	}
+
+	return ticket;
+}
+
+bool WorkStealingExecutor::isRunning(THREADPOOL_TICKET ticket)
+{
+	STicketShard& shard = ticket_shards[ticket % n_ticket_shards];
+	IScopedLock lock(shard.mutex.get());
+	return shard.running.find(ticket) != shard.running.end();
+}
+
+bool WorkStealingExecutor::waitFor(const std::vector<THREADPOOL_TICKET>& tickets, int timems)
+{
+	int64 starttime = 0;
+	if (timems >= 0)
+	{
+		starttime = Server->getTimeMS();
+	}
+
+	for (size_t i = 0; i < tickets.size(); ++i)
+	{
+		STicketShard& shard = ticket_shards[tickets[i] % n_ticket_shards];
+		IScopedLock lock(shard.mutex.get());
+
+		std::map<THREADPOOL_TICKET, size_t>::iterator it;
+		while ((it = shard.running.find(tickets[i])) != shard.running.end())
+		{
+			int left = timems;
+			if (timems >= 0)
+			{
+				int64 passed = Server->getTimeMS() - starttime;
+				if (passed >= timems)
+				{
+					return false;
+				}
+				left = timems - static_cast<int>(passed);
+			}
+
+			++it->second;
+			shard.cond->wait(&lock, left);
+
+			it = shard.running.find(tickets[i]);
+			if (it != shard.running.end())
+			{
+				--it->second;
+			}
+		}
+	}
+
+	return true;
+}
+
+void WorkStealingExecutor::shutdown(bool leak_check)
+{
+	dexit = true;
+
+	unsigned int max = 0;
+	while (true)
+	{
+		{
+			IScopedLock lock(workers_mutex.get());
+			if (n_workers == 0)
+			{
+				break;
+			}
+		}
+
+		{
+			IScopedLock lock(idle_mutex.get());
+			idle_cond->notify_all();
+		}
+
+		Server->wait(100);
+
+		if ((!leak_check && max >= 3) || (leak_check && max >= 30))
+		{
+			Server->Log("Maximum wait time for work stealing executor exceeded. Shutting down the hard way", LL_ERROR);
+			break;
+		}
+		++max;
+	}
+}
+
+void WorkStealingExecutor::addStats(SThreadPoolStats & stats)
+{
+	stats.n_threads += n_workers;
+	stats.n_idle_threads += n_idle;
+	stats.queue_depth += n_queued;
+	stats.max_queue_depth = (std::max)(stats.max_queue_depth, static_cast<int64>(max_queue_depth.load()));
+	stats.n_executed += n_executed;
+	stats.n_steals += n_steals;
+	stats.total_wait_us += total_wait_us;
+	stats.max_wait_us = (std::max)(stats.max_wait_us, max_wait_us.load());
+}
+
+void WorkStealingExecutor::operator()(size_t slot)
+{
+	curr_executor = this;
+	curr_slot = slot;
+
+	THREAD_ID tid = Server->getThreadID();
+	STask task;
+	bool retired = false;
+	while (getTask(slot, task, retired))
+	{
+		int64 wait_us = getTimeUs() - task.enqueue_time;
+		total_wait_us += wait_us;
+		updateMax(max_wait_us, wait_us);
+		++n_executed;
+
+		if (!task.name.empty())
+		{
+			Server->setCurrentThreadName(task.name);
+		}
+		else
+		{
+			Server->setCurrentThreadName("unnamed");
+		}
+
+		(*task.runnable)();
+		Server->clearDatabases(tid);
+
+		--n_pending;
+		finishTicket(task.ticket);
+	}
+
+	Server->destroyDatabases(tid);
+
+	curr_executor = NULL;
+
+	IScopedLock lock(workers_mutex.get());
+	if (!retired)
+	{
+		--n_workers;
+	}
+	free_slots.push_back(slot);
+}
+
+WorkStealingExecutor::SWorker & WorkStealingExecutor::getWorker(size_t slot)
+{
+	return chunks[slot / SWorkerChunk::size].load()->workers[slot % SWorkerChunk::size];
+}
+
+THREADPOOL_TICKET WorkStealingExecutor::newTicket()
+{
+	while (true)
+	{
+		THREADPOOL_TICKET ticket = ((++curr_ticket) & ~THREADPOOL_TICKET_TAG_MASK) | ticket_tag;
+		if ((ticket & ~THREADPOOL_TICKET_TAG_MASK) == 0)
+		{
+			continue;
+		}
+
+		STicketShard& shard = ticket_shards[ticket % n_ticket_shards];
+		IScopedLock lock(shard.mutex.get());
+		if (shard.running.find(ticket) == shard.running.end())
+		{
+			shard.running[ticket] = 0;
+			return ticket;
+		}
+	}
+}
+
+void WorkStealingExecutor::finishTicket(THREADPOOL_TICKET ticket)
+{
+	STicketShard& shard = ticket_shards[ticket % n_ticket_shards];
+	IScopedLock lock(shard.mutex.get());
+	std::map<THREADPOOL_TICKET, size_t>::iterator it = shard.running.find(ticket);
+	if (it != shard.running.end())
+	{
+		bool has_waiters = it->second > 0;
+		shard.running.erase(it);
+		if (has_waiters)
+		{
+			shard.cond->notify_all();
+		}
+	}
+}
+
+bool WorkStealingExecutor::getTask(size_t slot, STask & task, bool& retired)
+{
+	SWorker& self = getWorker(slot);
+
+	while (!dexit)
+	{
+		{
+			IScopedLock lock(self.mutex.get());
+			if (!self.tasks.empty())
+			{
+				task = self.tasks.back();
+				self.tasks.pop_back();
+				--self.n_tasks;
+				--n_queued;
+				return true;
+			}
+		}
+
+		if (n_inject > 0)
+		{
+			IScopedLock lock(inject_mutex.get());
+			if (!inject_tasks.empty())
+			{
+				task = inject_tasks.front();
+				inject_tasks.pop_front();
+				--n_inject;
+				--n_queued;
+				return true;
+			}
+		}
+
+		if (steal(slot, task))
+		{
+			--n_queued;
+			return true;
+		}
+
+		IScopedLock lock(idle_mutex.get());
+		++n_idle;
+
+		//execute() increments n_queued before looking for idle workers
+		if (n_queued > 0 || dexit)
+		{
+			--n_idle;
+			continue;
+		}
+
+		if (grow
+			&& n_idle > max_idle_workers
+			&& n_workers > min_workers)
+		{
+			--n_idle;
+			--n_workers;
+			retired = true;
+			return false;
+		}
+
+		Server->setCurrentThreadName(idle_name);
+		idle_cond->wait(&lock);
+		--n_idle;
+	}
+
+	return false;
+}
+
+bool WorkStealingExecutor::steal(size_t slot, STask & task)
+{
+	size_t n = n_slots;
+	for (size_t i = 1; i < n; ++i)
+	{
+		size_t victim_slot = (slot + i) % n;
+		SWorker& victim = getWorker(victim_slot);
+		if (victim.n_tasks == 0)
+		{
+			continue;
+		}
+
+		IScopedLock lock(victim.mutex.get());
+		if (!victim.tasks.empty())
+		{
+			task = victim.tasks.front();
+			victim.tasks.pop_front();
+			--victim.n_tasks;
+			++n_steals;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+void WorkStealingExecutor::startWorkers()
+{
+	IScopedLock lock(workers_mutex.get());
+	size_t retries = 0;
+	while (!dexit
+		&& n_workers < max_workers
+		&& (n_workers < min_workers
+			|| (grow && n_pending > n_workers)))
+	{
+		size_t slot;
+		if (!free_slots.empty())
+		{
+			slot = free_slots.back();
+			free_slots.pop_back();
+		}
+		else
+		{
+			slot = n_slots;
+			if (chunks[slot / SWorkerChunk::size].load() == NULL)
+			{
+				chunks[slot / SWorkerChunk::size] = new SWorkerChunk;
+			}
+			n_slots = slot + 1;
+		}
+
+		WorkStealingWorker* nt = new WorkStealingWorker(this, slot);
+		++n_workers;
+		if (!Server->createThread(nt))
+		{
+			delete nt;
+			--n_workers;
+			free_slots.push_back(slot);
+			lock.relock(NULL);
+			unsigned int waittime = (std::min)(static_cast<unsigned int>(1000.*pow(2., static_cast<double>(++retries))), (unsigned int)30 * 60 * 1000); //30min
+			if (retries>20)
+			{
+				waittime = (unsigned int)30 * 60 * 1000;
+			}
+			Server->Log("Retrying creating thread for work stealing executor in " + PrettyPrintTime(waittime) + "...", LL_WARNING);
+			Server->wait(waittime);
+			lock.relock(workers_mutex.get());
+		}
+	}
+}
+
+void WorkStealingExecutor::wakeWorker()
+{
+	if (n_idle > 0)
+	{
+		IScopedLock lock(idle_mutex.get());
+		idle_cond->notify_one();
+	}
+}
@@ -0,0 +1,134 @@
+#pragma once
+
+#include "Interface/Mutex.h"
+#include "Interface/Condition.h"
+#include "Interface/Thread.h"
+#include "Interface/ThreadPool.h"
+#include <deque>
+#include <map>
+#include <vector>
+#include <string>
+#include <memory>
+#include <atomic>
+
+/*
+* Executor with one task deque per worker thread. A worker takes tasks from
+* the back of its own deque and steals from the front of the other workers'
+* deques once it runs out of work. Tasks submitted by threads that are not
+* workers of this executor go to a shared injection queue. Only short
+* per-queue and per-ticket-shard locks are taken instead of one lock for
+* the whole pool.
+*
+* With grow=true a new worker is started whenever there are more unfinished
+* tasks than workers (like CThreadPool does), so tasks may block for a long
+* time. Workers exceeding max_idle_workers exit. Otherwise the number of
+* workers is fixed and tasks should be short and CPU-bound.
+*/
+class WorkStealingExecutor
+{
+public:
+	WorkStealingExecutor(size_t min_workers, size_t max_workers, size_t max_idle_workers,
+		bool grow, THREADPOOL_TICKET ticket_tag, const std::string& idle_name);
+	~WorkStealingExecutor();
+
+	THREADPOOL_TICKET execute(IThread *runnable, const std::string& name);
+	bool isRunning(THREADPOOL_TICKET ticket);
+	bool waitFor(const std::vector<THREADPOOL_TICKET>& tickets, int timems);
+
+	void shutdown(bool leak_check);
+
+	//Adds the metrics of this executor to stats
+	void addStats(SThreadPoolStats& stats);
+
+	void operator()(size_t slot);
+
+private:
+	struct STask
+	{
+		STask()
+			: runnable(NULL), ticket(ILLEGAL_THREADPOOL_TICKET), enqueue_time(0)
+		{}
+
+		STask(IThread* runnable, THREADPOOL_TICKET ticket, const std::string& name, int64 enqueue_time)
+			: runnable(runnable), ticket(ticket), name(name), enqueue_time(enqueue_time)
+		{}
+
+		IThread* runnable;
+		THREADPOOL_TICKET ticket;
+		std::string name;
+		int64 enqueue_time;
+	};
+
+	struct SWorker
+	{
+		SWorker();
+
+		std::unique_ptr<IMutex> mutex;
+		std::deque<STask> tasks;
+		//Read without lock to skip empty deques when stealing
+		std::atomic<size_t> n_tasks;
+	};
+
+	struct SWorkerChunk
+	{
+		static const size_t size = 64;
+		SWorker workers[size];
+	};
+
+	struct STicketShard
+	{
+		std::unique_ptr<IMutex> mutex;
+		std::unique_ptr<ICondition> cond;
+		//Running ticket -> number of threads waiting for it
+		std::map<THREADPOOL_TICKET, size_t> running;
+	};
+
+	static const size_t max_chunks = 1024;
+	static const size_t n_ticket_shards = 16;
+
+	SWorker& getWorker(size_t slot);
+
+	THREADPOOL_TICKET newTicket();
+	void finishTicket(THREADPOOL_TICKET ticket);
+
+	bool getTask(size_t slot, STask& task, bool& retired);
+	bool steal(size_t slot, STask& task);
+	void startWorkers();
+	void wakeWorker();
+
+	size_t min_workers;
+	size_t max_workers;
+	size_t max_idle_workers;
+	bool grow;
+	THREADPOOL_TICKET ticket_tag;
+	std::string idle_name;
+
+	std::atomic<SWorkerChunk*> chunks[max_chunks];
+	std::atomic<size_t> n_slots;
+	std::vector<size_t> free_slots;
+	std::unique_ptr<IMutex> workers_mutex;
+
+	std::unique_ptr<IMutex> inject_mutex;
+	std::deque<STask> inject_tasks;
+	std::atomic<size_t> n_inject;
+
+	std::unique_ptr<IMutex> idle_mutex;
+	std::unique_ptr<ICondition> idle_cond;
+
+	STicketShard ticket_shards[n_ticket_shards];
+	std::atomic<THREADPOOL_TICKET> curr_ticket;
+
+	std::atomic<size_t> n_workers;
+	std::atomic<size_t> n_idle;
+	//Submitted but not yet started
+	std::atomic<size_t> n_queued;
+	//Submitted but not yet finished
+	std::atomic<size_t> n_pending;
+	std::atomic<bool> dexit;
+
+	std::atomic<size_t> max_queue_depth;
+	std::atomic<int64> n_executed;
+	std::atomic<int64> n_steals;
+	std::atomic<int64> total_wait_us;
+	std::atomic<int64> max_wait_us;
+};
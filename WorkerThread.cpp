@@ -38,7 +38,6 @@ CWorkerThread::CWorkerThread(CSelectThread *pMaster)
 	stop_mutex=Server->createMutex();
 	stop_cond=Server->createCondition();
 	Master=pMaster;
-	keep_alive=true;
 	run=true;
 }
 
@@ -92,7 +91,6 @@ void CWorkerThread::operator()()
 
 				if( rc<1 )
 				{
-					keep_alive=true;
 					//Server->Log("Client disconnected", LL_INFO);
 					Master->RemoveClient( client );
 					lock.relock(clients_mutex);
@@ -110,46 +108,8 @@ void CWorkerThread::operator()()
 					}
 					Server->Log("Incoming data: "+lbuf, LL_INFO);
 #endif
-					client->lock();
-					try
+					if( !ProcessInput(client, buffer, rc) )
 					{
-						client->getFCGIProtocolDriver()->process_input(buffer, rc);
-					}catch(...)
-					{
-						client->unlock();
-						Master->RemoveClient(client);
-						lock.relock(clients_mutex);
-						continue;
-					}
-					
-					FCGIRequest* req=NULL;
-					try
-					{
-						req=client->getFCGIProtocolDriver()->get_request();
-					}catch(...)
-					{
-						client->unlock();
-						Master->RemoveClient(client);
-						lock.relock(clients_mutex);
-						continue;
-					}
-
-					client->unlock();
-
-					if( req!=NULL )
-						client->addRequest(req);
-
-					while( (req=client->getAndRemoveReadyRequest())!=NULL )
-					{
-						Server->addRequest();
-						client->lock();
-						ProcessRequest(client, req);
-						client->unlock();
-					}
-
-					if( keep_alive==false )
-					{
-						keep_alive=true;
 						//Server->Log("Client disconnected", LL_INFO);
 						Master->RemoveClient( client );
 					}
@@ -168,7 +128,56 @@ void CWorkerThread::operator()()
 	stop_cond->notify_one();
 }
 
-void CWorkerThread::ProcessRequest(CClient *client, FCGIRequest *req)
+CFastCGIProcessor::CFastCGIProcessor()
+	: keep_alive(true)
+{
+}
+
+bool CFastCGIProcessor::ProcessInput(CClient *client, const char *buffer, size_t bsize)
+{
+	client->lock();
+	try
+	{
+		client->getFCGIProtocolDriver()->process_input(buffer, bsize);
+	}catch(...)
+	{
+		client->unlock();
+		return false;
+	}
+	
+	FCGIRequest* req=NULL;
+	try
+	{
+		req=client->getFCGIProtocolDriver()->get_request();
+	}catch(...)
+	{
+		client->unlock();
+		return false;
+	}
+
+	client->unlock();
+
+	if( req!=NULL )
+		client->addRequest(req);
+
+	while( (req=client->getAndRemoveReadyRequest())!=NULL )
+	{
+		Server->addRequest();
+		client->lock();
+		ProcessRequest(client, req);
+		client->unlock();
+	}
+
+	if( keep_alive==false )
+	{
+		keep_alive=true;
+		return false;
+	}
+
+	return true;
+}
+
+void CFastCGIProcessor::ProcessRequest(CClient *client, FCGIRequest *req)
 {
 	if( req->keep_connection )
 	{
@@ -302,7 +311,7 @@ void CWorkerThread::ProcessRequest(CClient *client, FCGIRequest *req)
 	}
 }
 
-POSTFILE_KEY CWorkerThread::ParseMultipartData(const std::string &data, const std::string &boundary)
+POSTFILE_KEY CFastCGIProcessor::ParseMultipartData(const std::string &data, const std::string &boundary)
 {
 	std::string rboundary="--"+boundary;
 	int state=0;
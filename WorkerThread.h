@@ -11,15 +11,14 @@ class FCGIRequest;
 
 const _u32 WT_BUFFERSIZE=2000;
 
-class CWorkerThread : public IThread
+class CFastCGIProcessor
 {
 public:
-	CWorkerThread(CSelectThread *pMaster);
-	~CWorkerThread();
+	CFastCGIProcessor();
 
-	void operator()();
-	
-	void shutdown(void);
+	//Passes data received from the client to its FastCGI driver and runs all complete requests.
+	//Returns false if the client should be disconnected
+	bool ProcessInput(CClient *client, const char *buffer, size_t bsize);
 
 private:
 	void ProcessRequest(CClient *client, FCGIRequest *req);
@@ -27,6 +26,19 @@ private:
 	POSTFILE_KEY ParseMultipartData(const std::string &data, const std::string &boundary);
 
 	bool keep_alive;
+};
+
+class CWorkerThread : public IThread, public CFastCGIProcessor
+{
+public:
+	CWorkerThread(CSelectThread *pMaster);
+	~CWorkerThread();
+
+	void operator()();
+	
+	void shutdown(void);
+
+private:
 	bool run;
 
 	CSelectThread* Master;
@@ -31,6 +31,10 @@ adler32.c -- compute the Adler-32 checksum of a data stream
 
 /* @(#) $Id$ */
 
+#include "adler32.h"
+#include "cpu_features.h"
+#include <atomic>
+
 #define BASE 65521      /* largest prime smaller than 65536 */
 #define NMAX 5552
 /* NMAX is the largest n such that 255n(n+1)/2 + (n+1)(BASE-1) <= 2^32-1 */
@@ -47,7 +51,7 @@ adler32.c -- compute the Adler-32 checksum of a data stream
 #  define MOD63(a) a %= BASE
 
 /* ========================================================================= */
-unsigned int urb_adler32(unsigned int adler, const char* pbuf, unsigned int len)
+unsigned int urb_adler32_scalar(unsigned int adler, const char* pbuf, unsigned int len)
 {
 	const unsigned char* buf = reinterpret_cast<const unsigned char*>(pbuf);
     unsigned int sum2;
@@ -115,6 +119,202 @@ unsigned int urb_adler32(unsigned int adler, const char* pbuf, unsigned int len)
     return adler | (sum2 << 16);
 }
 
+#ifdef URB_CPU_X86
+
+namespace
+{
+    /* Scalar tail after the vectorized blocks. len < NMAX */
+    unsigned int adler32_tail(unsigned int adler, unsigned int sum2, const unsigned char* buf, unsigned int len)
+    {
+        if (len) {
+            while (len >= 16) {
+                len -= 16;
+                DO16(buf);
+                buf += 16;
+            }
+            while (len--) {
+                adler += *buf++;
+                sum2 += adler;
+            }
+            MOD(adler);
+            MOD(sum2);
+        }
+        return adler | (sum2 << 16);
+    }
+
+    /*
+    * Process the data in blocks of 32 bytes. Per block, s1 is the sum of the
+    * bytes (_mm_sad_epu8) and s2 gets each byte multiplied with its distance to
+    * the block end (32..1) plus 32 times the s1 value before the block. The
+    * latter is accumulated in v_ps and multiplied with 32 at the end. At most
+    * NMAX bytes are processed before reducing modulo BASE, so nothing overflows.
+    */
+    URB_TARGET_ATTRIBUTE("ssse3")
+    unsigned int adler32_ssse3(unsigned int adler, const unsigned char* buf, unsigned int len)
+    {
+        unsigned int s1 = adler & 0xffff;
+        unsigned int s2 = (adler >> 16) & 0xffff;
+
+        const unsigned int block_size = 32;
+        unsigned int blocks = len / block_size;
+        len -= blocks * block_size;
+
+        const __m128i tap1 = _mm_setr_epi8(32, 31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21, 20, 19, 18, 17);
+        const __m128i tap2 = _mm_setr_epi8(16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1);
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i ones = _mm_set1_epi16(1);
+
+        while (blocks) {
+            unsigned int n = NMAX / block_size;
+            if (n > blocks)
+                n = blocks;
+            blocks -= n;
+
+            __m128i v_ps = _mm_setr_epi32(static_cast<int>(s1 * n), 0, 0, 0);
+            __m128i v_s2 = _mm_setr_epi32(static_cast<int>(s2), 0, 0, 0);
+            __m128i v_s1 = _mm_setzero_si128();
+
+            do {
+                const __m128i bytes1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(buf));
+                const __m128i bytes2 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(buf + 16));
+
+                v_ps = _mm_add_epi32(v_ps, v_s1);
+
+                v_s1 = _mm_add_epi32(v_s1, _mm_sad_epu8(bytes1, zero));
+                v_s2 = _mm_add_epi32(v_s2, _mm_madd_epi16(_mm_maddubs_epi16(bytes1, tap1), ones));
+
+                v_s1 = _mm_add_epi32(v_s1, _mm_sad_epu8(bytes2, zero));
+                v_s2 = _mm_add_epi32(v_s2, _mm_madd_epi16(_mm_maddubs_epi16(bytes2, tap2), ones));
+
+                buf += block_size;
+            } while (--n);
+
+            v_s2 = _mm_add_epi32(v_s2, _mm_slli_epi32(v_ps, 5));
+
+            v_s1 = _mm_add_epi32(v_s1, _mm_shuffle_epi32(v_s1, _MM_SHUFFLE(2, 3, 0, 1)));
+            v_s1 = _mm_add_epi32(v_s1, _mm_shuffle_epi32(v_s1, _MM_SHUFFLE(1, 0, 3, 2)));
+            s1 += static_cast<unsigned int>(_mm_cvtsi128_si32(v_s1));
+
+            v_s2 = _mm_add_epi32(v_s2, _mm_shuffle_epi32(v_s2, _MM_SHUFFLE(2, 3, 0, 1)));
+            v_s2 = _mm_add_epi32(v_s2, _mm_shuffle_epi32(v_s2, _MM_SHUFFLE(1, 0, 3, 2)));
+            s2 = static_cast<unsigned int>(_mm_cvtsi128_si32(v_s2));
+
+            MOD(s1);
+            MOD(s2);
+        }
+
+        return adler32_tail(s1, s2, buf, len);
+    }
+
+    /* Same as adler32_ssse3 but with one 32 byte block per AVX2 register */
+    URB_TARGET_ATTRIBUTE("avx2")
+    unsigned int adler32_avx2(unsigned int adler, const unsigned char* buf, unsigned int len)
+    {
+        unsigned int s1 = adler & 0xffff;
+        unsigned int s2 = (adler >> 16) & 0xffff;
+
+        const unsigned int block_size = 32;
+        unsigned int blocks = len / block_size;
+        len -= blocks * block_size;
+
+        const __m256i tap = _mm256_setr_epi8(32, 31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21, 20, 19, 18, 17,
+            16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1);
+        const __m256i zero = _mm256_setzero_si256();
+        const __m256i ones = _mm256_set1_epi16(1);
+
+        while (blocks) {
+            unsigned int n = NMAX / block_size;
+            if (n > blocks)
+                n = blocks;
+            blocks -= n;
+
+            __m256i v_ps = _mm256_setr_epi32(static_cast<int>(s1 * n), 0, 0, 0, 0, 0, 0, 0);
+            __m256i v_s2 = _mm256_setr_epi32(static_cast<int>(s2), 0, 0, 0, 0, 0, 0, 0);
+            __m256i v_s1 = _mm256_setzero_si256();
+
+            do {
+                const __m256i bytes = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(buf));
+
+                v_ps = _mm256_add_epi32(v_ps, v_s1);
+                v_s1 = _mm256_add_epi32(v_s1, _mm256_sad_epu8(bytes, zero));
+                v_s2 = _mm256_add_epi32(v_s2, _mm256_madd_epi16(_mm256_maddubs_epi16(bytes, tap), ones));
+
+                buf += block_size;
+            } while (--n);
+
+            v_s2 = _mm256_add_epi32(v_s2, _mm256_slli_epi32(v_ps, 5));
+
+            __m128i h_s1 = _mm_add_epi32(_mm256_castsi256_si128(v_s1), _mm256_extracti128_si256(v_s1, 1));
+            h_s1 = _mm_add_epi32(h_s1, _mm_shuffle_epi32(h_s1, _MM_SHUFFLE(2, 3, 0, 1)));
+            h_s1 = _mm_add_epi32(h_s1, _mm_shuffle_epi32(h_s1, _MM_SHUFFLE(1, 0, 3, 2)));
+            s1 += static_cast<unsigned int>(_mm_cvtsi128_si32(h_s1));
+
+            __m128i h_s2 = _mm_add_epi32(_mm256_castsi256_si128(v_s2), _mm256_extracti128_si256(v_s2, 1));
+            h_s2 = _mm_add_epi32(h_s2, _mm_shuffle_epi32(h_s2, _MM_SHUFFLE(2, 3, 0, 1)));
+            h_s2 = _mm_add_epi32(h_s2, _mm_shuffle_epi32(h_s2, _MM_SHUFFLE(1, 0, 3, 2)));
+            s2 = static_cast<unsigned int>(_mm_cvtsi128_si32(h_s2));
+
+            MOD(s1);
+            MOD(s2);
+        }
+
+        return adler32_tail(s1, s2, buf, len);
+    }
+
+    typedef unsigned int(*adler32_fun)(unsigned int adler, const unsigned char* buf, unsigned int len);
+
+    adler32_fun select_adler32_impl()
+    {
+        if (cpu_features::has_avx2())
+            return adler32_avx2;
+        if (cpu_features::has_ssse3())
+            return adler32_ssse3;
+        return NULL;
+    }
+
+    //Only toggled by the hash benchmark while other threads may be hashing
+    std::atomic<bool> adler32_simd_enabled(true);
+}
+
+#endif //URB_CPU_X86
+
+unsigned int urb_adler32(unsigned int adler, const char* pbuf, unsigned int len)
+{
+#ifdef URB_CPU_X86
+    static adler32_fun simd_impl = select_adler32_impl();
+
+    if (len >= 64
+        && pbuf != nullptr
+        && simd_impl != NULL
+        && adler32_simd_enabled.load(std::memory_order_relaxed))
+    {
+        return simd_impl(adler, reinterpret_cast<const unsigned char*>(pbuf), len);
+    }
+#endif
+    return urb_adler32_scalar(adler, pbuf, len);
+}
+
+const char* urb_adler32_impl()
+{
+#ifdef URB_CPU_X86
+    if (adler32_simd_enabled.load(std::memory_order_relaxed))
+    {
+        if (cpu_features::has_avx2())
+            return "avx2";
+        if (cpu_features::has_ssse3())
+            return "ssse3";
+    }
+#endif
+    return "scalar";
+}
+
+void urb_adler32_set_simd(bool enabled)
+{
+#ifdef URB_CPU_X86
+    adler32_simd_enabled.store(enabled, std::memory_order_relaxed);
+#endif
+}
+
 unsigned int urb_adler32_combine(unsigned int adler1, unsigned int adler2, unsigned int len2)
 {
 	unsigned long sum1;
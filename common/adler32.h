@@ -2,4 +2,13 @@
 
 unsigned int urb_adler32(unsigned int adler, const char *pbuf, unsigned int len);
 
-unsigned int urb_adler32_combine(unsigned int adler1, unsigned int adler2, unsigned int len2);
\ No newline at end of file
+unsigned int urb_adler32_combine(unsigned int adler1, unsigned int adler2, unsigned int len2);
+
+//Portable implementation. urb_adler32 dispatches to a SSSE3/AVX2 version if the CPU supports it
+unsigned int urb_adler32_scalar(unsigned int adler, const char *pbuf, unsigned int len);
+
+//Name of the implementation urb_adler32 currently uses
+const char* urb_adler32_impl();
+
+//Enable/disable the vectorized implementations (for benchmarking). Not thread-safe.
+void urb_adler32_set_simd(bool enabled);
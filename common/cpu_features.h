@@ -0,0 +1,101 @@
+#pragma once
+
+/*
+* Runtime detection of the x86 instruction set extensions used by the
+* accelerated hash implementations (adler32, sha2). On other architectures
+* all checks return false and the portable code is used.
+*/
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define URB_CPU_X86
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#include <immintrin.h>
+#define URB_TARGET_ATTRIBUTE(x)
+#else
+#include <cpuid.h>
+#include <immintrin.h>
+#define URB_TARGET_ATTRIBUTE(x) __attribute__((target(x)))
+#endif
+
+#endif //x86
+
+namespace cpu_features
+{
+#ifdef URB_CPU_X86
+	struct SCpuFeatures
+	{
+		SCpuFeatures()
+			: ssse3(false), sse41(false), avx2(false), sha(false)
+		{
+			unsigned int regs1[4] = {};
+			unsigned int regs7[4] = {};
+			unsigned int max_leaf;
+#ifdef _MSC_VER
+			int r[4];
+			__cpuid(r, 0);
+			max_leaf = static_cast<unsigned int>(r[0]);
+			__cpuid(r, 1);
+			for (size_t i = 0; i < 4; ++i) regs1[i] = static_cast<unsigned int>(r[i]);
+			if (max_leaf >= 7)
+			{
+				__cpuidex(r, 7, 0);
+				for (size_t i = 0; i < 4; ++i) regs7[i] = static_cast<unsigned int>(r[i]);
+			}
+#else
+			max_leaf = __get_cpuid_max(0, NULL);
+			if (max_leaf >= 1)
+			{
+				__cpuid(1, regs1[0], regs1[1], regs1[2], regs1[3]);
+			}
+			if (max_leaf >= 7)
+			{
+				__cpuid_count(7, 0, regs7[0], regs7[1], regs7[2], regs7[3]);
+			}
+#endif
+			ssse3 = (regs1[2] & (1 << 9)) != 0;
+			sse41 = (regs1[2] & (1 << 19)) != 0;
+			sha = ssse3 && sse41 && (regs7[1] & (1 << 29)) != 0;
+
+			bool osxsave = (regs1[2] & (1 << 27)) != 0;
+			bool avx = (regs1[2] & (1 << 28)) != 0;
+			if (osxsave && avx
+				&& (xgetbv0() & 6) == 6)
+			{
+				avx2 = (regs7[1] & (1 << 5)) != 0;
+			}
+		}
+
+		static unsigned long long xgetbv0()
+		{
+#ifdef _MSC_VER
+			return _xgetbv(0);
+#else
+			unsigned int eax, edx;
+			__asm__ __volatile__("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+			return (static_cast<unsigned long long>(edx) << 32) | eax;
+#endif
+		}
+
+		bool ssse3;
+		bool sse41;
+		bool avx2;
+		bool sha;
+	};
+
+	inline const SCpuFeatures& get()
+	{
+		static SCpuFeatures features;
+		return features;
+	}
+
+	inline bool has_ssse3() { return get().ssse3; }
+	inline bool has_avx2() { return get().avx2; }
+	inline bool has_sha() { return get().sha; }
+#else
+	inline bool has_ssse3() { return false; }
+	inline bool has_avx2() { return false; }
+	inline bool has_sha() { return false; }
+#endif
+}
@@ -0,0 +1,93 @@
+/*************************************************************************
+*    UrBackup - Client/Server backup system
+*    Copyright (C) 2011-2016 Martin Raiber
+*
+*    This program is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU Affero General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU Affero General Public License for more details.
+*
+*    You should have received a copy of the GNU Affero General Public License
+*    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**************************************************************************/
+
+#include "fastcdc.h"
+
+namespace
+{
+	typedef unsigned long long gear_t;
+
+	//log2(c_cdc_avg_size)
+	const unsigned int c_avg_bits = 16;
+
+	//Normalized chunking: harder to cut before the average size, easier after it
+	const gear_t c_mask_small = ((1ULL << (c_avg_bits + 2)) - 1) << (64 - (c_avg_bits + 2));
+	const gear_t c_mask_large = ((1ULL << (c_avg_bits - 2)) - 1) << (64 - (c_avg_bits - 2));
+
+	class GearTable
+	{
+	public:
+		GearTable()
+		{
+			//splitmix64 with a fixed seed. Has to be the same everywhere.
+			gear_t state = 0x5542636463474541ULL;
+			for (size_t i = 0; i < 256; ++i)
+			{
+				state += 0x9E3779B97F4A7C15ULL;
+				gear_t z = state;
+				z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+				z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+				table[i] = z ^ (z >> 31);
+			}
+		}
+
+		gear_t table[256];
+	};
+
+	const GearTable& gear()
+	{
+		static GearTable gear_table;
+		return gear_table;
+	}
+}
+
+size_t fastcdc_next_chunk(const char* pbuf, size_t bsize)
+{
+	if (bsize <= c_cdc_min_size)
+	{
+		return bsize;
+	}
+
+	const unsigned char* buf = reinterpret_cast<const unsigned char*>(pbuf);
+	const gear_t* table = gear().table;
+
+	size_t end = bsize < c_cdc_max_size ? bsize : c_cdc_max_size;
+	size_t normal = end < c_cdc_avg_size ? end : c_cdc_avg_size;
+
+	gear_t h = 0;
+	size_t i = c_cdc_min_size;
+	for (; i < normal; ++i)
+	{
+		h = (h << 1) + table[buf[i]];
+		if ((h & c_mask_small) == 0)
+		{
+			return i + 1;
+		}
+	}
+
+	for (; i < end; ++i)
+	{
+		h = (h << 1) + table[buf[i]];
+		if ((h & c_mask_large) == 0)
+		{
+			return i + 1;
+		}
+	}
+
+	return end;
+}
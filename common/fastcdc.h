@@ -0,0 +1,52 @@
+#pragma once
+
+#include <stddef.h>
+#include <string.h>
+
+/*
+* Content-defined chunking (FastCDC with a gear rolling hash and normalized
+* chunking). Chunk boundaries only depend on the content in front of them, so
+* data that was shifted by an insert or delete is split into the same chunks
+* again. Client and server have to use the same parameters and gear table.
+*/
+
+const unsigned int c_cdc_min_size = 16 * 1024;
+const unsigned int c_cdc_avg_size = 64 * 1024;
+const unsigned int c_cdc_max_size = 256 * 1024;
+
+const unsigned int c_cdc_hash_size = 16;
+
+//Maximum number of chunk hashes of the old file sent with a request (64MiB,
+//below the maximum packet size)
+const size_t c_cdc_max_index_size = 4 * 1024 * 1024;
+
+//Returns the length of the chunk starting at buf. bsize has to be at least
+//c_cdc_max_size except at the end of the data
+size_t fastcdc_next_chunk(const char* buf, size_t bsize);
+
+struct SCdcHash
+{
+	bool operator==(const SCdcHash& other) const
+	{
+		return memcmp(hash, other.hash, c_cdc_hash_size) == 0;
+	}
+
+	char hash[c_cdc_hash_size];
+};
+
+struct SCdcChunk
+{
+	SCdcHash hash;
+	unsigned int len;
+};
+
+struct SCdcHashHasher
+{
+	size_t operator()(const SCdcHash& h) const
+	{
+		//Already a cryptographic hash
+		size_t ret;
+		memcpy(&ret, h.hash, sizeof(ret));
+		return ret;
+	}
+};
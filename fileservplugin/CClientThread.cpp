@@ -340,6 +340,43 @@ bool CClientThread::FlushInt()
 	return clientpipe->Flush(CLIENT_TIMEOUT * 1000);
 }
 
+bool CClientThread::canSendZeroCopy()
+{
+	//Only direct connections write unbuffered to the socket
+	return has_socket && zero_copy_enabled();
+}
+
+EZeroCopyResult CClientThread::SendFileZeroCopy(int fd, int64 offset, size_t count)
+{
+	if (!canSendZeroCopy())
+	{
+		return EZeroCopyResult_Fallback;
+	}
+
+	size_t sent;
+	EZeroCopyResult rc = zero_copy_send(int_socket, fd, offset, count, SEND_TIMEOUT, sent);
+	if (rc != EZeroCopyResult_Ok)
+	{
+		return rc;
+	}
+
+	if (sent < count) //other process made the file smaller
+	{
+		std::vector<char> zero_buf((std::min)(count - sent, static_cast<size_t>(32768)));
+		while (sent < count)
+		{
+			size_t tosend = (std::min)(zero_buf.size(), count - sent);
+			if (SendInt(zero_buf.data(), tosend) == SOCKET_ERROR)
+			{
+				return EZeroCopyResult_Error;
+			}
+			sent += tosend;
+		}
+	}
+
+	return EZeroCopyResult_Ok;
+}
+
 bool CClientThread::ProcessPacket(CRData *data)
 {
 	uchar id;
@@ -689,6 +726,23 @@ bool CClientThread::ProcessPacket(CRData *data)
 
 				curr_filesize=filesize.QuadPart;
 
+				if (id != ID_GET_FILE_METADATA_ONLY)
+				{
+					IFile* redirect_file = FileServ::redirectRead(filename, curr_filesize);
+					if (redirect_file != nullptr)
+					{
+						CloseHandle(hFile);
+						hFile = INVALID_HANDLE_VALUE;
+						bool b = sendFullFile(redirect_file, start_offset, with_hashes);
+						Server->destroy(redirect_file);
+						if (!b)
+						{
+							Log("Sending redirected file " + o_filename + " not finished", LL_DEBUG);
+						}
+						break;
+					}
+				}
+
 				if (curr_filesize == 0)
 				{
 					with_sparse = false;
@@ -1036,6 +1090,20 @@ bool CClientThread::ProcessPacket(CRData *data)
 				off64_t filesize=stat_buf.st_size;
 				curr_filesize=filesize;
 
+				IFile* redirect_file = FileServ::redirectRead(filename, curr_filesize);
+				if (redirect_file != nullptr)
+				{
+					CloseHandle(hFile);
+					hFile = INVALID_HANDLE_VALUE;
+					bool b = sendFullFile(redirect_file, start_offset, with_hashes);
+					Server->destroy(redirect_file);
+					if (!b)
+					{
+						Log("Sending redirected file " + o_filename + " not finished", LL_DEBUG);
+					}
+					break;
+				}
+
 				int64 send_filesize = curr_filesize;
 
 				int64 n_sparse_extents;
@@ -1136,6 +1204,9 @@ bool CClientThread::ProcessPacket(CRData *data)
 				}
 
 				bool last_sent_hash = false;
+				//Hashing and sending read the file separately, which is only consistent if it does not change
+				bool zero_copy = canSendZeroCopy()
+					&& (!with_hashes || zero_copy_unchanging(hFile));
 
 				while (foffset < filesize)
 				{
@@ -1178,7 +1249,7 @@ bool CClientThread::ProcessPacket(CRData *data)
 						}
 					}
 				
-					size_t count=(std::min)((size_t)s_bsize, (size_t)(next_checkpoint-foffset));
+					size_t count=(std::min)(zero_copy ? static_cast<size_t>(c_checkpoint_dist) : (size_t)s_bsize, (size_t)(next_checkpoint-foffset));
 
 					if (has_file_extents)
 					{
@@ -1188,6 +1259,45 @@ bool CClientThread::ProcessPacket(CRData *data)
 						}
 					}
 
+					bool sent_zero_copy = false;
+					if (zero_copy && count > 0)
+					{
+						MD5 new_hash_func = hash_func;
+						EZeroCopyResult zrc = EZeroCopyResult_Ok;
+						if (with_hashes)
+						{
+							zrc = zero_copy_hash(hFile, foffset, count, new_hash_func);
+						}
+						if (zrc == EZeroCopyResult_Ok)
+						{
+							zrc = SendFileZeroCopy(hFile, foffset, count);
+						}
+
+						if (zrc == EZeroCopyResult_Error)
+						{
+							Log("Error: Sending data failed (zero-copy)", LL_DEBUG);
+							CloseHandle(hFile);
+							return false;
+						}
+						else if (zrc == EZeroCopyResult_Ok)
+						{
+							hash_func = new_hash_func;
+							foffset += count;
+							last_sent_hash = false;
+							sent_zero_copy = true;
+						}
+						else
+						{
+							zero_copy = false;
+							if (lseek64(hFile, foffset, SEEK_SET) != foffset)
+							{
+								Log("Error: Seeking in file failed (zero-copy fallback)", LL_ERROR);
+								CloseHandle(hFile);
+								return false;
+							}
+						}
+					}
+
 					if( clientpipe==nullptr && !with_hashes && count>0 )
 					{
 						#if defined(__APPLE__) || defined(__FreeBSD__)
@@ -1224,7 +1334,7 @@ bool CClientThread::ProcessPacket(CRData *data)
 					}
 					else
 					{
-						if (count > 0)
+						if (count > 0 && !sent_zero_copy)
 						{
 							ssize_t rc = read(hFile, buf.data(), count);
 
@@ -1288,13 +1398,19 @@ bool CClientThread::ProcessPacket(CRData *data)
 			}break;
 		case ID_GET_FILE_BLOCKDIFF:
 			{
-				bool b=GetFileBlockdiff(data, false);
+				bool b=GetFileBlockdiff(data, false, false);
 				if(!b)
 					return false;
 			}break;
 		case ID_GET_FILE_BLOCKDIFF_WITH_METADATA:
 			{
-				bool b=GetFileBlockdiff(data, true);
+				bool b=GetFileBlockdiff(data, true, false);
+				if(!b)
+					return false;
+			}break;
+		case ID_GET_FILE_CDC:
+			{
+				bool b=GetFileBlockdiff(data, true, true);
 				if(!b)
 					return false;
 			}break;
@@ -1698,7 +1814,7 @@ bool CClientThread::isKillable(void)
 	return killable;
 }
 
-bool CClientThread::GetFileBlockdiff(CRData *data, bool with_metadata)
+bool CClientThread::GetFileBlockdiff(CRData *data, bool with_metadata, bool cdc)
 {
 	std::string s_filename;
 	if(data->getStr(&s_filename)==false)
@@ -1773,7 +1889,26 @@ bool CClientThread::GetFileBlockdiff(CRData *data, bool with_metadata)
 		resumed = true;
 	}
 
-	Log("Sending file (chunked) "+o_filename, LL_DEBUG);
+	std::shared_ptr<std::vector<SCdcHash> > cdc_hashes;
+	if (cdc)
+	{
+		int64 n_cdc_hashes;
+		if (is_script
+			|| !data->getVarInt(&n_cdc_hashes)
+			|| n_cdc_hashes<0
+			|| data->getLeft() != n_cdc_hashes*c_cdc_hash_size)
+		{
+			return false;
+		}
+
+		cdc_hashes.reset(new std::vector<SCdcHash>(static_cast<size_t>(n_cdc_hashes)));
+		if (n_cdc_hashes > 0)
+		{
+			memcpy(cdc_hashes->data(), data->getCurrDataPtr(), data->getLeft());
+		}
+	}
+
+	Log(std::string(cdc ? "Sending file (content-defined chunks) " : "Sending file (chunked) ")+o_filename, LL_DEBUG);
 
 	bool allow_exec;
 	std::string filename=map_file(o_filename, ident, allow_exec, nullptr);
@@ -1935,6 +2070,8 @@ bool CClientThread::GetFileBlockdiff(CRData *data, bool with_metadata)
 	sendfilepart=0;
 	sent_bytes=0;
 
+	bool redirected = false;
+
 	if(!is_script)
 	{
 #ifdef _WIN32
@@ -1949,7 +2086,16 @@ bool CClientThread::GetFileBlockdiff(CRData *data, bool with_metadata)
 		curr_filesize=stat_buf.st_size;
 #endif
 
-		if (curr_filesize > c_checkpoint_dist)
+		srv_file = FileServ::redirectRead(filename, curr_filesize);
+
+		if (srv_file != nullptr)
+		{
+			CloseHandle(hFile);
+			hFile = INVALID_HANDLE_VALUE;
+			curr_filesize = srv_file->Size();
+			redirected = true;
+		}
+		else if (curr_filesize > c_checkpoint_dist)
 		{
 			map_file(o_filename, ident, allow_exec, &cbt_hash_file_info);
 
@@ -1976,7 +2122,7 @@ bool CClientThread::GetFileBlockdiff(CRData *data, bool with_metadata)
 	if(next_checkpoint>curr_filesize && curr_filesize>0)
 		next_checkpoint=curr_filesize;
 
-	if(!is_script)
+	if(!is_script && !redirected)
 	{
 		srv_file = Server->openFileFromHandle((void*)hFile, filename);
 
@@ -2001,9 +2147,10 @@ bool CClientThread::GetFileBlockdiff(CRData *data, bool with_metadata)
 	chunk.hashsize = curr_hash_size;
 	chunk.requested_filesize = requested_filesize;
 	chunk.pipe_file_user = pipe_file_user.get();
-	chunk.with_sparse = is_script ? false : with_sparse;
+	chunk.with_sparse = (is_script || cdc || redirected) ? false : with_sparse;
 	chunk.s_filename = s_filename;
 	chunk.cbt_hash_file_info = cbt_hash_file_info;
+	chunk.cdc_hashes = cdc_hashes;
 	pipe_file_user.release();
 
 	hFile=INVALID_HANDLE_VALUE;
@@ -13,6 +13,7 @@
 #include <deque>
 #include <vector>
 #include <queue>
+#include <memory>
 
 #include "../Interface/Thread.h"
 #include "../Interface/ThreadPool.h"
@@ -23,6 +24,8 @@
 #include "settings.h"
 #include "../md5.h"
 #include "FileServ.h"
+#include "../common/fastcdc.h"
+#include "ZeroCopySend.h"
 
 class CTCPFileServ;
 class IPipe;
@@ -74,6 +77,7 @@ struct SChunk
 	std::string s_filename;
 	IFileServ::CbtHashFileInfo cbt_hash_file_info;
 	size_t share_active_gen;
+	std::shared_ptr<std::vector<SCdcHash> > cdc_hashes;
 };
 
 struct SLPData
@@ -115,6 +119,8 @@ public:
 
     int SendInt(const char *buf, size_t bsize, bool flush=false);
 	bool FlushInt();
+	bool canSendZeroCopy();
+	EZeroCopyResult SendFileZeroCopy(int fd, int64 offset, size_t count);
 	bool getNextChunk(SChunk *chunk, bool has_error);
 
 	static std::string getDummyMetadata(std::string output_fn, int64 folder_items, int64 metadata_id, bool is_dir);
@@ -129,7 +135,7 @@ private:
 	void ReleaseMemory(void);
 	void CloseThread(HANDLE hFile);
 
-	bool GetFileBlockdiff(CRData *data, bool with_metadata);
+	bool GetFileBlockdiff(CRData *data, bool with_metadata, bool cdc);
 	bool Handle_ID_BLOCK_REQUEST(CRData *data);
 
 	bool GetFileHashAndMetadata(CRData* data);
@@ -24,6 +24,7 @@
 #include "socket_header.h"
 #include <memory.h>
 #include <assert.h>
+#include <unordered_map>
 
 #include "../Interface/File.h"
 #include "../Interface/Server.h"
@@ -197,6 +198,13 @@ void ChunkSendThread::operator()(void)
 					has_error = true;
 				}
 			}
+
+			if (!has_error
+				&& chunk.cdc_hashes.get() != nullptr
+				&& !sendCdc(*chunk.cdc_hashes))
+			{
+				has_error = true;
+			}
 		}
 		else
 		{
@@ -284,6 +292,45 @@ bool ChunkSendThread::sendChunk(SChunk *chunk)
 		bool readerr = false;
 		unsigned int readderr_code = 0;
 
+#ifndef _WIN32
+		IFsFile* fs_file = dynamic_cast<IFsFile*>(file);
+		if (blockleft > 0
+			&& fs_file != nullptr
+			&& pipe_file_user.get() == nullptr
+			&& curr_file_size > 0
+			&& chunk->startpos + blockleft <= curr_file_size
+			&& parent->canSendZeroCopy()
+			&& zero_copy_unchanging(fs_file->getOsHandle()))
+		{
+			int fd = fs_file->getOsHandle();
+			if (zero_copy_hash(fd, spos, blockleft, md5_hash) == EZeroCopyResult_Ok)
+			{
+				if (parent->SendInt(chunk_buf, off) == SOCKET_ERROR)
+				{
+					Log("Error sending whole block header", LL_DEBUG);
+					return false;
+				}
+				off_sent = true;
+
+				EZeroCopyResult zrc = parent->SendFileZeroCopy(fd, spos, blockleft);
+				if (zrc == EZeroCopyResult_Error)
+				{
+					Log("Error sending whole block (zero-copy)", LL_DEBUG);
+					return false;
+				}
+				else if (zrc == EZeroCopyResult_Ok)
+				{
+					spos += blockleft;
+					blockleft = 0;
+				}
+				else
+				{
+					md5_hash.init();
+				}
+			}
+		}
+#endif
+
 		do
 		{
 			r=0;
@@ -711,6 +758,120 @@ bool ChunkSendThread::sendChunk(SChunk *chunk)
 	return true;
 }
 
+bool ChunkSendThread::sendCdc(const std::vector<SCdcHash>& server_hashes)
+{
+	std::unordered_map<SCdcHash, _u32, SCdcHashHasher> server_chunks;
+	server_chunks.reserve(server_hashes.size());
+	for (size_t i = 0; i < server_hashes.size(); ++i)
+	{
+		server_chunks.insert(std::make_pair(server_hashes[i], static_cast<_u32>(i)));
+	}
+
+	const size_t ref_size = 1 + sizeof(_u32);
+	const size_t data_header_size = 1 + sizeof(_u32) + c_cdc_hash_size;
+	std::vector<char> buf(c_cdc_max_size * 2);
+	std::vector<char> send_buf(data_header_size + c_cdc_max_size);
+	size_t buf_start = 0;
+	size_t buf_end = 0;
+	int64 spos = 0;
+	bool eof = false;
+	int64 ref_bytes = 0;
+
+	while (true)
+	{
+		if (!eof && buf_end - buf_start < c_cdc_max_size)
+		{
+			if (buf_start > 0)
+			{
+				memmove(buf.data(), buf.data() + buf_start, buf_end - buf_start);
+				buf_end -= buf_start;
+				buf_start = 0;
+			}
+
+			while (!eof && buf_end < buf.size())
+			{
+				_u32 toread = static_cast<_u32>((std::min)(static_cast<int64>(buf.size() - buf_end), curr_file_size - spos));
+				if (toread == 0)
+				{
+					eof = true;
+					break;
+				}
+
+				bool readerr = false;
+				_u32 r = file->Read(spos, buf.data() + buf_end, toread, &readerr);
+
+				if (readerr)
+				{
+					unsigned int readerr_code = getSystemErrorCode();
+					Server->Log("Reading from file \"" + file->getFilename() + "\" at position " + convert(spos) + " failed (code: " + convert(readerr_code) + ")(cdc).", LL_ERROR);
+					FileServ::callErrorCallback(s_filename, file->getFilename(), spos, "code: " + convert(readerr_code));
+					return sendError(ERR_READING_FAILED, readerr_code);
+				}
+
+				if (r == 0)
+				{
+					eof = true;
+				}
+
+				spos += r;
+				buf_end += r;
+			}
+		}
+
+		if (buf_start == buf_end)
+		{
+			break;
+		}
+
+		size_t chunk_len = fastcdc_next_chunk(buf.data() + buf_start, buf_end - buf_start);
+		unsigned char* chunk_data = reinterpret_cast<unsigned char*>(buf.data() + buf_start);
+
+		MD5 chunk_hash;
+		chunk_hash.update(chunk_data, static_cast<_u32>(chunk_len));
+		chunk_hash.finalize();
+
+		SCdcHash key;
+		memcpy(key.hash, chunk_hash.raw_digest_int(), c_cdc_hash_size);
+
+		std::unordered_map<SCdcHash, _u32, SCdcHashHasher>::iterator it = server_chunks.find(key);
+
+		size_t send_size;
+		if (it != server_chunks.end())
+		{
+			send_buf[0] = ID_CDC_REF;
+			_u32 idx = little_endian(it->second);
+			memcpy(&send_buf[1], &idx, sizeof(idx));
+			send_size = ref_size;
+			ref_bytes += chunk_len;
+		}
+		else
+		{
+			send_buf[0] = ID_CDC_DATA;
+			_u32 len = little_endian(static_cast<_u32>(chunk_len));
+			memcpy(&send_buf[1], &len, sizeof(len));
+			memcpy(&send_buf[1 + sizeof(_u32)], key.hash, c_cdc_hash_size);
+			memcpy(&send_buf[data_header_size], chunk_data, chunk_len);
+			send_size = data_header_size + chunk_len;
+		}
+
+		if (parent->SendInt(send_buf.data(), send_size) == SOCKET_ERROR)
+		{
+			return false;
+		}
+
+		buf_start += chunk_len;
+	}
+
+	char end_buf[1 + sizeof(_i64)];
+	end_buf[0] = ID_CDC_END;
+	_i64 endian_spos = little_endian(spos);
+	memcpy(&end_buf[1], &endian_spos, sizeof(endian_spos));
+
+	Log("Sent file with content-defined chunks. " + PrettyPrintBytes(ref_bytes) + " of " + PrettyPrintBytes(spos) + " already on server", LL_DEBUG);
+
+	return parent->SendInt(end_buf, sizeof(end_buf), true) != SOCKET_ERROR;
+}
+
 bool ChunkSendThread::sendError( _u32 errorcode1, _u32 errorcode2 )
 {
 	char buffer[1+sizeof(_u32)*2];
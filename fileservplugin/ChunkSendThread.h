@@ -5,7 +5,9 @@
 #include "../Interface/Types.h"
 #include "../Interface/File.h"
 #include "../md5.h"
+#include "../common/fastcdc.h"
 #include <memory>
+#include <vector>
 
 class ScopedPipeFileUser;
 class CClientThread;
@@ -25,6 +27,8 @@ private:
 
 	bool sendError(_u32 errorcode1, _u32 errorcode2);
 
+	bool sendCdc(const std::vector<SCdcHash>& server_hashes);
+
 	CClientThread *parent;
 	IFile *file;
 	std::string s_filename;
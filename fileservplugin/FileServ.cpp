@@ -37,6 +37,7 @@ std::map<std::string, std::string> FileServ::fn_redirects;
 std::map<std::pair<std::string, size_t>, size_t> FileServ::active_shares;
 size_t FileServ::active_generation = 0;
 FileServ::IReadErrorCallback* FileServ::read_error_callback = nullptr;
+FileServ::IReadRedirectCallback* FileServ::read_redirect_callback = nullptr;
 std::vector<std::string> FileServ::read_error_files;
 std::map<std::pair<std::string, std::string>, IFileServ::CbtHashFileInfo> FileServ::cbt_hash_files;
 
@@ -396,6 +397,21 @@ void FileServ::registerReadErrorCallback(IReadErrorCallback * cb)
 	read_error_callback = cb;
 }
 
+void FileServ::registerReadRedirectCallback(IReadRedirectCallback * cb)
+{
+	read_redirect_callback = cb;
+}
+
+IFile* FileServ::redirectRead(const std::string & path, int64 filesize)
+{
+	if (read_redirect_callback == nullptr)
+	{
+		return nullptr;
+	}
+
+	return read_redirect_callback->redirectRead(path, filesize);
+}
+
 void FileServ::clearReadErrors()
 {
 	IScopedLock lock(mutex);
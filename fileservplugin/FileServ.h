@@ -61,6 +61,10 @@ public:
 
 	virtual void registerReadErrorCallback(IReadErrorCallback* cb);
 
+	virtual void registerReadRedirectCallback(IReadRedirectCallback* cb);
+
+	static IFile* redirectRead(const std::string& path, int64 filesize);
+
 	void clearReadErrors();
 
 	static void clearReadErrorFile(const std::string& filepath);
@@ -137,6 +141,8 @@ private:
 
 	static IReadErrorCallback* read_error_callback;
 
+	static IReadRedirectCallback* read_redirect_callback;
+
 	static std::vector<std::string> read_error_files;
 
 	static std::map<std::pair<std::string, std::string>, CbtHashFileInfo> cbt_hash_files;
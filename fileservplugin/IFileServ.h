@@ -41,6 +41,13 @@ public:
 		virtual void onReadError(const std::string& sharename, const std::string& filepath, int64 pos, const std::string& msg) = 0;
 	};
 
+	class IReadRedirectCallback
+	{
+	public:
+		//Returns a file to send instead of the content of the file at path or NULL
+		virtual IFile* redirectRead(const std::string& path, int64 filesize) = 0;
+	};
+
 
 	virtual void shareDir(const std::string &name, const std::string &path, const std::string& identity, bool allow_exec)=0;
 	virtual bool removeDir(const std::string &name, const std::string& identity)=0;
@@ -61,6 +68,7 @@ public:
 	virtual bool hasActiveTransfersGen(const std::string& sharename, const std::string& server_token, size_t gen) = 0;
 	virtual bool registerFnRedirect(const std::string& source_fn, const std::string& target_fn) = 0;
 	virtual void registerReadErrorCallback(IReadErrorCallback* cb) = 0;
+	virtual void registerReadRedirectCallback(IReadRedirectCallback* cb) = 0;
 	virtual void registerScriptPipeFile(const std::string& script_fn, IPipeFileExt* pipe_file) = 0;
 	virtual void deregisterScriptPipeFile(const std::string& script_fn) = 0;
 	virtual void clearReadErrors() = 0;
@@ -0,0 +1,129 @@
+/*************************************************************************
+*    UrBackup - Client/Server backup system
+*    Copyright (C) 2011-2016 Martin Raiber
+*
+*    This program is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU Affero General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU Affero General Public License for more details.
+*
+*    You should have received a copy of the GNU Affero General Public License
+*    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**************************************************************************/
+
+#include "ZeroCopySend.h"
+#include "../Interface/Server.h"
+#include "../md5.h"
+#include "../stringtools.h"
+#include <algorithm>
+#include <vector>
+
+#if defined(__linux__)
+#define WITH_ZERO_COPY_SEND
+#include <sys/statvfs.h>
+#endif
+
+bool zero_copy_enabled()
+{
+#ifdef WITH_ZERO_COPY_SEND
+	static bool enabled = Server->getServerParameter("fileserv_zero_copy") != "false";
+	return enabled;
+#else
+	return false;
+#endif
+}
+
+bool zero_copy_unchanging(int fd)
+{
+#ifdef WITH_ZERO_COPY_SEND
+	//Snapshots are mounted read-only
+	struct statvfs buf;
+	return fstatvfs(fd, &buf) == 0
+		&& (buf.f_flag & ST_RDONLY) != 0;
+#else
+	return false;
+#endif
+}
+
+EZeroCopyResult zero_copy_hash(int fd, int64 offset, size_t count, MD5& hash)
+{
+#ifdef WITH_ZERO_COPY_SEND
+	std::vector<char> buf((std::min)(count, static_cast<size_t>(65536)));
+	MD5 new_hash = hash;
+	size_t done = 0;
+	while (done < count)
+	{
+		ssize_t rc = pread64(fd, buf.data(), (std::min)(buf.size(), count - done), offset + done);
+		if (rc < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		else if (rc <= 0)
+		{
+			//Let the buffered path report the error
+			return EZeroCopyResult_Fallback;
+		}
+
+		new_hash.update(reinterpret_cast<unsigned char*>(buf.data()), static_cast<unsigned int>(rc));
+		done += rc;
+	}
+
+	hash = new_hash;
+	return EZeroCopyResult_Ok;
+#else
+	return EZeroCopyResult_Fallback;
+#endif
+}
+
+EZeroCopyResult zero_copy_send(SOCKET s, int fd, int64 offset, size_t count, int timeoutms, size_t& sent)
+{
+	sent = 0;
+#ifdef WITH_ZERO_COPY_SEND
+	off64_t foffset = offset;
+	while (sent < count)
+	{
+		ssize_t rc = sendfile64(s, fd, &foffset, count - sent);
+		if (rc < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			else if (errno == EAGAIN)
+			{
+				pollfd pfd = {};
+				pfd.fd = s;
+				pfd.events = POLLOUT;
+				if (poll(&pfd, 1, timeoutms) <= 0)
+				{
+					return EZeroCopyResult_Error;
+				}
+				continue;
+			}
+			else if (sent == 0
+				&& (errno == EINVAL || errno == ENOSYS))
+			{
+				return EZeroCopyResult_Fallback;
+			}
+
+			Server->Log("Error sending file data via sendfile. Errno: " + convert(errno), LL_DEBUG);
+			return EZeroCopyResult_Error;
+		}
+		else if (rc == 0)
+		{
+			//File got smaller
+			break;
+		}
+
+		sent += rc;
+	}
+	return EZeroCopyResult_Ok;
+#else
+	return EZeroCopyResult_Fallback;
+#endif
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include "../Interface/Types.h"
+#include "socket_header.h"
+
+class MD5;
+
+enum EZeroCopyResult
+{
+	EZeroCopyResult_Ok,
+	//Nothing was sent/hashed. Caller should read and send the data itself
+	EZeroCopyResult_Fallback,
+	EZeroCopyResult_Error
+};
+
+bool zero_copy_enabled();
+
+/**
+* True if the data of the file cannot change while it is being sent (it is on
+* a read-only mount, e.g. a snapshot). Only then may a range be hashed and
+* sent with separate reads.
+*/
+bool zero_copy_unchanging(int fd);
+
+/**
+* Hashes [offset, offset+count) of the file without moving the file position.
+* Only updates hash if the whole range could be read.
+*/
+EZeroCopyResult zero_copy_hash(int fd, int64 offset, size_t count, MD5& hash);
+
+/**
+* Sends [offset, offset+count) of the file to the socket via sendfile.
+* sent is less than count if the file got smaller in the meantime.
+*/
+EZeroCopyResult zero_copy_send(SOCKET s, int fd, int64 offset, size_t count, int timeoutms, size_t& sent);
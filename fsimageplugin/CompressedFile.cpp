@@ -26,6 +26,7 @@
 #include <zstd.h>
 #endif
 #include "LRUMemCache.h"
+#include "../Interface/Thread.h"
 
 #define MINIZ_NO_ZLIB_COMPATIBLE_NAMES
 #include "../common/miniz.h"
@@ -40,12 +41,37 @@ const _u32 mode_none = 0;
 const _u32 mode_zlib = 1;
 const _u32 mode_zstd = 2;
 const size_t c_header_size = sizeof(headerMagic) + sizeof(headerVersionV1_0) + sizeof(__int64) + sizeof(__int64) + sizeof(_u32);
+//Start reading ahead after this many reads of consecutive blocks
+const size_t c_readAheadMinSequential = 2;
+//Number of blocks decompressed ahead per worker
+const size_t c_readAheadBlocksPerThread = 2;
 
+class CompressedFileReadAhead : public IThread
+{
+public:
+	CompressedFileReadAhead(CompressedFile* file)
+		: file(file)
+	{}
+
+	virtual ~CompressedFileReadAhead() {}
+
+	void operator()()
+	{
+		file->readAheadWorker();
+		delete this;
+	}
+
+private:
+	CompressedFile* file;
+};
 
 CompressedFile::CompressedFile( std::string pFilename, int pMode, size_t n_threads)
-	: error(false), currentPosition(0),
-	  finished(false), filesize(0), noMagic(false),
-	mutex(Server->createMutex()), n_threads(n_threads), numBlockOffsets(0)
+	: filesize(0), currentPosition(0), numBlockOffsets(0),
+	nCacheItems(c_ncacheItems), error(false), finished(false), noMagic(false),
+	mutex(Server->createMutex()), n_threads(n_threads),
+	parallelRead(false), readMutex(Server->createMutex()), readCond(Server->createCondition()),
+	readAheadCond(Server->createCondition()), lastReadBlock(std::string::npos), sequentialReads(0),
+	readUseCounter(0), nReadAheadWorkers(0), readAheadStarted(false), readAheadQuit(false)
 {
 	uncompressedFile = Server->openFile(pFilename, pMode);
 
@@ -67,7 +93,7 @@ CompressedFile::CompressedFile( std::string pFilename, int pMode, size_t n_threa
 		readOnly=false;
 		blocksize = c_cacheBuffersize;
 		writeHeader();
-		hotCache.reset(new LRUMemCache(blocksize, c_ncacheItems, n_threads));
+		createHotCache(n_threads);
 		initCompressedBuffers(n_threads + 1);
 	}
 
@@ -80,9 +106,13 @@ CompressedFile::CompressedFile( std::string pFilename, int pMode, size_t n_threa
 }
 
 CompressedFile::CompressedFile(IFile* file, bool openExisting, bool readOnly, size_t n_threads)
-	: error(false), currentPosition(0),
-	finished(false), uncompressedFile(file), filesize(0), readOnly(readOnly),
-	noMagic(false), n_threads(n_threads), numBlockOffsets(0)
+	: filesize(0), currentPosition(0), numBlockOffsets(0),
+	uncompressedFile(file), nCacheItems(c_ncacheItems), error(false),
+	finished(false), readOnly(readOnly), noMagic(false),
+	mutex(Server->createMutex()), n_threads(n_threads),
+	parallelRead(false), readMutex(Server->createMutex()), readCond(Server->createCondition()),
+	readAheadCond(Server->createCondition()), lastReadBlock(std::string::npos), sequentialReads(0),
+	readUseCounter(0), nReadAheadWorkers(0), readAheadStarted(false), readAheadQuit(false)
 {
 	if(openExisting)
 	{
@@ -92,7 +122,7 @@ CompressedFile::CompressedFile(IFile* file, bool openExisting, bool readOnly, si
 	{
 		blocksize = c_cacheBuffersize;
 		writeHeader();
-		hotCache.reset(new LRUMemCache(blocksize, c_ncacheItems, n_threads));
+		createHotCache(n_threads);
 		initCompressedBuffers(n_threads + 1);
 	}
 	if(hotCache.get()!=nullptr)
@@ -105,6 +135,8 @@ CompressedFile::CompressedFile(IFile* file, bool openExisting, bool readOnly, si
 
 CompressedFile::~CompressedFile()
 {
+	finishReadAheadWorkers();
+
 	hotCache.reset();
 
 	if(!finished)
@@ -120,6 +152,39 @@ CompressedFile::~CompressedFile()
 		assert(compressedBuffers[i] != nullptr);
 		delete[] compressedBuffers[i];
 	}
+
+	for (std::map<size_t, SReadBlock>::iterator it = readBlocks.begin(); it != readBlocks.end(); ++it)
+	{
+		delete[] it->second.buffer;
+	}
+
+	for (size_t i = 0; i < freeReadBuffers.size(); ++i)
+	{
+		delete[] freeReadBuffers[i];
+	}
+}
+
+void CompressedFile::createHotCache(size_t n_eviction_threads)
+{
+	nCacheItems = c_ncacheItems;
+	std::string cache_items = Server->getServerParameter("image_cache_items");
+	if (!cache_items.empty())
+	{
+		nCacheItems = (std::max)(static_cast<size_t>(1), static_cast<size_t>(watoi64(cache_items)));
+	}
+
+	ECachePolicy policy = cachePolicyFromString(Server->getServerParameter("image_cache_policy"));
+
+	hotCache.reset(new LRUMemCache(blocksize, nCacheItems, n_eviction_threads, policy));
+}
+
+SCacheStats CompressedFile::getCacheStats()
+{
+	if (hotCache.get() == nullptr)
+	{
+		return SCacheStats();
+	}
+	return hotCache->getStats();
 }
 
 bool CompressedFile::hasError()
@@ -164,9 +229,12 @@ void CompressedFile::readHeader(bool *has_error)
 	filesize = little_endian(filesize);
 	blocksize = little_endian(blocksize);
 
-	hotCache.reset(new LRUMemCache(blocksize, c_ncacheItems, n_threads));
+	//Blocks are not compressed on eviction if read-only
+	createHotCache(readOnly ? 1 : n_threads);
 
 	readIndex(has_error);
+
+	parallelRead = readOnly && !error;
 }
 
 void CompressedFile::readIndex(bool *has_error)
@@ -209,6 +277,12 @@ bool CompressedFile::Seek( _i64 spos )
 
 _u32 CompressedFile::Read(_i64 spos, char* buffer, _u32 bsize, bool *has_error)
 {
+	if(parallelRead)
+	{
+		assert(!finished);
+		return readParallel(spos, buffer, bsize, has_error);
+	}
+
 	if(!Seek(spos))
 	{
 		if (has_error) *has_error = true;
@@ -222,6 +296,13 @@ _u32 CompressedFile::Read( char* buffer, _u32 bsize, bool *has_error)
 {
 	assert(!finished);
 
+	if(parallelRead)
+	{
+		_u32 read = readParallel(currentPosition, buffer, bsize, has_error);
+		currentPosition += read;
+		return read;
+	}
+
 	size_t cacheSize;
 	char* cachePtr = hotCache->get(currentPosition, cacheSize);
 
@@ -232,7 +313,7 @@ _u32 CompressedFile::Read( char* buffer, _u32 bsize, bool *has_error)
 			return 0;
 		}
 
-		cachePtr = hotCache->get(currentPosition, cacheSize);
+		cachePtr = hotCache->get(currentPosition, cacheSize, false);
 
 		if(cachePtr==nullptr)
 		{
@@ -283,6 +364,22 @@ std::string CompressedFile::Read( _u32 tr, bool *has_error)
 
 std::string CompressedFile::Read(_i64 spos, _u32 tr, bool *has_error)
 {
+	if(parallelRead)
+	{
+		if(tr==0)
+			return std::string();
+
+		std::string ret;
+		ret.resize(tr);
+
+		if(Read(spos, &ret[0], tr, has_error)!=tr)
+		{
+			return std::string();
+		}
+
+		return ret;
+	}
+
 	if(!Seek(spos))
 	{
 		if (has_error) *has_error = true;
@@ -296,13 +393,17 @@ bool CompressedFile::fillCache( __int64 offset, bool errorMsg, bool *has_error)
 {
 	size_t block = static_cast<size_t>(offset/blocksize);
 
-	if(block>=blockOffsets.size())
 	{
-		if(errorMsg)
+		//Eviction threads may extend the index
+		IScopedLock lock(mutex.get());
+		if(block>=blockOffsets.size())
 		{
-			Server->Log("Block "+convert(block)+" to read not found in block index", LL_ERROR);
+			if(errorMsg)
+			{
+				Server->Log("Block "+convert(block)+" to read not found in block index", LL_ERROR);
+			}
+			return false;
 		}
-		return false;
 	}
 
 	char* buf = hotCache->create(offset);
@@ -312,14 +413,23 @@ bool CompressedFile::fillCache( __int64 offset, bool errorMsg, bool *has_error)
 		return false;
 	}
 
-	if(blockOffsets[block]==-1)
+	return decompressBlock(block, buf, compressedBuffer, has_error);
+}
+
+bool CompressedFile::decompressBlock(size_t block, char* buf, std::vector<char>& compressed_buf, bool *has_error)
+{
+	__int64 blockDataOffset;
+	{
+		IScopedLock lock(mutex.get());
+		blockDataOffset = blockOffsets[block];
+	}
+
+	if(blockDataOffset==-1)
 	{
 		memset(buf, 0, blocksize);
 		return true;
 	}
 
-	const __int64 blockDataOffset = blockOffsets[block];	
-
 	char blockheaderBuf[2*sizeof(_u32)];
 	if(readFromFile(blockDataOffset, blockheaderBuf, sizeof(blockheaderBuf), has_error)!=sizeof(blockheaderBuf))
 	{
@@ -351,12 +461,12 @@ bool CompressedFile::fillCache( __int64 offset, bool errorMsg, bool *has_error)
 	}
 	else
 	{
-		if(compressedBuffer.size()<compressedSize)
+		if(compressed_buf.size()<compressedSize)
 		{
-			compressedBuffer.resize(compressedSize);
+			compressed_buf.resize(compressedSize);
 		}	
 
-		if(readFromFile(blockDataOffset + c_blockbufHeadersize, &compressedBuffer[0], compressedSize, has_error)!=compressedSize)
+		if(readFromFile(blockDataOffset + c_blockbufHeadersize, &compressed_buf[0], compressedSize, has_error)!=compressedSize)
 		{
 			Server->Log("Error while reading compressed data from "+convert(blockDataOffset)+" ("+convert(compressedSize)+" bytes)", LL_ERROR);
 			return false;
@@ -368,7 +478,7 @@ bool CompressedFile::fillCache( __int64 offset, bool errorMsg, bool *has_error)
 	{
 		rdecomp = blocksize;
 		int rc = mz_uncompress(reinterpret_cast<unsigned char*>(buf), &rdecomp,
-			reinterpret_cast<const unsigned char*>(compressedBuffer.data()), static_cast<mz_ulong>(compressedSize));
+			reinterpret_cast<const unsigned char*>(compressed_buf.data()), static_cast<mz_ulong>(compressedSize));
 
 		if(rc != MZ_OK)
 		{
@@ -381,7 +491,7 @@ bool CompressedFile::fillCache( __int64 offset, bool errorMsg, bool *has_error)
 	{
 		rdecomp = blocksize;
 		const size_t rc = ZSTD_decompress(buf, blocksize,
-			compressedBuffer.data(), compressedSize);
+			compressed_buf.data(), compressedSize);
 
 		if (ZSTD_isError(rc))
 		{
@@ -397,7 +507,7 @@ bool CompressedFile::fillCache( __int64 offset, bool errorMsg, bool *has_error)
 	}
 	
 
-	if(rdecomp!=blocksize && offset+blocksize<filesize)
+	if(rdecomp!=blocksize && static_cast<__int64>(block+1)*blocksize<filesize)
 	{
 		Server->Log("Did not receive enough bytes from compressed stream. Expected "+convert(blocksize)+" received "+convert((size_t)rdecomp), LL_ERROR);
 		return false;
@@ -410,6 +520,13 @@ _u32 CompressedFile::Write( const char* buffer, _u32 bsize, bool *has_error)
 {
 	assert(!finished);
 
+	if(parallelRead)
+	{
+		//Writes only go to the hot cache. Read from there from now on
+		finishReadAheadWorkers();
+		parallelRead = false;
+	}
+
 	_u32 maxWrite = static_cast<_u32>(((currentPosition/blocksize)+1)*blocksize - currentPosition);
 	_u32 write = bsize;
 	if(maxWrite<bsize)
@@ -639,6 +756,10 @@ bool CompressedFile::finish()
 	if(hotCache.get())
 	{
 		hotCache->clear();
+
+		SCacheStats stats = hotCache->getStats();
+		Server->Log("Cache of compressed file " + uncompressedFile->getFilename() + ": " + convert(stats.hits) + " hits, "
+			+ convert(stats.misses) + " misses, " + convert(stats.evictions) + " evictions, " + convert(stats.writebacks) + " write-backs", LL_DEBUG);
 	}
 
 	if(!readOnly)
@@ -729,3 +850,258 @@ bool CompressedFile::Sync()
 {
 	return finish();
 }
+
+_u32 CompressedFile::readParallel(int64 offset, char* buffer, _u32 bsize, bool *has_error)
+{
+	_u32 read = 0;
+	while (read < bsize
+		&& offset < filesize)
+	{
+		size_t block = static_cast<size_t>(offset / blocksize);
+
+		char* buf = pinReadBlock(block, has_error);
+		if (buf == nullptr)
+		{
+			break;
+		}
+
+		size_t innerOffset = static_cast<size_t>(offset - static_cast<int64>(block)*blocksize);
+		_u32 canRead = (std::min)(static_cast<_u32>(blocksize - innerOffset), bsize - read);
+		if (offset + canRead > filesize)
+		{
+			canRead = static_cast<_u32>(filesize - offset);
+		}
+
+		memcpy(buffer + read, buf + innerOffset, canRead);
+
+		unpinReadBlock(block);
+
+		read += canRead;
+		offset += canRead;
+	}
+
+	return read;
+}
+
+char* CompressedFile::pinReadBlock(size_t block, bool *has_error)
+{
+	if (block >= blockOffsets.size())
+	{
+		return nullptr;
+	}
+
+	IScopedLock lock(readMutex.get());
+
+	if (block != lastReadBlock)
+	{
+		if (block == lastReadBlock + 1)
+		{
+			++sequentialReads;
+		}
+		else
+		{
+			sequentialReads = 0;
+		}
+		lastReadBlock = block;
+
+		if (sequentialReads >= c_readAheadMinSequential)
+		{
+			scheduleReadAhead(block);
+		}
+	}
+
+	std::map<size_t, SReadBlock>::iterator it = readBlocks.find(block);
+	if (it != readBlocks.end())
+	{
+		SReadBlock& read_block = it->second;
+		++read_block.pins;
+		read_block.last_use = ++readUseCounter;
+
+		while (read_block.loading)
+		{
+			readCond->wait(&lock);
+		}
+
+		if (read_block.failed)
+		{
+			unpinReadBlock(block);
+			return nullptr;
+		}
+
+		return read_block.buffer;
+	}
+
+	SReadBlock& read_block = readBlocks[block];
+	read_block.buffer = getReadBuffer();
+	read_block.pins = 1;
+	read_block.last_use = ++readUseCounter;
+
+	lock.relock(nullptr);
+
+	std::vector<char> compressed_buf;
+	bool ok = decompressBlock(block, read_block.buffer, compressed_buf, has_error);
+
+	lock.relock(readMutex.get());
+
+	read_block.loading = false;
+	read_block.failed = !ok;
+	readCond->notify_all();
+
+	if (!ok)
+	{
+		unpinReadBlock(block);
+		return nullptr;
+	}
+
+	return read_block.buffer;
+}
+
+void CompressedFile::unpinReadBlock(size_t block)
+{
+	IScopedLock lock(readMutex.get());
+
+	std::map<size_t, SReadBlock>::iterator it = readBlocks.find(block);
+	assert(it != readBlocks.end());
+	assert(it->second.pins > 0);
+
+	--it->second.pins;
+
+	if (it->second.pins == 0
+		&& it->second.failed)
+	{
+		freeReadBuffers.push_back(it->second.buffer);
+		readBlocks.erase(it);
+	}
+}
+
+char* CompressedFile::getReadBuffer()
+{
+	const size_t maxBlocks = nCacheItems + c_readAheadBlocksPerThread * n_threads;
+
+	if (readBlocks.size() > maxBlocks)
+	{
+		//Evict the least recently used block nobody reads from
+		std::map<size_t, SReadBlock>::iterator lru = readBlocks.end();
+		for (std::map<size_t, SReadBlock>::iterator it = readBlocks.begin(); it != readBlocks.end(); ++it)
+		{
+			if (it->second.pins == 0
+				&& !it->second.loading
+				&& (lru == readBlocks.end()
+					|| it->second.last_use < lru->second.last_use))
+			{
+				lru = it;
+			}
+		}
+
+		if (lru != readBlocks.end())
+		{
+			char* ret = lru->second.buffer;
+			readBlocks.erase(lru);
+			return ret;
+		}
+	}
+
+	if (!freeReadBuffers.empty())
+	{
+		char* ret = freeReadBuffers.back();
+		freeReadBuffers.pop_back();
+		return ret;
+	}
+
+	return new char[blocksize];
+}
+
+void CompressedFile::scheduleReadAhead(size_t block)
+{
+	if (n_threads == 0)
+	{
+		return;
+	}
+
+	if (!readAheadStarted)
+	{
+		readAheadStarted = true;
+		for (size_t i = 0; i < n_threads; ++i)
+		{
+			if (Server->createThread(new CompressedFileReadAhead(this), "comp img read"))
+			{
+				++nReadAheadWorkers;
+			}
+		}
+	}
+
+	const size_t lastBlock = (std::min)(block + c_readAheadBlocksPerThread * n_threads, blockOffsets.size() - 1);
+	for (size_t i = block + 1; i <= lastBlock; ++i)
+	{
+		if (readBlocks.find(i) == readBlocks.end()
+			&& std::find(readAheadQueue.begin(), readAheadQueue.end(), i) == readAheadQueue.end())
+		{
+			readAheadQueue.push_back(i);
+			readAheadCond->notify_one();
+		}
+	}
+}
+
+void CompressedFile::readAheadWorker()
+{
+	std::vector<char> compressed_buf;
+
+	IScopedLock lock(readMutex.get());
+	while (!readAheadQuit)
+	{
+		if (readAheadQueue.empty())
+		{
+			readAheadCond->wait(&lock);
+			continue;
+		}
+
+		size_t block = readAheadQueue.front();
+		readAheadQueue.pop_front();
+
+		if (readBlocks.find(block) != readBlocks.end()
+			|| block < lastReadBlock)
+		{
+			//Already loaded or the reader moved past it
+			continue;
+		}
+
+		SReadBlock& read_block = readBlocks[block];
+		read_block.buffer = getReadBuffer();
+		read_block.pins = 1;
+		read_block.last_use = ++readUseCounter;
+
+		lock.relock(nullptr);
+
+		bool ok = decompressBlock(block, read_block.buffer, compressed_buf, nullptr);
+
+		lock.relock(readMutex.get());
+
+		read_block.loading = false;
+		read_block.failed = !ok;
+		readCond->notify_all();
+
+		--read_block.pins;
+		if (read_block.pins == 0
+			&& read_block.failed)
+		{
+			freeReadBuffers.push_back(read_block.buffer);
+			readBlocks.erase(block);
+		}
+	}
+
+	--nReadAheadWorkers;
+	readCond->notify_all();
+}
+
+void CompressedFile::finishReadAheadWorkers()
+{
+	IScopedLock lock(readMutex.get());
+	readAheadQuit = true;
+	readAheadQueue.clear();
+	readAheadCond->notify_all();
+
+	while (nReadAheadWorkers > 0)
+	{
+		readCond->wait(&lock);
+	}
+}
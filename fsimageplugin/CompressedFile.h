@@ -2,9 +2,12 @@
 
 #include <string>
 #include <memory>
+#include <map>
+#include <deque>
 
 #include "../Interface/File.h"
 #include "../Interface/Mutex.h"
+#include "../Interface/Condition.h"
 
 class LRUMemCache;
 
@@ -19,6 +22,19 @@ struct SCacheItem
 	__int64 offset;
 };
 
+struct SCacheStats
+{
+	SCacheStats()
+		: hits(0), misses(0), evictions(0), writebacks(0)
+	{}
+
+	int64 hits;
+	int64 misses;
+	int64 evictions;
+	//Evictions of modified blocks that were passed to the eviction callback
+	int64 writebacks;
+};
+
 class ICacheEvictionCallback
 {
 private:
@@ -57,10 +73,14 @@ public:
 
 	bool hasNoMagic();
 
+	SCacheStats getCacheStats();
+
 private:
+	void createHotCache(size_t n_eviction_threads);
 	void readHeader(bool *has_error);
 	void readIndex(bool *has_error);
 	bool fillCache(__int64 offset, bool errorMsg, bool *has_error);
+	bool decompressBlock(size_t block, char* buf, std::vector<char>& compressed_buf, bool *has_error);
 	virtual void evictFromLruCache(const SCacheItem& item);
 	void writeHeader();
 	void writeIndex();
@@ -71,6 +91,16 @@ private:
 
 	_u32 readFromFile(int64 offset, char* buffer, _u32 bsize, bool *has_error);
 	_u32 writeToFile(int64 offset, const char* buffer, _u32 bsize);
+
+	_u32 readParallel(int64 offset, char* buffer, _u32 bsize, bool *has_error);
+	char* pinReadBlock(size_t block, bool *has_error);
+	void unpinReadBlock(size_t block);
+	char* getReadBuffer();
+	void scheduleReadAhead(size_t block);
+	void readAheadWorker();
+	void finishReadAheadWorkers();
+
+	friend class CompressedFileReadAhead;
 	
 
 	__int64 filesize;
@@ -86,6 +116,7 @@ private:
 	int64 uncompressedFileSize;
 	
 	std::unique_ptr<LRUMemCache> hotCache;
+	size_t nCacheItems;
 
 	//for reading
 	std::vector<char> compressedBuffer;
@@ -104,4 +135,33 @@ private:
 	std::unique_ptr<IMutex> mutex;
 
 	size_t n_threads;
+
+	//Read-only files: blocks are decompressed by the reading threads and,
+	//once sequential access is detected, ahead of time by n_threads workers
+	struct SReadBlock
+	{
+		SReadBlock()
+			: buffer(NULL), loading(true), failed(false), pins(0), last_use(0)
+		{}
+
+		char* buffer;
+		bool loading;
+		bool failed;
+		size_t pins;
+		int64 last_use;
+	};
+
+	bool parallelRead;
+	std::unique_ptr<IMutex> readMutex;
+	std::unique_ptr<ICondition> readCond;
+	std::unique_ptr<ICondition> readAheadCond;
+	std::map<size_t, SReadBlock> readBlocks;
+	std::vector<char*> freeReadBuffers;
+	std::deque<size_t> readAheadQueue;
+	size_t lastReadBlock;
+	size_t sequentialReads;
+	int64 readUseCounter;
+	size_t nReadAheadWorkers;
+	bool readAheadStarted;
+	bool readAheadQuit;
 };
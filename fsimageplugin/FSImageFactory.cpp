@@ -27,6 +27,11 @@
 #define FSNTFS FSNTFSWIN
 #endif
 #include "fs/unknown.h"
+#ifndef _WIN32
+#include "fs/ext.h"
+#include "fs/xfs.h"
+#include "fs/btrfs.h"
+#endif
 #include "vhdfile.h"
 #include "vhdxfile.h"
 #include "../stringtools.h"
@@ -318,10 +323,12 @@ IFilesystem *FSImageFactory::createFilesystem(const std::string &pDevOrig, ERead
 {
 	std::string pDev = pDevOrig;
 #ifndef _WIN32
+#ifndef HAVE_LINUX_IO_URING_H
 	if(read_ahead==EReadaheadMode_Overlapped)
 	{
 		read_ahead = EReadaheadMode_None;
 	}
+#endif
 
 	pDev = trim(getFile(pDevOrig+"-dev"));
 	if(pDev.empty())
@@ -358,6 +365,10 @@ IFilesystem *FSImageFactory::createFilesystem(const std::string &pDevOrig, ERead
 		return nullptr;
 	}
 
+#ifndef _WIN32
+	bool is_btrfs = FSBtrfs::isBtrfs(dev);
+#endif
+
 	Server->destroy(dev);
 
 	if(isNTFS(buffer) )
@@ -498,15 +509,42 @@ IFilesystem *FSImageFactory::createFilesystem(const std::string &pDevOrig, ERead
 #else
 	else
 	{
-		IFilesystem* fs = new Partclone(pDev, read_ahead, background_priority, next_block_callback);
-		if (fs->hasError())
+		IFilesystem* fs = nullptr;
+		if (FSExt::isExt(buffer, sizeof(buffer)))
+		{
+			Server->Log("Filesystem type is ext ("+pDev+")", LL_DEBUG);
+			fs = new FSExt(pDev, read_ahead, background_priority, next_block_callback);
+		}
+		else if (FSXfs::isXfs(buffer, sizeof(buffer)))
+		{
+			Server->Log("Filesystem type is xfs ("+pDev+")", LL_DEBUG);
+			fs = new FSXfs(pDev, read_ahead, background_priority, next_block_callback);
+		}
+		else if (is_btrfs)
 		{
+			Server->Log("Filesystem type is btrfs ("+pDev+")", LL_DEBUG);
+			fs = new FSBtrfs(pDev, read_ahead, background_priority, next_block_callback);
+		}
+
+		if (fs != nullptr && fs->hasError())
+		{
+			Server->Log("Reading used blocks of " + fs->getType() + " file system failed. Falling back to partclone.", LL_WARNING);
 			delete fs;
-			fs = new FSUnknown(pDev, read_ahead, background_priority, next_block_callback);
+			fs = nullptr;
+		}
+
+		if (fs == nullptr)
+		{
+			fs = new Partclone(pDev, read_ahead, background_priority, next_block_callback);
 			if (fs->hasError())
 			{
 				delete fs;
-				return nullptr;
+				fs = new FSUnknown(pDev, read_ahead, background_priority, next_block_callback);
+				if (fs->hasError())
+				{
+					delete fs;
+					return nullptr;
+				}
 			}
 		}
 		PrintInfo(fs);
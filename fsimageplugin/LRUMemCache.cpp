@@ -21,82 +21,375 @@
 #include "../stringtools.h"
 #include <string.h>
 #include <assert.h>
+#include <list>
 
-
-LRUMemCache::LRUMemCache(size_t buffersize, size_t nbuffers, size_t p_n_threads)
-	: buffersize(buffersize), nbuffers(nbuffers), callback(nullptr),
-	mutex(Server->createMutex()), cond(Server->createCondition()), n_threads(p_n_threads),
-	do_quit(false), n_threads_working(0), cond_wait(Server->createCondition()), wait_work(false)
+namespace
 {
-	if (n_threads > 0)
-		--n_threads;
+	//Small caches are not sharded, so that eviction considers all blocks
+	const size_t c_minBuffersPerShard = 16;
+	const size_t c_maxShards = 16;
 
-	for (size_t i = 0; i < n_threads; ++i)
+	class LruPolicy : public ICachePolicy
 	{
-		Server->createThread(this, "comp img"+convert(i));
-	}
-}
+	public:
+		virtual void insert(__int64 key)
+		{
+			items[key] = order.insert(order.end(), key);
+		}
 
-char* LRUMemCache::get( __int64 offset, size_t& bsize )
-{
-	for(size_t i=lruItems.size(); i-->0; )
+		virtual void access(__int64 key)
+		{
+			std::unordered_map<__int64, std::list<__int64>::iterator>::iterator it = items.find(key);
+			if (it != items.end())
+			{
+				order.splice(order.end(), order, it->second);
+			}
+		}
+
+		virtual __int64 evict()
+		{
+			assert(!order.empty());
+			__int64 key = order.front();
+			order.pop_front();
+			items.erase(key);
+			return key;
+		}
+
+		virtual void remove(__int64 key)
+		{
+			std::unordered_map<__int64, std::list<__int64>::iterator>::iterator it = items.find(key);
+			if (it != items.end())
+			{
+				order.erase(it->second);
+				items.erase(it);
+			}
+		}
+
+	private:
+		//Least recently used first
+		std::list<__int64> order;
+		std::unordered_map<__int64, std::list<__int64>::iterator> items;
+	};
+
+	class ClockPolicy : public ICachePolicy
 	{
-		if(lruItems[i].offset<=offset &&
-			lruItems[i].offset+static_cast<__int64>(buffersize)>offset)
+	public:
+		ClockPolicy()
+			: hand(ring.end())
+		{}
+
+		virtual void insert(__int64 key)
 		{
-			size_t innerOffset = static_cast<size_t>(offset-lruItems[i].offset);
-			bsize = buffersize - innerOffset;
-			return lruItems[i].buffer + innerOffset;
+			//Inserted behind the hand, so it is the last block the hand reaches
+			items[key] = ring.insert(hand, SClockEntry(key));
 		}
-	}
 
-	return nullptr;
-}
+		virtual void access(__int64 key)
+		{
+			std::unordered_map<__int64, std::list<SClockEntry>::iterator>::iterator it = items.find(key);
+			if (it != items.end())
+			{
+				it->second->referenced = true;
+			}
+		}
 
-bool LRUMemCache::put( __int64 offset, const char* buffer, size_t bsize )
-{
-	for(size_t i=lruItems.size(); i-->0; )
+		virtual __int64 evict()
+		{
+			assert(!ring.empty());
+			while (true)
+			{
+				if (hand == ring.end())
+				{
+					hand = ring.begin();
+				}
+
+				if (hand->referenced)
+				{
+					hand->referenced = false;
+					++hand;
+				}
+				else
+				{
+					__int64 key = hand->key;
+					hand = ring.erase(hand);
+					items.erase(key);
+					return key;
+				}
+			}
+		}
+
+		virtual void remove(__int64 key)
+		{
+			std::unordered_map<__int64, std::list<SClockEntry>::iterator>::iterator it = items.find(key);
+			if (it != items.end())
+			{
+				if (hand == it->second)
+				{
+					hand = ring.erase(it->second);
+				}
+				else
+				{
+					ring.erase(it->second);
+				}
+				items.erase(it);
+			}
+		}
+
+	private:
+		struct SClockEntry
+		{
+			SClockEntry(__int64 key)
+				: key(key), referenced(true)
+			{}
+
+			__int64 key;
+			bool referenced;
+		};
+
+		std::list<SClockEntry> ring;
+		std::list<SClockEntry>::iterator hand;
+		std::unordered_map<__int64, std::list<SClockEntry>::iterator> items;
+	};
+
+	/*
+	* Adaptive replacement cache. Blocks used once are in t1, blocks used
+	* more than once in t2. b1 and b2 remember the keys recently evicted from
+	* t1 and t2. Misses on those move the target size of t1 (p), so a
+	* sequential scan only displaces blocks in t1.
+	*/
+	class ArcPolicy : public ICachePolicy
 	{
-		if(lruItems[i].offset<=offset &&
-			lruItems[i].offset+static_cast<__int64>(buffersize)>offset)
+	public:
+		ArcPolicy(size_t capacity)
+			: capacity(capacity), p(0), last_inserted(-1)
+		{}
+
+		virtual void insert(__int64 key)
 		{
-			size_t innerOffset = static_cast<size_t>(offset-lruItems[i].offset);
+			std::unordered_map<__int64, SArcEntry>::iterator it = items.find(key);
+			if (it != items.end()
+				&& it->second.list == b1)
+			{
+				p = (std::min)(capacity, p + (std::max)(lists[b2].size() / lists[b1].size(), static_cast<size_t>(1)));
+				move(it->second, t2);
+			}
+			else if (it != items.end()
+				&& it->second.list == b2)
+			{
+				size_t delta = (std::max)(lists[b1].size() / lists[b2].size(), static_cast<size_t>(1));
+				p = p > delta ? p - delta : 0;
+				move(it->second, t2);
+			}
+			else
+			{
+				SArcEntry& entry = items[key];
+				entry.list = t1;
+				entry.it = lists[t1].insert(lists[t1].end(), key);
+			}
+
+			last_inserted = key;
+
+			if (lists[t1].size() + lists[b1].size() > capacity
+				&& !lists[b1].empty())
+			{
+				dropGhost(b1);
+			}
 
-			if( buffersize - innerOffset < bsize)
+			if (lists[b2].size() > capacity)
 			{
-				return false;
+				dropGhost(b2);
 			}
+		}
 
-			memcpy(lruItems[i].buffer + innerOffset, buffer, bsize);
+		virtual void access(__int64 key)
+		{
+			std::unordered_map<__int64, SArcEntry>::iterator it = items.find(key);
+			if (it != items.end()
+				&& (it->second.list == t1 || it->second.list == t2))
+			{
+				move(it->second, t2);
+			}
+		}
 
-			putBack(i);
+		virtual __int64 evict()
+		{
+			bool from_t1 = !lists[t1].empty()
+				&& (lists[t1].size() > p || lists[t2].empty());
+
+			if (from_t1
+				&& lists[t1].size() == 1
+				&& lists[t1].front() == last_inserted
+				&& !lists[t2].empty())
+			{
+				from_t1 = false;
+			}
+			else if (!from_t1
+				&& lists[t2].size() == 1
+				&& lists[t2].front() == last_inserted
+				&& !lists[t1].empty())
+			{
+				from_t1 = true;
+			}
+
+			size_t list = from_t1 ? t1 : t2;
+			assert(!lists[list].empty());
+			__int64 key = lists[list].front();
+			move(items[key], from_t1 ? b1 : b2);
+			return key;
+		}
+
+		virtual void remove(__int64 key)
+		{
+			std::unordered_map<__int64, SArcEntry>::iterator it = items.find(key);
+			if (it != items.end())
+			{
+				lists[it->second.list].erase(it->second.it);
+				items.erase(it);
+			}
+		}
+
+	private:
+		enum
+		{
+			t1 = 0,
+			t2 = 1,
+			b1 = 2,
+			b2 = 3
+		};
+
+		struct SArcEntry
+		{
+			size_t list;
+			std::list<__int64>::iterator it;
+		};
+
+		void move(SArcEntry& entry, size_t list)
+		{
+			lists[list].splice(lists[list].end(), lists[entry.list], entry.it);
+			entry.list = list;
+		}
 
-			return true;
+		void dropGhost(size_t list)
+		{
+			items.erase(lists[list].front());
+			lists[list].pop_front();
 		}
+
+		size_t capacity;
+		size_t p;
+		__int64 last_inserted;
+		//Least recently used first
+		std::list<__int64> lists[4];
+		std::unordered_map<__int64, SArcEntry> items;
+	};
+}
+
+ECachePolicy cachePolicyFromString(const std::string& name)
+{
+	std::string lname = strlower(name);
+	if (lname == "clock")
+		return ECachePolicy_Clock;
+	else if (lname == "arc")
+		return ECachePolicy_Arc;
+
+	return ECachePolicy_Lru;
+}
+
+ICachePolicy* ICachePolicy::create(ECachePolicy policy, size_t capacity)
+{
+	switch (policy)
+	{
+	case ECachePolicy_Clock:
+		return new ClockPolicy;
+	case ECachePolicy_Arc:
+		return new ArcPolicy(capacity);
+	default:
+		return new LruPolicy;
 	}
+}
 
-	SCacheItem newItem = createInt(offset);
+LRUMemCache::LRUMemCache(size_t buffersize, size_t nbuffers, size_t p_n_threads, ECachePolicy policy)
+	: n_writeback(0), mutex(Server->createMutex()), cond(Server->createCondition()),
+	cond_wait(Server->createCondition()), buffersize(buffersize), nbuffers(nbuffers),
+	n_threads(p_n_threads), n_threads_working(0), do_quit(false),
+	hits(0), misses(0), evictions(0), writebacks(0), callback(nullptr)
+{
+	size_t n_shards = (std::max)(static_cast<size_t>(1), (std::min)(c_maxShards, nbuffers / c_minBuffersPerShard));
+	shards.resize(n_shards);
+	for (size_t i = 0; i < n_shards; ++i)
+	{
+		shards[i].mutex.reset(Server->createMutex());
+		shards[i].capacity = (std::max)(static_cast<size_t>(1), nbuffers / n_shards + (i < nbuffers % n_shards ? 1 : 0));
+		shards[i].policy.reset(ICachePolicy::create(policy, shards[i].capacity));
+	}
 
-	size_t innerOffset = static_cast<size_t>(offset-newItem.offset);
+	if (n_threads > 0)
+		--n_threads;
 
-	if( buffersize - innerOffset < bsize)
+	for (size_t i = 0; i < n_threads; ++i)
 	{
-		return false;
+		Server->createThread(this, "comp img"+convert(i));
 	}
+}
 
-	memcpy(newItem.buffer + innerOffset, buffer, bsize);
+char* LRUMemCache::get( __int64 offset, size_t& bsize, bool touch )
+{
+	__int64 block_offset = offset - offset % buffersize;
+	SShard& shard = getShard(block_offset);
+	IScopedLock lock(shard.mutex.get());
 
-	return true;
+	std::unordered_map<__int64, SCacheEntry>::iterator it = shard.items.find(block_offset);
+	if (it == shard.items.end())
+	{
+		lock.relock(nullptr);
+		//The caller will load the block next, which needs the written back version
+		waitWriteBack(block_offset);
+		return nullptr;
+	}
+
+	if (touch)
+	{
+		++hits;
+		shard.policy->access(block_offset);
+	}
+
+	size_t innerOffset = static_cast<size_t>(offset - block_offset);
+	bsize = buffersize - innerOffset;
+	return it->second.buffer + innerOffset;
 }
 
-void LRUMemCache::putBack( size_t idx )
+bool LRUMemCache::put( __int64 offset, const char* buffer, size_t bsize )
 {
-	if(idx == lruItems.size()-1)
-		return;
+	__int64 block_offset = offset - offset % buffersize;
+	size_t innerOffset = static_cast<size_t>(offset - block_offset);
+
+	if (buffersize - innerOffset < bsize)
+	{
+		return false;
+	}
+
+	waitWriteBack(block_offset);
 
-	SCacheItem item = lruItems[idx];
-	lruItems.erase(lruItems.begin()+idx);
-	lruItems.push_back(item);
+	SShard& shard = getShard(block_offset);
+	IScopedLock lock(shard.mutex.get());
+
+	std::unordered_map<__int64, SCacheEntry>::iterator it = shard.items.find(block_offset);
+	SCacheEntry* entry;
+	if (it != shard.items.end())
+	{
+		++hits;
+		shard.policy->access(block_offset);
+		entry = &it->second;
+	}
+	else
+	{
+		entry = &createInt(shard, block_offset);
+	}
+
+	memcpy(entry->buffer + innerOffset, buffer, bsize);
+	entry->dirty = true;
+
+	return true;
 }
 
 void LRUMemCache::setCacheEvictionCallback( ICacheEvictionCallback* cacheEvictionCallback )
@@ -108,11 +401,31 @@ void LRUMemCache::clear()
 {
 	waitThreadWork();
 
-	for(size_t i=0;i<lruItems.size();++i)
+	for (size_t i = 0; i < shards.size(); ++i)
 	{
-		evict(lruItems[i], true);
+		SShard& shard = shards[i];
+		IScopedLock lock(shard.mutex.get());
+		for (std::unordered_map<__int64, SCacheEntry>::iterator it = shard.items.begin();
+			it != shard.items.end(); ++it)
+		{
+			SCacheItem item;
+			item.buffer = it->second.buffer;
+			item.offset = it->first;
+			shard.policy->remove(it->first);
+			evict(item, it->second.dirty, true);
+		}
+		shard.items.clear();
 	}
-	lruItems.clear();
+}
+
+SCacheStats LRUMemCache::getStats()
+{
+	SCacheStats ret;
+	ret.hits = hits;
+	ret.misses = misses;
+	ret.evictions = evictions;
+	ret.writebacks = writebacks;
+	return ret;
 }
 
 void LRUMemCache::operator()()
@@ -138,34 +451,41 @@ void LRUMemCache::operator()()
 
 		lock.relock(mutex.get());
 		lruItemBuffers.push_back(item.buffer);
+		writeBackItems.erase(item.offset);
+		--n_writeback;
 		--n_threads_working;
-		if(wait_work)
-			cond_wait->notify_all();
-	}	
+		cond_wait->notify_all();
+	}
 	--n_threads;
 	cond_wait->notify_all();
 }
 
-char* LRUMemCache::evict( SCacheItem& item, bool deleteBuffer )
+char* LRUMemCache::evict( SCacheItem& item, bool dirty, bool deleteBuffer )
 {
+	++evictions;
+
+	if (dirty && callback != nullptr)
+	{
+		++writebacks;
+	}
+
 	if (deleteBuffer)
 	{
-		if (callback != nullptr)
+		if (dirty && callback != nullptr)
 		{
 			callback->evictFromLruCache(item);
 		}
-		if (deleteBuffer)
-		{
-			delete[] item.buffer;
-		}
+
+		delete[] item.buffer;
 
 		return nullptr;
 	}
 	else
 	{
-		if (callback == nullptr)
+		//Unmodified blocks do not need to be written back, so the buffer can be reused directly
+		if (!dirty || callback == nullptr)
 		{
-			return nullptr;
+			return item.buffer;
 		}
 
 		IScopedLock lock(mutex.get());
@@ -178,6 +498,8 @@ char* LRUMemCache::evict( SCacheItem& item, bool deleteBuffer )
 		else
 		{
 			evictedItems.push_back(item);
+			writeBackItems.insert(item.offset);
+			++n_writeback;
 			cond->notify_one();
 			return getLruItemBuffer(lock);
 		}
@@ -224,35 +546,62 @@ void LRUMemCache::finishThreads()
 void LRUMemCache::waitThreadWork()
 {
 	IScopedLock lock(mutex.get());
-	wait_work = true;
 	while (!evictedItems.empty()
 		|| n_threads_working > 0)
 	{
 		cond_wait->wait(&lock);
 	}
-	wait_work = false;
 }
 
-SCacheItem LRUMemCache::createInt( __int64 offset )
+void LRUMemCache::waitWriteBack(__int64 block_offset)
 {
+	if (n_writeback == 0)
+	{
+		return;
+	}
+
+	IScopedLock lock(mutex.get());
+	while (writeBackItems.find(block_offset) != writeBackItems.end())
+	{
+		cond_wait->wait(&lock);
+	}
+}
+
+LRUMemCache::SShard& LRUMemCache::getShard(__int64 block_offset)
+{
+	return shards[static_cast<size_t>(block_offset / buffersize) % shards.size()];
+}
+
+LRUMemCache::SCacheEntry& LRUMemCache::createInt( SShard& shard, __int64 block_offset )
+{
+	++misses;
+
+	shard.policy->insert(block_offset);
+
 	char* buffer=nullptr;
-	if(lruItems.size()>=nbuffers)
+	if(shard.items.size()>=shard.capacity)
 	{
-		SCacheItem& toremove = lruItems[0];
-		buffer = evict(toremove, false);
-		lruItems.erase(lruItems.begin());
+		__int64 victim = shard.policy->evict();
+		std::unordered_map<__int64, SCacheEntry>::iterator it = shard.items.find(victim);
+		assert(it != shard.items.end());
+
+		SCacheItem toremove;
+		toremove.buffer = it->second.buffer;
+		toremove.offset = victim;
+		bool dirty = it->second.dirty;
+		shard.items.erase(it);
+
+		buffer = evict(toremove, dirty, false);
 	}
 	else
 	{
 		buffer = new char[buffersize];
 	}
 
-	SCacheItem newItem;
 	assert(buffer != nullptr);
+	SCacheEntry& newItem = shard.items[block_offset];
 	newItem.buffer=buffer;
-	newItem.offset=offset - offset % buffersize;
-
-	lruItems.push_back(newItem);
+	newItem.dirty=false;
 
 	return newItem;
 }
@@ -260,12 +609,15 @@ SCacheItem LRUMemCache::createInt( __int64 offset )
 char* LRUMemCache::create( __int64 offset )
 {
 	size_t bsize;
-	char* buf = get(offset, bsize);
+	char* buf = get(offset, bsize, false);
 
 	if(buf!=nullptr)
 	{
 		return buf;
 	}
 
-	return createInt(offset).buffer;
+	__int64 block_offset = offset - offset % buffersize;
+	SShard& shard = getShard(block_offset);
+	IScopedLock lock(shard.mutex.get());
+	return createInt(shard, block_offset).buffer;
 }
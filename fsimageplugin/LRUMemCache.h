@@ -8,14 +8,60 @@
 
 #include <vector>
 #include <memory>
+#include <string>
+#include <atomic>
+#include <unordered_map>
+#include <unordered_set>
 
+enum ECachePolicy
+{
+	ECachePolicy_Lru,
+	ECachePolicy_Clock,
+	ECachePolicy_Arc
+};
+
+//"lru", "clock" or "arc". Returns ECachePolicy_Lru for unknown names
+ECachePolicy cachePolicyFromString(const std::string& name);
+
+/*
+* Decides which block of a cache shard gets evicted. Blocks are identified by
+* their offset. Called with the shard locked.
+*/
+class ICachePolicy
+{
+public:
+	virtual ~ICachePolicy() {}
+
+	//Block was added to the cache
+	virtual void insert(__int64 key) = 0;
+	//Block in the cache was used
+	virtual void access(__int64 key) = 0;
+	//Selects a block to evict and stops tracking it. Never selects the
+	//most recently inserted block if there are other blocks
+	virtual __int64 evict() = 0;
+	//Block was removed from the cache without evict()
+	virtual void remove(__int64 key) = 0;
+
+	static ICachePolicy* create(ECachePolicy policy, size_t capacity);
+};
+
+/*
+* Block cache of CompressedFile. Blocks are spread over shards by their
+* index, each with its own lock, hash index and eviction policy. Modified
+* blocks are handed to the eviction callback by the eviction threads once
+* they are evicted. Looking up a block that is still being written back
+* waits for the write-back to finish. Returned pointers stay valid until the block is
+* evicted, so callers have to serialize get/put/create among themselves.
+*/
 class LRUMemCache : public IThread
 {
 public:
-	LRUMemCache(size_t buffersize, size_t nbuffers, size_t n_threads);
+	LRUMemCache(size_t buffersize, size_t nbuffers, size_t n_threads,
+		ECachePolicy policy = ECachePolicy_Lru);
 	~LRUMemCache();
 
-	char* get(__int64 offset, size_t& bsize);
+	//Does not count as use of the block if touch is false
+	char* get(__int64 offset, size_t& bsize, bool touch=true);
 
 	bool put(__int64 offset, const char* buffer, size_t bsize);
 
@@ -25,22 +71,47 @@ public:
 
 	void clear();
 
+	SCacheStats getStats();
+
 	void operator()();
 
 private:
+	struct SCacheEntry
+	{
+		SCacheEntry()
+			: buffer(nullptr), dirty(false)
+		{}
+
+		char* buffer;
+		bool dirty;
+	};
+
+	struct SShard
+	{
+		std::unique_ptr<IMutex> mutex;
+		std::unordered_map<__int64, SCacheEntry> items;
+		std::unique_ptr<ICachePolicy> policy;
+		size_t capacity;
+	};
+
 	void finishThreads();
 	void waitThreadWork();
+	void waitWriteBack(__int64 block_offset);
 
-	SCacheItem createInt(__int64 offset);
+	SShard& getShard(__int64 block_offset);
 
-	void putBack(size_t idx);
+	SCacheEntry& createInt(SShard& shard, __int64 block_offset);
 
-	char* evict(SCacheItem& item, bool deleteBuffer);
+	char* evict(SCacheItem& item, bool dirty, bool deleteBuffer);
 
 	char* getLruItemBuffer(IScopedLock& lock);
 
-	std::vector<SCacheItem> lruItems;
+	std::vector<SShard> shards;
+
 	std::vector<SCacheItem> evictedItems;
+	//Queued or running write-backs
+	std::unordered_set<__int64> writeBackItems;
+	std::atomic<size_t> n_writeback;
 	std::vector<char*> lruItemBuffers;
 
 	std::unique_ptr<IMutex> mutex;
@@ -51,8 +122,12 @@ private:
 	size_t nbuffers;
 	size_t n_threads;
 	size_t n_threads_working;
-	bool wait_work;
 	bool do_quit;
 
+	std::atomic<int64> hits;
+	std::atomic<int64> misses;
+	std::atomic<int64> evictions;
+	std::atomic<int64> writebacks;
+
 	ICacheEvictionCallback* callback;
 };
\ No newline at end of file
@@ -26,12 +26,24 @@
 #include <Windows.h>
 #else
 #include <errno.h>
+#include "../config.h"
 #endif
 #include "../Interface/Thread.h"
 #include "../Interface/Condition.h"
 #include "../Interface/ThreadPool.h"
 #include <assert.h>
 
+#if !defined(_WIN32) && defined(HAVE_LINUX_IO_URING_H)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <poll.h>
+#include <unistd.h>
+#ifdef __NR_io_uring_setup
+#define FS_WITH_IO_URING
+#endif
+#endif
+
 
 namespace
 {
@@ -43,6 +55,8 @@ namespace
 #endif
 	const size_t max_idle_buffers = readahead_num_blocks;
 	const size_t readahead_low_level_blocks = readahead_num_blocks/2;
+	const size_t io_uring_default_queue_depth = 64;
+	const size_t io_uring_max_queue_depth = 4096;
 	const size_t slow_read_warning_seconds = 5 * 60;
 	const size_t max_read_wait_seconds = 60 * 60;
 
@@ -73,6 +87,190 @@ namespace
 #endif
 }
 
+#ifdef FS_WITH_IO_URING
+/*
+* Minimal io_uring submission/completion ring for readahead reads. Only used
+* from the thread reading blocks, so no locking.
+*/
+class Filesystem_IoUring
+{
+public:
+	Filesystem_IoUring()
+		: ring_fd(-1), sq_ptr(MAP_FAILED), cq_ptr(MAP_FAILED), sqes(MAP_FAILED),
+		sq_ring_size(0), cq_ring_size(0), sqes_size(0), to_submit(0)
+	{
+	}
+
+	~Filesystem_IoUring()
+	{
+		if (sqes != MAP_FAILED)
+			munmap(sqes, sqes_size);
+		if (cq_ptr != MAP_FAILED && cq_ptr != sq_ptr)
+			munmap(cq_ptr, cq_ring_size);
+		if (sq_ptr != MAP_FAILED)
+			munmap(sq_ptr, sq_ring_size);
+		if (ring_fd != -1)
+			close(ring_fd);
+	}
+
+	bool init(unsigned int entries)
+	{
+		io_uring_params params;
+		memset(&params, 0, sizeof(params));
+
+		ring_fd = static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+		if (ring_fd < 0)
+		{
+			ring_fd = -1;
+			return false;
+		}
+
+		sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+		cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+
+		bool single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+		if (single_mmap)
+		{
+			sq_ring_size = (std::max)(sq_ring_size, cq_ring_size);
+			cq_ring_size = sq_ring_size;
+		}
+
+		sq_ptr = mmap(nullptr, sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+		if (sq_ptr == MAP_FAILED)
+			return false;
+
+		if (single_mmap)
+		{
+			cq_ptr = sq_ptr;
+		}
+		else
+		{
+			cq_ptr = mmap(nullptr, cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+			if (cq_ptr == MAP_FAILED)
+				return false;
+		}
+
+		sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+		sqes = mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+		if (sqes == MAP_FAILED)
+			return false;
+
+		char* sq = static_cast<char*>(sq_ptr);
+		sq_head = reinterpret_cast<unsigned int*>(sq + params.sq_off.head);
+		sq_tail = reinterpret_cast<unsigned int*>(sq + params.sq_off.tail);
+		sq_mask = *reinterpret_cast<unsigned int*>(sq + params.sq_off.ring_mask);
+		sq_entries = params.sq_entries;
+		sq_array = reinterpret_cast<unsigned int*>(sq + params.sq_off.array);
+
+		char* cq = static_cast<char*>(cq_ptr);
+		cq_head = reinterpret_cast<unsigned int*>(cq + params.cq_off.head);
+		cq_tail = reinterpret_cast<unsigned int*>(cq + params.cq_off.tail);
+		cq_mask = *reinterpret_cast<unsigned int*>(cq + params.cq_off.ring_mask);
+		cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+
+		return true;
+	}
+
+	bool queueRead(int fd, SNextBlock* block)
+	{
+		unsigned int tail = *sq_tail;
+		if (tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >= sq_entries)
+		{
+			if (!submit()
+				|| tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >= sq_entries)
+			{
+				return false;
+			}
+		}
+
+		unsigned int idx = tail & sq_mask;
+		io_uring_sqe* sqe = static_cast<io_uring_sqe*>(sqes) + idx;
+		memset(sqe, 0, sizeof(*sqe));
+		sqe->opcode = IORING_OP_READV;
+		sqe->fd = fd;
+		sqe->off = static_cast<uint64>(block->offset);
+		sqe->addr = reinterpret_cast<uint64>(&block->iov);
+		sqe->len = 1;
+		sqe->user_data = reinterpret_cast<uint64>(block);
+
+		sq_array[idx] = idx;
+		__atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+		++to_submit;
+		return true;
+	}
+
+	bool submit()
+	{
+		while (to_submit > 0)
+		{
+			int rc = static_cast<int>(syscall(__NR_io_uring_enter, ring_fd, to_submit, 0, 0, nullptr, 0));
+			if (rc < 0)
+			{
+				if (errno == EINTR)
+					continue;
+				if (errno == EAGAIN || errno == EBUSY)
+					return true;
+				return false;
+			}
+			to_submit -= static_cast<unsigned int>(rc);
+		}
+		return true;
+	}
+
+	size_t reap(Filesystem& fs)
+	{
+		size_t n = 0;
+		unsigned int head = *cq_head;
+		while (head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE))
+		{
+			io_uring_cqe* cqe = &cqes[head & cq_mask];
+			SNextBlock* block = reinterpret_cast<SNextBlock*>(cqe->user_data);
+			int res = cqe->res;
+			++head;
+			__atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+
+			fs.ioUringCompletion(block, res);
+			++n;
+		}
+		return n;
+	}
+
+	bool wait(unsigned int wtimems)
+	{
+		pollfd pfd = {};
+		pfd.fd = ring_fd;
+		pfd.events = POLLIN;
+		return poll(&pfd, 1, static_cast<int>(wtimems)) > 0;
+	}
+
+private:
+	int ring_fd;
+	void* sq_ptr;
+	void* cq_ptr;
+	void* sqes;
+	size_t sq_ring_size;
+	size_t cq_ring_size;
+	size_t sqes_size;
+
+	unsigned int* sq_head;
+	unsigned int* sq_tail;
+	unsigned int sq_mask;
+	unsigned int sq_entries;
+	unsigned int* sq_array;
+
+	unsigned int* cq_head;
+	unsigned int* cq_tail;
+	unsigned int cq_mask;
+	io_uring_cqe* cqes;
+
+	unsigned int to_submit;
+};
+#elif !defined(_WIN32)
+class Filesystem_IoUring
+{
+};
+#endif
+
 class Filesystem_ReadaheadThread : public IThread
 {
 public:
@@ -252,6 +450,9 @@ Filesystem::Filesystem(const std::string &pDev, IFSImageFactory::EReadaheadMode
 	num_uncompleted_blocks(0), errcode(0), curr_fs_readahead_n_max_buffers(fs_readahead_n_max_buffers)
 {
 	has_error=false;
+#ifndef _WIN32
+	dev_fd = -1;
+#endif
 
 	if (read_ahead == IFSImageFactory::EReadaheadMode_Overlapped)
 	{
@@ -276,12 +477,19 @@ Filesystem::Filesystem(IFile *pDev, IFsNextBlockCallback* next_block_callback)
 {
 	has_error=false;
 	own_dev=false;
+#ifndef _WIN32
+	dev_fd = -1;
+#endif
 }
 
 Filesystem::~Filesystem()
 {
 	assert(readahead_thread.get()==nullptr);
 
+#ifndef _WIN32
+	io_uring.reset();
+#endif
+
 	if(dev!=nullptr && own_dev)
 	{
 		Server->destroy(dev);
@@ -405,6 +613,33 @@ void Filesystem::overlappedIoCompletion(SNextBlock * block, DWORD dwErrorCode, D
 			block->buffers[i].state = ENextBlockState_Ready;
 	}
 }
+#else
+void Filesystem::ioUringCompletion(SNextBlock * block, int res)
+{
+	--num_uncompleted_blocks;
+
+	if (res < 0)
+	{
+		errcode = -res;
+		Server->Log("Reading from device at position " + convert(block->offset) + " failed. System error code " + convert(-res), LL_ERROR);
+		has_error = true;
+		for (size_t i = 0; i<block->n_buffers; ++i)
+			block->buffers[i].state = ENextBlockState_Error;
+	}
+	else if (static_cast<size_t>(res) != block->iov.iov_len)
+	{
+		Server->Log("Reading from device at position " + convert(block->offset) + " failed. OS returned only " + convert(res) + " bytes"
+			". Expected " + convert(block->iov.iov_len) + " bytes", LL_ERROR);
+		has_error = true;
+		for (size_t i = 0; i<block->n_buffers; ++i)
+			block->buffers[i].state = ENextBlockState_Error;
+	}
+	else
+	{
+		for (size_t i = 0; i<block->n_buffers; ++i)
+			block->buffers[i].state = ENextBlockState_Ready;
+	}
+}
 #endif
 
 int64 Filesystem::nextBlock(int64 curr_block)
@@ -519,6 +754,18 @@ bool Filesystem::readFromDev(char *buf, _u32 bsize)
 
 void Filesystem::initReadahead(IFSImageFactory::EReadaheadMode read_ahead, bool background_priority)
 {
+	size_t n_next_blocks = readahead_num_blocks;
+
+#ifndef _WIN32
+	if (read_ahead == IFSImageFactory::EReadaheadMode_Overlapped)
+	{
+		if (!initIoUring(n_next_blocks))
+		{
+			read_ahead = IFSImageFactory::EReadaheadMode_None;
+		}
+	}
+#endif
+
 	read_ahead_mode = read_ahead;
 
 #ifdef _WIN32
@@ -562,7 +809,7 @@ void Filesystem::initReadahead(IFSImageFactory::EReadaheadMode read_ahead, bool
 
 	if (read_ahead== IFSImageFactory::EReadaheadMode_Overlapped)
 	{
-		next_blocks.resize(readahead_num_blocks);
+		next_blocks.resize(n_next_blocks);
 
 		for (size_t i = 0; i < next_blocks.size(); ++i)
 		{
@@ -603,10 +850,46 @@ void Filesystem::initReadahead(IFSImageFactory::EReadaheadMode read_ahead, bool
 	}
 }
 
+#ifndef _WIN32
+bool Filesystem::initIoUring(size_t& queue_depth)
+{
+#ifdef FS_WITH_IO_URING
+	IFsFile* fs_dev = dynamic_cast<IFsFile*>(dev);
+	if (fs_dev == nullptr)
+	{
+		return false;
+	}
+
+	queue_depth = io_uring_default_queue_depth;
+	std::string str_queue_depth = Server->getServerParameter("image_readahead_queue_depth");
+	if (!str_queue_depth.empty())
+	{
+		queue_depth = (std::max)(static_cast<size_t>(1),
+			(std::min)(io_uring_max_queue_depth, static_cast<size_t>(watoi(str_queue_depth))));
+	}
+
+	//There is one read in flight per next block at most, so the completion
+	//queue (twice the submission queue size) cannot overflow
+	io_uring.reset(new Filesystem_IoUring);
+	if (!io_uring->init(static_cast<unsigned int>(queue_depth)))
+	{
+		Server->Log("Setting up io_uring for device readahead failed. Reading synchronously. Errorcode: " + convert(getLastSystemError()), LL_INFO);
+		io_uring.reset();
+		return false;
+	}
+
+	dev_fd = fs_dev->getOsHandle();
+	return true;
+#else
+	return false;
+#endif
+}
+#endif
+
 bool Filesystem::queueOverlappedReads(bool force_queue)
 {
 	bool ret = false;
-	if (usedNextBlocks() < readahead_low_level_blocks
+	if (usedNextBlocks() < next_blocks.size()/2
 		|| force_queue)
 	{
 		int64 queue_starttime = Server->getTimeMS();
@@ -654,16 +937,37 @@ bool Filesystem::queueOverlappedReads(bool force_queue)
 				has_error = true;
 				return false;
 			}
+#elif defined(FS_WITH_IO_URING)
+			block->offset = overlapped_start_block*getBlocksize();
+			block->iov.iov_base = block->buffers[0].buffer;
+			block->iov.iov_len = block->n_buffers*blocksize;
+
+			if (!io_uring->queueRead(dev_fd, block))
+			{
+				--num_uncompleted_blocks;
+				Server->Log("Error queuing io_uring read operation. System error code " + convert(getLastSystemError()), LL_ERROR);
+				has_error = true;
+				return false;
+			}
 #endif	
 			ret = true;
 
 			if (Server->getTimeMS() - queue_starttime > 500)
 			{
-				return true;
+				break;
 			}
 		}
 	}
 
+#ifdef FS_WITH_IO_URING
+	if (ret && !io_uring->submit())
+	{
+		Server->Log("Error submitting io_uring read operations. System error code " + convert(getLastSystemError()), LL_ERROR);
+		has_error = true;
+		return false;
+	}
+#endif
+
 	return ret;
 }
 
@@ -671,6 +975,28 @@ bool Filesystem::waitForCompletion(unsigned int wtimems)
 {
 #ifdef _WIN32
 	return SleepEx(wtimems, TRUE)== WAIT_IO_COMPLETION;
+#elif defined(FS_WITH_IO_URING)
+	if (io_uring.get() == nullptr)
+	{
+		return false;
+	}
+
+	if (!io_uring->submit())
+	{
+		Server->Log("Error submitting io_uring read operations. System error code " + convert(getLastSystemError()), LL_ERROR);
+	}
+
+	if (io_uring->reap(*this) > 0)
+	{
+		return true;
+	}
+
+	if (!io_uring->wait(wtimems))
+	{
+		return false;
+	}
+
+	return io_uring->reap(*this) > 0;
 #else
 	return false;
 #endif
@@ -1026,6 +1352,34 @@ bool Filesystem::excludeSectors(int64 start, int64 count)
 	return true;
 }
 
+void Filesystem::setBitmapRange(unsigned char* bitmap, int64 start_block, int64 n_blocks, bool used)
+{
+	int64 end_block = start_block + n_blocks;
+	int64 block = start_block;
+
+	for (; block < end_block && block % 8 != 0; ++block)
+	{
+		if (used)
+			bitmap[block / 8] |= (1 << (block % 8));
+		else
+			bitmap[block / 8] &= ~(1 << (block % 8));
+	}
+
+	if (end_block - block >= 8)
+	{
+		memset(&bitmap[block / 8], used ? 0xFF : 0, static_cast<size_t>((end_block - block) / 8));
+		block += ((end_block - block) / 8) * 8;
+	}
+
+	for (; block < end_block; ++block)
+	{
+		if (used)
+			bitmap[block / 8] |= (1 << (block % 8));
+		else
+			bitmap[block / 8] &= ~(1 << (block % 8));
+	}
+}
+
 bool Filesystem::excludeBlock(int64 block)
 {
 	size_t bitmap_byte = (size_t)(block / 8);
@@ -3,6 +3,8 @@
 
 #ifdef _WIN32
 #include <Windows.h>
+#else
+#include <sys/uio.h>
 #endif
 
 #include <string>
@@ -20,6 +22,7 @@
 class VHDFile;
 
 class Filesystem_ReadaheadThread;
+class Filesystem_IoUring;
 class Filesystem;
 
 enum ENextBlockState
@@ -53,6 +56,9 @@ struct SNextBlock
 	Filesystem* fs;
 #ifdef _WIN32
 	OVERLAPPED ovl;
+#else
+	struct iovec iov;
+	int64 offset;
 #endif
 };
 
@@ -83,6 +89,8 @@ public:
 
 #ifdef _WIN32
 	void overlappedIoCompletion(SNextBlock* block, DWORD dwErrorCode, DWORD dwNumberOfBytesTransfered, int64 offset);
+#else
+	void ioUringCompletion(SNextBlock* block, int res);
 #endif
 
 	virtual int64 nextBlock(int64 curr_block);
@@ -102,7 +110,11 @@ public:
 
 protected:
 	bool readFromDev(char *buf, _u32 bsize);
+	static void setBitmapRange(unsigned char* bitmap, int64 start_block, int64 n_blocks, bool used);
 	void initReadahead(IFSImageFactory::EReadaheadMode read_ahead, bool background_priority);
+#ifndef _WIN32
+	bool initIoUring(size_t& queue_depth);
+#endif
 	bool queueOverlappedReads(bool force_queue);
 	bool waitForCompletion(unsigned int wtimems);
 	size_t usedNextBlocks();
@@ -147,6 +159,9 @@ protected:
 
 #ifdef _WIN32
 	HANDLE hVol;
+#else
+	std::unique_ptr<Filesystem_IoUring> io_uring;
+	int dev_fd;
 #endif
 
 };
@@ -0,0 +1,504 @@
+/*************************************************************************
+*    UrBackup - Client/Server backup system
+*    Copyright (C) 2011-2016 Martin Raiber
+*
+*    This program is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU Affero General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU Affero General Public License for more details.
+*
+*    You should have received a copy of the GNU Affero General Public License
+*    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**************************************************************************/
+
+#include "btrfs.h"
+#include "../../Interface/Server.h"
+#include "../../stringtools.h"
+#include <memory.h>
+
+namespace
+{
+	const int64 btrfs_super_offset = 0x10000;
+	const int64 btrfs_super_size = 4096;
+	const char btrfs_magic[] = "_BHRfS_M";
+
+	const size_t btrfs_sb_magic = 0x40;
+	const size_t btrfs_sb_root = 0x50;
+	const size_t btrfs_sb_chunk_root = 0x58;
+	const size_t btrfs_sb_log_root = 0x60;
+	const size_t btrfs_sb_total_bytes = 0x70;
+	const size_t btrfs_sb_num_devices = 0x88;
+	const size_t btrfs_sb_sectorsize = 0x90;
+	const size_t btrfs_sb_nodesize = 0x94;
+	const size_t btrfs_sb_sys_chunk_array_size = 0xA0;
+	const size_t btrfs_sb_incompat_flags = 0xBC;
+	const size_t btrfs_sb_root_level = 0xC6;
+	const size_t btrfs_sb_chunk_root_level = 0xC7;
+	const size_t btrfs_sb_dev_item_devid = 0xC9;
+	const size_t btrfs_sb_sys_chunk_array = 0x32B;
+	const size_t btrfs_sys_chunk_array_max = 2048;
+
+	const size_t btrfs_key_size = 17;
+	const size_t btrfs_header_size = 101;
+	const size_t btrfs_header_bytenr = 0x30;
+	const size_t btrfs_header_nritems = 0x60;
+	const size_t btrfs_header_level = 0x64;
+	const size_t btrfs_item_size = btrfs_key_size + 8;
+	const size_t btrfs_key_ptr_size = btrfs_key_size + 16;
+	const int btrfs_max_level = 8;
+
+	const size_t btrfs_chunk_type = 24;
+	const size_t btrfs_chunk_num_stripes = 44;
+	const size_t btrfs_chunk_stripes = 48;
+	const size_t btrfs_stripe_size = 32;
+
+	const size_t btrfs_root_item_bytenr = 176;
+	const size_t btrfs_root_item_level = 238;
+
+	const unsigned char btrfs_root_item_key = 132;
+	const unsigned char btrfs_extent_item_key = 168;
+	const unsigned char btrfs_metadata_item_key = 169;
+	const unsigned char btrfs_chunk_item_key = 228;
+	const uint64 btrfs_extent_tree_objectid = 2;
+
+	const uint64 btrfs_block_group_data = 1 << 0;
+	const uint64 btrfs_block_group_raid0 = 1 << 3;
+	const uint64 btrfs_block_group_raid10 = 1 << 6;
+	const uint64 btrfs_block_group_raid5 = 1 << 7;
+	const uint64 btrfs_block_group_raid6 = 1 << 8;
+	const uint64 btrfs_block_group_striped = btrfs_block_group_raid0 | btrfs_block_group_raid10
+		| btrfs_block_group_raid5 | btrfs_block_group_raid6;
+
+	const uint64 btrfs_feature_incompat_extent_tree_v2 = 1ULL << 13;
+
+	//Area before the primary superblock (boot loader) and superblock mirrors
+	const int64 btrfs_reserved_start = 1024 * 1024;
+	const int64 btrfs_super_mirrors[] = { 64LL * 1024 * 1024, 256LL * 1024 * 1024 * 1024 };
+
+	uint64 read_u64(const char* p)
+	{
+		uint64 ret;
+		memcpy(&ret, p, sizeof(ret));
+		return little_endian(ret);
+	}
+
+	unsigned int read_u32(const char* p)
+	{
+		unsigned int ret;
+		memcpy(&ret, p, sizeof(ret));
+		return little_endian(ret);
+	}
+
+	unsigned short read_u16(const char* p)
+	{
+		unsigned short ret;
+		memcpy(&ret, p, sizeof(ret));
+		return little_endian(ret);
+	}
+}
+
+FSBtrfs::FSBtrfs(const std::string &pDev, IFSImageFactory::EReadaheadMode read_ahead, bool background_priority, IFsNextBlockCallback* next_block_callback)
+	: Filesystem(pDev, read_ahead, next_block_callback), bitmap(NULL)
+{
+	init();
+	initReadahead(read_ahead, background_priority);
+}
+
+FSBtrfs::FSBtrfs(IFile *pDev, IFSImageFactory::EReadaheadMode read_ahead, bool background_priority, IFsNextBlockCallback* next_block_callback)
+	: Filesystem(pDev, next_block_callback), bitmap(NULL)
+{
+	init();
+	initReadahead(read_ahead, background_priority);
+}
+
+FSBtrfs::~FSBtrfs(void)
+{
+	delete[] bitmap;
+}
+
+bool FSBtrfs::isBtrfs(IFile* dev)
+{
+	char magic[sizeof(btrfs_magic) - 1];
+	if (dev->Read(btrfs_super_offset + btrfs_sb_magic, magic, sizeof(magic)) != sizeof(magic))
+	{
+		return false;
+	}
+
+	return memcmp(magic, btrfs_magic, sizeof(magic)) == 0;
+}
+
+void FSBtrfs::init()
+{
+	if (has_error)
+		return;
+
+	std::vector<char> sb(btrfs_super_size);
+	if (dev->Read(btrfs_super_offset, sb.data(), static_cast<_u32>(sb.size())) != sb.size())
+	{
+		Server->Log("Error reading btrfs superblock", LL_ERROR);
+		has_error = true;
+		return;
+	}
+
+	if (memcmp(&sb[btrfs_sb_magic], btrfs_magic, sizeof(btrfs_magic) - 1) != 0)
+	{
+		Server->Log("btrfs magic wrong", LL_ERROR);
+		has_error = true;
+		return;
+	}
+
+	if (read_u64(&sb[btrfs_sb_num_devices]) != 1)
+	{
+		Server->Log("btrfs file system spans multiple devices", LL_WARNING);
+		has_error = true;
+		return;
+	}
+
+	if (read_u64(&sb[btrfs_sb_incompat_flags]) & btrfs_feature_incompat_extent_tree_v2)
+	{
+		Server->Log("btrfs extent tree v2 not supported", LL_WARNING);
+		has_error = true;
+		return;
+	}
+
+	blocksize = read_u32(&sb[btrfs_sb_sectorsize]);
+	nodesize = read_u32(&sb[btrfs_sb_nodesize]);
+	devid = read_u64(&sb[btrfs_sb_dev_item_devid]);
+	int64 total_bytes = static_cast<int64>(read_u64(&sb[btrfs_sb_total_bytes]));
+	size_t sys_chunk_array_size = read_u32(&sb[btrfs_sb_sys_chunk_array_size]);
+
+	if (blocksize < 512 || blocksize > 65536
+		|| nodesize < blocksize || nodesize > 65536
+		|| sys_chunk_array_size > btrfs_sys_chunk_array_max)
+	{
+		Server->Log("btrfs superblock invalid", LL_ERROR);
+		has_error = true;
+		return;
+	}
+
+	drivesize = dev->Size();
+	if (drivesize < total_bytes)
+	{
+		Server->Log("Device is smaller than btrfs file system", LL_ERROR);
+		has_error = true;
+		return;
+	}
+
+	int64 bitmap_entries = (drivesize + blocksize - 1) / blocksize;
+	size_t bitmap_bytes = static_cast<size_t>((bitmap_entries + 7) / 8);
+	bitmap = new unsigned char[bitmap_bytes];
+	memset(bitmap, 0, bitmap_bytes);
+
+	markPhysical(0, btrfs_reserved_start);
+	markPhysical(btrfs_super_offset, btrfs_super_size);
+	for (size_t i = 0; i < sizeof(btrfs_super_mirrors) / sizeof(btrfs_super_mirrors[0]); ++i)
+	{
+		markPhysical(btrfs_super_mirrors[i], btrfs_super_size);
+	}
+
+	//The system chunks needed to read the chunk tree are in the superblock
+	size_t pos = 0;
+	const char* sys_chunk_array = &sb[btrfs_sb_sys_chunk_array];
+	while (pos + btrfs_key_size + btrfs_chunk_stripes <= sys_chunk_array_size)
+	{
+		const char* key = sys_chunk_array + pos;
+		const char* item = key + btrfs_key_size;
+		size_t num_stripes = read_u16(item + btrfs_chunk_num_stripes);
+		size_t item_size = btrfs_chunk_stripes + num_stripes*btrfs_stripe_size;
+
+		if (static_cast<unsigned char>(key[8]) != btrfs_chunk_item_key
+			|| pos + btrfs_key_size + item_size > sys_chunk_array_size)
+		{
+			Server->Log("btrfs system chunk array invalid", LL_ERROR);
+			has_error = true;
+			return;
+		}
+
+		if (!addChunk(static_cast<int64>(read_u64(key + 9)), item, item_size))
+		{
+			has_error = true;
+			return;
+		}
+
+		pos += btrfs_key_size + item_size;
+	}
+
+	if (!walkTree(static_cast<int64>(read_u64(&sb[btrfs_sb_chunk_root])),
+			static_cast<unsigned char>(sb[btrfs_sb_chunk_root_level]), ETreeWalk_Chunks))
+	{
+		has_error = true;
+		return;
+	}
+
+	extent_root = -1;
+	if (!walkTree(static_cast<int64>(read_u64(&sb[btrfs_sb_root])),
+			static_cast<unsigned char>(sb[btrfs_sb_root_level]), ETreeWalk_Roots))
+	{
+		has_error = true;
+		return;
+	}
+
+	if (extent_root < 0)
+	{
+		Server->Log("btrfs extent tree root not found", LL_ERROR);
+		has_error = true;
+		return;
+	}
+
+	//Data written via fsync is only in the log tree until it is replayed
+	bool has_log = read_u64(&sb[btrfs_sb_log_root]) != 0;
+
+	for (std::map<int64, SChunk>::iterator it = chunks.begin(); it != chunks.end(); ++it)
+	{
+		if (has_log
+			|| !(it->second.type & btrfs_block_group_data))
+		{
+			markLogical(it->first, it->second.length);
+		}
+	}
+
+	if (!walkTree(extent_root, extent_root_level, ETreeWalk_Extents))
+	{
+		has_error = true;
+		return;
+	}
+}
+
+bool FSBtrfs::addChunk(int64 logical, const char* item, size_t item_size)
+{
+	SChunk chunk;
+	chunk.length = static_cast<int64>(read_u64(item));
+	chunk.type = read_u64(item + btrfs_chunk_type);
+	size_t num_stripes = read_u16(item + btrfs_chunk_num_stripes);
+
+	if (num_stripes == 0
+		|| item_size < btrfs_chunk_stripes + num_stripes*btrfs_stripe_size)
+	{
+		Server->Log("btrfs chunk at " + convert(logical) + " invalid", LL_ERROR);
+		return false;
+	}
+
+	if (chunk.type & btrfs_block_group_striped)
+	{
+		Server->Log("btrfs chunk at " + convert(logical) + " uses a striped profile", LL_WARNING);
+		return false;
+	}
+
+	for (size_t i = 0; i < num_stripes; ++i)
+	{
+		const char* stripe = item + btrfs_chunk_stripes + i*btrfs_stripe_size;
+		if (read_u64(stripe) != devid)
+		{
+			Server->Log("btrfs chunk at " + convert(logical) + " is on another device", LL_WARNING);
+			return false;
+		}
+		chunk.stripes.push_back(static_cast<int64>(read_u64(stripe + 8)));
+	}
+
+	chunks[logical] = chunk;
+	return true;
+}
+
+bool FSBtrfs::readNode(int64 logical, int level, std::vector<char>& node)
+{
+	std::map<int64, SChunk>::iterator it = chunks.upper_bound(logical);
+	if (it == chunks.begin())
+	{
+		Server->Log("btrfs tree block at " + convert(logical) + " not in any chunk", LL_ERROR);
+		return false;
+	}
+	--it;
+
+	if (logical + nodesize > it->first + it->second.length)
+	{
+		Server->Log("btrfs tree block at " + convert(logical) + " not in any chunk (2)", LL_ERROR);
+		return false;
+	}
+
+	node.resize(static_cast<size_t>(nodesize));
+	int64 physical = it->second.stripes[0] + (logical - it->first);
+	if (dev->Read(physical, node.data(), static_cast<_u32>(node.size())) != node.size())
+	{
+		Server->Log("Error reading btrfs tree block at " + convert(logical), LL_ERROR);
+		return false;
+	}
+
+	if (static_cast<int64>(read_u64(&node[btrfs_header_bytenr])) != logical
+		|| static_cast<unsigned char>(node[btrfs_header_level]) != level)
+	{
+		Server->Log("btrfs tree block at " + convert(logical) + " invalid", LL_ERROR);
+		return false;
+	}
+
+	return true;
+}
+
+bool FSBtrfs::walkTree(int64 logical, int level, ETreeWalk mode)
+{
+	if (level > btrfs_max_level)
+	{
+		Server->Log("btrfs tree level " + convert(level) + " invalid", LL_ERROR);
+		return false;
+	}
+
+	std::vector<char> node;
+	if (!readNode(logical, level, node))
+	{
+		return false;
+	}
+
+	size_t nritems = read_u32(&node[btrfs_header_nritems]);
+
+	if (level > 0)
+	{
+		if (btrfs_header_size + nritems*btrfs_key_ptr_size > node.size())
+		{
+			Server->Log("btrfs tree node at " + convert(logical) + " has too many items", LL_ERROR);
+			return false;
+		}
+
+		for (size_t i = 0; i < nritems; ++i)
+		{
+			const char* ptr = &node[btrfs_header_size + i*btrfs_key_ptr_size];
+			if (!walkTree(static_cast<int64>(read_u64(ptr + btrfs_key_size)), level - 1, mode))
+			{
+				return false;
+			}
+		}
+
+		return true;
+	}
+
+	if (btrfs_header_size + nritems*btrfs_item_size > node.size())
+	{
+		Server->Log("btrfs tree leaf at " + convert(logical) + " has too many items", LL_ERROR);
+		return false;
+	}
+
+	for (size_t i = 0; i < nritems; ++i)
+	{
+		const char* item = &node[btrfs_header_size + i*btrfs_item_size];
+		uint64 objectid = read_u64(item);
+		unsigned char type = static_cast<unsigned char>(item[8]);
+		uint64 offset = read_u64(item + 9);
+		size_t data_offset = read_u32(item + btrfs_key_size);
+		size_t data_size = read_u32(item + btrfs_key_size + 4);
+
+		if (btrfs_header_size + data_offset + data_size > node.size())
+		{
+			Server->Log("btrfs tree leaf at " + convert(logical) + " has invalid item", LL_ERROR);
+			return false;
+		}
+
+		const char* data = &node[btrfs_header_size + data_offset];
+
+		switch (mode)
+		{
+		case ETreeWalk_Chunks:
+			if (type == btrfs_chunk_item_key
+				&& !addChunk(static_cast<int64>(offset), data, data_size))
+			{
+				return false;
+			}
+			break;
+		case ETreeWalk_Roots:
+			if (type == btrfs_root_item_key
+				&& objectid == btrfs_extent_tree_objectid
+				&& data_size > btrfs_root_item_level)
+			{
+				extent_root = static_cast<int64>(read_u64(data + btrfs_root_item_bytenr));
+				extent_root_level = static_cast<unsigned char>(data[btrfs_root_item_level]);
+			}
+			break;
+		case ETreeWalk_Extents:
+			if (type == btrfs_extent_item_key)
+			{
+				if (!markLogical(static_cast<int64>(objectid), static_cast<int64>(offset)))
+				{
+					return false;
+				}
+			}
+			else if (type == btrfs_metadata_item_key)
+			{
+				if (!markLogical(static_cast<int64>(objectid), nodesize))
+				{
+					return false;
+				}
+			}
+			break;
+		}
+	}
+
+	return true;
+}
+
+bool FSBtrfs::markLogical(int64 logical, int64 length)
+{
+	std::map<int64, SChunk>::iterator it = chunks.upper_bound(logical);
+	if (it == chunks.begin())
+	{
+		Server->Log("btrfs extent at " + convert(logical) + " not in any chunk", LL_ERROR);
+		return false;
+	}
+	--it;
+
+	if (logical + length > it->first + it->second.length)
+	{
+		Server->Log("btrfs extent at " + convert(logical) + " not in any chunk (2)", LL_ERROR);
+		return false;
+	}
+
+	//DUP chunks have the full content in each stripe
+	for (size_t i = 0; i < it->second.stripes.size(); ++i)
+	{
+		markPhysical(it->second.stripes[i] + (logical - it->first), length);
+	}
+
+	return true;
+}
+
+void FSBtrfs::markPhysical(int64 offset, int64 length)
+{
+	if (offset >= drivesize)
+	{
+		return;
+	}
+
+	if (offset + length > drivesize)
+	{
+		length = drivesize - offset;
+	}
+
+	int64 start_block = offset / blocksize;
+	int64 end_block = (offset + length + blocksize - 1) / blocksize;
+	setBitmapRange(bitmap, start_block, end_block - start_block, true);
+}
+
+int64 FSBtrfs::getBlocksize(void)
+{
+	return blocksize;
+}
+
+int64 FSBtrfs::getSize(void)
+{
+	return drivesize;
+}
+
+const unsigned char * FSBtrfs::getBitmap(void)
+{
+	return bitmap;
+}
+
+void FSBtrfs::logFileChanges(std::string volpath, int64 min_size, char * fc_bitmap)
+{
+}
+
+std::string FSBtrfs::getType()
+{
+	return "btrfs";
+}
@@ -0,0 +1,56 @@
+#include "../filesystem.h"
+#include <map>
+
+/*
+* Single device btrfs used block bitmap from the chunk and extent trees
+*/
+class FSBtrfs : public Filesystem
+{
+public:
+	FSBtrfs(const std::string &pDev, IFSImageFactory::EReadaheadMode read_ahead, bool background_priority, IFsNextBlockCallback* next_block_callback);
+	FSBtrfs(IFile *pDev, IFSImageFactory::EReadaheadMode read_ahead, bool background_priority, IFsNextBlockCallback* next_block_callback);
+	~FSBtrfs(void);
+
+	int64 getBlocksize(void);
+	virtual int64 getSize(void);
+	const unsigned char * getBitmap(void);
+
+	virtual void logFileChanges(std::string volpath, int64 min_size, char* fc_bitmap);
+
+	virtual std::string getType();
+
+	static bool isBtrfs(IFile* dev);
+
+private:
+	struct SChunk
+	{
+		int64 length;
+		uint64 type;
+		std::vector<int64> stripes;
+	};
+
+	enum ETreeWalk
+	{
+		ETreeWalk_Chunks,
+		ETreeWalk_Roots,
+		ETreeWalk_Extents
+	};
+
+	void init();
+	bool addChunk(int64 logical, const char* item, size_t item_size);
+	bool readNode(int64 logical, int level, std::vector<char>& node);
+	bool walkTree(int64 logical, int level, ETreeWalk mode);
+	bool markLogical(int64 logical, int64 length);
+	void markPhysical(int64 offset, int64 length);
+
+	unsigned char *bitmap;
+	int64 drivesize;
+	int64 blocksize;
+
+	int64 nodesize;
+	uint64 devid;
+	std::map<int64, SChunk> chunks;
+
+	int64 extent_root;
+	int extent_root_level;
+};
@@ -0,0 +1,442 @@
+/*************************************************************************
+*    UrBackup - Client/Server backup system
+*    Copyright (C) 2011-2016 Martin Raiber
+*
+*    This program is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU Affero General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU Affero General Public License for more details.
+*
+*    You should have received a copy of the GNU Affero General Public License
+*    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**************************************************************************/
+
+#include "ext.h"
+#include "../../Interface/Server.h"
+#include "../../stringtools.h"
+#include <memory.h>
+
+namespace
+{
+	const int64 ext_superblock_offset = 1024;
+	const unsigned short ext_magic = 0xEF53;
+
+	const unsigned int ext_feature_compat_sparse_super2 = 0x200;
+	const unsigned int ext_feature_incompat_recover = 0x4;
+	const unsigned int ext_feature_incompat_meta_bg = 0x10;
+	const unsigned int ext_feature_incompat_64bit = 0x80;
+	const unsigned int ext_feature_ro_compat_sparse_super = 0x1;
+	const unsigned int ext_feature_ro_compat_bigalloc = 0x200;
+
+	const unsigned short ext_bg_block_uninit = 0x2;
+
+#pragma pack(push)
+#pragma pack(1)
+	struct ext_super_block
+	{
+		unsigned int s_inodes_count;
+		unsigned int s_blocks_count_lo;
+		unsigned int s_r_blocks_count_lo;
+		unsigned int s_free_blocks_count_lo;
+		unsigned int s_free_inodes_count;
+		unsigned int s_first_data_block;
+		unsigned int s_log_block_size;
+		unsigned int s_log_cluster_size;
+		unsigned int s_blocks_per_group;
+		unsigned int s_clusters_per_group;
+		unsigned int s_inodes_per_group;
+		unsigned int s_mtime;
+		unsigned int s_wtime;
+		unsigned short s_mnt_count;
+		unsigned short s_max_mnt_count;
+		unsigned short s_magic;
+		unsigned short s_state;
+		unsigned short s_errors;
+		unsigned short s_minor_rev_level;
+		unsigned int s_lastcheck;
+		unsigned int s_checkinterval;
+		unsigned int s_creator_os;
+		unsigned int s_rev_level;
+		unsigned short s_def_resuid;
+		unsigned short s_def_resgid;
+		unsigned int s_first_ino;
+		unsigned short s_inode_size;
+		unsigned short s_block_group_nr;
+		unsigned int s_feature_compat;
+		unsigned int s_feature_incompat;
+		unsigned int s_feature_ro_compat;
+		char s_uuid[16];
+		char s_volume_name[16];
+		char s_last_mounted[64];
+		unsigned int s_algorithm_usage_bitmap;
+		unsigned char s_prealloc_blocks;
+		unsigned char s_prealloc_dir_blocks;
+		unsigned short s_reserved_gdt_blocks;
+		char s_journal_uuid[16];
+		unsigned int s_journal_inum;
+		unsigned int s_journal_dev;
+		unsigned int s_last_orphan;
+		unsigned int s_hash_seed[4];
+		unsigned char s_def_hash_version;
+		unsigned char s_jnl_backup_type;
+		unsigned short s_desc_size;
+		unsigned int s_default_mount_opts;
+		unsigned int s_first_meta_bg;
+		unsigned int s_mkfs_time;
+		unsigned int s_jnl_blocks[17];
+		unsigned int s_blocks_count_hi;
+		unsigned int s_r_blocks_count_hi;
+		unsigned int s_free_blocks_count_hi;
+		unsigned short s_min_extra_isize;
+		unsigned short s_want_extra_isize;
+		unsigned int s_flags;
+		unsigned short s_raid_stride;
+		unsigned short s_mmp_update_interval;
+		uint64 s_mmp_block;
+		unsigned int s_raid_stripe_width;
+		unsigned char s_log_groups_per_flex;
+		unsigned char s_checksum_type;
+		unsigned short s_reserved_pad;
+		uint64 s_kbytes_written;
+		unsigned int s_snapshot_inum;
+		unsigned int s_snapshot_id;
+		uint64 s_snapshot_r_blocks_count;
+		unsigned int s_snapshot_list;
+		unsigned int s_error_count;
+		unsigned int s_first_error_time;
+		unsigned int s_first_error_ino;
+		uint64 s_first_error_block;
+		char s_first_error_func[32];
+		unsigned int s_first_error_line;
+		unsigned int s_last_error_time;
+		unsigned int s_last_error_ino;
+		unsigned int s_last_error_line;
+		uint64 s_last_error_block;
+		char s_last_error_func[32];
+		char s_mount_opts[64];
+		unsigned int s_usr_quota_inum;
+		unsigned int s_grp_quota_inum;
+		unsigned int s_overhead_clusters;
+		unsigned int s_backup_bgs[2];
+	};
+
+	struct ext_group_desc
+	{
+		unsigned int bg_block_bitmap_lo;
+		unsigned int bg_inode_bitmap_lo;
+		unsigned int bg_inode_table_lo;
+		unsigned short bg_free_blocks_count_lo;
+		unsigned short bg_free_inodes_count_lo;
+		unsigned short bg_used_dirs_count_lo;
+		unsigned short bg_flags;
+		unsigned int bg_exclude_bitmap_lo;
+		unsigned short bg_block_bitmap_csum_lo;
+		unsigned short bg_inode_bitmap_csum_lo;
+		unsigned short bg_itable_unused_lo;
+		unsigned short bg_checksum;
+		unsigned int bg_block_bitmap_hi;
+		unsigned int bg_inode_bitmap_hi;
+		unsigned int bg_inode_table_hi;
+	};
+#pragma pack(pop)
+
+	bool isPowerOf(int64 n, int64 base)
+	{
+		while (n > 1 && n%base == 0)
+		{
+			n /= base;
+		}
+		return n == 1;
+	}
+}
+
+FSExt::FSExt(const std::string &pDev, IFSImageFactory::EReadaheadMode read_ahead, bool background_priority, IFsNextBlockCallback* next_block_callback)
+	: Filesystem(pDev, read_ahead, next_block_callback), bitmap(NULL)
+{
+	init();
+	initReadahead(read_ahead, background_priority);
+}
+
+FSExt::FSExt(IFile *pDev, IFSImageFactory::EReadaheadMode read_ahead, bool background_priority, IFsNextBlockCallback* next_block_callback)
+	: Filesystem(pDev, next_block_callback), bitmap(NULL)
+{
+	init();
+	initReadahead(read_ahead, background_priority);
+}
+
+FSExt::~FSExt(void)
+{
+	delete[] bitmap;
+}
+
+bool FSExt::isExt(const char* buffer, size_t bsize)
+{
+	if (bsize < ext_superblock_offset + sizeof(ext_super_block))
+	{
+		return false;
+	}
+
+	ext_super_block sb;
+	memcpy(&sb, buffer + ext_superblock_offset, sizeof(sb));
+	return little_endian(sb.s_magic) == ext_magic;
+}
+
+void FSExt::init()
+{
+	if (has_error)
+		return;
+
+	ext_super_block sb;
+	if (dev->Read(ext_superblock_offset, reinterpret_cast<char*>(&sb), sizeof(sb)) != sizeof(sb))
+	{
+		Server->Log("Error reading ext superblock", LL_ERROR);
+		has_error = true;
+		return;
+	}
+
+	if (little_endian(sb.s_magic) != ext_magic)
+	{
+		Server->Log("ext magic wrong", LL_ERROR);
+		has_error = true;
+		return;
+	}
+
+	unsigned int log_block_size = little_endian(sb.s_log_block_size);
+	if (log_block_size > 6)
+	{
+		Server->Log("ext block size invalid", LL_ERROR);
+		has_error = true;
+		return;
+	}
+
+	blocksize = 1024LL << log_block_size;
+	feature_compat = little_endian(sb.s_feature_compat);
+	feature_incompat = little_endian(sb.s_feature_incompat);
+	feature_ro_compat = little_endian(sb.s_feature_ro_compat);
+
+	if (feature_incompat & ext_feature_incompat_recover)
+	{
+		//Blocks allocated by transactions still in the journal may be free in the bitmaps
+		Server->Log("ext journal needs recovery (snapshot of file system that was not frozen?)", LL_INFO);
+		has_error = true;
+		return;
+	}
+
+	if (feature_ro_compat & ext_feature_ro_compat_bigalloc)
+	{
+		//Bitmaps are per cluster
+		Server->Log("ext bigalloc is not supported", LL_INFO);
+		has_error = true;
+		return;
+	}
+
+	blocks_count = little_endian(sb.s_blocks_count_lo);
+	desc_size = 32;
+	if (feature_incompat & ext_feature_incompat_64bit)
+	{
+		blocks_count |= static_cast<int64>(little_endian(sb.s_blocks_count_hi)) << 32;
+		desc_size = little_endian(sb.s_desc_size);
+		if (desc_size < 32 || desc_size > 1024)
+		{
+			Server->Log("ext group descriptor size invalid", LL_ERROR);
+			has_error = true;
+			return;
+		}
+	}
+
+	first_data_block = little_endian(sb.s_first_data_block);
+	blocks_per_group = little_endian(sb.s_blocks_per_group);
+	inodes_per_group = little_endian(sb.s_inodes_per_group);
+	inode_size = little_endian(sb.s_rev_level) == 0 ? 128 : little_endian(sb.s_inode_size);
+	first_meta_bg = little_endian(sb.s_first_meta_bg);
+	backup_bgs[0] = little_endian(sb.s_backup_bgs[0]);
+	backup_bgs[1] = little_endian(sb.s_backup_bgs[1]);
+
+	if (blocks_per_group == 0
+		|| blocks_per_group > blocksize * 8
+		|| blocks_count <= first_data_block)
+	{
+		Server->Log("ext superblock invalid", LL_ERROR);
+		has_error = true;
+		return;
+	}
+
+	n_groups = (blocks_count - first_data_block + blocks_per_group - 1) / blocks_per_group;
+
+	drivesize = dev->Size();
+	if (drivesize < blocks_count*blocksize)
+	{
+		Server->Log("Device is smaller than ext file system", LL_ERROR);
+		has_error = true;
+		return;
+	}
+
+	int64 bitmap_entries = (drivesize + blocksize - 1) / blocksize;
+	size_t bitmap_bytes = static_cast<size_t>((bitmap_entries + 7) / 8);
+	bitmap = new unsigned char[bitmap_bytes];
+	//Boot block and blocks after the file system
+	memset(bitmap, 0xFF, bitmap_bytes);
+	setBitmapRange(bitmap, first_data_block, blocks_count - first_data_block, false);
+
+	std::vector<char> descs;
+	if (!readGroupDescriptors(descs))
+	{
+		has_error = true;
+		return;
+	}
+
+	std::vector<char> group_bitmap(static_cast<size_t>(blocksize));
+	int64 inode_table_blocks = (inodes_per_group*inode_size + blocksize - 1) / blocksize;
+
+	for (int64 group = 0; group < n_groups; ++group)
+	{
+		ext_group_desc gd = {};
+		memcpy(&gd, &descs[static_cast<size_t>(group*desc_size)], (std::min)(desc_size, sizeof(gd)));
+
+		int64 block_bitmap = little_endian(gd.bg_block_bitmap_lo);
+		int64 inode_bitmap = little_endian(gd.bg_inode_bitmap_lo);
+		int64 inode_table = little_endian(gd.bg_inode_table_lo);
+		if (desc_size >= sizeof(gd))
+		{
+			block_bitmap |= static_cast<int64>(little_endian(gd.bg_block_bitmap_hi)) << 32;
+			inode_bitmap |= static_cast<int64>(little_endian(gd.bg_inode_bitmap_hi)) << 32;
+			inode_table |= static_cast<int64>(little_endian(gd.bg_inode_table_hi)) << 32;
+		}
+
+		int64 group_start = groupFirstBlock(group);
+		int64 group_blocks = (std::min)(blocks_per_group, blocks_count - group_start);
+
+		if (little_endian(gd.bg_flags) & ext_bg_block_uninit)
+		{
+			//Only the metadata of uninitialized groups is in use. The group
+			//metadata is marked below, backup super blocks and group descriptors here
+			if (groupHasSuper(group)
+				|| (feature_incompat & ext_feature_incompat_meta_bg))
+			{
+				setBitmapRange(bitmap, group_start, group_blocks, true);
+			}
+		}
+		else
+		{
+			if (block_bitmap >= blocks_count
+				|| dev->Read(block_bitmap*blocksize, group_bitmap.data(), static_cast<_u32>(blocksize)) != blocksize)
+			{
+				Server->Log("Error reading block bitmap of ext block group " + convert(group), LL_ERROR);
+				has_error = true;
+				return;
+			}
+
+			const unsigned char* gb = reinterpret_cast<const unsigned char*>(group_bitmap.data());
+			for (int64 i = 0; i < group_blocks; ++i)
+			{
+				if (gb[i / 8] & (1 << (i % 8)))
+				{
+					int64 block = group_start + i;
+					bitmap[block / 8] |= (1 << (block % 8));
+				}
+			}
+		}
+
+		if (block_bitmap < blocks_count)
+		{
+			setBitmapRange(bitmap, block_bitmap, 1, true);
+		}
+		if (inode_bitmap < blocks_count)
+		{
+			setBitmapRange(bitmap, inode_bitmap, 1, true);
+		}
+		if (inode_table + inode_table_blocks <= blocks_count)
+		{
+			setBitmapRange(bitmap, inode_table, inode_table_blocks, true);
+		}
+	}
+}
+
+int64 FSExt::groupFirstBlock(int64 group)
+{
+	return first_data_block + group*blocks_per_group;
+}
+
+bool FSExt::groupHasSuper(int64 group)
+{
+	if (group == 0)
+	{
+		return true;
+	}
+
+	if (feature_compat & ext_feature_compat_sparse_super2)
+	{
+		return group == backup_bgs[0] || group == backup_bgs[1];
+	}
+
+	if (!(feature_ro_compat & ext_feature_ro_compat_sparse_super))
+	{
+		return true;
+	}
+
+	return group == 1 || isPowerOf(group, 3) || isPowerOf(group, 5) || isPowerOf(group, 7);
+}
+
+bool FSExt::readGroupDescriptors(std::vector<char>& descs)
+{
+	int64 descs_per_block = blocksize / desc_size;
+	int64 n_desc_blocks = (n_groups + descs_per_block - 1) / descs_per_block;
+
+	descs.resize(static_cast<size_t>(n_desc_blocks*blocksize));
+
+	int64 gdt_start = first_data_block + 1;
+
+	for (int64 i = 0; i < n_desc_blocks; ++i)
+	{
+		int64 desc_block;
+		if (!(feature_incompat & ext_feature_incompat_meta_bg)
+			|| i < first_meta_bg)
+		{
+			desc_block = gdt_start + i;
+		}
+		else
+		{
+			//Descriptor block is at the start of the first group of its meta group
+			int64 group = i*descs_per_block;
+			desc_block = groupFirstBlock(group) + (groupHasSuper(group) ? 1 : 0);
+		}
+
+		if (desc_block >= blocks_count
+			|| dev->Read(desc_block*blocksize, &descs[static_cast<size_t>(i*blocksize)], static_cast<_u32>(blocksize)) != blocksize)
+		{
+			Server->Log("Error reading ext group descriptors", LL_ERROR);
+			return false;
+		}
+	}
+
+	return true;
+}
+
+int64 FSExt::getBlocksize(void)
+{
+	return blocksize;
+}
+
+int64 FSExt::getSize(void)
+{
+	return drivesize;
+}
+
+const unsigned char * FSExt::getBitmap(void)
+{
+	return bitmap;
+}
+
+void FSExt::logFileChanges(std::string volpath, int64 min_size, char * fc_bitmap)
+{
+}
+
+std::string FSExt::getType()
+{
+	return "ext";
+}
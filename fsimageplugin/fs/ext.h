@@ -0,0 +1,45 @@
+#include "../filesystem.h"
+
+/*
+* ext2/3/4 used block bitmap from the block group bitmaps
+*/
+class FSExt : public Filesystem
+{
+public:
+	FSExt(const std::string &pDev, IFSImageFactory::EReadaheadMode read_ahead, bool background_priority, IFsNextBlockCallback* next_block_callback);
+	FSExt(IFile *pDev, IFSImageFactory::EReadaheadMode read_ahead, bool background_priority, IFsNextBlockCallback* next_block_callback);
+	~FSExt(void);
+
+	int64 getBlocksize(void);
+	virtual int64 getSize(void);
+	const unsigned char * getBitmap(void);
+
+	virtual void logFileChanges(std::string volpath, int64 min_size, char* fc_bitmap);
+
+	virtual std::string getType();
+
+	static bool isExt(const char* buffer, size_t bsize);
+
+private:
+	void init();
+	bool groupHasSuper(int64 group);
+	int64 groupFirstBlock(int64 group);
+	bool readGroupDescriptors(std::vector<char>& descs);
+
+	unsigned char *bitmap;
+	int64 drivesize;
+	int64 blocksize;
+
+	int64 blocks_count;
+	int64 first_data_block;
+	int64 blocks_per_group;
+	int64 inodes_per_group;
+	int64 inode_size;
+	int64 n_groups;
+	size_t desc_size;
+	unsigned int feature_compat;
+	unsigned int feature_incompat;
+	unsigned int feature_ro_compat;
+	int64 first_meta_bg;
+	unsigned int backup_bgs[2];
+};
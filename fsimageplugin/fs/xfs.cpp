@@ -0,0 +1,523 @@
+/*************************************************************************
+*    UrBackup - Client/Server backup system
+*    Copyright (C) 2011-2016 Martin Raiber
+*
+*    This program is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU Affero General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU Affero General Public License for more details.
+*
+*    You should have received a copy of the GNU Affero General Public License
+*    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**************************************************************************/
+
+#include "xfs.h"
+#include "../../Interface/Server.h"
+#include "../../stringtools.h"
+#include <memory.h>
+
+namespace
+{
+	const unsigned int xfs_sb_magic = 0x58465342; //XFSB
+	const unsigned int xfs_agf_magic = 0x58414746; //XAGF
+	const unsigned int xfs_abtb_magic = 0x41425442; //ABTB
+	const unsigned int xfs_abtb_crc_magic = 0x41423342; //AB3B
+
+	const unsigned short xfs_sb_version_numbits = 0x000f;
+	const unsigned short xfs_sb_version_5 = 5;
+
+	//Short form B+tree block header. CRC enabled file systems add blkno, lsn, uuid, owner and crc
+	const size_t xfs_btree_sblock_len = 16;
+	const size_t xfs_btree_sblock_crc_len = 56;
+
+	//Deeper trees cannot address the maximum allocation group size
+	const int xfs_btree_max_levels = 9;
+
+	const unsigned int xlog_header_magic = 0xFEEDBABE;
+	const unsigned int xlog_version_2 = 2;
+	const unsigned char xlog_unmount_trans = 0x04;
+	const int64 xlog_bbsize = 512;
+	const int64 xlog_header_cycle_size = 32 * 1024;
+	//Largest log record including its extended headers
+	const int64 xlog_max_record_bbs = (256 * 1024) / xlog_bbsize + 8;
+
+#pragma pack(push)
+#pragma pack(1)
+	struct xfs_dsb
+	{
+		unsigned int sb_magicnum;
+		unsigned int sb_blocksize;
+		uint64 sb_dblocks;
+		uint64 sb_rblocks;
+		uint64 sb_rextents;
+		char sb_uuid[16];
+		uint64 sb_logstart;
+		uint64 sb_rootino;
+		uint64 sb_rbmino;
+		uint64 sb_rsumino;
+		unsigned int sb_rextsize;
+		unsigned int sb_agblocks;
+		unsigned int sb_agcount;
+		unsigned int sb_rbmblocks;
+		unsigned int sb_logblocks;
+		unsigned short sb_versionnum;
+		unsigned short sb_sectsize;
+		unsigned short sb_inodesize;
+		unsigned short sb_inopblock;
+		char sb_fname[12];
+		unsigned char sb_blocklog;
+		unsigned char sb_sectlog;
+		unsigned char sb_inodelog;
+		unsigned char sb_inopblog;
+		unsigned char sb_agblklog;
+		unsigned char sb_rextslog;
+		unsigned char sb_inprogress;
+		unsigned char sb_imax_pct;
+	};
+
+	struct xfs_agf
+	{
+		unsigned int agf_magicnum;
+		unsigned int agf_versionnum;
+		unsigned int agf_seqno;
+		unsigned int agf_length;
+		unsigned int agf_bno_root;
+		unsigned int agf_cnt_root;
+		unsigned int agf_rmap_root;
+		unsigned int agf_bno_level;
+		unsigned int agf_cnt_level;
+		unsigned int agf_rmap_level;
+	};
+
+	struct xfs_btree_sblock
+	{
+		unsigned int bb_magic;
+		unsigned short bb_level;
+		unsigned short bb_numrecs;
+		unsigned int bb_leftsib;
+		unsigned int bb_rightsib;
+	};
+
+	struct xfs_alloc_rec
+	{
+		unsigned int ar_startblock;
+		unsigned int ar_blockcount;
+	};
+
+	struct xlog_rec_header
+	{
+		unsigned int h_magicno;
+		unsigned int h_cycle;
+		unsigned int h_version;
+		unsigned int h_len;
+		uint64 h_lsn;
+		uint64 h_tail_lsn;
+		unsigned int h_crc;
+		unsigned int h_prev_block;
+		unsigned int h_num_logops;
+		unsigned int h_cycle_data[64];
+		unsigned int h_fmt;
+		char h_fs_uuid[16];
+		unsigned int h_size;
+	};
+
+	struct xlog_op_header
+	{
+		unsigned int oh_tid;
+		unsigned int oh_len;
+		unsigned char oh_clientid;
+		unsigned char oh_flags;
+		unsigned short oh_res2;
+	};
+#pragma pack(pop)
+
+	//The first word of every log block is the cycle it was written in, except for record headers
+	unsigned int xlog_block_cycle(const char* buf)
+	{
+		unsigned int word;
+		memcpy(&word, buf, sizeof(word));
+		if (big_endian(word) == xlog_header_magic)
+		{
+			memcpy(&word, buf + sizeof(word), sizeof(word));
+		}
+		return big_endian(word);
+	}
+}
+
+FSXfs::FSXfs(const std::string &pDev, IFSImageFactory::EReadaheadMode read_ahead, bool background_priority, IFsNextBlockCallback* next_block_callback)
+	: Filesystem(pDev, read_ahead, next_block_callback), bitmap(NULL), log_offset(0), log_bbs(0)
+{
+	init();
+	initReadahead(read_ahead, background_priority);
+}
+
+FSXfs::FSXfs(IFile *pDev, IFSImageFactory::EReadaheadMode read_ahead, bool background_priority, IFsNextBlockCallback* next_block_callback)
+	: Filesystem(pDev, next_block_callback), bitmap(NULL), log_offset(0), log_bbs(0)
+{
+	init();
+	initReadahead(read_ahead, background_priority);
+}
+
+FSXfs::~FSXfs(void)
+{
+	delete[] bitmap;
+}
+
+bool FSXfs::isXfs(const char* buffer, size_t bsize)
+{
+	if (bsize < sizeof(unsigned int))
+	{
+		return false;
+	}
+
+	unsigned int magic;
+	memcpy(&magic, buffer, sizeof(magic));
+	return big_endian(magic) == xfs_sb_magic;
+}
+
+void FSXfs::init()
+{
+	if (has_error)
+		return;
+
+	xfs_dsb sb;
+	if (dev->Read(0LL, reinterpret_cast<char*>(&sb), sizeof(sb)) != sizeof(sb))
+	{
+		Server->Log("Error reading XFS superblock", LL_ERROR);
+		has_error = true;
+		return;
+	}
+
+	if (big_endian(sb.sb_magicnum) != xfs_sb_magic)
+	{
+		Server->Log("XFS magic wrong", LL_ERROR);
+		has_error = true;
+		return;
+	}
+
+	blocksize = big_endian(sb.sb_blocksize);
+	sector_size = big_endian(sb.sb_sectsize);
+	ag_blocks = big_endian(sb.sb_agblocks);
+	int64 ag_count = big_endian(sb.sb_agcount);
+	int64 dblocks = static_cast<int64>(big_endian(sb.sb_dblocks));
+	crc_enabled = (big_endian(sb.sb_versionnum) & xfs_sb_version_numbits) == xfs_sb_version_5;
+
+	if (blocksize < 512 || blocksize > 65536
+		|| sector_size < 512 || sector_size > blocksize
+		|| ag_blocks == 0 || ag_count == 0
+		|| dblocks > ag_blocks*ag_count)
+	{
+		Server->Log("XFS superblock invalid", LL_ERROR);
+		has_error = true;
+		return;
+	}
+
+	if (sb.sb_inprogress)
+	{
+		Server->Log("XFS file system is being created", LL_ERROR);
+		has_error = true;
+		return;
+	}
+
+	drivesize = dev->Size();
+	if (drivesize < dblocks*blocksize)
+	{
+		Server->Log("Device is smaller than XFS file system", LL_ERROR);
+		has_error = true;
+		return;
+	}
+
+	if (!logIsClean(big_endian(sb.sb_logstart), sb.sb_agblklog, big_endian(sb.sb_logblocks)))
+	{
+		//Blocks allocated by transactions still in the log may be free in the free space trees
+		Server->Log("XFS log is dirty (snapshot of file system that was not frozen?)", LL_INFO);
+		has_error = true;
+		return;
+	}
+
+	int64 bitmap_entries = (drivesize + blocksize - 1) / blocksize;
+	size_t bitmap_bytes = static_cast<size_t>((bitmap_entries + 7) / 8);
+	bitmap = new unsigned char[bitmap_bytes];
+	//Everything is used except for the free extents
+	memset(bitmap, 0xFF, bitmap_bytes);
+
+	tree_block.resize(static_cast<size_t>(blocksize));
+
+	for (int64 ag = 0; ag < ag_count; ++ag)
+	{
+		xfs_agf agf;
+		if (dev->Read(ag*ag_blocks*blocksize + sector_size, reinterpret_cast<char*>(&agf), sizeof(agf)) != sizeof(agf))
+		{
+			Server->Log("Error reading XFS AGF of allocation group " + convert(ag), LL_ERROR);
+			has_error = true;
+			return;
+		}
+
+		if (big_endian(agf.agf_magicnum) != xfs_agf_magic
+			|| big_endian(agf.agf_seqno) != ag)
+		{
+			Server->Log("XFS AGF of allocation group " + convert(ag) + " invalid", LL_ERROR);
+			has_error = true;
+			return;
+		}
+
+		int64 ag_length = big_endian(agf.agf_length);
+		int level = static_cast<int>(big_endian(agf.agf_bno_level));
+
+		if (ag_length > ag_blocks
+			|| level < 1 || level > xfs_btree_max_levels)
+		{
+			Server->Log("XFS AGF of allocation group " + convert(ag) + " invalid (2)", LL_ERROR);
+			has_error = true;
+			return;
+		}
+
+		if (!readFreeSpaceTree(ag, big_endian(agf.agf_bno_root), level - 1, ag_length))
+		{
+			has_error = true;
+			return;
+		}
+	}
+}
+
+bool FSXfs::readFreeSpaceTree(int64 ag, unsigned int agbno, int level, int64 ag_length)
+{
+	if (agbno >= ag_length)
+	{
+		Server->Log("XFS free space tree block out of range in allocation group " + convert(ag), LL_ERROR);
+		return false;
+	}
+
+	if (dev->Read((ag*ag_blocks + agbno)*blocksize, tree_block.data(), static_cast<_u32>(blocksize)) != blocksize)
+	{
+		Server->Log("Error reading XFS free space tree block in allocation group " + convert(ag), LL_ERROR);
+		return false;
+	}
+
+	xfs_btree_sblock hdr;
+	memcpy(&hdr, tree_block.data(), sizeof(hdr));
+
+	unsigned int magic = big_endian(hdr.bb_magic);
+	if (magic != (crc_enabled ? xfs_abtb_crc_magic : xfs_abtb_magic)
+		|| big_endian(hdr.bb_level) != level)
+	{
+		Server->Log("XFS free space tree block in allocation group " + convert(ag) + " invalid", LL_ERROR);
+		return false;
+	}
+
+	size_t hdr_len = crc_enabled ? xfs_btree_sblock_crc_len : xfs_btree_sblock_len;
+	size_t numrecs = big_endian(hdr.bb_numrecs);
+
+	if (level == 0)
+	{
+		if (hdr_len + numrecs*sizeof(xfs_alloc_rec) > tree_block.size())
+		{
+			Server->Log("XFS free space tree leaf in allocation group " + convert(ag) + " has too many records", LL_ERROR);
+			return false;
+		}
+
+		for (size_t i = 0; i < numrecs; ++i)
+		{
+			xfs_alloc_rec rec;
+			memcpy(&rec, &tree_block[hdr_len + i*sizeof(rec)], sizeof(rec));
+
+			int64 start = big_endian(rec.ar_startblock);
+			int64 count = big_endian(rec.ar_blockcount);
+
+			if (start + count > ag_length)
+			{
+				Server->Log("XFS free extent out of range in allocation group " + convert(ag), LL_ERROR);
+				return false;
+			}
+
+			setBitmapRange(bitmap, ag*ag_blocks + start, count, false);
+		}
+
+		return true;
+	}
+
+	//Nodes have space for the maximum number of keys before the pointers
+	size_t maxrecs = (tree_block.size() - hdr_len) / (sizeof(xfs_alloc_rec) + sizeof(unsigned int));
+	if (numrecs > maxrecs)
+	{
+		Server->Log("XFS free space tree node in allocation group " + convert(ag) + " has too many records", LL_ERROR);
+		return false;
+	}
+
+	std::vector<unsigned int> ptrs(numrecs);
+	size_t ptr_offset = hdr_len + maxrecs*sizeof(xfs_alloc_rec);
+	for (size_t i = 0; i < numrecs; ++i)
+	{
+		unsigned int ptr;
+		memcpy(&ptr, &tree_block[ptr_offset + i*sizeof(ptr)], sizeof(ptr));
+		ptrs[i] = big_endian(ptr);
+	}
+
+	for (size_t i = 0; i < ptrs.size(); ++i)
+	{
+		if (!readFreeSpaceTree(ag, ptrs[i], level - 1, ag_length))
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
+
+bool FSXfs::logIsClean(uint64 logstart, unsigned int agblklog, int64 logblocks)
+{
+	if (logstart == 0)
+	{
+		Server->Log("XFS file system has an external log", LL_INFO);
+		return false;
+	}
+
+	if (agblklog >= 32)
+	{
+		Server->Log("XFS superblock invalid (agblklog)", LL_ERROR);
+		return false;
+	}
+
+	uint64 agbno_mask = (1ULL << agblklog) - 1;
+	log_offset = (static_cast<int64>(logstart >> agblklog)*ag_blocks + static_cast<int64>(logstart & agbno_mask))*blocksize;
+	log_bbs = logblocks*blocksize / xlog_bbsize;
+
+	if (log_bbs < 2
+		|| log_offset + log_bbs*xlog_bbsize > drivesize)
+	{
+		Server->Log("XFS log location invalid", LL_ERROR);
+		return false;
+	}
+
+	char buf[xlog_bbsize];
+	if (!readLogBlock(0, buf))
+	{
+		return false;
+	}
+	unsigned int first_cycle = xlog_block_cycle(buf);
+
+	if (!readLogBlock(log_bbs - 1, buf))
+	{
+		return false;
+	}
+	unsigned int last_cycle = xlog_block_cycle(buf);
+
+	//The head is the first block not written in the current cycle
+	int64 head_blk = 0;
+	if (first_cycle != last_cycle)
+	{
+		int64 lo = 0;
+		int64 hi = log_bbs - 1;
+		while (hi - lo > 1)
+		{
+			int64 mid = lo + (hi - lo) / 2;
+			if (!readLogBlock(mid, buf))
+			{
+				return false;
+			}
+
+			if (xlog_block_cycle(buf) == last_cycle)
+			{
+				hi = mid;
+			}
+			else
+			{
+				lo = mid;
+			}
+		}
+		head_blk = hi;
+	}
+
+	//The last record before the head has to be an unmount record that ends exactly at the head
+	int64 hdr_blk = -1;
+	for (int64 i = 1; i <= xlog_max_record_bbs && i <= log_bbs; ++i)
+	{
+		int64 blk = (head_blk - i + log_bbs) % log_bbs;
+		if (!readLogBlock(blk, buf))
+		{
+			return false;
+		}
+
+		unsigned int magic;
+		memcpy(&magic, buf, sizeof(magic));
+		if (big_endian(magic) == xlog_header_magic)
+		{
+			hdr_blk = blk;
+			break;
+		}
+	}
+
+	if (hdr_blk < 0)
+	{
+		return false;
+	}
+
+	xlog_rec_header hdr;
+	memcpy(&hdr, buf, sizeof(hdr));
+
+	int64 hdr_bbs = 1;
+	if (big_endian(hdr.h_version) & xlog_version_2)
+	{
+		int64 h_size = big_endian(hdr.h_size);
+		if (h_size > xlog_header_cycle_size)
+		{
+			hdr_bbs = (h_size + xlog_header_cycle_size - 1) / xlog_header_cycle_size;
+		}
+	}
+
+	int64 rec_bbs = hdr_bbs + (static_cast<int64>(big_endian(hdr.h_len)) + xlog_bbsize - 1) / xlog_bbsize;
+	if ((hdr_blk + rec_bbs) % log_bbs != head_blk
+		|| big_endian(hdr.h_num_logops) != 1)
+	{
+		return false;
+	}
+
+	if (!readLogBlock((hdr_blk + hdr_bbs) % log_bbs, buf))
+	{
+		return false;
+	}
+
+	xlog_op_header oh;
+	memcpy(&oh, buf, sizeof(oh));
+
+	return (oh.oh_flags & xlog_unmount_trans) != 0;
+}
+
+bool FSXfs::readLogBlock(int64 blk, char* buf)
+{
+	if (dev->Read(log_offset + blk*xlog_bbsize, buf, static_cast<_u32>(xlog_bbsize)) != xlog_bbsize)
+	{
+		Server->Log("Error reading XFS log block " + convert(blk), LL_ERROR);
+		return false;
+	}
+	return true;
+}
+
+int64 FSXfs::getBlocksize(void)
+{
+	return blocksize;
+}
+
+int64 FSXfs::getSize(void)
+{
+	return drivesize;
+}
+
+const unsigned char * FSXfs::getBitmap(void)
+{
+	return bitmap;
+}
+
+void FSXfs::logFileChanges(std::string volpath, int64 min_size, char * fc_bitmap)
+{
+}
+
+std::string FSXfs::getType()
+{
+	return "xfs";
+}
@@ -0,0 +1,40 @@
+#include "../filesystem.h"
+
+/*
+* XFS used block bitmap from the free space B+trees (by block number) of the
+* allocation groups
+*/
+class FSXfs : public Filesystem
+{
+public:
+	FSXfs(const std::string &pDev, IFSImageFactory::EReadaheadMode read_ahead, bool background_priority, IFsNextBlockCallback* next_block_callback);
+	FSXfs(IFile *pDev, IFSImageFactory::EReadaheadMode read_ahead, bool background_priority, IFsNextBlockCallback* next_block_callback);
+	~FSXfs(void);
+
+	int64 getBlocksize(void);
+	virtual int64 getSize(void);
+	const unsigned char * getBitmap(void);
+
+	virtual void logFileChanges(std::string volpath, int64 min_size, char* fc_bitmap);
+
+	virtual std::string getType();
+
+	static bool isXfs(const char* buffer, size_t bsize);
+
+private:
+	void init();
+	bool readFreeSpaceTree(int64 ag, unsigned int agbno, int level, int64 ag_length);
+	bool logIsClean(uint64 logstart, unsigned int agblklog, int64 logblocks);
+	bool readLogBlock(int64 blk, char* buf);
+
+	unsigned char *bitmap;
+	int64 drivesize;
+	int64 blocksize;
+
+	int64 ag_blocks;
+	int64 sector_size;
+	bool crc_enabled;
+	std::vector<char> tree_block;
+	int64 log_offset;
+	int64 log_bbs;
+};
@@ -52,9 +52,7 @@ documentation and/or software.
 #include <string>
 #include <iostream>
 
-#ifndef _WIN32
 #include <string.h>
-#endif
 
 using namespace std;
 
@@ -462,35 +460,29 @@ void MD5::encode (uint1 *output, uint4 *input, uint4 len) {
 // a multiple of 4.
 void MD5::decode (uint4 *output, uint1 *input, uint4 len){
 
+#if defined(_WIN32) || (defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+  ::memcpy(output, input, len);
+#else
   unsigned int i, j;
 
   for (i = 0, j = 0; j < len; i++, j += 4)
     output[i] = ((uint4)input[j]) | (((uint4)input[j+1]) << 8) |
       (((uint4)input[j+2]) << 16) | (((uint4)input[j+3]) << 24);
+#endif
 }
 
 
 
 
 
-// Note: Replace "for loop" with standard memcpy if possible.
 void MD5::memcpy (uint1 *output, uint1 *input, uint4 len){
-
-  unsigned int i;
-
-  for (i = 0; i < len; i++)
-    output[i] = input[i];
+  ::memcpy(output, input, len);
 }
 
 
 
-// Note: Replace "for loop" with standard memset if possible.
 void MD5::memset (uint1 *output, uint1 value, uint4 len){
-
-  unsigned int i;
-
-  for (i = 0; i < len; i++)
-    output[i] = value;
+  ::memset(output, value, len);
 }
 
 
@@ -506,12 +498,14 @@ inline unsigned int MD5::rotate_left  (uint4 x, uint4 n){
 
 // F, G, H and I are basic MD5 functions.
 
+// F and G are computed with one operation less than the
+// textbook definitions (x & y) | (~x & z) and (x & z) | (y & ~z).
 inline unsigned int MD5::F            (uint4 x, uint4 y, uint4 z){
-  return (x & y) | (~x & z);
+  return z ^ (x & (y ^ z));
 }
 
 inline unsigned int MD5::G            (uint4 x, uint4 y, uint4 z){
-  return (x & z) | (y & ~z);
+  return y ^ (z & (x ^ y));
 }
 
 inline unsigned int MD5::H            (uint4 x, uint4 y, uint4 z){
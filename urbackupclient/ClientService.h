@@ -115,6 +115,14 @@ struct ImageInformation
 	THREADPOOL_TICKET thread_ticket;
 	std::string shadowdrive;
 	int64 startpos;
+	//Block after the last block to send or -1
+	int64 endpos;
+	//Number of parallel connections the server receives the image with
+	int n_streams;
+	//Server could not receive all ranges. Only release the snapshot
+	bool abort_ranges;
+	//Block the previous client bitmap starts at
+	int64 cbitmap_start;
 	int shadow_id;
 	std::string image_letter;
 	std::string orig_image_letter;
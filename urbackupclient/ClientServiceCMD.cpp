@@ -1552,6 +1552,20 @@ void ClientConnector::CMD_FULL_IMAGE(const std::string &cmd, bool ident_ok)
 		{
 			image_inf.startpos=-1;
 		}
+		if(params.find("end")!=params.end())
+		{
+			image_inf.endpos=watoi64(params["end"]);
+		}
+		else
+		{
+			image_inf.endpos=-1;
+		}
+		image_inf.n_streams=1;
+		if(params.find("streams")!=params.end())
+		{
+			image_inf.n_streams=watoi(params["streams"]);
+		}
+		image_inf.abort_ranges=params["abort"]=="1";
 		if(params.find("shadowid")!=params.end())
 		{
 			image_inf.shadow_id=watoi(params["shadowid"]);
@@ -1689,6 +1703,20 @@ void ClientConnector::CMD_INCR_IMAGE(const std::string &cmd, bool ident_ok)
 			{
 				image_inf.startpos=-1;
 			}
+			if(params.find("end")!=params.end())
+			{
+				image_inf.endpos=watoi64(params["end"]);
+			}
+			else
+			{
+				image_inf.endpos=-1;
+			}
+			image_inf.n_streams=1;
+			if(params.find("streams")!=params.end())
+			{
+				image_inf.n_streams=watoi(params["streams"]);
+			}
+			image_inf.abort_ranges=params["abort"]=="1";
 			if(params.find("shadowid")!=params.end())
 			{
 				image_inf.shadow_id=watoi(params["shadowid"]);
@@ -1718,9 +1746,11 @@ void ClientConnector::CMD_INCR_IMAGE(const std::string &cmd, bool ident_ok)
 #endif
 
 			str_map::iterator f_cbitmapsize = params.find("cbitmapsize");
+			image_inf.cbitmap_start = 0;
 			if (f_cbitmapsize != params.end())
 			{
 				bitmapleft = watoi(f_cbitmapsize->second);
+				image_inf.cbitmap_start = watoi64(params["cbitmapstart"]);
 
 				bitmapfile = Server->openTemporaryFile();
 				if (bitmapfile == nullptr)
@@ -1774,6 +1804,9 @@ void ClientConnector::CMD_INCR_IMAGE(const std::string &cmd, bool ident_ok)
 				return;
 			}
 
+			//Image ranges only get the hash data of the range
+			hashdatafile->Seek(watoi64(params["hashoffset"]));
+
 			state = CCSTATE_IMAGE_HASHDATA;
 
 			size_t bufpos = 0;
@@ -2727,10 +2760,10 @@ void ClientConnector::CMD_CAPA(const std::string &cmd)
 	bool locked = IndexThread::isWindowsLocked();
 	std::string locked_str = std::string("&LOCKED=") + (locked ? "1" : "0");
 
-	tcpstack.Send(pipe, "FILE=2&FILE2=1&IMAGE=1&UPDATE=1&MBR=1&FILESRV=3&SET_SETTINGS=1&IMAGE_VER=1&CLIENTUPDATE=2&ASYNC_INDEX=1"
+	tcpstack.Send(pipe, "FILE=2&FILE2=1&IMAGE=1&UPDATE=1&MBR=1&FILESRV=3&SET_SETTINGS=1&IMAGE_VER=2&CLIENTUPDATE=2&ASYNC_INDEX=1"
 		"&CLIENT_VERSION_STR="+EscapeParamString((client_version_str))+"&OS_VERSION_STR="+EscapeParamString(os_version_str)+
 		"&ALL_VOLUMES="+EscapeParamString(win_volumes)+"&ETA=1&CDP=0&ALL_NONUSB_VOLUMES="+EscapeParamString(win_nonusb_volumes)+"&EFI=1"
-		"&FILE_META=1&SELECT_SHA=1&PHASH=1&RESTORE="+restore+"&RESTORE_VER=1&CLIENT_BITMAP=1&CMD=2&SYMBIT=1&WTOKENS=1&FILESRVTUNNEL=1&FACET=1&OS_SIMPLE=windows"
+		"&FILE_META=1&SELECT_SHA=1&PHASH=1&RESTORE="+restore+"&RESTORE_VER=1&CLIENT_BITMAP=1&CMD=2&SYMBIT=1&WTOKENS=1&FILESRVTUNNEL=1&CDC=1&FACET=1&OS_SIMPLE=windows"
 		"&clientuid="+EscapeParamString(clientuid)+conn_metered+ send_prev_cbitmap + imm_backup + locked_str);
 #else
 
@@ -2750,9 +2783,9 @@ void ClientConnector::CMD_CAPA(const std::string &cmd)
 
 
 	std::string os_version_str=get_lin_os_version();
-	tcpstack.Send(pipe, "FILE=2&FILE2=1&FILESRV=3&SET_SETTINGS=1&IMAGE_VER=1&CLIENTUPDATE=2&ASYNC_INDEX=1"
+	tcpstack.Send(pipe, "FILE=2&FILE2=1&FILESRV=3&SET_SETTINGS=1&IMAGE_VER=2&CLIENTUPDATE=2&ASYNC_INDEX=1"
 		"&CLIENT_VERSION_STR="+EscapeParamString((client_version_str))+"&OS_VERSION_STR="+EscapeParamString(os_version_str)
-		+"&ETA=1&CPD=0&EFI=1&FILE_META=1&SELECT_SHA=1&PHASH=1&RESTORE="+restore+"&RESTORE_VER=1&CLIENT_BITMAP=1&CMD=2&SYMBIT=1&WTOKENS=1&FILESRVTUNNEL=1&FACET=1&OS_SIMPLE="+os_simple
+		+"&ETA=1&CPD=0&EFI=1&FILE_META=1&SELECT_SHA=1&PHASH=1&RESTORE="+restore+"&RESTORE_VER=1&CLIENT_BITMAP=1&CMD=2&SYMBIT=1&WTOKENS=1&FILESRVTUNNEL=1&CDC=1&FACET=1&OS_SIMPLE="+os_simple
 		+"&clientuid=" + EscapeParamString(clientuid) + imm_backup + image_args);
 #endif
 }
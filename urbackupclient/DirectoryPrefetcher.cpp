@@ -0,0 +1,190 @@
+/*************************************************************************
+*    UrBackup - Client/Server backup system
+*    Copyright (C) 2011-2016 Martin Raiber
+*
+*    This program is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU Affero General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU Affero General Public License for more details.
+*
+*    You should have received a copy of the GNU Affero General Public License
+*    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**************************************************************************/
+
+#include "DirectoryPrefetcher.h"
+#include "../Interface/Server.h"
+#include "../stringtools.h"
+#include <algorithm>
+#include <errno.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+namespace
+{
+	//Upper bound of queued and finished directory listings
+	const size_t max_prefetched_dirs = 1024;
+}
+
+DirectoryPrefetcher::DirectoryPrefetcher(size_t n_threads, bool ignore_other_fs)
+	: mutex(Server->createMutex()), cond(Server->createCondition()),
+	done_cond(Server->createCondition()), ignore_other_fs(ignore_other_fs),
+	do_quit(false)
+{
+	for (size_t i = 0; i < n_threads; ++i)
+	{
+		tickets.push_back(Server->getThreadPool()->execute(this, "idx prefetch" + convert(i)));
+	}
+}
+
+DirectoryPrefetcher::~DirectoryPrefetcher()
+{
+	{
+		IScopedLock lock(mutex.get());
+		do_quit = true;
+		cond->notify_all();
+	}
+
+	Server->getThreadPool()->waitFor(tickets);
+}
+
+size_t DirectoryPrefetcher::configuredThreads()
+{
+	std::string n_threads = Server->getServerParameter("index_prefetch_threads");
+	if (n_threads.empty())
+	{
+		return 4;
+	}
+	return static_cast<size_t>((std::max)(0, watoi(n_threads)));
+}
+
+void DirectoryPrefetcher::operator()()
+{
+	IScopedLock lock(mutex.get());
+	while (!do_quit)
+	{
+		if (queue.empty())
+		{
+			cond->wait(&lock);
+			continue;
+		}
+
+		std::string path = queue.back();
+		queue.pop_back();
+
+		std::map<std::string, SItem>::iterator it = items.find(path);
+		if (it == items.end()
+			|| it->second.state != EState_Queued)
+		{
+			//Already claimed by the indexer
+			continue;
+		}
+
+		it->second.state = EState_Running;
+
+		lock.relock(nullptr);
+
+		bool has_error;
+		int err;
+		std::vector<SFile> files = listDir(path, &has_error, err);
+
+		lock.relock(mutex.get());
+
+		//Items are only removed by the indexer once they are done
+		SItem& item = items[path];
+		item.files.swap(files);
+		item.has_error = has_error;
+		item.err = err;
+		item.state = EState_Done;
+		done_cond->notify_all();
+	}
+}
+
+void DirectoryPrefetcher::prefetch(const std::vector<std::string>& paths)
+{
+	if (tickets.empty())
+	{
+		return;
+	}
+
+	IScopedLock lock(mutex.get());
+	for (size_t i = 0; i < paths.size(); ++i)
+	{
+		if (items.size() >= max_prefetched_dirs)
+		{
+			break;
+		}
+
+		if (items.find(paths[i]) != items.end())
+		{
+			continue;
+		}
+
+		items[paths[i]];
+		queue.push_back(paths[i]);
+		cond->notify_one();
+	}
+}
+
+std::vector<SFile> DirectoryPrefetcher::getFiles(const std::string& path, bool* has_error)
+{
+	int err = 0;
+	std::vector<SFile> ret;
+
+	{
+		IScopedLock lock(mutex.get());
+		bool prefetched = false;
+		std::map<std::string, SItem>::iterator it = items.find(path);
+		if (it != items.end())
+		{
+			while (it->second.state == EState_Running)
+			{
+				done_cond->wait(&lock);
+			}
+
+			if (it->second.state == EState_Done)
+			{
+				ret.swap(it->second.files);
+				*has_error = it->second.has_error;
+				err = it->second.err;
+				prefetched = true;
+			}
+
+			//Workers skip queue entries without item
+			items.erase(it);
+		}
+
+		if (!prefetched)
+		{
+			lock.relock(nullptr);
+			ret = listDir(path, has_error, err);
+		}
+	}
+
+#ifdef _WIN32
+	SetLastError(static_cast<DWORD>(err));
+#else
+	errno = err;
+#endif
+
+	return ret;
+}
+
+std::vector<SFile> DirectoryPrefetcher::listDir(const std::string& path, bool* has_error, int& err)
+{
+	std::vector<SFile> files = getFilesWin(path, has_error, true, true, ignore_other_fs);
+
+#ifdef _WIN32
+	err = static_cast<int>(GetLastError());
+#else
+	err = errno;
+#endif
+
+	return files;
+}
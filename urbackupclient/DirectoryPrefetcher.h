@@ -0,0 +1,67 @@
+#pragma once
+
+#include "../Interface/Thread.h"
+#include "../Interface/Mutex.h"
+#include "../Interface/Condition.h"
+#include "../Interface/ThreadPool.h"
+#include "../urbackupcommon/os_functions.h"
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+/**
+* Lists directories the indexer is going to visit next with a bounded number of
+* worker threads. The indexer still walks the tree sequentially (and therefore
+* writes the file list in the same order), it only picks up the prefetched
+* directory listings instead of reading them itself.
+*/
+class DirectoryPrefetcher : public IThread
+{
+public:
+	DirectoryPrefetcher(size_t n_threads, bool ignore_other_fs);
+	~DirectoryPrefetcher();
+
+	static size_t configuredThreads();
+
+	void operator()();
+
+	//Queues the directories. The last one is listed first
+	void prefetch(const std::vector<std::string>& paths);
+
+	//Same as getFilesWin(path, has_error, true, true, ignore_other_fs) including the last error
+	std::vector<SFile> getFiles(const std::string& path, bool* has_error);
+
+private:
+	enum EState
+	{
+		EState_Queued,
+		EState_Running,
+		EState_Done
+	};
+
+	struct SItem
+	{
+		SItem()
+			: state(EState_Queued), has_error(false), err(0)
+		{}
+
+		EState state;
+		std::vector<SFile> files;
+		bool has_error;
+		int err;
+	};
+
+	std::vector<SFile> listDir(const std::string& path, bool* has_error, int& err);
+
+	std::unique_ptr<IMutex> mutex;
+	std::unique_ptr<ICondition> cond;
+	std::unique_ptr<ICondition> done_cond;
+
+	std::map<std::string, SItem> items;
+	std::vector<std::string> queue;
+
+	bool ignore_other_fs;
+	bool do_quit;
+	std::vector<THREADPOOL_TICKET> tickets;
+};
@@ -124,9 +124,60 @@ void ImageThread::createShadowData(str_map & other_vols, CWData & shadow_data)
 const unsigned int c_vhdblocksize=(1024*1024/2);
 const unsigned int c_hashsize=32;
 
+bool ImageThread::isMultiStream()
+{
+#if !defined(VSS_XP) && !defined(VSS_S03)
+	return image_inf->startpos<0
+		&& image_inf->n_streams>1
+		&& !image_inf->no_shadowcopy;
+#else
+	return false;
+#endif
+}
+
+int64 ImageThread::getRangeEnd(int64 blocks, unsigned int blocksize)
+{
+	if(image_inf->endpos>=0)
+	{
+		return (std::min)(image_inf->endpos, blocks);
+	}
+
+#if !defined(VSS_XP) && !defined(VSS_S03)
+	if(isMultiStream())
+	{
+		//The server receives the other ranges via additional connections.
+		//Has to match ImageBackup::startImageRanges
+		int64 vhdblocks=c_vhdblocksize/blocksize;
+		int64 range_blocks=(blocks+image_inf->n_streams-1)/image_inf->n_streams;
+		range_blocks=((range_blocks+vhdblocks-1)/vhdblocks)*vhdblocks;
+		if(range_blocks==0)
+		{
+			range_blocks=vhdblocks;
+		}
+		return (std::min)(range_blocks, blocks);
+	}
+#endif
+
+	return blocks;
+}
+
+bool ImageThread::isPartialRange(int64 blocks)
+{
+	//Connections for a range always have an end. Once all ranges are done the
+	//server requests the empty range at the end of the volume, which finishes
+	//the backup and releases the snapshot
+	if(image_inf->endpos>=0)
+	{
+		return image_inf->startpos<blocks;
+	}
+
+	return isMultiStream();
+}
+
 bool ImageThread::sendFullImageThread(void)
 {
 	bool has_error=true;
+	bool partial_range=false;
 
 	int save_id=-1;
 	bool with_checksum=image_inf->with_checksum;
@@ -310,7 +361,9 @@ bool ImageThread::sendFullImageThread(void)
 			int64 last_hash_block=-1;
 			std::vector<char*> bufs;
 			int64 startpos = image_inf->startpos < 0 ? 0 : image_inf->startpos;
-			for(int64 i=startpos,blocks=drivesize/blocksize;i<blocks;i+=64)
+			int64 range_end = getRangeEnd(drivesize/blocksize, blocksize);
+			partial_range = isPartialRange(drivesize/blocksize);
+			for(int64 i=startpos,blocks=range_end;i<blocks;i+=64)
 			{
 				std::vector<char*> n_bufs= clientSend->getBuffers(needed_bufs);
 				bufs.insert(bufs.end(), n_bufs.begin(), n_bufs.end() );
@@ -462,7 +515,19 @@ bool ImageThread::sendFullImageThread(void)
 
 	bool success = !has_error;
 
-	if (success && !image_inf->no_shadowcopy)
+	//The snapshot is still used by the connections sending the other ranges
+	if (partial_range)
+	{
+		client->doQuitClient();
+		return success;
+	}
+
+	if (image_inf->abort_ranges)
+	{
+		Server->Log("Server stopped image backup. Releasing snapshot.", LL_INFO);
+		success = false;
+	}
+	else if (success && !image_inf->no_shadowcopy)
 	{
 		ClientConnector::updateLastBackup();
 		IndexThread::execute_postbackup_hook("postimagebackup", 0, std::string());
@@ -511,6 +576,7 @@ void ImageThread::removeShadowCopyThread(int save_id)
 bool ImageThread::sendIncrImageThread(void)
 {
 	char *zeroblockbuf=nullptr;
+	bool partial_range=false;
 	std::vector<IFilesystem::IFsBuffer*> blockbufs;
 
 	bool has_error=true;
@@ -668,7 +734,8 @@ bool ImageThread::sendIncrImageThread(void)
 							if (fs->hasBlock(j / blocksize))
 							{
 								fs_has_block = true;
-								if (!previous_bitmap->hasBlock(j / blocksize))
+								if (j / blocksize >= image_inf->cbitmap_start
+									&& !previous_bitmap->hasBlock(j / blocksize - image_inf->cbitmap_start))
 								{
 									bitmap_diff = true;
 									break;
@@ -824,7 +891,9 @@ bool ImageThread::sendIncrImageThread(void)
 			THREADPOOL_TICKET send_ticket=Server->getThreadPool()->execute(clientSend, "incr image transfer");
 
 			int64 startpos = image_inf->startpos < 0 ? 0 : image_inf->startpos;
-			for(int64 i=startpos,blocks=drivesize/blocksize;i<blocks;i+= blocks_per_vhdblock)
+			int64 range_end = getRangeEnd(numblocks, blocksize);
+			partial_range = isPartialRange(numblocks);
+			for(int64 i=startpos,blocks=range_end;i<blocks;i+= blocks_per_vhdblock)
 			{
 				++update_cnt;
 				if(update_cnt>10
@@ -1071,7 +1140,19 @@ bool ImageThread::sendIncrImageThread(void)
 
 	bool success = !has_error;
 
-	if (success && !image_inf->no_shadowcopy)
+	//The snapshot is still used by the connections sending the other ranges
+	if (partial_range)
+	{
+		client->doQuitClient();
+		return success;
+	}
+
+	if (image_inf->abort_ranges)
+	{
+		Server->Log("Server stopped image backup. Releasing snapshot.", LL_INFO);
+		success = false;
+	}
+	else if (success && !image_inf->no_shadowcopy)
 	{
 		ClientConnector::updateLastBackup();
 		IndexThread::execute_postbackup_hook("postimagebackup", 0, std::string());
@@ -40,6 +40,9 @@ private:
 	bool sendIncrImageThread(void);
 
 	void removeShadowCopyThread(int save_id);
+	bool isMultiStream();
+	int64 getRangeEnd(int64 blocks, unsigned int blocksize);
+	bool isPartialRange(int64 blocks);
 	void updateShadowCopyStarttime(int save_id);
 
 	bool sendBitmap(IFilesystem* fs, int64 drivesize, unsigned int blocksize);
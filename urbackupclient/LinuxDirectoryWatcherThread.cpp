@@ -0,0 +1,1039 @@
+/*************************************************************************
+*    UrBackup - Client/Server backup system
+*    Copyright (C) 2011-2016 Martin Raiber
+*
+*    This program is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU Affero General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU Affero General Public License for more details.
+*
+*    You should have received a copy of the GNU Affero General Public License
+*    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**************************************************************************/
+
+#include "LinuxDirectoryWatcherThread.h"
+#include "../Interface/Server.h"
+#include "../stringtools.h"
+#include "database.h"
+#include "clientdao.h"
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <sys/fanotify.h>
+#include <sys/statfs.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <mntent.h>
+#include <string.h>
+#include <stdio.h>
+#endif
+#include <algorithm>
+#include <iterator>
+
+IPipe *LinuxDirectoryWatcherThread::pipe=nullptr;
+IMutex *LinuxDirectoryWatcherThread::update_mutex=nullptr;
+ICondition *LinuxDirectoryWatcherThread::update_cond=nullptr;
+
+namespace
+{
+	const unsigned int max_change_ram_cache=10*60*1000;
+	const size_t max_handle_cache=10000;
+	const int poll_timeout=100;
+	const std::string gap_prefix="##-GAP-##";
+
+#ifdef __linux__
+	const uint32_t inotify_mask=IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE
+		| IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR | IN_DONT_FOLLOW | IN_EXCL_UNLINK;
+
+#ifdef FAN_REPORT_DFID_NAME
+	const uint64_t fanotify_mask=FAN_MODIFY | FAN_ATTRIB | FAN_CREATE | FAN_DELETE
+		| FAN_MOVED_FROM | FAN_MOVED_TO | FAN_ONDIR;
+#endif
+#endif
+
+	std::string with_trailing_sep(const std::string& path)
+	{
+		if(!path.empty() && path[path.size()-1]=='/')
+		{
+			return path;
+		}
+		return path+"/";
+	}
+
+	std::string join_path(const std::string& dir, const std::string& name)
+	{
+		return with_trailing_sep(dir)+name;
+	}
+
+	bool is_below(const std::string& dir, const std::string& prefix)
+	{
+		return with_trailing_sep(dir).compare(0, prefix.size(), prefix)==0;
+	}
+
+#ifdef __linux__
+	//Changes on these are made by other machines or in user space and cause no (complete) events
+	bool is_remote_or_fuse(const struct statfs& sfs)
+	{
+		switch(static_cast<uint32_t>(sfs.f_type))
+		{
+		case 0x6969: //NFS
+		case 0x517B: //SMB
+		case 0xFF534D42: //CIFS
+		case 0xFE534D42: //SMB2
+		case 0x65735546: //FUSE
+		case 0x00C36400: //Ceph
+		case 0x5346414F: //AFS
+		case 0x01021997: //9P
+			return true;
+		default:
+			return false;
+		}
+	}
+#endif
+
+	std::string parent_dir(const std::string& dir)
+	{
+		size_t pos=dir.find_last_of('/');
+		if(pos==std::string::npos
+			|| pos==0)
+		{
+			return "/";
+		}
+		return dir.substr(0, pos);
+	}
+}
+
+LinuxDirectoryWatcherThread::LinuxDirectoryWatcherThread(const std::vector<std::string> &watchdirs)
+	: db(nullptr), q_add_dir(nullptr), q_remove_changed_dirs(nullptr), q_remove_changed_dir(nullptr),
+	do_stop(false), frozen(false), fan_fd(-1), in_fd(-1), mounts_fd(-1)
+{
+	for(size_t i=0;i<watchdirs.size();++i)
+	{
+		watching.push_back(SWatchRoot(watchdirs[i]));
+		watching.back().prefix=with_trailing_sep(watchdirs[i]);
+	}
+}
+
+bool LinuxDirectoryWatcherThread::is_enabled(void)
+{
+#ifdef __linux__
+	return Server->getServerParameter("linux_change_tracking")=="true";
+#else
+	return false;
+#endif
+}
+
+void LinuxDirectoryWatcherThread::operator()(void)
+{
+#ifdef __linux__
+	db=Server->getDatabase(Server->getThreadID(), URBACKUPDB_CLIENT);
+
+	q_add_dir=db->Prepare("INSERT INTO mdirs (name) SELECT ? AS name WHERE NOT EXISTS (SELECT * FROM mdirs WHERE name=?)");
+	q_remove_changed_dirs = db->Prepare("DELETE FROM mdirs WHERE name GLOB ?");
+	q_remove_changed_dir = db->Prepare("DELETE FROM mdirs WHERE name=?");
+
+#ifdef FAN_REPORT_DFID_NAME
+	fan_fd=fanotify_init(FAN_CLASS_NOTIF | FAN_REPORT_DFID_NAME | FAN_UNLIMITED_QUEUE | FAN_NONBLOCK | FAN_CLOEXEC,
+		O_RDONLY | O_LARGEFILE);
+	if(fan_fd==-1)
+	{
+		Server->Log("Cannot use fanotify to track changed directories (errno "+convert(errno)+"). Using inotify.", LL_INFO);
+	}
+#endif
+
+	mounts_fd=open("/proc/self/mounts", O_RDONLY | O_CLOEXEC);
+	readMounts();
+
+	for(size_t i=0;i<watching.size();++i)
+	{
+		watchRoot(watching[i]);
+	}
+
+	flushPending();
+
+	while(do_stop==false)
+	{
+		pollfd fds[3];
+		nfds_t nfds=0;
+		if(fan_fd!=-1)
+		{
+			fds[nfds].fd=fan_fd;
+			fds[nfds].events=POLLIN;
+			++nfds;
+		}
+		if(in_fd!=-1)
+		{
+			fds[nfds].fd=in_fd;
+			fds[nfds].events=POLLIN;
+			++nfds;
+		}
+		if(mounts_fd!=-1)
+		{
+			//Changes to the mount table are signaled via POLLPRI/POLLERR
+			fds[nfds].fd=mounts_fd;
+			fds[nfds].events=POLLPRI;
+			++nfds;
+		}
+
+		int rc=poll(fds, nfds, poll_timeout);
+
+		if(rc>0)
+		{
+			for(nfds_t i=0;i<nfds;++i)
+			{
+				if(fds[i].revents==0)
+					continue;
+
+				if(fds[i].fd==fan_fd)
+				{
+					readFanotifyEvents();
+				}
+				else if(fds[i].fd==in_fd)
+				{
+					readInotifyEvents();
+				}
+				else if(fds[i].fd==mounts_fd)
+				{
+					readMounts();
+				}
+			}
+		}
+
+		if(!frozen)
+		{
+			flushPending();
+		}
+
+		std::string msg;
+		while(!do_stop && pipe->Read(&msg, 0)>0)
+		{
+			handleMessage(msg);
+		}
+	}
+
+	if(fan_fd!=-1)
+	{
+		close(fan_fd);
+	}
+	for(std::map<std::pair<int, int>, int>::iterator it=fan_mount_fds.begin();it!=fan_mount_fds.end();++it)
+	{
+		close(it->second);
+	}
+	if(in_fd!=-1)
+	{
+		close(in_fd);
+	}
+	if(mounts_fd!=-1)
+	{
+		close(mounts_fd);
+	}
+
+	db->destroyAllQueries();
+#endif
+}
+
+void LinuxDirectoryWatcherThread::handleMessage(const std::string& msg)
+{
+	if(msg.empty())
+	{
+		return;
+	}
+
+	if(msg[0]=='A')
+	{
+		std::string dir=msg.substr(1);
+		bool w=false;
+		for(size_t i=0;i<watching.size();++i)
+		{
+			if(watching[i].path==dir)
+			{
+				w=true;
+				break;
+			}
+		}
+		if(w==false && !dir.empty())
+		{
+			watching.push_back(SWatchRoot(dir));
+			watching.back().prefix=with_trailing_sep(dir);
+			watchRoot(watching.back());
+		}
+	}
+	else if(msg[0]=='D')
+	{
+		std::string dir=msg.substr(1);
+		for(size_t i=0;i<watching.size();++i)
+		{
+			if(watching[i].path==dir)
+			{
+				watching.erase(watching.begin()+i);
+				break;
+			}
+		}
+	}
+	else if(msg[0]=='K')
+	{
+		//Events which were generated before the call are in the kernel queues
+		if(fan_fd!=-1)
+		{
+			readFanotifyEvents();
+		}
+		if(in_fd!=-1)
+		{
+			readInotifyEvents();
+		}
+		flushPending();
+		frozen=true;
+
+		IScopedLock lock(update_mutex);
+		update_cond->notify_all();
+	}
+	else if(msg[0]=='H')
+	{
+		frozen=false;
+		flushPending();
+
+		IScopedLock lock(update_mutex);
+		update_cond->notify_all();
+	}
+	else if(msg[0]=='R')
+	{
+		std::string path=msg.substr(1);
+		if(path.compare(0, gap_prefix.size(), gap_prefix)==0)
+		{
+			//Gaps of other paths belong to other backups
+			q_remove_changed_dir->Bind(path);
+			q_remove_changed_dir->Write();
+			q_remove_changed_dir->Reset();
+		}
+		else
+		{
+			std::string sep=path.empty() ? "" : "/";
+			q_remove_changed_dirs->Bind(ClientDAO::escapeGlob(path)+sep+"*");
+			q_remove_changed_dirs->Write();
+			q_remove_changed_dirs->Reset();
+		}
+		lastentries.clear();
+
+		//Paths which are not watched need a full rescan every time
+		for(size_t i=0;i<watching.size();++i)
+		{
+			if(!watching[i].active)
+			{
+				onGap(watching[i]);
+			}
+		}
+
+		if(!frozen)
+		{
+			flushPending();
+		}
+
+		IScopedLock lock(update_mutex);
+		update_cond->notify_all();
+	}
+}
+
+void LinuxDirectoryWatcherThread::watchRoot(SWatchRoot& root)
+{
+#ifdef __linux__
+	root.active=false;
+	root.use_inotify=false;
+
+	bool local=hasLocalFilesystems(root);
+
+	if(local && fan_fd!=-1)
+	{
+		root.active=markFilesystems(root);
+	}
+
+	if(local && !root.active)
+	{
+		if(in_fd==-1)
+		{
+			in_fd=inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+			if(in_fd==-1)
+			{
+				Server->Log("Error initializing inotify. Errno: "+convert(errno), LL_WARNING);
+			}
+		}
+
+		if(in_fd!=-1)
+		{
+			root.use_inotify=true;
+			root.active=addInotifyWatches(root.path, false);
+		}
+	}
+
+	if(root.active)
+	{
+		Server->Log("Tracking changes in \""+root.path+"\" via "+(root.use_inotify ? "inotify" : "fanotify"), LL_DEBUG);
+	}
+	else
+	{
+		Server->Log("Cannot track changes in \""+root.path+"\". Incremental backups will scan all directories in this path.", LL_WARNING);
+	}
+
+	//Everything might have changed since the last time this was watched
+	onGap(root);
+#endif
+}
+
+std::vector<std::string> LinuxDirectoryWatcherThread::getRootFilesystems(const SWatchRoot& root)
+{
+	std::vector<std::string> ret;
+	ret.push_back(root.path);
+	for(std::set<std::string>::iterator it=mounts.begin();it!=mounts.end();++it)
+	{
+		if(*it!=root.path
+			&& is_below(*it, root.prefix))
+		{
+			ret.push_back(*it);
+		}
+	}
+	return ret;
+}
+
+bool LinuxDirectoryWatcherThread::hasLocalFilesystems(const SWatchRoot& root)
+{
+#ifdef __linux__
+	std::vector<std::string> paths=getRootFilesystems(root);
+
+	for(size_t i=0;i<paths.size();++i)
+	{
+		struct statfs sfs;
+		if(statfs(paths[i].c_str(), &sfs)==0
+			&& is_remote_or_fuse(sfs))
+		{
+			Server->Log("""+paths[i]+"" is on a network or FUSE file system. Not tracking changes in ""+root.path+"".", LL_INFO);
+			return false;
+		}
+	}
+
+	return true;
+#else
+	return false;
+#endif
+}
+
+bool LinuxDirectoryWatcherThread::markFilesystems(SWatchRoot& root)
+{
+#if defined(__linux__) && defined(FAN_REPORT_DFID_NAME)
+	//Marks cover one file system, so file systems mounted below the path need their own
+	std::vector<std::string> mark_paths=getRootFilesystems(root);
+
+	for(size_t i=0;i<mark_paths.size();++i)
+	{
+		struct statfs sfs;
+		if(statfs(mark_paths[i].c_str(), &sfs)!=0)
+		{
+			Server->Log("Error getting file system of \""+mark_paths[i]+"\". Errno: "+convert(errno), LL_INFO);
+			return false;
+		}
+
+		if(fanotify_mark(fan_fd, FAN_MARK_ADD | FAN_MARK_FILESYSTEM, fanotify_mask, AT_FDCWD, mark_paths[i].c_str())!=0)
+		{
+			Server->Log("Cannot add fanotify mark for \""+mark_paths[i]+"\". Errno: "+convert(errno), LL_INFO);
+			return false;
+		}
+
+		int fsid[2];
+		memcpy(fsid, &sfs.f_fsid, sizeof(fsid));
+		std::pair<int, int> fsid_key(fsid[0], fsid[1]);
+
+		if(fan_mount_fds.find(fsid_key)==fan_mount_fds.end())
+		{
+			int mount_fd=open(mark_paths[i].c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+			if(mount_fd==-1)
+			{
+				Server->Log("Error opening \""+mark_paths[i]+"\". Errno: "+convert(errno), LL_WARNING);
+				return false;
+			}
+			fan_mount_fds[fsid_key]=mount_fd;
+		}
+	}
+
+	return true;
+#else
+	return false;
+#endif
+}
+
+bool LinuxDirectoryWatcherThread::addInotifyWatches(const std::string& dir, bool mark_changed)
+{
+#ifdef __linux__
+	std::vector<std::string> todo;
+	todo.push_back(dir);
+
+	while(!todo.empty())
+	{
+		std::string curr=todo.back();
+		todo.pop_back();
+
+		int wd=inotify_add_watch(in_fd, curr.c_str(), inotify_mask);
+		if(wd==-1)
+		{
+			if(errno==ENOSPC || errno==ENOMEM)
+			{
+				Server->Log("Reached the maximum number of inotify watches while watching \""+curr+"\". "
+					"Increase fs.inotify.max_user_watches to track changes in this path.", LL_WARNING);
+				return false;
+			}
+			//Directory was removed or replaced in the meantime. Its parent has an event for that.
+			continue;
+		}
+
+		std::map<int, std::string>::iterator it_wd=in_wd_paths.find(wd);
+		if(it_wd!=in_wd_paths.end()
+			&& it_wd->second!=curr)
+		{
+			in_path_wds.erase(it_wd->second);
+		}
+		in_wd_paths[wd]=curr;
+		in_path_wds[curr]=wd;
+
+		if(mark_changed)
+		{
+			onRealDirMod(curr);
+		}
+
+		DIR* dp=opendir(curr.c_str());
+		if(dp==nullptr)
+		{
+			continue;
+		}
+
+		dirent* de;
+		while((de=readdir(dp))!=nullptr)
+		{
+			if(strcmp(de->d_name, ".")==0
+				|| strcmp(de->d_name, "..")==0)
+				continue;
+
+			std::string child=join_path(curr, de->d_name);
+			bool isdir=de->d_type==DT_DIR;
+			if(de->d_type==DT_UNKNOWN)
+			{
+				struct stat64 st;
+				isdir=lstat64(child.c_str(), &st)==0 && S_ISDIR(st.st_mode);
+			}
+
+			if(isdir)
+			{
+				todo.push_back(child);
+			}
+		}
+		closedir(dp);
+	}
+
+	return true;
+#else
+	return false;
+#endif
+}
+
+void LinuxDirectoryWatcherThread::markSubtreeChanged(const std::string& dir)
+{
+#ifdef __linux__
+	std::vector<std::string> todo;
+	todo.push_back(dir);
+
+	while(!todo.empty())
+	{
+		std::string curr=todo.back();
+		todo.pop_back();
+
+		onRealDirMod(curr);
+
+		DIR* dp=opendir(curr.c_str());
+		if(dp==nullptr)
+		{
+			continue;
+		}
+
+		dirent* de;
+		while((de=readdir(dp))!=nullptr)
+		{
+			if(strcmp(de->d_name, ".")==0
+				|| strcmp(de->d_name, "..")==0)
+				continue;
+
+			std::string child=join_path(curr, de->d_name);
+			bool isdir=de->d_type==DT_DIR;
+			if(de->d_type==DT_UNKNOWN)
+			{
+				struct stat64 st;
+				isdir=lstat64(child.c_str(), &st)==0 && S_ISDIR(st.st_mode);
+			}
+
+			if(isdir)
+			{
+				todo.push_back(child);
+			}
+		}
+		closedir(dp);
+	}
+#endif
+}
+
+void LinuxDirectoryWatcherThread::readInotifyEvents(void)
+{
+#ifdef __linux__
+	char buf[64*1024] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+
+	while(true)
+	{
+		ssize_t len=read(in_fd, buf, sizeof(buf));
+		if(len<=0)
+		{
+			break;
+		}
+
+		for(char* ptr=buf;ptr<buf+len;)
+		{
+			const inotify_event* ev=reinterpret_cast<const inotify_event*>(ptr);
+			ptr+=sizeof(inotify_event)+ev->len;
+
+			if(ev->mask & IN_Q_OVERFLOW)
+			{
+				Server->Log("inotify event queue overflowed", LL_WARNING);
+				for(size_t i=0;i<watching.size();++i)
+				{
+					if(watching[i].use_inotify)
+					{
+						onGap(watching[i]);
+					}
+				}
+				continue;
+			}
+
+			std::map<int, std::string>::iterator it_wd=in_wd_paths.find(ev->wd);
+			if(it_wd==in_wd_paths.end())
+			{
+				continue;
+			}
+
+			if(ev->mask & IN_IGNORED)
+			{
+				std::map<std::string, int>::iterator it_path=in_path_wds.find(it_wd->second);
+				if(it_path!=in_path_wds.end()
+					&& it_path->second==ev->wd)
+				{
+					in_path_wds.erase(it_path);
+				}
+				in_wd_paths.erase(it_wd);
+				continue;
+			}
+
+			std::string dir=it_wd->second;
+			onRealDirMod(dir);
+
+			//The modification time of the directory, which is listed in its parent, changed
+			if(ev->len==0
+				|| (ev->mask & (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO)) )
+			{
+				onRealDirMod(parent_dir(dir));
+			}
+
+			if(ev->len==0
+				|| !(ev->mask & IN_ISDIR))
+			{
+				continue;
+			}
+
+			std::string child=join_path(dir, ev->name);
+
+			if(ev->mask & IN_CREATE)
+			{
+				//Entries may have been created before the watch was added
+				addInotifyWatches(child, true);
+			}
+			else if(ev->mask & IN_MOVED_FROM)
+			{
+				in_moved_from[ev->cookie]=child;
+			}
+			else if(ev->mask & IN_MOVED_TO)
+			{
+				std::map<unsigned int, std::string>::iterator it_from=in_moved_from.find(ev->cookie);
+				if(it_from!=in_moved_from.end())
+				{
+					//The watches stay on the moved directories. Only their paths change.
+					std::string from_prefix=with_trailing_sep(it_from->second);
+					for(std::map<std::string, int>::iterator it=in_path_wds.lower_bound(from_prefix);
+						it!=in_path_wds.end() && it->first.compare(0, from_prefix.size(), from_prefix)==0;)
+					{
+						in_path_wds.erase(it++);
+					}
+					in_path_wds.erase(it_from->second);
+					in_moved_from.erase(it_from);
+				}
+				addInotifyWatches(child, true);
+			}
+		}
+
+		//Directories moved out of the watched trees
+		for(std::map<unsigned int, std::string>::iterator it_from=in_moved_from.begin();it_from!=in_moved_from.end();++it_from)
+		{
+			std::map<std::string, int>::iterator it=in_path_wds.find(it_from->second);
+			if(it!=in_path_wds.end())
+			{
+				inotify_rm_watch(in_fd, it->second);
+				in_path_wds.erase(it);
+			}
+
+			std::string from_prefix=with_trailing_sep(it_from->second);
+			for(it=in_path_wds.lower_bound(from_prefix);
+				it!=in_path_wds.end() && it->first.compare(0, from_prefix.size(), from_prefix)==0;)
+			{
+				inotify_rm_watch(in_fd, it->second);
+				in_path_wds.erase(it++);
+			}
+		}
+		in_moved_from.clear();
+	}
+#endif
+}
+
+void LinuxDirectoryWatcherThread::readFanotifyEvents(void)
+{
+#if defined(__linux__) && defined(FAN_REPORT_DFID_NAME)
+	char buf[64*1024] __attribute__ ((aligned(__alignof__(struct fanotify_event_metadata))));
+
+	fan_handle_cache.clear();
+
+	while(true)
+	{
+		ssize_t len=read(fan_fd, buf, sizeof(buf));
+		if(len<=0)
+		{
+			break;
+		}
+
+		const fanotify_event_metadata* meta=reinterpret_cast<const fanotify_event_metadata*>(buf);
+		for(;FAN_EVENT_OK(meta, len);meta=FAN_EVENT_NEXT(meta, len))
+		{
+			if(meta->vers!=FANOTIFY_METADATA_VERSION)
+			{
+				Server->Log("Unexpected fanotify metadata version "+convert(static_cast<int>(meta->vers)), LL_ERROR);
+				for(size_t i=0;i<watching.size();++i)
+				{
+					if(!watching[i].use_inotify)
+					{
+						watching[i].active=false;
+						onGap(watching[i]);
+					}
+				}
+				close(fan_fd);
+				fan_fd=-1;
+				return;
+			}
+
+			if(meta->mask & FAN_Q_OVERFLOW)
+			{
+				Server->Log("fanotify event queue overflowed", LL_WARNING);
+				for(size_t i=0;i<watching.size();++i)
+				{
+					if(!watching[i].use_inotify)
+					{
+						onGap(watching[i]);
+					}
+				}
+				continue;
+			}
+
+			const fanotify_event_info_fid* fid=reinterpret_cast<const fanotify_event_info_fid*>(meta+1);
+			if(meta->event_len<sizeof(fanotify_event_metadata)+sizeof(fanotify_event_info_fid)
+				|| (fid->hdr.info_type!=FAN_EVENT_INFO_TYPE_DFID_NAME
+					&& fid->hdr.info_type!=FAN_EVENT_INFO_TYPE_DFID) )
+			{
+				continue;
+			}
+
+			file_handle* fh=reinterpret_cast<file_handle*>(const_cast<unsigned char*>(fid->handle));
+			const char* name=".";
+			if(fid->hdr.info_type==FAN_EVENT_INFO_TYPE_DFID_NAME)
+			{
+				name=reinterpret_cast<const char*>(fh->f_handle+fh->handle_bytes);
+			}
+
+			int fsid[2];
+			memcpy(fsid, &fid->fsid, sizeof(fsid));
+
+			std::string dir;
+			if(!resolveHandle(fsid, fh, dir))
+			{
+				continue;
+			}
+
+			onRealDirMod(dir);
+
+			//The directory itself changed or its modification time, which is listed in its parent
+			if(strcmp(name, ".")==0
+				|| (meta->mask & (FAN_CREATE | FAN_DELETE | FAN_MOVED_FROM | FAN_MOVED_TO)) )
+			{
+				onRealDirMod(parent_dir(dir));
+			}
+
+			if(meta->mask & FAN_ONDIR)
+			{
+				if(meta->mask & (FAN_MOVED_FROM | FAN_MOVED_TO | FAN_DELETE))
+				{
+					//Paths of cached handles below the directory changed
+					fan_handle_cache.clear();
+				}
+
+				if((meta->mask & (FAN_CREATE | FAN_MOVED_TO))
+					&& strcmp(name, ".")!=0)
+				{
+					//Cached directory lists of the old paths of a moved directory tree are stale
+					markSubtreeChanged(join_path(dir, name));
+				}
+			}
+		}
+	}
+#endif
+}
+
+bool LinuxDirectoryWatcherThread::resolveHandle(const int fsid[2], void* fh, std::string& path)
+{
+#if defined(__linux__) && defined(FAN_REPORT_DFID_NAME)
+	file_handle* handle=reinterpret_cast<file_handle*>(fh);
+
+	std::string key(reinterpret_cast<const char*>(fsid), sizeof(int)*2);
+	key.append(reinterpret_cast<const char*>(&handle->handle_type), sizeof(handle->handle_type));
+	key.append(reinterpret_cast<const char*>(handle->f_handle), handle->handle_bytes);
+
+	std::map<std::string, std::string>::iterator it_cache=fan_handle_cache.find(key);
+	if(it_cache!=fan_handle_cache.end())
+	{
+		path=it_cache->second;
+		return true;
+	}
+
+	std::pair<int, int> fsid_key(fsid[0], fsid[1]);
+	std::map<std::pair<int, int>, int>::iterator it_mount=fan_mount_fds.find(fsid_key);
+	int fd=-1;
+	if(it_mount!=fan_mount_fds.end())
+	{
+		fd=open_by_handle_at(it_mount->second, handle, O_PATH | O_CLOEXEC);
+	}
+	else
+	{
+		//Some file systems (e.g. btrfs subvolumes) report a different fsid than statfs of the marked path.
+		//Any file descriptor on the same file system works.
+		for(it_mount=fan_mount_fds.begin();it_mount!=fan_mount_fds.end() && fd==-1;++it_mount)
+		{
+			fd=open_by_handle_at(it_mount->second, handle, O_PATH | O_CLOEXEC);
+			if(fd!=-1)
+			{
+				fan_mount_fds[fsid_key]=dup(it_mount->second);
+			}
+		}
+	}
+
+	if(fd==-1)
+	{
+		if(errno!=ESTALE)
+		{
+			Server->Log("Error opening directory by handle. Errno: "+convert(errno), LL_WARNING);
+			for(size_t i=0;i<watching.size();++i)
+			{
+				if(!watching[i].use_inotify)
+				{
+					onGap(watching[i]);
+				}
+			}
+		}
+		return false;
+	}
+
+	char fd_path[64];
+	snprintf(fd_path, sizeof(fd_path), "/proc/self/fd/%d", fd);
+	char target[PATH_MAX];
+	ssize_t rc=readlink(fd_path, target, sizeof(target)-1);
+	close(fd);
+
+	if(rc<=0)
+	{
+		return false;
+	}
+
+	path.assign(target, rc);
+
+	const std::string deleted_suffix=" (deleted)";
+	if(path[0]!='/'
+		|| (path.size()>deleted_suffix.size()
+			&& path.compare(path.size()-deleted_suffix.size(), deleted_suffix.size(), deleted_suffix)==0) )
+	{
+		//Directory is not reachable from our root or deleted
+		return false;
+	}
+
+	if(fan_handle_cache.size()>=max_handle_cache)
+	{
+		fan_handle_cache.clear();
+	}
+	fan_handle_cache[key]=path;
+
+	return true;
+#else
+	return false;
+#endif
+}
+
+void LinuxDirectoryWatcherThread::readMounts(void)
+{
+#ifdef __linux__
+	std::set<std::string> new_mounts;
+
+	FILE* mf=setmntent("/proc/self/mounts", "r");
+	if(mf!=nullptr)
+	{
+		mntent* ent;
+		while((ent=getmntent(mf))!=nullptr)
+		{
+			new_mounts.insert(ent->mnt_dir);
+		}
+		endmntent(mf);
+	}
+
+	if(mounts_fd!=-1
+		&& !mounts.empty())
+	{
+		std::vector<std::string> changed;
+		std::set_symmetric_difference(mounts.begin(), mounts.end(),
+			new_mounts.begin(), new_mounts.end(), std::back_inserter(changed));
+
+		mounts=new_mounts;
+
+		for(size_t i=0;i<watching.size();++i)
+		{
+			for(size_t j=0;j<changed.size();++j)
+			{
+				//Something got mounted below or above the watched path
+				if(is_below(changed[j], watching[i].prefix)
+					|| is_below(watching[i].path, with_trailing_sep(changed[j])))
+				{
+					Server->Log("Mount table change below \""+watching[i].path+"\". Watching it again.", LL_DEBUG);
+					watchRoot(watching[i]);
+					break;
+				}
+			}
+		}
+	}
+	else
+	{
+		mounts=new_mounts;
+	}
+#endif
+}
+
+void LinuxDirectoryWatcherThread::onRealDirMod(const std::string& dir)
+{
+	for(size_t i=0;i<watching.size();++i)
+	{
+		const SWatchRoot& root=watching[i];
+		if(!root.active
+			|| !is_below(dir, root.prefix))
+			continue;
+
+		//Same format as the directories in the file index
+		pending.insert(root.path+"/"+with_trailing_sep(dir).substr(root.prefix.size()));
+	}
+}
+
+void LinuxDirectoryWatcherThread::onGap(const SWatchRoot& root)
+{
+	pending.insert(gap_prefix+root.path+"/");
+}
+
+void LinuxDirectoryWatcherThread::flushPending(void)
+{
+	if(pending.empty())
+	{
+		return;
+	}
+
+	int64 currtime=Server->getTimeMS();
+
+	for(std::map<std::string, int64>::iterator it=lastentries.begin();it!=lastentries.end();)
+	{
+		if(currtime-it->second>max_change_ram_cache)
+		{
+			lastentries.erase(it++);
+		}
+		else
+		{
+			++it;
+		}
+	}
+
+	DBScopedWriteTransaction trans(db);
+
+	for(std::set<std::string>::iterator it=pending.begin();it!=pending.end();++it)
+	{
+		std::map<std::string, int64>::iterator it_last=lastentries.find(*it);
+		if(it_last!=lastentries.end())
+		{
+			it_last->second=currtime;
+			continue;
+		}
+
+		q_add_dir->Bind(*it);
+		q_add_dir->Bind(*it);
+		q_add_dir->Write();
+		q_add_dir->Reset();
+
+		lastentries[*it]=currtime;
+	}
+
+	pending.clear();
+}
+
+void LinuxDirectoryWatcherThread::init_mutex(void)
+{
+	pipe=Server->createMemoryPipe();
+	update_mutex=Server->createMutex();
+	update_cond=Server->createCondition();
+}
+
+IPipe *LinuxDirectoryWatcherThread::getPipe(void)
+{
+	return pipe;
+}
+
+void LinuxDirectoryWatcherThread::stop(void)
+{
+	do_stop=true;
+	pipe->Write("Q");
+}
+
+void LinuxDirectoryWatcherThread::freeze(void)
+{
+	IScopedLock lock(update_mutex);
+	pipe->Write("K");
+	update_cond->wait(&lock);
+}
+
+void LinuxDirectoryWatcherThread::unfreeze(void)
+{
+	IScopedLock lock(update_mutex);
+	pipe->Write("H");
+	update_cond->wait(&lock);
+}
+
+void LinuxDirectoryWatcherThread::reset_mdirs(const std::string& path)
+{
+	IScopedLock lock(update_mutex);
+	pipe->Write("R"+path);
+	update_cond->wait(&lock);
+}
@@ -0,0 +1,106 @@
+#pragma once
+
+#include "../Interface/Pipe.h"
+#include "../Interface/Query.h"
+#include "../Interface/Thread.h"
+#include "../Interface/Database.h"
+#include "../Interface/Mutex.h"
+#include "../Interface/Condition.h"
+#include "../Interface/Types.h"
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+/**
+* Tracks changed directories below the backup paths on Linux and records them
+* in the same mdirs table the Windows change journal watcher fills. Uses fanotify
+* file system marks (FAN_REPORT_DFID_NAME) if possible and recursive inotify
+* watches otherwise. Changes while the watcher does not run cannot be recovered,
+* so (re-)starting to watch a path records a gap for it, which causes a full
+* rescan of that path during the next incremental backup.
+*/
+class LinuxDirectoryWatcherThread : public IThread
+{
+public:
+	LinuxDirectoryWatcherThread(const std::vector<std::string> &watchdirs);
+	virtual ~LinuxDirectoryWatcherThread(void) {}
+
+	static void init_mutex(void);
+
+	static bool is_enabled(void);
+
+	void operator()(void);
+
+	static IPipe *getPipe(void);
+
+	void stop(void);
+
+	//Writes all pending changes to the database and keeps further changes in memory
+	static void freeze(void);
+	static void unfreeze(void);
+
+	static void reset_mdirs(const std::string& path);
+
+private:
+	struct SWatchRoot
+	{
+		SWatchRoot(const std::string& path)
+			: path(path), active(false), use_inotify(false)
+		{}
+
+		//Path as used by the indexer
+		std::string path;
+		//Path with exactly one trailing separator
+		std::string prefix;
+		bool active;
+		bool use_inotify;
+	};
+
+	void handleMessage(const std::string& msg);
+
+	void watchRoot(SWatchRoot& root);
+	std::vector<std::string> getRootFilesystems(const SWatchRoot& root);
+	bool hasLocalFilesystems(const SWatchRoot& root);
+	bool markFilesystems(SWatchRoot& root);
+	bool addInotifyWatches(const std::string& dir, bool mark_changed);
+	void markSubtreeChanged(const std::string& dir);
+
+	void readInotifyEvents(void);
+	void readFanotifyEvents(void);
+	bool resolveHandle(const int fsid[2], void* fh, std::string& path);
+	void readMounts(void);
+
+	void onRealDirMod(const std::string& dir);
+	void onGap(const SWatchRoot& root);
+	void flushPending(void);
+
+	static IPipe *pipe;
+	static IMutex *update_mutex;
+	static ICondition *update_cond;
+
+	IDatabase *db;
+	IQuery* q_add_dir;
+	IQuery *q_remove_changed_dirs;
+	IQuery *q_remove_changed_dir;
+
+	volatile bool do_stop;
+	bool frozen;
+
+	std::vector<SWatchRoot> watching;
+
+	std::set<std::string> pending;
+	std::map<std::string, int64> lastentries;
+
+	int fan_fd;
+	std::map<std::pair<int, int>, int> fan_mount_fds;
+	std::map<std::string, std::string> fan_handle_cache;
+
+	int in_fd;
+	std::map<int, std::string> in_wd_paths;
+	std::map<std::string, int> in_path_wds;
+	std::map<unsigned int, std::string> in_moved_from;
+
+	int mounts_fd;
+	std::set<std::string> mounts;
+};
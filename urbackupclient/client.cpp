@@ -25,8 +25,10 @@
 #ifdef _WIN32
 #include "DirectoryWatcherThread.h"
 #else
+#include "LinuxDirectoryWatcherThread.h"
 #include <errno.h>
 #endif
+#include "DirectoryPrefetcher.h"
 #include "../stringtools.h"
 #include "../common/data.h"
 #include "../md5.h"
@@ -575,6 +577,8 @@ IndexThread::IndexThread(void)
 	curr_result_id = 0;
 
 	dwt=nullptr;
+	ldwt=nullptr;
+	index_change_tracking=false;
 
 	if(Server->getPlugin(Server->getThreadID(), filesrv_pluginid))
 	{
@@ -605,6 +609,13 @@ IndexThread::~IndexThread()
 		Server->getThreadPool()->waitFor(dwt_ticket);
 		delete dwt;
 	}
+#else
+	if(ldwt!=nullptr)
+	{
+		ldwt->stop();
+		Server->getThreadPool()->waitFor(ldwt_ticket);
+		delete ldwt;
+	}
 #endif
 
 	((IFileServFactory*)(Server->getPlugin(Server->getThreadID(), filesrv_pluginid)))->destroyFileServ(filesrv);
@@ -661,6 +672,35 @@ void IndexThread::updateDirs(void)
 			dwt->getPipe()->Write(msg);
 		}
 	}
+#else
+	if(!LinuxDirectoryWatcherThread::is_enabled())
+	{
+		return;
+	}
+
+	std::vector<std::string> watching;
+	for(size_t i=0;i<backup_dirs.size();++i)
+	{
+		if (backup_dirs[i].facet != index_facet_id
+			|| backup_dirs[i].symlinked
+			|| isAllSpecialDir(backup_dirs[i]))
+			continue;
+
+		watching.push_back(backup_dirs[i].path);
+	}
+
+	if(ldwt==nullptr)
+	{
+		ldwt=new LinuxDirectoryWatcherThread(watching);
+		ldwt_ticket=Server->getThreadPool()->execute(ldwt, "directory watcher");
+	}
+	else
+	{
+		for(size_t i=0;i<watching.size();++i)
+		{
+			ldwt->getPipe()->Write("A"+watching[i]);
+		}
+	}
 #endif
 }
 
@@ -1585,6 +1625,52 @@ IndexThread::IndexErrorInfo IndexThread::indexDirs(bool full_backup, bool simult
 	}
 
 	_i64 last_filebackup_filetime_new = DirectoryWatcherThread::get_current_filetime();
+#else
+	changed_dirs.clear();
+	change_tracking_gaps.clear();
+
+	if(ldwt!=nullptr)
+	{
+		//Start watching paths which were added since the last backup
+		for(size_t i=0;i<backup_dirs.size();++i)
+		{
+			if(backup_dirs[i].facet == index_facet_id
+				&& backup_dirs[i].group == index_group
+				&& !backup_dirs[i].symlinked
+				&& !isAllSpecialDir(backup_dirs[i]))
+			{
+				ldwt->getPipe()->Write("A"+backup_dirs[i].path);
+			}
+		}
+
+		LinuxDirectoryWatcherThread::freeze();
+
+		//Paths which were not tracked continuously since the last backup
+		std::vector<std::string> gaps=cd->getChangedDirs("##-GAP-##", true);
+		for(size_t i=0;i<gaps.size();++i)
+		{
+			for(size_t j=0;j<selected_dirs.size();++j)
+			{
+				std::string sdir = selected_dirs[j].empty() ? os_file_sep() : selected_dirs[j];
+				if(gaps[i]=="##-GAP-##"+sdir+os_file_sep())
+				{
+					change_tracking_gaps.push_back(gaps[i].substr(9));
+					LinuxDirectoryWatcherThread::reset_mdirs(gaps[i]);
+					break;
+				}
+			}
+		}
+
+		for(size_t i=0;i<selected_dirs.size();++i)
+		{
+			std::string sdir = selected_dirs[i].empty() ? os_file_sep() : selected_dirs[i];
+			std::vector<std::string> acd=cd->getChangedDirs(sdir, true);
+			changed_dirs.insert(changed_dirs.end(), acd.begin(), acd.end() );
+			LinuxDirectoryWatcherThread::reset_mdirs(sdir);
+		}
+
+		LinuxDirectoryWatcherThread::unfreeze();
+	}
 #endif
 
 	bool has_stale_shadowcopy=false;
@@ -1862,6 +1948,14 @@ IndexThread::IndexErrorInfo IndexThread::indexDirs(bool full_backup, bool simult
 				index_root_path = mod_path;
 				index_keep_files = (backup_dirs[i].flags & EBackupDirFlag_KeepFiles) > 0
 					&& !backup_dirs[i].reset_keep;
+#ifndef _WIN32
+				//Directories reached via symlinks are not watched
+				index_change_tracking = ldwt != nullptr
+					&& with_proper_symlinks
+					&& !backup_dirs[i].symlinked
+					&& std::find(change_tracking_gaps.begin(), change_tracking_gaps.end(),
+						backup_dirs[i].path + os_file_sep()) == change_tracking_gaps.end();
+#endif
 
 				std::string vssvolume = mod_path;
 				normalizeVolume(vssvolume);
@@ -1885,12 +1979,21 @@ IndexThread::IndexErrorInfo IndexThread::indexDirs(bool full_backup, bool simult
 							"\". Not using this pattern while indexing this path", LL_DEBUG);
 					}
 					
+					size_t prefetch_threads = DirectoryPrefetcher::configuredThreads();
+					if (prefetch_threads > 0)
+					{
+						dir_prefetcher.reset(new DirectoryPrefetcher(prefetch_threads,
+							(backup_dirs[i].flags & EBackupDirFlag_OneFilesystem) > 0));
+					}
+
 					std::vector<SRecurParams> params_stack;
 					initialCheck(params_stack, std::string::npos,
 						strlower(volume), vssvolume, backup_dirs[i].path, mod_path, backup_dirs[i].tname, outfile, true,
 						backup_dirs[i].flags, !full_backup, backup_dirs[i].symlinked, 0, true, true,
 						index_exclude_dirs, index_include_dirs, std::string());
 
+					dir_prefetcher.reset();
+
 					index_exclude_dirs.insert(index_exclude_dirs.end(), rm_exclude_dirs.begin(), rm_exclude_dirs.end());
 				}
 
@@ -2019,6 +2122,27 @@ IndexThread::IndexErrorInfo IndexThread::indexDirs(bool full_backup, bool simult
 	open_files.clear();
 	changed_dirs.clear();
 	
+#else
+	if(ldwt!=nullptr)
+	{
+		if(has_stale_shadowcopy)
+		{
+			VSSLog("Did not delete backup of changed dirs because a stale snapshot was used.", LL_INFO);
+		}
+		else if(!index_error)
+		{
+			VSSLog("Deleting backup of changed dirs...", LL_DEBUG);
+			cd->deleteSavedChangedDirs();
+		}
+		else
+		{
+			VSSLog("Did not delete backup of changed dirs because there was an error while indexing which might not occur the next time.", LL_INFO);
+		}
+	}
+
+	changed_dirs.clear();
+	change_tracking_gaps.clear();
+	index_change_tracking=false;
 #endif
 
 	IndexErrorInfo ret = IndexErrorInfo_Ok;
@@ -2381,6 +2505,11 @@ void IndexThread::resetFileEntries(void)
 	cd->resetAllHardlinks();
 #ifdef _WIN32
 	DirectoryWatcherThread::reset_mdirs(std::string());
+#else
+	if(ldwt!=nullptr)
+	{
+		LinuxDirectoryWatcherThread::reset_mdirs(std::string());
+	}
 #endif
 }
 
@@ -2682,6 +2811,8 @@ bool IndexThread::initialCheck(std::vector<SRecurParams>& params_stack, size_t s
 		stack_idx = params_stack.size() - 1;
 	}
 
+	size_t first_pushed_idx = params_stack.size();
+
 	for(size_t i=files.size();dir_recurse && i-->0;)
 	{
 		if( files[i].isdir )
@@ -2737,6 +2868,11 @@ bool IndexThread::initialCheck(std::vector<SRecurParams>& params_stack, size_t s
 		}
 	}
 
+	if (dir_prefetcher.get() != nullptr)
+	{
+		prefetchDirs(params_stack, first_pushed_idx, use_db);
+	}
+
 	if (first)
 	{
 		while (!params_stack.empty())
@@ -2843,6 +2979,38 @@ void IndexThread::initialCheckRecur1(std::vector<SRecurParams>& params_stack, SR
 	}
 }
 
+void IndexThread::prefetchDirs(const std::vector<SRecurParams>& params_stack, size_t start_idx, bool use_db)
+{
+	std::vector<std::string> paths;
+	for (size_t i = start_idx; i < params_stack.size(); ++i)
+	{
+		const SRecurParams& params = params_stack[i];
+
+		if (params.file.issym && with_proper_symlinks)
+		{
+			continue;
+		}
+
+		//Directories getFilesProxy() reads from the database don't need listing
+#ifdef _WIN32
+		std::string path_lower = strlower(params.orig_dir + os_file_sep() + params.file.name + os_file_sep());
+		bool dir_changed = std::binary_search(changed_dirs.begin(), changed_dirs.end(), path_lower);
+#else
+		std::string path_lower = params.orig_dir + os_file_sep() + params.file.name + os_file_sep();
+		bool dir_changed = !index_change_tracking
+			|| std::binary_search(changed_dirs.begin(), changed_dirs.end(), path_lower);
+#endif
+		if (use_db && !dir_changed)
+		{
+			continue;
+		}
+
+		paths.push_back(os_file_prefix(params.dir + os_file_sep() + params.file.name));
+	}
+
+	dir_prefetcher->prefetch(paths);
+}
+
 void IndexThread::initialCheckRecur2(std::vector<SRecurParams>& params_stack, SRecurParams& params, const size_t stack_idx,
 	const std::string & volume, const std::string & vssvolume,
 	std::fstream & outfile, const int flags, const bool use_db, const bool dir_recurse, const bool include_exclude_dirs,
@@ -3237,10 +3405,41 @@ std::vector<SFileAndHash> IndexThread::getFilesProxy(const std::string &orig_pat
 		use_db=false;
 	}
 #else
-	use_db=false;
-	bool dir_changed=true;
+	bool dir_changed=!index_change_tracking
+		|| std::binary_search(changed_dirs.begin(), changed_dirs.end(), path_lower);
+
+	if(path_lower==Server->getServerWorkingDir()+os_file_sep()+"urbackup"+os_file_sep())
+	{
+		use_db=false;
+	}
 #endif
 	std::vector<SFileAndHash> fs_files;
+#ifndef _WIN32
+	if (use_db && !dir_changed)
+	{
+		if( cd->getFiles(path_lower, get_db_tgroup(), fs_files, target_generation) )
+		{
+			++index_c_db;
+
+			handleSymlinks(orig_path, named_path, exclude_dirs, include_dirs, fs_files);
+
+			if(calculate_filehashes_on_client)
+			{
+				if(addMissingHashes(&fs_files, nullptr, orig_path, path, named_path,
+					exclude_dirs, include_dirs, phash_queue==nullptr))
+				{
+					++index_c_db_update;
+					modifyFilesInt(path_lower, get_db_tgroup(), fs_files, target_generation);
+					++target_generation;
+				}
+			}
+
+			return fs_files;
+		}
+
+		dir_changed = true;
+	}
+#endif
 	if (!use_db || dir_changed)
 	{
 		++index_c_fs;
@@ -3248,7 +3447,8 @@ std::vector<SFileAndHash> IndexThread::getFilesProxy(const std::string &orig_pat
 		std::string tpath = os_file_prefix(path);
 
 		bool has_error;
-		std::vector<SFile> os_files = getFilesWin(tpath, &has_error, true, true, (index_flags & EBackupDirFlag_OneFilesystem) > 0);
+		std::vector<SFile> os_files = dir_prefetcher.get() != nullptr ? dir_prefetcher->getFiles(tpath, &has_error)
+			: getFilesWin(tpath, &has_error, true, true, (index_flags & EBackupDirFlag_OneFilesystem) > 0);
 		filterEncryptedFiles(path, orig_path, os_files);
 		fs_files = convertToFileAndHash(orig_path, named_path, exclude_dirs, include_dirs, os_files, fn_filter);
 
@@ -3292,7 +3492,8 @@ std::vector<SFileAndHash> IndexThread::getFilesProxy(const std::string &orig_pat
 		if (use_db_hashes)
 		{
 #ifndef _WIN32
-			if (calculate_filehashes_on_client)
+			if (calculate_filehashes_on_client
+				|| index_change_tracking)
 			{
 #endif
 				has_files = cd->getFiles(path_lower, get_db_tgroup(), db_files, target_generation);
@@ -3369,8 +3570,10 @@ std::vector<SFileAndHash> IndexThread::getFilesProxy(const std::string &orig_pat
 		else
 		{
 #ifndef _WIN32
-			if(calculate_filehashes_on_client
-				&& (hasHash(fs_files) || hasDirectory(fs_files) ) )
+			//Directory lists of unchanged directories are read from the database with change tracking
+			if(index_change_tracking
+				|| (calculate_filehashes_on_client
+					&& (hasHash(fs_files) || hasDirectory(fs_files) ) ) )
 			{
 #endif
 				addFilesInt(path_lower, get_db_tgroup(), fs_files);
@@ -3410,7 +3613,8 @@ std::vector<SFileAndHash> IndexThread::getFilesProxy(const std::string &orig_pat
 			std::string tpath=os_file_prefix(path);
 
 			bool has_error;
-			std::vector<SFile> os_files = getFilesWin(tpath, &has_error, true, true, (index_flags & EBackupDirFlag_OneFilesystem) > 0);
+			std::vector<SFile> os_files = dir_prefetcher.get() != nullptr ? dir_prefetcher->getFiles(tpath, &has_error)
+				: getFilesWin(tpath, &has_error, true, true, (index_flags & EBackupDirFlag_OneFilesystem) > 0);
 			filterEncryptedFiles(path, orig_path, os_files);
 			fs_files=convertToFileAndHash(orig_path, named_path, exclude_dirs, include_dirs, os_files, fn_filter);
 			if(has_error)
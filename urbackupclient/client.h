@@ -72,6 +72,8 @@ const uint64 change_indicator_special_bit = 0x2000000000000000ULL;
 const uint64 change_indicator_all_bits = change_indicator_symlink_bit | change_indicator_special_bit;
 
 class DirectoryWatcherThread;
+class LinuxDirectoryWatcherThread;
+class DirectoryPrefetcher;
 
 class IdleCheckerThread : public IThread
 {
@@ -699,6 +701,11 @@ private:
 	DirectoryWatcherThread *dwt;
 	THREADPOOL_TICKET dwt_ticket;
 
+	LinuxDirectoryWatcherThread *ldwt;
+	THREADPOOL_TICKET ldwt_ticket;
+	bool index_change_tracking;
+	std::vector<std::string> change_tracking_gaps;
+
 	std::map<SCDirServerKey, std::map<std::string, SCDirs*> > scdirs;
 	std::vector<SCRef*> sc_refs;
 
@@ -880,6 +887,10 @@ private:
 		const std::vector<std::string>& exclude_dirs,
 		const std::vector<SIndexInclude>& include_dirs, const std::string& orig_path);
 
+	void prefetchDirs(const std::vector<SRecurParams>& params_stack, size_t start_idx, bool use_db);
+
+	std::unique_ptr<DirectoryPrefetcher> dir_prefetcher;
+
 	std::unique_ptr<SLastFileList> last_filelist;
 
 	std::vector<SReadError> read_errors;
@@ -19,6 +19,7 @@
 #include "clientdao.h"
 #include "../stringtools.h"
 #include "../Interface/Server.h"
+#include "../Interface/DatabaseCursor.h"
 #include <memory.h>
 
 const int ClientDAO::c_is_group = 0;
@@ -176,21 +177,23 @@ bool ClientDAO::getFiles(std::string path, int tgroup, std::vector<SFileAndHash>
 {
 	q_get_files->Bind(path);
 	q_get_files->Bind(tgroup);
-	db_results res=q_get_files->Read();
-	q_get_files->Reset();
-	if(res.size()==0)
+	IDatabaseCursor* cur=q_get_files->Cursor();
+	if(!cur->nextRow())
+	{
+		cur->shutdown();
+		q_get_files->Reset();
 		return false;
+	}
 
-	generation = watoi64(res[0]["generation"]);
-
-	std::string &qdata=res[0]["data"];
+	generation = cur->getInt64(2);
 
-	if(qdata.empty())
-		return true;
+	//Decoded directly from the column data
+	size_t qdata_size;
+	const char* qdata=cur->getData(0, qdata_size);
 
-	int num=watoi(res[0]["num"]);
-	char *ptr=(char*)&qdata[0];
-	while(ptr-(char*)&qdata[0]<num)
+	int num=qdata_size>0 ? cur->getInt(1) : 0;
+	const char *ptr=qdata;
+	while(ptr-qdata<num)
 	{
 		SFileAndHash f;
 		unsigned short ss;
@@ -248,6 +251,9 @@ bool ClientDAO::getFiles(std::string path, int tgroup, std::vector<SFileAndHash>
 
 		data.push_back(f);
 	}
+
+	cur->shutdown();
+	q_get_files->Reset();
 	return true;
 }
 
@@ -708,16 +714,18 @@ std::vector<ClientDAO::SToken> ClientDAO::getFileAccessTokens(void)
 	{
 		q_getFileAccessTokens=db->Prepare("SELECT id, accountname, token, is_user FROM fileaccess_tokens", false);
 	}
-	db_results res=q_getFileAccessTokens->Read();
+	IDatabaseCursor* cur=q_getFileAccessTokens->Cursor();
 	std::vector<ClientDAO::SToken> ret;
-	ret.resize(res.size());
-	for(size_t i=0;i<res.size();++i)
+	while(cur->nextRow())
 	{
-		ret[i].id=watoi64(res[i]["id"]);
-		ret[i].accountname=res[i]["accountname"];
-		ret[i].token=res[i]["token"];
-		ret[i].is_user=watoi(res[i]["is_user"]);
+		ret.push_back(ClientDAO::SToken());
+		ClientDAO::SToken& row=ret.back();
+		row.id=cur->getInt64(0);
+		row.accountname=cur->getString(1);
+		row.token=cur->getString(2);
+		row.is_user=cur->getInt(3);
 	}
+	cur->shutdown();
 	return ret;
 }
 
@@ -739,14 +747,15 @@ ClientDAO::CondInt64 ClientDAO::getFileAccessTokenId2Alts(const std::string& acc
 	q_getFileAccessTokenId2Alts->Bind(accountname);
 	q_getFileAccessTokenId2Alts->Bind(is_user_alt1);
 	q_getFileAccessTokenId2Alts->Bind(is_user_alt2);
-	db_results res=q_getFileAccessTokenId2Alts->Read();
-	q_getFileAccessTokenId2Alts->Reset();
+	IDatabaseCursor* cur=q_getFileAccessTokenId2Alts->Cursor();
 	CondInt64 ret = { false, 0 };
-	if(!res.empty())
+	if(cur->nextRow())
 	{
 		ret.exists=true;
-		ret.value=watoi64(res[0]["id"]);
+		ret.value=cur->getInt64(0);
 	}
+	cur->shutdown();
+	q_getFileAccessTokenId2Alts->Reset();
 	return ret;
 }
 
@@ -767,14 +776,15 @@ ClientDAO::CondInt64 ClientDAO::getFileAccessTokenId(const std::string& accountn
 	}
 	q_getFileAccessTokenId->Bind(accountname);
 	q_getFileAccessTokenId->Bind(is_user);
-	db_results res=q_getFileAccessTokenId->Read();
-	q_getFileAccessTokenId->Reset();
+	IDatabaseCursor* cur=q_getFileAccessTokenId->Cursor();
 	CondInt64 ret = { false, 0 };
-	if(!res.empty())
+	if(cur->nextRow())
 	{
 		ret.exists=true;
-		ret.value=watoi64(res[0]["id"]);
+		ret.value=cur->getInt64(0);
 	}
+	cur->shutdown();
+	q_getFileAccessTokenId->Reset();
 	return ret;
 }
 
@@ -832,14 +842,14 @@ std::vector<int> ClientDAO::getGroupMembership(int uid)
 		q_getGroupMembership=db->Prepare("SELECT gid FROM token_group_memberships WHERE uid = ?", false);
 	}
 	q_getGroupMembership->Bind(uid);
-	db_results res=q_getGroupMembership->Read();
+	IDatabaseCursor* cur=q_getGroupMembership->Cursor();
+	std::vector<int> ret;
+	while(cur->nextRow())
+	{
+		ret.push_back(cur->getInt(0));
+	}
+	cur->shutdown();
 	q_getGroupMembership->Reset();
-	std::vector<int> ret;
-	ret.resize(res.size());
-	for(size_t i=0;i<res.size();++i)
-	{
-		ret[i]=watoi(res[i]["gid"]);
-	}
 	return ret;
 }
 
@@ -940,14 +950,15 @@ ClientDAO::CondInt64 ClientDAO::hasHardLink(const std::string& vol, int64 frn_hi
 	q_hasHardLink->Bind(vol);
 	q_hasHardLink->Bind(frn_high);
 	q_hasHardLink->Bind(frn_low);
-	db_results res=q_hasHardLink->Read();
-	q_hasHardLink->Reset();
+	IDatabaseCursor* cur=q_hasHardLink->Cursor();
 	CondInt64 ret = { false, 0 };
-	if(!res.empty())
+	if(cur->nextRow())
 	{
 		ret.exists=true;
-		ret.value=watoi64(res[0]["frn_low"]);
+		ret.value=cur->getInt64(0);
 	}
+	cur->shutdown();
+	q_hasHardLink->Reset();
 	return ret;
 }
 
@@ -1002,16 +1013,17 @@ ClientDAO::SClientFacet ClientDAO::getClientFacet(const std::string& server_iden
 		q_getClientFacet=db->Prepare("SELECT id, name, server_identity FROM client_facets WHERE server_identity=?", false);
 	}
 	q_getClientFacet->Bind(server_identity);
-	db_results res=q_getClientFacet->Read();
-	q_getClientFacet->Reset();
+	IDatabaseCursor* cur=q_getClientFacet->Cursor();
 	SClientFacet ret = { false, 0, "", "" };
-	if(!res.empty())
+	if(cur->nextRow())
 	{
 		ret.exists=true;
-		ret.id=watoi(res[0]["id"]);
-		ret.name=res[0]["name"];
-		ret.server_identity=res[0]["server_identity"];
+		ret.id=cur->getInt(0);
+		ret.name=cur->getString(1);
+		ret.server_identity=cur->getString(2);
 	}
+	cur->shutdown();
+	q_getClientFacet->Reset();
 	return ret;
 }
 
@@ -1029,16 +1041,17 @@ ClientDAO::SClientFacet ClientDAO::getClientFacetByName(const std::string& name)
 		q_getClientFacetByName=db->Prepare("SELECT id, name, server_identity FROM client_facets WHERE name=?", false);
 	}
 	q_getClientFacetByName->Bind(name);
-	db_results res=q_getClientFacetByName->Read();
-	q_getClientFacetByName->Reset();
+	IDatabaseCursor* cur=q_getClientFacetByName->Cursor();
 	SClientFacet ret = { false, 0, "", "" };
-	if(!res.empty())
+	if(cur->nextRow())
 	{
 		ret.exists=true;
-		ret.id=watoi(res[0]["id"]);
-		ret.name=res[0]["name"];
-		ret.server_identity=res[0]["server_identity"];
+		ret.id=cur->getInt(0);
+		ret.name=cur->getString(1);
+		ret.server_identity=cur->getString(2);
 	}
+	cur->shutdown();
+	q_getClientFacetByName->Reset();
 	return ret;
 }
 
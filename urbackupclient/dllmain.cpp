@@ -72,6 +72,8 @@ extern IServer* Server;
 #ifdef _WIN32
 #include "DirectoryWatcherThread.h"
 #include "win_sysvol.h"
+#else
+#include "LinuxDirectoryWatcherThread.h"
 #endif
 #include "InternetClient.h"
 #include <stdlib.h>
@@ -433,6 +435,8 @@ DLLEXPORT void LoadActions(IServer* pServer)
 	ServerIdentityMgr::init_mutex();
 #ifdef _WIN32
 	DirectoryWatcherThread::init_mutex();
+#else
+	LinuxDirectoryWatcherThread::init_mutex();
 #endif
 
 	if(getFile(pw_file).size()<5)
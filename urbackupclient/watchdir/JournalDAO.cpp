@@ -1,5 +1,6 @@
 #include "JournalDAO.h"
 #include "../../stringtools.h"
+#include "../../Interface/DatabaseCursor.h"
 
 
 JournalDAO::JournalDAO( IDatabase *pDB )
@@ -83,16 +84,17 @@ JournalDAO::SDeviceInfo JournalDAO::getDeviceInfo(const std::string& device_name
 		q_getDeviceInfo=db->Prepare("SELECT journal_id, last_record, index_done FROM journal_ids WHERE device_name=?", false);
 	}
 	q_getDeviceInfo->Bind(device_name);
-	db_results res=q_getDeviceInfo->Read();
-	q_getDeviceInfo->Reset();
+	IDatabaseCursor* cur=q_getDeviceInfo->Cursor();
 	SDeviceInfo ret = { false, 0, 0, 0 };
-	if(!res.empty())
+	if(cur->nextRow())
 	{
 		ret.exists=true;
-		ret.journal_id=watoi64(res[0]["journal_id"]);
-		ret.last_record=watoi64(res[0]["last_record"]);
-		ret.index_done=watoi(res[0]["index_done"]);
+		ret.journal_id=cur->getInt64(0);
+		ret.last_record=cur->getInt64(1);
+		ret.index_done=cur->getInt(2);
 	}
+	cur->shutdown();
+	q_getDeviceInfo->Reset();
 	return ret;
 }
 
@@ -110,14 +112,15 @@ JournalDAO::CondInt64 JournalDAO::getRootId(const std::string& name)
 		q_getRootId=db->Prepare("SELECT id FROM map_frn WHERE rid=-1 AND name=?", false);
 	}
 	q_getRootId->Bind(name);
-	db_results res=q_getRootId->Read();
-	q_getRootId->Reset();
+	IDatabaseCursor* cur=q_getRootId->Cursor();
 	CondInt64 ret = { false, 0 };
-	if(!res.empty())
+	if(cur->nextRow())
 	{
 		ret.exists=true;
-		ret.value=watoi64(res[0]["id"]);
+		ret.value=cur->getInt64(0);
 	}
+	cur->shutdown();
+	q_getRootId->Reset();
 	return ret;
 }
 
@@ -178,14 +181,15 @@ JournalDAO::CondInt64 JournalDAO::getFrnEntryId(int64 frn, int64 frn_high, int64
 	q_getFrnEntryId->Bind(frn);
 	q_getFrnEntryId->Bind(frn_high);
 	q_getFrnEntryId->Bind(rid);
-	db_results res=q_getFrnEntryId->Read();
-	q_getFrnEntryId->Reset();
+	IDatabaseCursor* cur=q_getFrnEntryId->Cursor();
 	CondInt64 ret = { false, 0 };
-	if(!res.empty())
+	if(cur->nextRow())
 	{
 		ret.exists=true;
-		ret.value=watoi64(res[0]["id"]);
+		ret.value=cur->getInt64(0);
 	}
+	cur->shutdown();
+	q_getFrnEntryId->Reset();
 	return ret;
 }
 
@@ -205,15 +209,17 @@ std::vector<JournalDAO::SFrn> JournalDAO::getFrnChildren(int64 pid, int64 pid_hi
 	q_getFrnChildren->Bind(pid);
 	q_getFrnChildren->Bind(pid_high);
 	q_getFrnChildren->Bind(rid);
-	db_results res=q_getFrnChildren->Read();
-	q_getFrnChildren->Reset();
+	IDatabaseCursor* cur=q_getFrnChildren->Cursor();
 	std::vector<JournalDAO::SFrn> ret;
-	ret.resize(res.size());
-	for(size_t i=0;i<res.size();++i)
+	while(cur->nextRow())
 	{
-		ret[i].frn=watoi64(res[i]["frn"]);
-		ret[i].frn_high=watoi64(res[i]["frn_high"]);
+		ret.push_back(JournalDAO::SFrn());
+		JournalDAO::SFrn& row=ret.back();
+		row.frn=cur->getInt64(0);
+		row.frn_high=cur->getInt64(1);
 	}
+	cur->shutdown();
+	q_getFrnChildren->Reset();
 	return ret;
 }
 
@@ -250,16 +256,17 @@ JournalDAO::SNameAndPid JournalDAO::getNameAndPid(int64 frn, int64 frn_high, int
 	q_getNameAndPid->Bind(frn);
 	q_getNameAndPid->Bind(frn_high);
 	q_getNameAndPid->Bind(rid);
-	db_results res=q_getNameAndPid->Read();
-	q_getNameAndPid->Reset();
+	IDatabaseCursor* cur=q_getNameAndPid->Cursor();
 	SNameAndPid ret = { false, "", 0, 0 };
-	if(!res.empty())
+	if(cur->nextRow())
 	{
 		ret.exists=true;
-		ret.name=res[0]["name"];
-		ret.pid=watoi64(res[0]["pid"]);
-		ret.pid_high=watoi64(res[0]["pid_high"]);
+		ret.name=cur->getString(0);
+		ret.pid=cur->getInt64(1);
+		ret.pid_high=cur->getInt64(2);
 	}
+	cur->shutdown();
+	q_getNameAndPid->Reset();
 	return ret;
 }
 
@@ -383,22 +390,24 @@ std::vector<JournalDAO::SJournalData> JournalDAO::getJournalData(const std::stri
 		q_getJournalData=db->Prepare("SELECT usn, reason, filename, frn, frn_high, parent_frn, parent_frn_high, next_usn, attributes FROM journal_data WHERE device_name=? ORDER BY usn ASC", false);
 	}
 	q_getJournalData->Bind(device_name);
-	db_results res=q_getJournalData->Read();
-	q_getJournalData->Reset();
+	IDatabaseCursor* cur=q_getJournalData->Cursor();
 	std::vector<JournalDAO::SJournalData> ret;
-	ret.resize(res.size());
-	for(size_t i=0;i<res.size();++i)
+	while(cur->nextRow())
 	{
-		ret[i].usn=watoi64(res[i]["usn"]);
-		ret[i].reason=watoi64(res[i]["reason"]);
-		ret[i].filename=res[i]["filename"];
-		ret[i].frn=watoi64(res[i]["frn"]);
-		ret[i].frn_high=watoi64(res[i]["frn_high"]);
-		ret[i].parent_frn=watoi64(res[i]["parent_frn"]);
-		ret[i].parent_frn_high=watoi64(res[i]["parent_frn_high"]);
-		ret[i].next_usn=watoi64(res[i]["next_usn"]);
-		ret[i].attributes=watoi64(res[i]["attributes"]);
+		ret.push_back(JournalDAO::SJournalData());
+		JournalDAO::SJournalData& row=ret.back();
+		row.usn=cur->getInt64(0);
+		row.reason=cur->getInt64(1);
+		row.filename=cur->getString(2);
+		row.frn=cur->getInt64(3);
+		row.frn_high=cur->getInt64(4);
+		row.parent_frn=cur->getInt64(5);
+		row.parent_frn_high=cur->getInt64(6);
+		row.next_usn=cur->getInt64(7);
+		row.attributes=cur->getInt64(8);
 	}
+	cur->shutdown();
+	q_getJournalData->Reset();
 	return ret;
 }
 
@@ -417,14 +426,15 @@ JournalDAO::CondInt JournalDAO::getJournalDataSingle(const std::string& device_n
 		q_getJournalDataSingle=db->Prepare("SELECT id FROM journal_data WHERE device_name=? LIMIT 1", false);
 	}
 	q_getJournalDataSingle->Bind(device_name);
-	db_results res=q_getJournalDataSingle->Read();
-	q_getJournalDataSingle->Reset();
+	IDatabaseCursor* cur=q_getJournalDataSingle->Cursor();
 	CondInt ret = { false, 0 };
-	if(!res.empty())
+	if(cur->nextRow())
 	{
 		ret.exists=true;
-		ret.value=watoi(res[0]["id"]);
+		ret.value=cur->getInt(0);
 	}
+	cur->shutdown();
+	q_getJournalDataSingle->Reset();
 	return ret;
 }
 
@@ -515,15 +525,17 @@ std::vector<JournalDAO::SParentFrn> JournalDAO::getHardLinkParents(const std::st
 	q_getHardLinkParents->Bind(volume);
 	q_getHardLinkParents->Bind(frn_high);
 	q_getHardLinkParents->Bind(frn_low);
-	db_results res=q_getHardLinkParents->Read();
-	q_getHardLinkParents->Reset();
+	IDatabaseCursor* cur=q_getHardLinkParents->Cursor();
 	std::vector<JournalDAO::SParentFrn> ret;
-	ret.resize(res.size());
-	for(size_t i=0;i<res.size();++i)
+	while(cur->nextRow())
 	{
-		ret[i].parent_frn_high=watoi64(res[i]["parent_frn_high"]);
-		ret[i].parent_frn_low=watoi64(res[i]["parent_frn_low"]);
+		ret.push_back(JournalDAO::SParentFrn());
+		JournalDAO::SParentFrn& row=ret.back();
+		row.parent_frn_high=cur->getInt64(0);
+		row.parent_frn_low=cur->getInt64(1);
 	}
+	cur->shutdown();
+	q_getHardLinkParents->Reset();
 	return ret;
 }
 
@@ -0,0 +1,565 @@
+/*************************************************************************
+*    UrBackup - Client/Server backup system
+*    Copyright (C) 2011-2016 Martin Raiber
+*
+*    This program is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU Affero General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU Affero General Public License for more details.
+*
+*    You should have received a copy of the GNU Affero General Public License
+*    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**************************************************************************/
+
+#include "ParallelChunkHasher.h"
+#include "../Interface/Server.h"
+#include "../stringtools.h"
+#include "../md5.h"
+#include "../common/adler32.h"
+#include <memory.h>
+#include <assert.h>
+#include <algorithm>
+
+namespace
+{
+	//Number of checkpoints read with one read call
+	const size_t c_slab_blocks = 8;
+
+	bool buf_is_zero(const char* buf, size_t bsize)
+	{
+		for (size_t i = 0; i < bsize; ++i)
+		{
+			if (buf[i] != 0)
+			{
+				return false;
+			}
+		}
+
+		return true;
+	}
+}
+
+ParallelChunkHasher::ParallelChunkHasher(size_t n_threads)
+	: n_threads((std::max)(n_threads, static_cast<size_t>(1))),
+	max_slabs(this->n_threads * 2 + 2),
+	mutex(Server->createMutex()),
+	reader_cond(Server->createCondition()),
+	worker_cond(Server->createCondition()),
+	writer_cond(Server->createCondition()),
+	n_slabs(0), reader_done(false), has_error(false), do_quit(false),
+	f(NULL), fsize(0), extent_iterator(NULL), hashoutput(NULL), cb(NULL),
+	copy(NULL), hashf(NULL), treehash(NULL),
+	sparse_extent_start(-1), copy_sparse_extent_start(-1),
+	copy_max_sparse(-1), copy_write_pos(0)
+{
+}
+
+ParallelChunkHasher::~ParallelChunkHasher()
+{
+	for (size_t i = 0; i < in_order.size(); ++i)
+	{
+		if (in_order[i]->last_in_slab)
+		{
+			delete in_order[i]->slab;
+		}
+		delete in_order[i];
+	}
+
+	for (size_t i = 0; i < free_slabs.size(); ++i)
+	{
+		delete free_slabs[i];
+	}
+}
+
+bool ParallelChunkHasher::build(IFile * f, IFile * hashoutput, INotEnoughSpaceCallback * cb,
+	IFsFile * copy, IHashFunc * hashf, IExtentIterator * extent_iterator,
+	IBuildChunkHashsUpdateCallback* update_progress)
+{
+	this->f = f;
+	this->hashoutput = hashoutput;
+	this->cb = cb;
+	this->copy = copy;
+	this->hashf = hashf;
+	this->extent_iterator = extent_iterator;
+	treehash = dynamic_cast<TreeHash*>(hashf);
+
+	hashoutput->Seek(0);
+	fsize = f->Size();
+	_i64 fsize_endian = little_endian(fsize);
+	if (!writeRepeatFreeSpace(hashoutput, (char*)&fsize_endian, sizeof(_i64), cb))
+	{
+		Server->Log("Error writing to hashoutput file (" + hashoutput->getFilename() + ")", LL_DEBUG);
+		return false;
+	}
+
+	if (update_progress != nullptr)
+		update_progress->updateBchPc(0, fsize);
+
+	ReaderThread reader_thread(this);
+	HashWorkerThread worker_thread(this);
+
+	std::vector<THREADPOOL_TICKET> tickets;
+	tickets.push_back(Server->getThreadPool()->execute(&reader_thread, "chunk hash read"));
+	for (size_t i = 0; i < n_threads; ++i)
+	{
+		tickets.push_back(Server->getThreadPool()->execute(&worker_thread, "chunk hash"));
+	}
+
+	SBlock* block;
+	while ((block = nextOrderedBlock()) != NULL)
+	{
+		if (update_progress != nullptr)
+			update_progress->updateBchPc(block->pos, fsize);
+
+		bool ok;
+		if (block->sparse)
+		{
+			ok = writeSparseBlock(block);
+		}
+		else
+		{
+			ok = writeBlock(block);
+		}
+
+		releaseBlock(block);
+
+		if (!ok)
+		{
+			setError();
+			break;
+		}
+	}
+
+	{
+		IScopedLock lock(mutex.get());
+		do_quit = true;
+		reader_cond->notify_all();
+		worker_cond->notify_all();
+	}
+
+	Server->getThreadPool()->waitFor(tickets);
+
+	if (has_error)
+	{
+		return false;
+	}
+
+	if (sparse_extent_start != -1)
+	{
+		assert(fsize%c_checkpoint_dist == 0);
+		int64 ext_pos[2] = { sparse_extent_start, fsize - sparse_extent_start };
+		hashf->sparse_hash(reinterpret_cast<char*>(ext_pos), sizeof(ext_pos));
+		sparse_extent_start = -1;
+	}
+
+	if (copy != NULL
+		&& copy_max_sparse != -1
+		&& copy_max_sparse > copy->Size())
+	{
+		if (!copy->Resize(copy_max_sparse))
+		{
+			Server->Log("Error resizing copy file (" + copy->getFilename() + ")", LL_DEBUG);
+			return false;
+		}
+	}
+
+	return true;
+}
+
+void ParallelChunkHasher::runReader()
+{
+	IFsFile::SSparseExtent curr_extent;
+
+	if (extent_iterator != NULL)
+	{
+		curr_extent = extent_iterator->nextExtent();
+	}
+
+	int64 pos = 0;
+	while (pos < fsize)
+	{
+		while (curr_extent.offset != -1
+			&& curr_extent.offset + curr_extent.size < pos)
+		{
+			curr_extent = extent_iterator->nextExtent();
+		}
+
+		int64 epos = pos + c_checkpoint_dist;
+
+		if (curr_extent.offset != -1
+			&& curr_extent.offset <= pos
+			&& curr_extent.offset + curr_extent.size >= epos
+			&& epos <= fsize)
+		{
+			SBlock* block = new SBlock;
+			block->pos = pos;
+			block->size = c_checkpoint_dist;
+			block->sparse = true;
+			block->extent_offset = curr_extent.offset;
+			block->extent_size = curr_extent.size;
+			block->data = NULL;
+			block->slab = NULL;
+			block->last_in_slab = false;
+			block->hashed = true;
+			block->all_zeros = true;
+			block->chunkidx = 0;
+
+			IScopedLock lock(mutex.get());
+			if (do_quit || has_error)
+			{
+				delete block;
+				break;
+			}
+			in_order.push_back(block);
+			writer_cond->notify_all();
+
+			pos = epos;
+			continue;
+		}
+
+		//Read consecutive non-sparse checkpoints in one go
+		size_t n_blocks = 1;
+		int64 slab_end = (std::min)(epos, fsize);
+		while (n_blocks < c_slab_blocks
+			&& slab_end < fsize)
+		{
+			while (curr_extent.offset != -1
+				&& curr_extent.offset + curr_extent.size < slab_end)
+			{
+				curr_extent = extent_iterator->nextExtent();
+			}
+
+			int64 next_epos = slab_end + c_checkpoint_dist;
+			if (curr_extent.offset != -1
+				&& curr_extent.offset <= slab_end
+				&& curr_extent.offset + curr_extent.size >= next_epos
+				&& next_epos <= fsize)
+			{
+				break;
+			}
+
+			++n_blocks;
+			slab_end = (std::min)(next_epos, fsize);
+		}
+
+		SSlab* slab;
+		{
+			IScopedLock lock(mutex.get());
+			while (!do_quit && !has_error
+				&& free_slabs.empty()
+				&& n_slabs >= max_slabs)
+			{
+				reader_cond->wait(&lock);
+			}
+
+			if (do_quit || has_error)
+			{
+				break;
+			}
+
+			if (!free_slabs.empty())
+			{
+				slab = free_slabs.back();
+				free_slabs.pop_back();
+			}
+			else
+			{
+				slab = new SSlab;
+				slab->buf.resize(c_slab_blocks*c_checkpoint_dist);
+				++n_slabs;
+			}
+		}
+
+		_u32 toread = static_cast<_u32>(slab_end - pos);
+		_u32 read = 0;
+		bool has_read_error = false;
+		while (read < toread && !has_read_error)
+		{
+			_u32 r = f->Read(pos + read, slab->buf.data() + read, toread - read, &has_read_error);
+			if (r == 0)
+			{
+				break;
+			}
+			read += r;
+		}
+
+		if (has_read_error || read != toread)
+		{
+			Server->Log("Error while reading from file \"" + f->getFilename() + "\" at position " + convert(pos + read), LL_DEBUG);
+			IScopedLock lock(mutex.get());
+			free_slabs.push_back(slab);
+			has_error = true;
+			writer_cond->notify_all();
+			worker_cond->notify_all();
+			break;
+		}
+
+		IScopedLock lock(mutex.get());
+		for (int64 bpos = pos; bpos < slab_end; bpos += c_checkpoint_dist)
+		{
+			SBlock* block = new SBlock;
+			block->pos = bpos;
+			block->size = static_cast<_u32>((std::min)(slab_end - bpos, static_cast<int64>(c_checkpoint_dist)));
+			block->sparse = false;
+			block->extent_offset = -1;
+			block->extent_size = -1;
+			block->data = slab->buf.data() + (bpos - pos);
+			block->slab = slab;
+			block->last_in_slab = bpos + c_checkpoint_dist >= slab_end;
+			block->hashed = false;
+			block->all_zeros = true;
+			block->chunkidx = 0;
+
+			to_hash.push_back(block);
+			in_order.push_back(block);
+		}
+
+		worker_cond->notify_all();
+
+		pos = slab_end;
+	}
+
+	IScopedLock lock(mutex.get());
+	reader_done = true;
+	worker_cond->notify_all();
+	writer_cond->notify_all();
+}
+
+void ParallelChunkHasher::runWorker()
+{
+	IScopedLock lock(mutex.get());
+	while (true)
+	{
+		while (!do_quit && !has_error
+			&& to_hash.empty()
+			&& !reader_done)
+		{
+			worker_cond->wait(&lock);
+		}
+
+		if (do_quit || has_error
+			|| to_hash.empty())
+		{
+			break;
+		}
+
+		SBlock* block = to_hash.front();
+		to_hash.pop_front();
+
+		lock.relock(NULL);
+
+		hashBlock(block);
+
+		lock.relock(mutex.get());
+
+		block->hashed = true;
+		writer_cond->notify_all();
+	}
+}
+
+void ParallelChunkHasher::hashBlock(SBlock* block)
+{
+	MD5 big_hash;
+	size_t chunkidx = 0;
+	bool all_zeros = true;
+
+	for (_u32 off = 0; off < block->size; off += c_small_hash_dist, ++chunkidx)
+	{
+		_u32 r = (std::min)(static_cast<_u32>(c_small_hash_dist), block->size - off);
+		char* cbuf = block->data + off;
+
+		if (hashf != NULL
+			&& all_zeros
+			&& !buf_is_zero(cbuf, r))
+		{
+			all_zeros = false;
+		}
+
+		_u32 small_hash = little_endian(urb_adler32(urb_adler32(0, NULL, 0), cbuf, r));
+		memcpy(&block->chunk.small_hash[chunkidx*small_hash_size], &small_hash, small_hash_size);
+		big_hash.update(reinterpret_cast<unsigned char*>(cbuf), r);
+	}
+
+	big_hash.finalize();
+	memcpy(block->chunk.big_hash, big_hash.raw_digest_int(), big_hash_size);
+
+	block->chunkidx = chunkidx;
+	block->all_zeros = all_zeros;
+}
+
+ParallelChunkHasher::SBlock* ParallelChunkHasher::nextOrderedBlock()
+{
+	IScopedLock lock(mutex.get());
+	while (!has_error
+		&& (in_order.empty() ? !reader_done : !in_order.front()->hashed))
+	{
+		writer_cond->wait(&lock);
+	}
+
+	if (has_error
+		|| in_order.empty())
+	{
+		return NULL;
+	}
+
+	SBlock* ret = in_order.front();
+	in_order.pop_front();
+	return ret;
+}
+
+void ParallelChunkHasher::releaseBlock(SBlock* block)
+{
+	if (block->last_in_slab)
+	{
+		IScopedLock lock(mutex.get());
+		free_slabs.push_back(block->slab);
+		reader_cond->notify_all();
+	}
+
+	delete block;
+}
+
+void ParallelChunkHasher::setError()
+{
+	IScopedLock lock(mutex.get());
+	has_error = true;
+	reader_cond->notify_all();
+	worker_cond->notify_all();
+	writer_cond->notify_all();
+}
+
+bool ParallelChunkHasher::writeBlock(SBlock* block)
+{
+	copy_sparse_extent_start = -1;
+
+	if (copy != NULL)
+	{
+		if (!writeRepeatFreeSpace(copy, block->data, block->size, cb))
+		{
+			Server->Log("Error writing to copy file (" + copy->getFilename() + ") -4", LL_DEBUG);
+			return false;
+		}
+
+		copy_write_pos += block->size;
+	}
+
+	if (hashf != NULL)
+	{
+		if (block->size == c_checkpoint_dist
+			&& block->all_zeros)
+		{
+			if (sparse_extent_start == -1)
+			{
+				sparse_extent_start = block->pos;
+			}
+		}
+		else
+		{
+			flushSparseHash(block->pos);
+
+			if (treehash != NULL)
+			{
+				treehash->addHashAllAdler(block->chunk.big_hash, big_hash_size + block->chunkidx*small_hash_size, block->size);
+			}
+			else
+			{
+				hashf->hash(block->data, block->size);
+			}
+		}
+	}
+
+	if (!writeRepeatFreeSpace(hashoutput, block->chunk.big_hash, big_hash_size + block->chunkidx*small_hash_size, cb))
+	{
+		Server->Log("Error writing to hashoutput file (" + hashoutput->getFilename() + ") -3", LL_DEBUG);
+		return false;
+	}
+
+	return true;
+}
+
+bool ParallelChunkHasher::writeSparseBlock(SBlock* block)
+{
+	std::string c = get_sparse_extent_content();
+	if (!writeRepeatFreeSpace(hashoutput, c.data(), c.size(), cb))
+	{
+		Server->Log("Error writing to hashoutput file (" + hashoutput->getFilename() + ") -2", LL_DEBUG);
+		return false;
+	}
+
+	if (hashf != NULL && sparse_extent_start == -1)
+	{
+		sparse_extent_start = block->pos;
+	}
+
+	if (copy_sparse_extent_start == -1)
+	{
+		copy_sparse_extent_start = block->pos;
+
+		if (block->extent_offset < fsize)
+		{
+			int64 extent_size = block->extent_size;
+			if (block->extent_offset + extent_size > fsize)
+			{
+				extent_size = fsize - block->extent_offset;
+			}
+
+			if (copy != NULL && !copy->PunchHole(block->extent_offset, extent_size))
+			{
+				std::vector<char> zero_buf;
+				zero_buf.resize(32768);
+
+				if (copy->Seek(block->extent_offset))
+				{
+					for (int64 written = 0; written < extent_size;)
+					{
+						_u32 towrite = static_cast<_u32>((std::min)(extent_size - written, static_cast<int64>(zero_buf.size())));
+						if (!writeRepeatFreeSpace(copy, zero_buf.data(), towrite, cb))
+						{
+							Server->Log("Error writing to copy file (" + copy->getFilename() + ")", LL_DEBUG);
+							return false;
+						}
+						written += towrite;
+					}
+				}
+				else
+				{
+					Server->Log("Error seeking in copy file (" + copy->getFilename() + ")", LL_DEBUG);
+					return false;
+				}
+			}
+			else
+			{
+				copy_max_sparse = (std::min)(fsize, block->extent_offset + block->extent_size);
+			}
+		}
+	}
+
+	copy_write_pos += c_checkpoint_dist;
+
+	if (copy != NULL)
+	{
+		if (!copy->Seek(copy_write_pos))
+		{
+			Server->Log("Error seeking in copy file (" + copy->getFilename() + ")", LL_DEBUG);
+			return false;
+		}
+	}
+
+	return true;
+}
+
+void ParallelChunkHasher::flushSparseHash(int64 end_pos)
+{
+	if (sparse_extent_start != -1)
+	{
+		end_pos = (end_pos / c_checkpoint_dist)*c_checkpoint_dist;
+		int64 ext_pos[2] = { sparse_extent_start, end_pos - sparse_extent_start };
+		hashf->sparse_hash(reinterpret_cast<char*>(ext_pos), sizeof(ext_pos));
+		sparse_extent_start = -1;
+	}
+}
@@ -0,0 +1,117 @@
+#pragma once
+
+#include "../Interface/File.h"
+#include "../Interface/Mutex.h"
+#include "../Interface/Condition.h"
+#include "../Interface/Thread.h"
+#include "../Interface/ThreadPool.h"
+#include "../fileservplugin/chunk_settings.h"
+#include "fileclient/FileClientChunked.h"
+#include "chunk_hasher.h"
+#include <memory>
+#include <deque>
+#include <vector>
+
+/*
+* Pipelined version of build_chunk_hashs for large files.
+* A reader thread reads the file in large sequential pieces, the
+* independent 512KiB checkpoints are hashed (adler32 + md5) on a pool of
+* worker threads and the calling thread writes the hash file and the copy
+* (and updates the file hash) strictly in file order. The output is identical
+* to build_chunk_hashs.
+* Inplace modification, hash input and CBT hash files are not supported.
+*/
+class ParallelChunkHasher
+{
+public:
+	ParallelChunkHasher(size_t n_threads);
+	~ParallelChunkHasher();
+
+	bool build(IFile *f, IFile *hashoutput, INotEnoughSpaceCallback *cb,
+		IFsFile *copy, IHashFunc* hashf, IExtentIterator* extent_iterator,
+		IBuildChunkHashsUpdateCallback* update_progress);
+
+private:
+	struct SSlab
+	{
+		std::vector<char> buf;
+	};
+
+	struct SBlock
+	{
+		int64 pos;
+		_u32 size;
+		bool sparse;
+		int64 extent_offset;
+		int64 extent_size;
+		char* data;
+		SSlab* slab;
+		bool last_in_slab;
+		bool hashed;
+		bool all_zeros;
+		size_t chunkidx;
+		SChunkHashes chunk;
+	};
+
+	class ReaderThread : public IThread
+	{
+	public:
+		ReaderThread(ParallelChunkHasher* parent)
+			: parent(parent) {}
+		void operator()() { parent->runReader(); }
+	private:
+		ParallelChunkHasher* parent;
+	};
+
+	class HashWorkerThread : public IThread
+	{
+	public:
+		HashWorkerThread(ParallelChunkHasher* parent)
+			: parent(parent) {}
+		void operator()() { parent->runWorker(); }
+	private:
+		ParallelChunkHasher* parent;
+	};
+
+	void runReader();
+	void runWorker();
+	void hashBlock(SBlock* block);
+	SBlock* nextOrderedBlock();
+	void releaseBlock(SBlock* block);
+	void setError();
+
+	bool writeBlock(SBlock* block);
+	bool writeSparseBlock(SBlock* block);
+	void flushSparseHash(int64 end_pos);
+
+	size_t n_threads;
+	size_t max_slabs;
+
+	std::unique_ptr<IMutex> mutex;
+	std::unique_ptr<ICondition> reader_cond;
+	std::unique_ptr<ICondition> worker_cond;
+	std::unique_ptr<ICondition> writer_cond;
+
+	std::deque<SBlock*> to_hash;
+	std::deque<SBlock*> in_order;
+	std::vector<SSlab*> free_slabs;
+	size_t n_slabs;
+	bool reader_done;
+	bool has_error;
+	bool do_quit;
+
+	IFile* f;
+	int64 fsize;
+	IExtentIterator* extent_iterator;
+
+	IFile* hashoutput;
+	INotEnoughSpaceCallback* cb;
+	IFsFile* copy;
+	IHashFunc* hashf;
+	TreeHash* treehash;
+
+	int64 sparse_extent_start;
+	int64 copy_sparse_extent_start;
+	int64 copy_max_sparse;
+	int64 copy_write_pos;
+};
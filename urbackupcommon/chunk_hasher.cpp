@@ -24,6 +24,7 @@
 #include "../common/adler32.h"
 #include "../urbackupcommon/fileclient/FileClientChunked.h"
 #include "TreeHash.h"
+#include "ParallelChunkHasher.h"
 #include <memory.h>
 #include <memory>
 #include <assert.h>
@@ -70,6 +71,11 @@ namespace
 	}
 
 	std::string sparse_extent_content;
+
+	size_t chunk_hasher_threads = 0;
+
+	//Smaller files are not worth the thread hand-off
+	const int64 c_parallel_min_size = 32 * 1024 * 1024;
 }
 
 std::string get_sparse_extent_content()
@@ -81,6 +87,13 @@ std::string get_sparse_extent_content()
 void init_chunk_hasher()
 {
 	sparse_extent_content = build_sparse_extent_content();
+
+	Server->Log(std::string("Hash implementations: adler32=") + urb_adler32_impl() + " sha256=" + sha256_impl(), LL_DEBUG);
+}
+
+void set_chunk_hasher_threads(size_t n_threads)
+{
+	chunk_hasher_threads = n_threads;
 }
 
 bool build_chunk_hashs(IFile *f, IFile *hashoutput, INotEnoughSpaceCallback *cb,
@@ -88,6 +101,17 @@ bool build_chunk_hashs(IFile *f, IFile *hashoutput, INotEnoughSpaceCallback *cb,
 	bool show_pc, IHashFunc* hashf, IExtentIterator* extent_iterator,
 	std::pair<IFile*, int64> cbt_hash_file, IBuildChunkHashsUpdateCallback* update_progress)
 {
+	if (chunk_hasher_threads > 1
+		&& !modify_inplace
+		&& hashinput == NULL
+		&& !show_pc
+		&& cbt_hash_file.first == NULL
+		&& f->Size() >= c_parallel_min_size)
+	{
+		ParallelChunkHasher parallel_hasher(chunk_hasher_threads);
+		return parallel_hasher.build(f, hashoutput, cb, copy, hashf, extent_iterator, update_progress);
+	}
+
 	f->Seek(0);
 
 	hashoutput->Seek(0);
@@ -19,6 +19,9 @@ public:
 
 void init_chunk_hasher();
 
+//Use a pipeline with this many hash threads for large files (<=1 disables it)
+void set_chunk_hasher_threads(size_t n_threads);
+
 std::string get_sparse_extent_content();
 
 bool build_chunk_hashs(IFile *f, IFile *hashoutput, INotEnoughSpaceCallback *cb,
@@ -28,6 +28,7 @@
 #include <memory>
 #include <algorithm>
 #include <limits.h>
+#include <unordered_map>
 #include "../../common/adler32.h"
 #include "../chunk_hasher.h"
 #include "../../urbackupcommon/os_functions.h"
@@ -41,6 +42,44 @@ namespace
 		"Seeking in file failed",
 		"Reading from file failed"
 	};
+
+	//The index of the new file is only kept while it still fits into a request
+	void add_cdc_index_entry(std::vector<SCdcChunk>*& index, const SCdcHash& hash, _u32 len)
+	{
+		if(index==NULL)
+		{
+			return;
+		}
+
+		if(index->size()>=c_cdc_max_index_size)
+		{
+			index->clear();
+			index=NULL;
+			return;
+		}
+
+		SCdcChunk chunk;
+		chunk.hash = hash;
+		chunk.len = len;
+		index->push_back(chunk);
+	}
+
+	unsigned int max_chunk_window()
+	{
+		static unsigned int max_window = 0;
+		if (max_window == 0)
+		{
+			unsigned int new_max_window = c_max_queued_chunks;
+			std::string str_max_window = Server->getServerParameter("chunked_max_queued_chunks");
+			if (!str_max_window.empty())
+			{
+				new_max_window = (std::max)(c_min_queued_chunks,
+					(std::min)(c_max_queued_chunks, static_cast<unsigned int>(watoi(str_max_window))));
+			}
+			max_window = new_max_window;
+		}
+		return max_window;
+	}
 }
 
 int64 get_hashdata_size(int64 hashfilesize)
@@ -66,6 +105,8 @@ FileClientChunked::FileClientChunked(IPipe *pipe, bool del_pipe, CTCPStack *stac
 	: pipe(pipe), destroy_pipe(del_pipe), stack(stack), transferred_bytes(0), reconnection_callback(reconnection_callback),
 	  nofreespace_callback(nofreespace_callback), reconnection_timeout(300000), identity(identity), received_data_bytes(0),
 	  parent(prev), queue_only(false), queue_callback(NULL), remote_filesize(-1), ofb_pipe(NULL), hashfilesize(-1), did_queue_fc(false), queued_chunks(0),
+	  chunk_window(c_initial_queued_chunks), window_probe_start(0), window_rtt(0), window_rate(0), window_rate_start(0), window_completed(0),
+	  window_byte_rate(0), window_bytes_start(0),
 	  last_transferred_bytes(0), last_progress_log(0), progress_log_callback(NULL), reconnected(false), needs_flush(false),
 	  real_transferred_bytes(0), queue_next(false), sparse_bytes(0)
 {
@@ -82,8 +123,10 @@ FileClientChunked::FileClientChunked(IPipe *pipe, bool del_pipe, CTCPStack *stac
 
 FileClientChunked::FileClientChunked(void)
 	: pipe(NULL), stack(NULL), destroy_pipe(false), transferred_bytes(0), reconnection_callback(NULL), reconnection_timeout(300000), received_data_bytes(0),
-	  parent(NULL), remote_filesize(-1), ofb_pipe(NULL), hashfilesize(-1), did_queue_fc(false), queued_chunks(0), last_transferred_bytes(0), last_progress_log(0),
-	  progress_log_callback(NULL), reconnected(false), real_transferred_bytes(0), queue_next(false), sparse_bytes(0)
+	  parent(NULL), remote_filesize(-1), ofb_pipe(NULL), hashfilesize(-1), did_queue_fc(false), queued_chunks(0),
+	  chunk_window(c_initial_queued_chunks), window_probe_start(0), window_rtt(0), window_rate(0), window_rate_start(0), window_completed(0),
+	  window_byte_rate(0), window_bytes_start(0),
+	  last_transferred_bytes(0), last_progress_log(0), progress_log_callback(NULL), reconnected(false), real_transferred_bytes(0), queue_next(false), sparse_bytes(0)
 {
 	has_error=true;
 	mutex=NULL;
@@ -127,6 +170,467 @@ _u32 FileClientChunked::GetFilePatch(std::string remotefn, IFile *orig_file, IFi
 	return rc;
 }
 
+_u32 FileClientChunked::GetFilePatchCdc(std::string remotefn, IFile *orig_file, const std::vector<SCdcChunk>& orig_index, IFile *patchfile, IFile *chunkhashes, IFsFile *hashoutput,
+	_i64& predicted_filesize, int64 file_id, std::vector<SCdcChunk>* new_index)
+{
+	if(!queued_fcs.empty() || parent!=NULL)
+	{
+		//Other files are already requested on this connection
+		return GetFilePatch(remotefn, orig_file, patchfile, chunkhashes, hashoutput, predicted_filesize, file_id, false, NULL);
+	}
+
+	std::vector<SCdcHash> hashes;
+	std::vector<std::pair<int64, _u32> > chunks;
+	std::unordered_map<SCdcHash, size_t, SCdcHashHasher> seen;
+	int64 chunk_pos=0;
+	for(size_t i=0;i<orig_index.size();++i)
+	{
+		if(seen.insert(std::make_pair(orig_index[i].hash, chunks.size())).second)
+		{
+			hashes.push_back(orig_index[i].hash);
+			chunks.push_back(std::make_pair(chunk_pos, static_cast<_u32>(orig_index[i].len)));
+		}
+		chunk_pos+=orig_index[i].len;
+	}
+
+	if(chunk_pos!=orig_file->Size()
+		|| hashes.size()>c_cdc_max_index_size)
+	{
+		Server->Log("Chunk index of \""+orig_file->getFilename()+"\" cannot be used. Transferring \""+remotefn+"\" with fixed-size chunks.", LL_DEBUG);
+		return GetFilePatch(remotefn, orig_file, patchfile, chunkhashes, hashoutput, predicted_filesize, file_id, false, NULL);
+	}
+
+	patch_mode=true;
+	m_chunkhashes=chunkhashes;
+	m_hashoutput=hashoutput;
+	m_patchfile=patchfile;
+	m_file=orig_file;
+	patchfile_pos=0;
+	patch_buf_pos=0;
+	remote_filesize = predicted_filesize;
+	last_transferred_bytes=0;
+	curr_output_fsize=0;
+	curr_is_script = false;
+	file_pos = 0;
+	extent_iterator.reset();
+	curr_sparse_extent.offset = -1;
+	remote_filename=remotefn;
+	curr_file_id = file_id;
+	last_chunk_patches.clear();
+
+	if(getPipe()==NULL)
+		return ERR_ERROR;
+
+	setReconnectTries(50);
+
+	int64 old_filesize=0;
+	m_chunkhashes->Seek(0);
+	if(m_chunkhashes->Read((char*)&old_filesize, sizeof(_i64))!=sizeof(_i64) )
+	{
+		Server->Log("Cannot read hashfilesize in FileClientChunked::GetFilePatchCdc", LL_ERROR);
+		return ERR_INT_ERROR;
+	}
+	old_filesize = little_endian(old_filesize);
+
+	if(old_filesize!=m_file->Size())
+	{
+		//Hashes cannot be reused
+		old_filesize=-1;
+	}
+
+	if(new_index!=NULL)
+	{
+		new_index->clear();
+	}
+
+	CWData data;
+	data.addUChar(ID_GET_FILE_CDC);
+	data.addString(remotefn);
+	data.addString(identity);
+	data.addChar(0); //version
+	data.addVarInt(file_id);
+	data.addChar(0); //no sparse extents
+	data.addInt64(0); //offset
+	data.addInt64(m_file->Size());
+	data.addInt64(remote_filesize);
+	data.addUChar(0); //flags
+	data.addVarInt(hashes.size());
+	if(!hashes.empty())
+	{
+		data.addBuffer(reinterpret_cast<char*>(hashes.data()), hashes.size()*sizeof(SCdcHash));
+	}
+
+	starttime=Server->getTimeMS();
+
+	if(stack->Send(getPipe(), data.getDataPtr(), data.getDataSize(), reconnection_timeout)!=data.getDataSize())
+	{
+		Server->Log("Timeout during content-defined chunk file request", LL_ERROR);
+		if(!Reconnect(false))
+		{
+			return ERR_CONN_LOST;
+		}
+		return ERR_TIMEOUT;
+	}
+
+	needs_flush=true;
+
+	char id;
+	if(!readCdc(&id, 1))
+	{
+		Reconnect(false);
+		return ERR_TIMEOUT;
+	}
+
+	switch(id)
+	{
+	case ID_FILESIZE:
+		break;
+	case ID_BASE_DIR_LOST:
+		return ERR_BASE_DIR_LOST;
+	case ID_COULDNT_OPEN:
+		return ERR_CANNOT_OPEN_FILE;
+	case ID_READ_ERROR:
+		return ERR_READ_ERROR;
+	default:
+		Server->Log("Unknown Packet ID "+convert(static_cast<int>(id))+" at start of content-defined chunk transfer of "+remote_filename, LL_ERROR);
+		Reconnect(false);
+		return ERR_ERROR;
+	}
+
+	_i64 new_filesize;
+	if(!readCdc(reinterpret_cast<char*>(&new_filesize), sizeof(new_filesize)))
+	{
+		Reconnect(false);
+		return ERR_TIMEOUT;
+	}
+	remote_filesize = little_endian(new_filesize);
+
+	writePatchSize(remote_filesize);
+
+	SCdcBlock block;
+	block.start=0;
+	block.fill=0;
+	block.dirty=false;
+	block.buf.resize(c_checkpoint_dist);
+
+	std::vector<char> buf(c_cdc_max_size);
+	int64 reused_bytes=0;
+	bool done=false;
+	_u32 rc=ERR_SUCCESS;
+
+	while(!done && rc==ERR_SUCCESS && !has_error)
+	{
+		if(!readCdc(&id, 1))
+		{
+			rc=ERR_TIMEOUT;
+			break;
+		}
+
+		switch(id)
+		{
+		case ID_CDC_REF:
+			{
+				_u32 idx;
+				if(!readCdc(reinterpret_cast<char*>(&idx), sizeof(idx)))
+				{
+					rc=ERR_TIMEOUT;
+					break;
+				}
+				idx = little_endian(idx);
+
+				if(idx>=chunks.size())
+				{
+					Server->Log("Client referenced unknown chunk "+convert(idx)+" in "+remote_filename, LL_ERROR);
+					rc=ERR_ERROR;
+					break;
+				}
+
+				const std::pair<int64, _u32>& chunk = chunks[idx];
+				reused_bytes+=chunk.second;
+
+				add_cdc_index_entry(new_index, hashes[idx], chunk.second);
+
+				if(chunk.first==file_pos)
+				{
+					if(!addCdcData(block, NULL, chunk.second, true, old_filesize))
+					{
+						rc=ERR_INT_ERROR;
+					}
+				}
+				else
+				{
+					bool read_err=false;
+					if(m_file->Read(chunk.first, buf.data(), chunk.second, &read_err)!=chunk.second)
+					{
+						Server->Log("Error reading chunk at "+convert(chunk.first)+" from \""+m_file->getFilename()+"\". "+os_last_error_str(), LL_ERROR);
+						rc=ERR_INT_ERROR;
+						break;
+					}
+
+					writePatchInt(file_pos, chunk.second, buf.data());
+					if(!addCdcData(block, buf.data(), chunk.second, false, old_filesize))
+					{
+						rc=ERR_INT_ERROR;
+					}
+				}
+				file_pos+=chunk.second;
+			}break;
+		case ID_CDC_DATA:
+			{
+				char header[sizeof(_u32)+c_cdc_hash_size];
+				if(!readCdc(header, sizeof(header)))
+				{
+					rc=ERR_TIMEOUT;
+					break;
+				}
+				_u32 len;
+				memcpy(&len, header, sizeof(len));
+				len = little_endian(len);
+
+				if(len>c_cdc_max_size)
+				{
+					Server->Log("Content-defined chunk too large ("+convert(len)+") in "+remote_filename, LL_ERROR);
+					rc=ERR_ERROR;
+					break;
+				}
+
+				if(!readCdc(buf.data(), len))
+				{
+					rc=ERR_TIMEOUT;
+					break;
+				}
+
+				addReceivedBytes(len);
+
+				MD5 chunk_hash;
+				chunk_hash.update(reinterpret_cast<unsigned char*>(buf.data()), len);
+				chunk_hash.finalize();
+				if(memcmp(chunk_hash.raw_digest_int(), header+sizeof(_u32), c_cdc_hash_size)!=0)
+				{
+					Server->Log("Hash of content-defined chunk at "+convert(file_pos)+" of "+remote_filename+" wrong", LL_WARNING);
+					rc=ERR_HASH;
+					break;
+				}
+
+				SCdcHash data_hash;
+				memcpy(data_hash.hash, header+sizeof(_u32), c_cdc_hash_size);
+				add_cdc_index_entry(new_index, data_hash, len);
+
+				writePatchInt(file_pos, len, buf.data());
+				if(!addCdcData(block, buf.data(), len, false, old_filesize))
+				{
+					rc=ERR_INT_ERROR;
+				}
+				file_pos+=len;
+			}break;
+		case ID_CDC_END:
+			{
+				_i64 sent_size;
+				if(!readCdc(reinterpret_cast<char*>(&sent_size), sizeof(sent_size)))
+				{
+					rc=ERR_TIMEOUT;
+					break;
+				}
+				sent_size = little_endian(sent_size);
+
+				if(sent_size!=file_pos)
+				{
+					Server->Log("Size of content-defined chunk transfer of "+remote_filename+" wrong ("+convert(sent_size)+"!="+convert(file_pos)+")", LL_ERROR);
+					rc=ERR_ERROR;
+					break;
+				}
+
+				if(!finishCdcBlock(block, old_filesize))
+				{
+					rc=ERR_INT_ERROR;
+					break;
+				}
+
+				done=true;
+			}break;
+		case ID_BLOCK_ERROR:
+			{
+				_u32 ec[2];
+				if(!readCdc(reinterpret_cast<char*>(ec), sizeof(ec)))
+				{
+					rc=ERR_TIMEOUT;
+					break;
+				}
+
+				Server->Log("Received error codes (ID_BLOCK_ERROR) ec1=" + convert(ec[0]) + " ec2=" + convert(ec[1]), LL_DEBUG);
+
+				setErrorCodes(ec[0], ec[1]);
+				return ERR_ERRORCODES;
+			}
+		default:
+			{
+				Server->Log("Unknown Packet ID "+convert(static_cast<int>(id))+" in content-defined chunk transfer of "+remote_filename, LL_ERROR);
+				rc=ERR_ERROR;
+			}break;
+		}
+
+		logTransferProgress();
+	}
+
+	if(has_error)
+	{
+		return ERR_ERROR;
+	}
+
+	if(rc!=ERR_SUCCESS)
+	{
+		//Rest of the transfer is still on the connection
+		if(!Reconnect(false))
+		{
+			rc=ERR_CONN_LOST;
+		}
+		return rc;
+	}
+
+	writePatchSize(file_pos);
+
+	if(m_hashoutput!=NULL)
+	{
+		m_hashoutput->Seek(0);
+		_i64 endian_filesize = little_endian(file_pos);
+		writeFileRepeat(m_hashoutput, (char*)&endian_filesize, sizeof(_i64));
+	}
+
+	predicted_filesize = file_pos;
+
+	Server->Log("Transferred \""+remote_filename+"\" with content-defined chunks. "+PrettyPrintBytes(reused_bytes)+" of "+PrettyPrintBytes(file_pos)+" found in previous version", LL_DEBUG);
+
+	if(has_error)
+	{
+		return ERR_ERROR;
+	}
+
+	return ERR_SUCCESS;
+}
+
+bool FileClientChunked::readCdc(char* buf, size_t bsize)
+{
+	int64 last_data = Server->getTimeMS();
+	size_t off=0;
+	while(off<bsize)
+	{
+		size_t r = getPipe()->Read(buf+off, bsize-off, c_default_timeout);
+		if(r==0)
+		{
+			if(getPipe()->hasError())
+			{
+				Server->Log("Pipe has error while receiving content-defined chunks", LL_DEBUG);
+				return false;
+			}
+
+			if(Server->getTimeMS()-last_data>reconnection_timeout)
+			{
+				Server->Log("Timeout while receiving content-defined chunks", LL_DEBUG);
+				return false;
+			}
+		}
+		else
+		{
+			off+=r;
+			last_data = Server->getTimeMS();
+		}
+	}
+	return true;
+}
+
+bool FileClientChunked::addCdcData(SCdcBlock& block, const char* data, _u32 len, bool unchanged, int64 old_filesize)
+{
+	while(len>0)
+	{
+		_u32 tocopy = (std::min)(len, static_cast<_u32>(c_checkpoint_dist)-block.fill);
+
+		if(unchanged)
+		{
+			block.unchanged.push_back(std::make_pair(block.fill, tocopy));
+		}
+		else
+		{
+			memcpy(block.buf.data()+block.fill, data, tocopy);
+			data+=tocopy;
+			block.dirty=true;
+		}
+
+		block.fill+=tocopy;
+		len-=tocopy;
+
+		if(block.fill==c_checkpoint_dist
+			&& !finishCdcBlock(block, old_filesize))
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
+
+bool FileClientChunked::finishCdcBlock(SCdcBlock& block, int64 old_filesize)
+{
+	if(block.fill==0)
+	{
+		return true;
+	}
+
+	int64 block_idx = block.start/c_checkpoint_dist;
+	_u32 entry_size = big_hash_size + ((block.fill+c_chunk_size-1)/c_chunk_size)*small_hash_size;
+	char entry[chunkhash_single_size];
+	bool has_entry=false;
+
+	if(!block.dirty
+		&& old_filesize!=-1
+		&& (block.fill==c_checkpoint_dist || block.start+block.fill==old_filesize)
+		&& block.start+block.fill<=old_filesize)
+	{
+		//Block is unchanged. Reuse its hashes
+		has_entry = m_chunkhashes->Read(chunkhash_file_off+block_idx*chunkhash_single_size, entry, entry_size)==entry_size;
+	}
+
+	if(!has_entry)
+	{
+		for(size_t i=0;i<block.unchanged.size();++i)
+		{
+			bool read_err=false;
+			if(m_file->Read(block.start+block.unchanged[i].first, block.buf.data()+block.unchanged[i].first,
+				block.unchanged[i].second, &read_err)!=block.unchanged[i].second)
+			{
+				Server->Log("Error reading unchanged data at "+convert(block.start+block.unchanged[i].first)+" from \""+m_file->getFilename()+"\". "+os_last_error_str(), LL_ERROR);
+				return false;
+			}
+		}
+
+		MD5 big_hash;
+		big_hash.update(reinterpret_cast<unsigned char*>(block.buf.data()), block.fill);
+		big_hash.finalize();
+		memcpy(entry, big_hash.raw_digest_int(), big_hash_size);
+
+		char* small_hash = entry+big_hash_size;
+		for(_u32 pos=0;pos<block.fill;pos+=c_chunk_size)
+		{
+			_u32 adler = urb_adler32(urb_adler32(0, NULL, 0), block.buf.data()+pos, (std::min)(c_chunk_size, block.fill-pos));
+			adler = little_endian(adler);
+			memcpy(small_hash, &adler, small_hash_size);
+			small_hash+=small_hash_size;
+		}
+	}
+
+	if(m_hashoutput!=NULL)
+	{
+		m_hashoutput->Seek(chunkhash_file_off+block_idx*chunkhash_single_size);
+		writeFileRepeat(m_hashoutput, entry, entry_size);
+	}
+
+	block.start+=block.fill;
+	block.fill=0;
+	block.dirty=false;
+	block.unchanged.clear();
+
+	return !has_error;
+}
+
 _u32 FileClientChunked::GetFileChunked(std::string remotefn, IFile *file, IFile *chunkhashes, IFsFile *hashoutput, _i64& predicted_filesize, int64 file_id, bool is_script, IFile** sparse_extents_f)
 {
 	patch_mode=false;
@@ -293,18 +797,19 @@ _u32 FileClientChunked::GetFile(std::string remotefn, _i64& filesize_out, int64
 		num_total_chunks=0;
 	}
 
-	size_t queued_chunks_low = c_queued_chunks_low;
-
-	if(queue_only)
-	{
-		queued_chunks_low = c_max_queued_chunks;
-	}
-
 	do
 	{
+		unsigned int curr_chunk_window = chunkWindow();
+		size_t queued_chunks_low = curr_chunk_window/2;
+
+		if(queue_only)
+		{
+			queued_chunks_low = curr_chunk_window;
+		}
+
 		if(queuedChunks()<queued_chunks_low && remote_filesize!=-1 && next_chunk<num_total_chunks)
 		{		
-			while(queuedChunks()<c_max_queued_chunks && next_chunk<num_total_chunks)
+			while(queuedChunks()<curr_chunk_window && next_chunk<num_total_chunks)
 			{
 				if(!getPipe()->isWritable())
 				{
@@ -390,6 +895,11 @@ _u32 FileClientChunked::GetFile(std::string remotefn, _i64& filesize_out, int64
 					pending_chunks.insert(std::pair<_i64, SChunkHashes>(next_chunk*c_checkpoint_dist, SChunkHashes() ));
 				}
 
+				if (queuedChunks() == 0)
+				{
+					startWindowProbe();
+				}
+
 				if (stack->Send(getPipe(), buf, buf_size, c_default_timeout, false) != buf_size)
 				{
 					Server->Log("Timeout during chunk request of chunk "+convert(next_chunk*c_checkpoint_dist)+". Reconnecting...", LL_DEBUG);
@@ -692,6 +1202,11 @@ _u32 FileClientChunked::handle_data( char* buf, size_t bsize, bool ignore_filesi
 	reconnected=false;
 	bufptr=buf;
 	remaining_bufptr_bytes=bsize;
+
+	if(bsize>0)
+	{
+		finishWindowProbe();
+	}
 	while(bufptr<buf+bsize)
 	{
 		bufptr_bytes_done=0;
@@ -2133,6 +2648,18 @@ void FileClientChunked::decrQueuedChunks()
 	else
 	{
 		--queued_chunks;
+
+		++window_completed;
+		int64 curr_time = Server->getTimeMS();
+		if (window_rate_start == 0)
+		{
+			window_rate_start = curr_time;
+			window_bytes_start = getTransferredBytes();
+		}
+		else if (curr_time - window_rate_start >= 1000)
+		{
+			updateChunkWindow(curr_time);
+		}
 	}
 }
 
@@ -2145,6 +2672,105 @@ void FileClientChunked::resetQueuedChunks()
 	else
 	{
 		queued_chunks = 0;
+		window_probe_start = 0;
+		window_rate_start = 0;
+		window_completed = 0;
+	}
+}
+
+unsigned int FileClientChunked::chunkWindow()
+{
+	if(parent)
+	{
+		return parent->chunkWindow();
+	}
+	else
+	{
+		return chunk_window;
+	}
+}
+
+void FileClientChunked::startWindowProbe()
+{
+	if(parent)
+	{
+		return parent->startWindowProbe();
+	}
+	else if(window_probe_start==0)
+	{
+		//Nothing is in flight, so the time until the first response
+		//arrives is the round trip time without any queuing
+		window_probe_start = Server->getTimeMS();
+	}
+}
+
+void FileClientChunked::finishWindowProbe()
+{
+	if(parent)
+	{
+		return parent->finishWindowProbe();
+	}
+	else if(window_probe_start!=0)
+	{
+		int64 rtt = (std::max)(static_cast<int64>(1), Server->getTimeMS() - window_probe_start);
+		window_probe_start = 0;
+
+		if (window_rtt == 0)
+		{
+			window_rtt = rtt;
+		}
+		else
+		{
+			window_rtt = (3 * window_rtt + rtt) / 4;
+		}
+	}
+}
+
+void FileClientChunked::updateChunkWindow(int64 curr_time)
+{
+	int64 rate = (window_completed * 1000LL) / (curr_time - window_rate_start);
+	int64 curr_bytes = getTransferredBytes();
+	int64 byte_rate = ((curr_bytes - window_bytes_start) * 1000LL) / (curr_time - window_rate_start);
+	window_rate_start = curr_time;
+	window_bytes_start = curr_bytes;
+	window_completed = 0;
+
+	if (window_rate == 0)
+	{
+		window_rate = rate;
+		window_byte_rate = byte_rate;
+	}
+	else
+	{
+		window_rate = (3 * window_rate + rate) / 4;
+		window_byte_rate = (3 * window_byte_rate + byte_rate) / 4;
+	}
+
+	if (window_rtt == 0 || window_rate == 0)
+	{
+		return;
+	}
+
+	//Twice the bandwidth-delay product (in chunks) keeps the pipe full while
+	//the requests for the next half of the window are sent.
+	//If the window limited the rate this doubles the window
+	int64 bdp = (window_rate*window_rtt + 999) / 1000;
+
+	//Requests for unchanged chunks are answered with a few bytes, but each of
+	//them may return a whole chunk once the data changes, so the worst case
+	//is limited in bytes
+	int64 bdp_bytes = (window_byte_rate*window_rtt + 999) / 1000;
+	int64 max_window_bytes = (std::max)(c_min_queued_chunk_bytes, c_queued_chunk_bytes_bdp_factor*bdp_bytes);
+
+	unsigned int new_window = static_cast<unsigned int>((std::max)(static_cast<int64>(c_min_queued_chunks),
+		(std::min)((std::min)(static_cast<int64>(max_chunk_window()), max_window_bytes / c_checkpoint_dist), 2 * bdp)));
+
+	if (new_window != chunk_window)
+	{
+		VLOG(Server->Log("Chunk request window " + convert(chunk_window) + " -> " + convert(new_window)
+			+ " (rtt=" + convert(window_rtt) + "ms rate=" + convert(window_rate) + " chunks/s "
+			+ PrettyPrintSpeed(static_cast<size_t>(window_byte_rate)) + ")", LL_DEBUG));
+		chunk_window = new_window;
 	}
 }
 
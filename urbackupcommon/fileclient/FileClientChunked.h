@@ -7,6 +7,7 @@
 #include "../../md5.h"
 #include "../../fileservplugin/chunk_settings.h"
 #include "../ExtentIterator.h"
+#include "../../common/fastcdc.h"
 #include <map>
 #include <deque>
 
@@ -14,8 +15,15 @@ class IFile;
 class IPipe;
 class CTCPStack;
 
-const unsigned int c_max_queued_chunks=1000;
-const unsigned int c_queued_chunks_low=100;
+//Chunk request window before the bandwidth-delay product has been measured
+const unsigned int c_initial_queued_chunks=64;
+const unsigned int c_min_queued_chunks=32;
+const unsigned int c_max_queued_chunks=1024;
+//Every queued chunk may be answered with c_checkpoint_dist bytes of data. The
+//window is limited to this many bytes or a few times the bandwidth-delay
+//product in bytes, whichever is larger
+const _i64 c_min_queued_chunk_bytes=32*1024*1024;
+const _i64 c_queued_chunk_bytes_bdp_factor=4;
 
 enum EChunkedState
 {
@@ -64,6 +72,11 @@ public:
 
 	_u32 GetFileChunked(std::string remotefn, IFile *file, IFile *chunkhashes, IFsFile *hashoutput, _i64& predicted_filesize, int64 file_id, bool is_script, IFile** sparse_extents_f);
 	_u32 GetFilePatch(std::string remotefn, IFile *orig_file, IFile *patchfile, IFile *chunkhashes, IFsFile *hashoutput, _i64& predicted_filesize, int64 file_id, bool is_script, IFile** sparse_extents_f);
+	//Same output as GetFilePatch, but the file is transferred as content-defined chunks, which are
+	//looked up in orig_index (the chunk index of orig_file). Needs ID_GET_FILE_CDC support on the client. Cannot be queued.
+	//Falls back to GetFilePatch if the index does not fit into a request. new_index receives the chunk index of the new file
+	_u32 GetFilePatchCdc(std::string remotefn, IFile *orig_file, const std::vector<SCdcChunk>& orig_index, IFile *patchfile, IFile *chunkhashes, IFsFile *hashoutput,
+		_i64& predicted_filesize, int64 file_id, std::vector<SCdcChunk>* new_index);
 
 	bool hasError(void);
 
@@ -126,6 +139,19 @@ private:
 
 	void calcTotalChunks();
 
+	struct SCdcBlock
+	{
+		int64 start;
+		_u32 fill;
+		bool dirty;
+		std::vector<char> buf;
+		std::vector<std::pair<_u32, _u32> > unchanged;
+	};
+
+	bool readCdc(char* buf, size_t bsize);
+	bool addCdcData(SCdcBlock& block, const char* data, _u32 len, bool unchanged, int64 old_filesize);
+	bool finishCdcBlock(SCdcBlock& block, int64 old_filesize);
+
 	_u32 loadFileOutOfBand(IFile** sparse_extents_f);
 
 	bool constructOutOfBandPipe();
@@ -147,6 +173,11 @@ private:
 	void decrQueuedChunks();
 	void resetQueuedChunks();
 
+	unsigned int chunkWindow();
+	void startWindowProbe();
+	void finishWindowProbe();
+	void updateChunkWindow(int64 curr_time);
+
 	void addReceivedBytes(size_t bytes);
 
 	void addSparseBytes(_i64 bytes);
@@ -200,6 +231,16 @@ private:
 	int64 starttime;
 	unsigned int queued_chunks;
 
+	//Request window. Sized to twice the measured bandwidth-delay product
+	unsigned int chunk_window;
+	int64 window_probe_start;
+	int64 window_rtt;
+	int64 window_rate;
+	int64 window_rate_start;
+	unsigned int window_completed;
+	int64 window_byte_rate;
+	int64 window_bytes_start;
+
 	EChunkedState state;
 	char curr_id;
 	unsigned int need_bytes;
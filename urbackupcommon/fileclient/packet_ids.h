@@ -35,6 +35,10 @@ const uchar ID_FLUSH_SOCKET=13;
 const uchar ID_SCRIPT_FINISH = 14;
 const uchar ID_FREE_SERVER_FILE=18;
 const uchar ID_STOP_PHASH = 19;
+const uchar ID_GET_FILE_CDC = 20;
+		const uchar ID_CDC_REF = 21;
+		const uchar ID_CDC_DATA = 22;
+		const uchar ID_CDC_END = 23;
 
 //errors
 const unsigned int ERR_SEEKING_FAILED = 0;
@@ -19,6 +19,29 @@
 #include "filelist_utils.h"
 #include "../Interface/Server.h"
 #include "../stringtools.h"
+#include <memory.h>
+
+namespace
+{
+	//Number of bytes before the first occurrence of d1 or d2
+	size_t span_until(const char* buf, size_t bsize, char d1, char d2)
+	{
+		const char* p = static_cast<const char*>(memchr(buf, d1, bsize));
+		if (p != NULL)
+		{
+			bsize = p - buf;
+		}
+		if (d2 != d1)
+		{
+			p = static_cast<const char*>(memchr(buf, d2, bsize));
+			if (p != NULL)
+			{
+				bsize = p - buf;
+			}
+		}
+		return bsize;
+	}
+}
 
 void writeFileRepeat(IFile *f, const char *buf, size_t bsize)
 {
@@ -316,9 +339,55 @@ bool FileListParser::nextEntry( char ch, SFile &data, std::map<std::string, std:
 	return false;
 }
 
+bool FileListParser::nextEntry(const char* buf, size_t bsize, size_t& off, SFile &data, std::map<std::string, std::string>* extra)
+{
+	while (off < bsize)
+	{
+		const char* curr = buf + off;
+		size_t remaining = bsize - off;
+		size_t run = 0;
+
+		switch (state)
+		{
+		case ParseState_Name:
+			run = span_until(curr, remaining, '"', '\\');
+			break;
+		case ParseState_Filesize:
+			run = span_until(curr, remaining, ' ', ' ');
+			break;
+		case ParseState_ModifiedTime:
+			run = span_until(curr, remaining, '\n', '#');
+			break;
+		case ParseState_ExtraParams:
+			run = span_until(curr, remaining, '\n', '\n');
+			break;
+		default:
+			break;
+		}
+
+		if (run > 0)
+		{
+			t_name.append(curr, run);
+			pos += run;
+			off += run;
+			if (off >= bsize)
+			{
+				break;
+			}
+		}
+
+		//Delimiters and the remaining states go through the per character parser
+		if (nextEntry(buf[off++], data, extra))
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
 void FileListParser::reset( void )
 {
-	t_name="";
+	t_name.clear();
 	state=ParseState_Type;
 	pos = 0;
 }
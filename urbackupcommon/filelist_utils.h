@@ -21,6 +21,11 @@ public:
 
 	bool nextEntry(char ch, SFile &data, std::map<std::string, std::string>* extra);
 
+	//Parses buf starting at off until an entry is complete (returns true)
+	//or the buffer is exhausted. Advances off past the consumed bytes.
+	//Runs of name and number bytes are scanned and copied in one go
+	bool nextEntry(const char* buf, size_t bsize, size_t& off, SFile &data, std::map<std::string, std::string>* extra);
+
 private:
 
 	enum ParseState
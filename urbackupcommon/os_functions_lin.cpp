@@ -48,8 +48,11 @@
 #include <sys/resource.h>
 #include <sys/syscall.h>
 #include <linux/fs.h>
+#include <sys/sysmacros.h>
 #endif
 #include <stack>
+#include <atomic>
+#include <string.h>
 
 #if defined(__FreeBSD__) || defined(__APPLE__)
 #define lstat64 lstat
@@ -82,6 +85,224 @@ std::vector<SFile> getFilesWin(const std::string &path, bool *has_error, bool ex
 	return getFiles(path, has_error, ignore_other_fs);
 }
 
+#ifdef __linux__
+namespace
+{
+	const size_t getdents_buffer_size = 256*1024;
+
+	struct SDirEntry
+	{
+		uint64 ino;
+		std::string name;
+
+		bool operator<(const SDirEntry& other) const
+		{
+			return ino < other.ino;
+		}
+	};
+
+	struct SStatInfo
+	{
+		mode_t mode;
+		dev_t dev;
+		int64 size;
+		int64 mtime;
+		int64 ctime;
+		int64 atime;
+	};
+
+	int stat_entry(int dfd, const char* name, bool follow_symlink, SStatInfo& info)
+	{
+#ifdef STATX_TYPE
+		static std::atomic<bool> has_statx(true);
+		if(has_statx)
+		{
+			//Only request the fields the file list needs. Lets
+			//network file systems skip fetching the rest
+			struct statx stx;
+			unsigned int mask = follow_symlink ? STATX_TYPE :
+				(STATX_TYPE | STATX_MODE | STATX_SIZE | STATX_MTIME | STATX_CTIME | STATX_ATIME);
+			int rc = statx(dfd, name, (follow_symlink ? 0 : AT_SYMLINK_NOFOLLOW) | AT_NO_AUTOMOUNT, mask, &stx);
+			if(rc==0)
+			{
+				info.mode = stx.stx_mode;
+				info.dev = makedev(stx.stx_dev_major, stx.stx_dev_minor);
+				info.size = stx.stx_size;
+				info.mtime = stx.stx_mtime.tv_sec;
+				info.ctime = stx.stx_ctime.tv_sec;
+				info.atime = stx.stx_atime.tv_sec;
+				return 0;
+			}
+			else if(errno!=ENOSYS)
+			{
+				return rc;
+			}
+			has_statx=false;
+		}
+#endif
+		struct stat64 f_info;
+		int rc = fstatat64(dfd, name, &f_info, follow_symlink ? 0 : AT_SYMLINK_NOFOLLOW);
+		if(rc==0)
+		{
+			info.mode = f_info.st_mode;
+			info.dev = f_info.st_dev;
+			info.size = f_info.st_size;
+			info.mtime = f_info.st_mtime;
+			info.ctime = f_info.st_ctime;
+			info.atime = f_info.st_atime;
+		}
+		return rc;
+	}
+}
+
+std::vector<SFile> getFiles(const std::string &path, bool *has_error, bool ignore_other_fs)
+{
+	if(has_error!=NULL)
+	{
+		*has_error=false;
+	}
+	std::vector<SFile> tmp;
+	int dfd = open64(path.c_str(), O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+	if(dfd==-1)
+	{
+		if(has_error!=NULL)
+		{
+			*has_error=true;
+		}
+		std::string errmsg;
+		int err = os_last_error(errmsg);
+		Log("Cannot open \""+path+"\": "+errmsg+" ("+convert(err)+")", LL_ERROR);
+		return tmp;
+	}
+
+	dev_t parent_dev_id;
+	bool has_parent_dev_id=false;
+	if(ignore_other_fs)
+	{
+		struct stat64 f_info;
+		int rc=fstat64(dfd, &f_info);
+		if(rc==0)
+		{
+			has_parent_dev_id = true;
+			parent_dev_id = f_info.st_dev;
+		}
+	}
+
+	std::string upath = path + os_file_sep();
+
+	//Read the whole directory with a few large getdents calls first,
+	//then stat the entries in inode order, which is roughly their on-disk order
+	std::vector<SDirEntry> entries;
+	thread_local std::vector<char> dents_buf(getdents_buffer_size);
+	while(true)
+	{
+		long rc = syscall(SYS_getdents64, dfd, dents_buf.data(), dents_buf.size());
+		if(rc<0)
+		{
+			if(errno==EINTR)
+			{
+				continue;
+			}
+			std::string errmsg;
+			int err = os_last_error(errmsg);
+			Log("Error listing files in directory \""+path+"\": "+errmsg+" ("+convert(err)+")", LL_ERROR);
+			if(has_error!=NULL)
+				*has_error=true;
+			break;
+		}
+		else if(rc==0)
+		{
+			break;
+		}
+
+		for(long pos=0;pos<rc;)
+		{
+			struct dirent64* dirp = reinterpret_cast<struct dirent64*>(dents_buf.data()+pos);
+			pos+=dirp->d_reclen;
+
+			if(strcmp(dirp->d_name, ".")==0 || strcmp(dirp->d_name, "..")==0)
+				continue;
+
+			SDirEntry entry;
+			entry.ino = dirp->d_ino;
+			entry.name = dirp->d_name;
+			entries.push_back(entry);
+		}
+	}
+
+	std::sort(entries.begin(), entries.end());
+
+	tmp.reserve(entries.size());
+	for(size_t i=0;i<entries.size();++i)
+	{
+		SFile f;
+		f.name=entries[i].name;
+
+		SStatInfo f_info;
+		int rc=stat_entry(dfd, f.name.c_str(), false, f_info);
+		if(rc!=0)
+		{
+			std::string errmsg;
+			int err = os_last_error(errmsg);
+			Log("Cannot stat \""+upath+f.name+"\": "+(errmsg)+" ("+convert(err)+")", LL_ERROR);
+			if(has_error!=NULL)
+			{
+				*has_error=true;
+			}
+			continue;
+		}
+
+		f.isdir = S_ISDIR(f_info.mode);
+
+		if(ignore_other_fs && f.isdir
+			&& has_parent_dev_id && parent_dev_id!=f_info.dev)
+		{
+			continue;
+		}
+
+		if(S_ISLNK(f_info.mode))
+		{
+			f.issym=true;
+			f.isspecialf=true;
+			SStatInfo l_info;
+			int rc2 = stat_entry(dfd, f.name.c_str(), true, l_info);
+
+			if(rc2==0)
+			{
+				f.isdir=S_ISDIR(l_info.mode);
+			}
+			else
+			{
+				f.isdir=false;
+			}
+		}
+
+		f.usn = (uint64)f_info.mtime | ((uint64)f_info.ctime<<32);
+
+		if(!f.isdir)
+		{
+			if(!S_ISREG(f_info.mode) )
+			{
+				f.isspecialf=true;
+			}
+
+			f.size=f_info.size;
+		}
+
+		f.last_modified=f_info.mtime;
+		f.created = f_info.ctime;
+		f.accessed = f_info.atime;
+
+		tmp.push_back(f);
+	}
+
+	close(dfd);
+
+	std::sort(tmp.begin(), tmp.end());
+
+	return tmp;
+}
+#else //__linux__
 std::vector<SFile> getFiles(const std::string &path, bool *has_error, bool ignore_other_fs)
 {
 	if(has_error!=NULL)
@@ -240,6 +461,7 @@ std::vector<SFile> getFiles(const std::string &path, bool *has_error, bool ignor
 	
     return tmp;
 }
+#endif //__linux__
 
 bool removeFile(const std::string &path)
 {
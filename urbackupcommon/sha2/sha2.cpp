@@ -37,6 +37,9 @@
 
 #ifdef DO_NOT_USE_CRYPTOPP_SHA
 
+#include "../../common/cpu_features.h"
+#include <atomic>
+
 
 #ifdef __cplusplus
 extern "C" {
@@ -385,7 +388,7 @@ void SHA256_Init(SHA256_CTX* context) {
 	(h) = T1 + Sigma0_256(a) + Maj((a), (b), (c)); \
 	j++
 
-void SHA256_Transform(SHA256_CTX* context, const sha2_word32* data) {
+static void SHA256_Transform_generic(SHA256_CTX* context, const sha2_word32* data) {
 	sha2_word32	a, b, c, d, e, f, g, h, s0, s1;
 	sha2_word32	T1, *W256;
 	int		j;
@@ -443,7 +446,7 @@ void SHA256_Transform(SHA256_CTX* context, const sha2_word32* data) {
 
 #else /* SHA2_UNROLL_TRANSFORM */
 
-void SHA256_Transform(SHA256_CTX* context, const sha2_word32* data) {
+static void SHA256_Transform_generic(SHA256_CTX* context, const sha2_word32* data) {
 	sha2_word32	a, b, c, d, e, f, g, h, s0, s1;
 	sha2_word32	T1, T2, *W256;
 	int		j;
@@ -523,6 +526,84 @@ void SHA256_Transform(SHA256_CTX* context, const sha2_word32* data) {
 
 #endif /* SHA2_UNROLL_TRANSFORM */
 
+#ifdef URB_CPU_X86
+
+/*
+* SHA-256 using the x86 SHA extensions (SHA-NI). Processes 'blocks' 64 byte
+* blocks of big-endian input. The state is kept in the ABEF/CDGH layout the
+* sha256rnds2 instruction expects and converted back at the end.
+*/
+URB_TARGET_ATTRIBUTE("sha,sse4.1,ssse3")
+static void SHA256_Transform_shani(sha2_word32 state[8], const sha2_byte* data, size_t blocks) {
+	const __m128i byteswap_mask = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+
+	__m128i tmp = _mm_loadu_si128((const __m128i*)&state[0]);
+	__m128i state1 = _mm_loadu_si128((const __m128i*)&state[4]);
+
+	tmp = _mm_shuffle_epi32(tmp, 0xB1);		/* CDAB */
+	state1 = _mm_shuffle_epi32(state1, 0x1B);	/* EFGH */
+	__m128i state0 = _mm_alignr_epi8(tmp, state1, 8);	/* ABEF */
+	state1 = _mm_blend_epi16(state1, tmp, 0xF0);	/* CDGH */
+
+	while (blocks > 0) {
+		const __m128i abef_save = state0;
+		const __m128i cdgh_save = state1;
+		__m128i W[4];
+		int g;
+
+		for (g = 0; g < 16; ++g) {
+			__m128i msg;
+			if (g < 4) {
+				msg = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(data + g * 16)), byteswap_mask);
+			}
+			else {
+				/* W[t] = sigma1(W[t-2]) + W[t-7] + sigma0(W[t-15]) + W[t-16] */
+				msg = _mm_sha256msg1_epu32(W[g & 3], W[(g + 1) & 3]);
+				msg = _mm_add_epi32(msg, _mm_alignr_epi8(W[(g + 3) & 3], W[(g + 2) & 3], 4));
+				msg = _mm_sha256msg2_epu32(msg, W[(g + 3) & 3]);
+			}
+			W[g & 3] = msg;
+
+			msg = _mm_add_epi32(msg, _mm_loadu_si128((const __m128i*)&K256[g * 4]));
+			state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+			msg = _mm_shuffle_epi32(msg, 0x0E);
+			state0 = _mm_sha256rnds2_epu32(state0, state1, msg);
+		}
+
+		state0 = _mm_add_epi32(state0, abef_save);
+		state1 = _mm_add_epi32(state1, cdgh_save);
+
+		data += SHA256_BLOCK_LENGTH;
+		--blocks;
+	}
+
+	tmp = _mm_shuffle_epi32(state0, 0x1B);		/* FEBA */
+	state1 = _mm_shuffle_epi32(state1, 0xB1);	/* DCHG */
+	state0 = _mm_blend_epi16(tmp, state1, 0xF0);	/* DCBA */
+	state1 = _mm_alignr_epi8(state1, tmp, 8);	/* ABEF */
+
+	_mm_storeu_si128((__m128i*)&state[0], state0);
+	_mm_storeu_si128((__m128i*)&state[4], state1);
+}
+
+static std::atomic<bool> sha2_accel_enabled(true);
+
+static int SHA256_Use_shani(void) {
+	return sha2_accel_enabled.load(std::memory_order_relaxed) && cpu_features::has_sha();
+}
+
+#endif /* URB_CPU_X86 */
+
+void SHA256_Transform(SHA256_CTX* context, const sha2_word32* data) {
+#ifdef URB_CPU_X86
+	if (SHA256_Use_shani()) {
+		SHA256_Transform_shani(context->state, (const sha2_byte*)data, 1);
+		return;
+	}
+#endif
+	SHA256_Transform_generic(context, data);
+}
+
 void SHA256_Update(SHA256_CTX* context, const sha2_byte *data, size_t len) {
 	unsigned int	freespace, usedspace;
 
@@ -556,6 +637,16 @@ void SHA256_Update(SHA256_CTX* context, const sha2_byte *data, size_t len) {
 			return;
 		}
 	}
+#ifdef URB_CPU_X86
+	if (len >= SHA256_BLOCK_LENGTH && SHA256_Use_shani()) {
+		/* Process all complete blocks without reloading the state in between */
+		size_t blocks = len / SHA256_BLOCK_LENGTH;
+		SHA256_Transform_shani(context->state, data, blocks);
+		context->bitcount += (sha2_word64)(blocks * SHA256_BLOCK_LENGTH) << 3;
+		len -= blocks * SHA256_BLOCK_LENGTH;
+		data += blocks * SHA256_BLOCK_LENGTH;
+	}
+#endif
 	while (len >= SHA256_BLOCK_LENGTH) {
 		/* Process as many complete blocks as we can */
 		SHA256_Transform(context, (sha2_word32*)data);
@@ -1126,6 +1217,24 @@ void sha512(const unsigned char *message, unsigned int len,
 	SHA512_Data(message, len, reinterpret_cast<char*>(digest));
 }
 
+const char* sha256_impl()
+{
+#ifdef URB_CPU_X86
+	if (SHA256_Use_shani())
+	{
+		return "sha-ni";
+	}
+#endif
+	return "generic";
+}
+
+void sha2_set_accel(bool enabled)
+{
+#ifdef URB_CPU_X86
+	sha2_accel_enabled.store(enabled, std::memory_order_relaxed);
+#endif
+}
+
 #else //!DO_NOT_USE_CRYPTOPP_SHA
 
 void sha256_init(sha256_ctx * ctx)
@@ -1179,4 +1288,13 @@ void sha256(const unsigned char *message, unsigned int len, unsigned char *diges
 	sha256_final(&ctx, digest);
 }
 
+const char* sha256_impl()
+{
+	return "cryptopp";
+}
+
+void sha2_set_accel(bool enabled)
+{
+}
+
 #endif //DO_NOT_USE_CRYPTOPP_SHA
\ No newline at end of file
@@ -241,6 +241,12 @@ void sha512_final(sha512_ctx *ctx, unsigned char *digest);
 void sha512(const unsigned char *message, unsigned int len,
 	unsigned char *digest);
 
+//Name of the SHA-256 implementation in use
+const char* sha256_impl();
+
+//Enable/disable the SHA-NI accelerated SHA-256 (for benchmarking). Not thread-safe.
+void sha2_set_accel(bool enabled);
+
 
 typedef sha512_ctx sha_def_ctx;
 
@@ -60,7 +60,7 @@ Backup::Backup(ClientMain* client_main, int clientid, std::string clientname, st
 	is_file_backup(is_file_backup), r_incremental(is_incremental), r_resumed(false), backup_result(false),
 	log_backup(true), has_early_error(false), should_backoff(true), db(NULL), status_id(0), has_timeout_error(false),
 	server_token(server_token), details(details), num_issues(0), stop_backup_running(true), scheduled(scheduled),
-	allow_remove_backup_folder(true)
+	allow_remove_backup_folder(true), status_handle(new ProcessCounters)
 {
 	
 }
@@ -111,7 +111,12 @@ void Backup::operator()()
 		{
 			status_id = ServerStatus::startProcess(clientname, sa_full_image, details, logid, true);
 		}
-		ServerStatus::setProcessPcDone(clientname, status_id, 0);
+	}
+	status_handle = ServerStatus::getProcessHandle(clientname, status_id);
+
+	if (!is_file_backup)
+	{
+		status_handle->setPcDone(0);
 	}
 
 	createDirectoryForClient();
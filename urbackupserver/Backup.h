@@ -131,6 +131,7 @@ protected:
 
 	logid_t logid;
 	size_t status_id;
+	ProcessHandle status_handle;
 
 	ActiveThread* active_thread;
 
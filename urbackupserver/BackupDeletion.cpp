@@ -0,0 +1,461 @@
+/*************************************************************************
+*    UrBackup - Client/Server backup system
+*    Copyright (C) 2011-2016 Martin Raiber
+*
+*    This program is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU Affero General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU Affero General Public License for more details.
+*
+*    You should have received a copy of the GNU Affero General Public License
+*    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**************************************************************************/
+
+#ifndef CLIENT_ONLY
+
+#include "BackupDeletion.h"
+#include "../Interface/Server.h"
+#include "../Interface/Thread.h"
+#include "../Interface/ThreadPool.h"
+#include "../Interface/Database.h"
+#include "../urbackupcommon/os_functions.h"
+#include "../stringtools.h"
+#include "server_dir_links.h"
+#include "server_status.h"
+#include "server_metrics.h"
+#include "BlockDedupStore.h"
+#include <algorithm>
+#include <memory>
+
+IMutex* BackupDeletion::pause_mutex = NULL;
+ICondition* BackupDeletion::pause_cond = NULL;
+bool BackupDeletion::paused = false;
+volatile bool BackupDeletion::do_quit = false;
+
+namespace
+{
+	bool longer_path(const std::string& a, const std::string& b)
+	{
+		return a.size() > b.size();
+	}
+}
+
+class BackupDeletion::Worker : public IThread
+{
+public:
+	Worker(BackupDeletion& deletion, std::vector<char>* removed)
+		: deletion(deletion), removed(removed)
+	{}
+
+	void operator()()
+	{
+		deletion.runWorker(removed);
+	}
+
+private:
+	BackupDeletion& deletion;
+	std::vector<char>* removed;
+};
+
+BackupDeletion::BackupDeletion(logid_t logid, int clientid)
+	: logid(logid), clientid(clientid), n_workers(0), starttime(0),
+	mutex(Server->createMutex()), cond(Server->createCondition()),
+	busy_workers(0), has_error(false), aborted(false),
+	removed_files(0), removed_bytes(0), removed_dirs(0)
+{
+	n_threads = static_cast<size_t>((std::max)(1, watoi(Server->getServerParameter("cleanup_delete_threads", "4"))));
+}
+
+BackupDeletion::~BackupDeletion()
+{
+	Server->destroy(cond);
+	Server->destroy(mutex);
+}
+
+void BackupDeletion::init_mutex()
+{
+	pause_mutex = Server->createMutex();
+	pause_cond = Server->createCondition();
+}
+
+void BackupDeletion::destroy_mutex()
+{
+	Server->destroy(pause_cond);
+	Server->destroy(pause_mutex);
+}
+
+bool BackupDeletion::isEnabled()
+{
+	return watoi(Server->getServerParameter("cleanup_delete_threads", "4")) > 1;
+}
+
+size_t BackupDeletion::getSqlBatchSize()
+{
+	return static_cast<size_t>((std::max)(static_cast<int64>(0),
+		watoi64(Server->getServerParameter("cleanup_delete_batch_size", "10000"))));
+}
+
+void BackupDeletion::setPaused(bool b)
+{
+	IScopedLock lock(pause_mutex);
+	if (paused != b)
+	{
+		Server->Log(b ? "Pausing backup deletion" : "Resuming backup deletion", LL_INFO);
+	}
+	paused = b;
+	pause_cond->notify_all();
+}
+
+bool BackupDeletion::isPaused()
+{
+	IScopedLock lock(pause_mutex);
+	return paused;
+}
+
+bool BackupDeletion::waitWhilePaused()
+{
+	IScopedLock lock(pause_mutex);
+	while (paused && !do_quit)
+	{
+		pause_cond->wait(&lock, 10000);
+		ServerStatus::updateActive();
+	}
+	return !do_quit;
+}
+
+void BackupDeletion::doQuit()
+{
+	IScopedLock lock(pause_mutex);
+	do_quit = true;
+	pause_cond->notify_all();
+}
+
+bool BackupDeletion::removeTree(const std::string& path, ServerLinkDao& link_dao)
+{
+	IScopedLock lock(NULL);
+	dir_link_lock_client_mutex(clientid, lock);
+
+	std::string root = os_file_prefix(path);
+
+	//A directory link root points into the shared directory pool, so only the link is removed
+	if (os_is_symlink(root))
+	{
+		if (!os_remove_symlink_dir(root))
+		{
+			ServerLogger::Log(logid, "Error deleting symlink \"" + path + "\" (root)", LL_ERROR);
+		}
+		return true;
+	}
+
+	BlockDedupStore* block_store = BlockDedupStore::getInstance();
+	if (block_store != NULL)
+	{
+		block_store->releaseDirectory(path);
+	}
+
+	deferred_dirs.clear();
+	SItem item = { root, std::string::npos };
+	queue.push_back(item);
+
+	run(n_threads, &link_dao, NULL);
+
+	if (!aborted)
+	{
+		//Directories with subdirectories removed by other workers. Children sort before their parents
+		std::sort(deferred_dirs.begin(), deferred_dirs.end(), longer_path);
+
+		for (size_t i = 0; i < deferred_dirs.size(); ++i)
+		{
+			if (!os_remove_dir(deferred_dirs[i]))
+			{
+				ServerLogger::Log(logid, "Error deleting directory \"" + deferred_dirs[i] + "\". " + os_last_error_str(), LL_ERROR);
+				has_error = true;
+			}
+			else
+			{
+				++removed_dirs;
+			}
+		}
+	}
+
+	logProgress(path, true);
+
+	return !has_error && !aborted;
+}
+
+void BackupDeletion::removeFiles(const std::vector<std::string>& paths, std::vector<char>& removed)
+{
+	removed.resize(paths.size(), 0);
+
+	for (size_t i = 0; i < paths.size(); ++i)
+	{
+		SItem item = { paths[i], i };
+		queue.push_back(item);
+	}
+
+	run((std::min)(n_threads, paths.size()), NULL, &removed);
+}
+
+bool BackupDeletion::isAborted()
+{
+	return aborted;
+}
+
+void BackupDeletion::run(size_t p_n_workers, ServerLinkDao* link_dao, std::vector<char>* removed)
+{
+	starttime = Server->getTimeMS();
+	has_error = false;
+	aborted = false;
+	removed_files = 0;
+	removed_bytes = 0;
+	removed_dirs = 0;
+	n_workers = p_n_workers;
+	busy_workers = 0;
+
+	std::vector<std::unique_ptr<Worker> > workers;
+	std::vector<THREADPOOL_TICKET> tickets;
+	for (size_t i = 0; i < n_workers; ++i)
+	{
+		workers.push_back(std::unique_ptr<Worker>(new Worker(*this, removed)));
+		tickets.push_back(Server->getThreadPool()->execute(workers[i].get(), "delete backup"));
+	}
+
+	int64 last_log = starttime;
+
+	IScopedLock lock(mutex);
+	while (true)
+	{
+		while (!link_requests.empty())
+		{
+			SLinkRequest* req = link_requests.front();
+			link_requests.pop_front();
+			lock.relock(NULL);
+
+			if (link_dao != NULL)
+			{
+				std::unique_ptr<DBScopedSynchronous> synchronous_link_dao;
+				remove_directory_link(req->path, *link_dao, clientid, synchronous_link_dao);
+			}
+
+			lock.relock(mutex);
+			req->done = true;
+			cond->notify_all();
+		}
+
+		if (queue.empty() && busy_workers == 0)
+		{
+			break;
+		}
+
+		cond->wait(&lock, 1000);
+
+		if (Server->getTimeMS() - last_log > 60000)
+		{
+			lock.relock(NULL);
+			ServerStatus::updateActive();
+			logProgress(queue.empty() ? std::string() : queue.front().path, false);
+			last_log = Server->getTimeMS();
+			lock.relock(mutex);
+		}
+	}
+	lock.relock(NULL);
+
+	Server->getThreadPool()->waitFor(tickets);
+
+	ServerMetrics::addDeleted(removed_files, removed_bytes);
+}
+
+void BackupDeletion::runWorker(std::vector<char>* removed)
+{
+	IScopedLock lock(mutex);
+	while (true)
+	{
+		if (queue.empty())
+		{
+			if (busy_workers == 0)
+			{
+				break;
+			}
+			cond->wait(&lock);
+			continue;
+		}
+
+		SItem item = queue.front();
+		queue.pop_front();
+		++busy_workers;
+		lock.relock(NULL);
+
+		if (!waitWhilePaused())
+		{
+			lock.relock(mutex);
+			aborted = true;
+			queue.clear();
+		}
+		else if (item.file_idx != std::string::npos)
+		{
+			if (Server->deleteFile(os_file_prefix(item.path)))
+			{
+				(*removed)[item.file_idx] = 1;
+				++removed_files;
+			}
+			lock.relock(mutex);
+		}
+		else
+		{
+			removeDir(item.path);
+			lock.relock(mutex);
+		}
+
+		--busy_workers;
+		cond->notify_all();
+	}
+}
+
+void BackupDeletion::removeDir(const std::string& root)
+{
+	struct SDir
+	{
+		std::string path;
+		bool expanded;
+		bool deferred;
+	};
+
+	std::vector<SDir> stack;
+	SDir root_dir = { root, false, false };
+	stack.push_back(root_dir);
+
+	while (!stack.empty())
+	{
+		if (stack.back().expanded)
+		{
+			SDir dir = stack.back();
+			stack.pop_back();
+
+			if (dir.deferred)
+			{
+				IScopedLock lock(mutex);
+				deferred_dirs.push_back(dir.path);
+				if (!stack.empty())
+				{
+					stack.back().deferred = true;
+				}
+			}
+			else if (!os_remove_dir(dir.path))
+			{
+				ServerLogger::Log(logid, "Error deleting directory \"" + dir.path + "\". " + os_last_error_str(), LL_ERROR);
+				IScopedLock lock(mutex);
+				has_error = true;
+			}
+			else
+			{
+				++removed_dirs;
+			}
+			continue;
+		}
+
+		if (!waitWhilePaused())
+		{
+			IScopedLock lock(mutex);
+			aborted = true;
+			queue.clear();
+			return;
+		}
+
+		size_t curr = stack.size() - 1;
+		stack[curr].expanded = true;
+		std::string path = stack[curr].path;
+
+		bool list_error = false;
+		std::vector<SFile> files = getFiles(path, &list_error);
+		if (list_error)
+		{
+			ServerLogger::Log(logid, "No permission to access \"" + path + "\"", LL_ERROR);
+			IScopedLock lock(mutex);
+			has_error = true;
+			continue;
+		}
+
+		for (size_t i = 0; i < files.size(); ++i)
+		{
+			std::string fpath = path + os_file_sep() + files[i].name;
+
+			if (files[i].issym)
+			{
+				removeLink(fpath);
+			}
+			else if (files[i].isdir)
+			{
+				if (shareDir(fpath))
+				{
+					stack[curr].deferred = true;
+				}
+				else
+				{
+					SDir dir = { fpath, false, false };
+					stack.push_back(dir);
+				}
+			}
+			else if (!Server->deleteFile(fpath))
+			{
+				ServerLogger::Log(logid, "Error deleting file \"" + fpath + "\". " + os_last_error_str(), LL_ERROR);
+				IScopedLock lock(mutex);
+				has_error = true;
+			}
+			else
+			{
+				++removed_files;
+				removed_bytes += files[i].size;
+			}
+		}
+	}
+}
+
+void BackupDeletion::removeLink(const std::string& path)
+{
+	SLinkRequest req = { path, false };
+
+	IScopedLock lock(mutex);
+	link_requests.push_back(&req);
+	cond->notify_all();
+
+	while (!req.done)
+	{
+		cond->wait(&lock);
+	}
+}
+
+bool BackupDeletion::shareDir(const std::string& path)
+{
+	IScopedLock lock(mutex);
+	if (aborted
+		|| busy_workers + queue.size() >= n_workers)
+	{
+		return false;
+	}
+
+	SItem item = { path, std::string::npos };
+	queue.push_back(item);
+	cond->notify_all();
+	return true;
+}
+
+void BackupDeletion::logProgress(const std::string& name, bool done)
+{
+	int64 passed_ms = (std::max)(static_cast<int64>(1), Server->getTimeMS() - starttime);
+	int64 files = removed_files;
+	int64 bytes = removed_bytes;
+
+	std::string msg = done ? ("Deleted \"" + name + "\"") : ("Deleting (currently at \"" + name + "\")");
+	msg += ": " + convert(files) + " files (" + PrettyPrintBytes(bytes) + ") and " + convert(static_cast<int64>(removed_dirs))
+		+ " directories in " + PrettyPrintTime(passed_ms) + " using " + convert(n_workers) + " threads ("
+		+ convert(files * 1000 / passed_ms) + " files/s, " + PrettyPrintBytes(bytes * 1000 / passed_ms) + "/s)";
+
+	ServerLogger::Log(logid, msg, done ? LL_INFO : LL_DEBUG);
+}
+
+#endif //CLIENT_ONLY
@@ -0,0 +1,104 @@
+#pragma once
+
+#include "../Interface/Types.h"
+#include "../Interface/Mutex.h"
+#include "../Interface/Condition.h"
+#include "dao/ServerLinkDao.h"
+#include "server_log.h"
+#include <atomic>
+#include <deque>
+#include <string>
+#include <vector>
+
+/*
+* Removes the files of a backup on a bounded number of thread pool workers
+* ("cleanup_delete_threads", the serial removal is used if it is one or
+* less).
+*
+* The workers split the directory tree among themselves. Directory links
+* (symlinks into the directory pool) are handed back to the thread calling
+* removeTree, which holds the client's directory link lock for the whole
+* removal like remove_directory_link_dir does, so the link database is only
+* changed by one thread.
+*
+* All deletions can be paused and resumed. A removal that was aborted leaves
+* the remaining files in place, so the next cleanup continues where it
+* stopped.
+*/
+class BackupDeletion
+{
+public:
+	BackupDeletion(logid_t logid, int clientid);
+	~BackupDeletion();
+
+	static void init_mutex();
+	static void destroy_mutex();
+
+	static bool isEnabled();
+
+	//Number of file entries removed per database transaction (0 means all at once)
+	static size_t getSqlBatchSize();
+
+	static void setPaused(bool b);
+	static bool isPaused();
+
+	//Waits while deletions are paused. Returns false if the server is shutting down
+	static bool waitWhilePaused();
+
+	static void doQuit();
+
+	//Removes the directory tree at path including the directory links in it
+	bool removeTree(const std::string& path, ServerLinkDao& link_dao);
+
+	//Deletes the files concurrently. Sets removed[i] to 1 if paths[i] was deleted
+	void removeFiles(const std::vector<std::string>& paths, std::vector<char>& removed);
+
+	//True if the last removal stopped because the server is shutting down
+	bool isAborted();
+
+private:
+	class Worker;
+
+	struct SItem
+	{
+		std::string path;
+		size_t file_idx;
+	};
+
+	struct SLinkRequest
+	{
+		std::string path;
+		bool done;
+	};
+
+	void runWorker(std::vector<char>* removed);
+	void removeDir(const std::string& path);
+	void removeLink(const std::string& path);
+	bool shareDir(const std::string& path);
+	void run(size_t p_n_workers, ServerLinkDao* link_dao, std::vector<char>* removed);
+	void logProgress(const std::string& name, bool done);
+
+	logid_t logid;
+	int clientid;
+	size_t n_threads;
+	size_t n_workers;
+	int64 starttime;
+
+	IMutex* mutex;
+	ICondition* cond;
+	std::deque<SItem> queue;
+	std::deque<SLinkRequest*> link_requests;
+	std::vector<std::string> deferred_dirs;
+	size_t busy_workers;
+	bool has_error;
+	bool aborted;
+
+	std::atomic<int64> removed_files;
+	std::atomic<int64> removed_bytes;
+	std::atomic<int64> removed_dirs;
+
+	static IMutex* pause_mutex;
+	static ICondition* pause_cond;
+	static bool paused;
+	static volatile bool do_quit;
+};
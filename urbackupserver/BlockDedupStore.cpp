@@ -0,0 +1,884 @@
+/*************************************************************************
+*    UrBackup - Client/Server backup system
+*    Copyright (C) 2011-2016 Martin Raiber
+*
+*    This program is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU Affero General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU Affero General Public License for more details.
+*
+*    You should have received a copy of the GNU Affero General Public License
+*    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**************************************************************************/
+
+#include "BlockDedupStore.h"
+#include "../Interface/Database.h"
+#include "../Interface/Query.h"
+#include "../fileservplugin/chunk_settings.h"
+#include "../urbackupcommon/file_metadata.h"
+#include "../urbackupcommon/os_functions.h"
+#include "../stringtools.h"
+#include "database.h"
+#include <algorithm>
+#include <memory.h>
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#include <sys/types.h>
+#include <sys/stat.h>
+#endif
+
+BlockDedupStore* BlockDedupStore::instance = NULL;
+
+namespace
+{
+	const char c_manifest_magic[] = "URBACKUP BLOCKS1";
+	const size_t c_magic_size = 16;
+	const size_t c_store_id_size = 16;
+	const size_t c_manifest_header_size = c_magic_size + c_store_id_size + sizeof(int64);
+	const size_t c_manifest_entry_size = big_hash_size;
+
+	//Smaller files are not worth the indirection
+	const int64 c_min_filesize = 2 * c_checkpoint_dist;
+
+	//Blocks processed per index transaction while holding the store lock
+	const size_t c_batch_blocks = 64;
+
+	const size_t c_release_mutexes = 64;
+
+	size_t block_count(int64 filesize)
+	{
+		return static_cast<size_t>((filesize + c_checkpoint_dist - 1) / c_checkpoint_dist);
+	}
+
+	std::string block_path(const std::string& store_path, const BlockDedupStore::SBlockHash& hash)
+	{
+		std::string hex = bytesToHex(reinterpret_cast<const unsigned char*>(hash.hash), big_hash_size);
+		return store_path + os_file_sep() + hex.substr(0, 2) + os_file_sep() + hex;
+	}
+
+	class ScopedQuery
+	{
+	public:
+		ScopedQuery(IDatabase* db, const std::string& sql)
+			: db(db), q(db->Prepare(sql, false))
+		{}
+
+		~ScopedQuery()
+		{
+			db->destroyQuery(q);
+		}
+
+		IQuery* operator->()
+		{
+			return q;
+		}
+
+	private:
+		IDatabase* db;
+		IQuery* q;
+	};
+
+	/**
+	* Read-only view of the data referenced by a manifest
+	*/
+	class BlockStoreFile : public IFsFile
+	{
+	public:
+		BlockStoreFile(IFsFile* manifest, const std::string& store_path, int64 filesize,
+			const std::vector<BlockDedupStore::SBlockHash>& blocks)
+			: manifest(manifest), store_path(store_path), filesize(filesize), blocks(blocks),
+			pos(0), curr_idx(std::string::npos)
+		{}
+
+		const std::vector<BlockDedupStore::SBlockHash>& getBlocks()
+		{
+			return blocks;
+		}
+
+		IFsFile* getManifest()
+		{
+			return manifest.get();
+		}
+
+		virtual std::string Read(_u32 tr, bool * has_error = NULL)
+		{
+			std::string ret = Read(pos, tr, has_error);
+			pos += ret.size();
+			return ret;
+		}
+
+		virtual std::string Read(int64 spos, _u32 tr, bool * has_error = NULL)
+		{
+			std::string ret;
+			ret.resize(tr);
+			_u32 r = Read(spos, &ret[0], tr, has_error);
+			ret.resize(r);
+			return ret;
+		}
+
+		virtual _u32 Read(char * buffer, _u32 bsize, bool * has_error = NULL)
+		{
+			_u32 r = Read(pos, buffer, bsize, has_error);
+			pos += r;
+			return r;
+		}
+
+		virtual _u32 Read(int64 spos, char * buffer, _u32 bsize, bool * has_error = NULL)
+		{
+			_u32 read = 0;
+			while (read < bsize && spos < filesize)
+			{
+				size_t idx = static_cast<size_t>(spos / c_checkpoint_dist);
+				int64 block_off = spos % c_checkpoint_dist;
+				int64 block_size = (std::min)(c_checkpoint_dist, filesize - static_cast<int64>(idx)*c_checkpoint_dist);
+				_u32 toread = static_cast<_u32>((std::min)(static_cast<int64>(bsize - read), block_size - block_off));
+
+				if (!openBlock(idx))
+				{
+					if (has_error) *has_error = true;
+					break;
+				}
+
+				_u32 r = curr_block->Read(block_off, buffer + read, toread, has_error);
+				read += r;
+				spos += r;
+
+				if (r < toread)
+				{
+					Server->Log("Block " + curr_block->getFilename() + " of \"" + manifest->getFilename() + "\" is too short", LL_ERROR);
+					if (has_error) *has_error = true;
+					break;
+				}
+			}
+			return read;
+		}
+
+		virtual _u32 Write(const std::string & tw, bool * has_error = NULL)
+		{
+			return Write(tw.data(), static_cast<_u32>(tw.size()), has_error);
+		}
+
+		virtual _u32 Write(int64 spos, const std::string & tw, bool * has_error = NULL)
+		{
+			return Write(spos, tw.data(), static_cast<_u32>(tw.size()), has_error);
+		}
+
+		virtual _u32 Write(const char * buffer, _u32 bsiz, bool * has_error = NULL)
+		{
+			return Write(pos, buffer, bsiz, has_error);
+		}
+
+		virtual _u32 Write(int64 spos, const char * buffer, _u32 bsiz, bool * has_error = NULL)
+		{
+			if (has_error) *has_error = true;
+			return 0;
+		}
+
+		virtual bool Seek(_i64 spos)
+		{
+			pos = spos;
+			return true;
+		}
+
+		virtual _i64 Size(void)
+		{
+			return filesize;
+		}
+
+		virtual _i64 RealSize()
+		{
+			return manifest->RealSize();
+		}
+
+		virtual bool PunchHole(_i64 spos, _i64 size)
+		{
+			return false;
+		}
+
+		virtual bool Sync()
+		{
+			return manifest->Sync();
+		}
+
+		virtual std::string getFilename(void)
+		{
+			return manifest->getFilename();
+		}
+
+		virtual void resetSparseExtentIter()
+		{
+		}
+
+		virtual SSparseExtent nextSparseExtent()
+		{
+			return SSparseExtent();
+		}
+
+		virtual bool Resize(int64 new_size, bool set_sparse = true)
+		{
+			return false;
+		}
+
+		virtual std::vector<SFileExtent> getFileExtents(int64 starting_offset, int64 block_size, bool& more_data, unsigned int flags = 0)
+		{
+			more_data = false;
+			return std::vector<SFileExtent>();
+		}
+
+		virtual IVdlVolCache* createVdlVolCache()
+		{
+			return NULL;
+		}
+
+		virtual int64 getValidDataLength(IVdlVolCache* vol_cache)
+		{
+			return -1;
+		}
+
+		//There is no handle with the file data
+		virtual os_file_handle getOsHandle(bool release_handle = false)
+		{
+#ifdef _WIN32
+			return INVALID_HANDLE_VALUE;
+#else
+			return -1;
+#endif
+		}
+
+	private:
+		bool openBlock(size_t idx)
+		{
+			if (curr_idx == idx
+				&& curr_block.get() != NULL)
+			{
+				return true;
+			}
+
+			curr_idx = idx;
+			curr_block.reset(Server->openFile(os_file_prefix(block_path(store_path, blocks[idx])), MODE_READ));
+
+			if (curr_block.get() == NULL)
+			{
+				Server->Log("Error opening block " + convert(idx) + " of \"" + manifest->getFilename() + "\". " + os_last_error_str(), LL_ERROR);
+				return false;
+			}
+
+			return true;
+		}
+
+		std::unique_ptr<IFsFile> manifest;
+		std::string store_path;
+		int64 filesize;
+		std::vector<BlockDedupStore::SBlockHash> blocks;
+		int64 pos;
+		size_t curr_idx;
+		std::unique_ptr<IFsFile> curr_block;
+	};
+}
+
+void BlockDedupStore::init(const std::string & backupfolder, bool enabled, IFileServ* fileserv)
+{
+	std::string store_path = backupfolder + os_file_sep() + "urbackup_block_store";
+
+	if (!os_directory_exists(os_file_prefix(store_path)))
+	{
+		if (!enabled)
+		{
+			return;
+		}
+
+		if (!os_create_dir(os_file_prefix(store_path)))
+		{
+			Server->Log("Error creating block store at \"" + store_path + "\". " + os_last_error_str(), LL_ERROR);
+			return;
+		}
+	}
+
+	str_map params;
+	if (!Server->openDatabase(store_path + os_file_sep() + "blocks.db", URBACKUPDB_SERVER_BLOCKS, params))
+	{
+		Server->Log("Error opening block store index at \"" + store_path + "\"", LL_ERROR);
+		return;
+	}
+
+	IDatabase* db = Server->getDatabase(Server->getThreadID(), URBACKUPDB_SERVER_BLOCKS);
+	if (db == NULL)
+	{
+		Server->Log("Error opening block store index database", LL_ERROR);
+		return;
+	}
+
+	db->Write("PRAGMA journal_mode=WAL");
+	db->Write("CREATE TABLE IF NOT EXISTS blocks (hash BLOB PRIMARY KEY, size INTEGER, refcount INTEGER) WITHOUT ROWID");
+	db->Write("CREATE TABLE IF NOT EXISTS store_info (key TEXT PRIMARY KEY, value TEXT)");
+
+	std::string store_id;
+	db_results res = db->Read("SELECT value FROM store_info WHERE key='store_id'");
+	if (res.empty())
+	{
+		store_id.resize(c_store_id_size);
+		Server->secureRandomFill(&store_id[0], store_id.size());
+
+		ScopedQuery q(db, "INSERT INTO store_info (key, value) VALUES ('store_id', ?)");
+		q->Bind(bytesToHex(store_id));
+		if (!q->Write())
+		{
+			Server->Log("Error writing block store id", LL_ERROR);
+			return;
+		}
+	}
+	else
+	{
+		store_id = hexToBytes(res[0]["value"]);
+	}
+
+	if (store_id.size() != c_store_id_size)
+	{
+		Server->Log("Block store id in \"" + store_path + "\" is invalid", LL_ERROR);
+		return;
+	}
+
+	instance = new BlockDedupStore(store_path, store_id, enabled);
+
+	if (fileserv != NULL)
+	{
+		fileserv->registerReadRedirectCallback(instance);
+	}
+
+	Server->Log(std::string("Block store at \"") + store_path + "\" " + (enabled ? "enabled" : "is read-only (block_dedup_store not enabled)"), LL_INFO);
+}
+
+BlockDedupStore * BlockDedupStore::getInstance()
+{
+	return instance;
+}
+
+IFsFile * BlockDedupStore::openRead(IFsFile * file)
+{
+	if (instance == NULL)
+	{
+		return file;
+	}
+
+	return instance->openManifest(file);
+}
+
+bool BlockDedupStore::isEnabled()
+{
+	return enabled;
+}
+
+BlockDedupStore::BlockDedupStore(const std::string & store_path, const std::string & store_id, bool enabled)
+	: store_path(store_path), store_id(store_id), enabled(enabled), mutex(Server->createMutex())
+{
+	for (size_t i = 0; i < c_release_mutexes; ++i)
+	{
+		release_mutexes.push_back(std::unique_ptr<IMutex>(Server->createMutex()));
+	}
+}
+
+bool BlockDedupStore::isManifestSize(int64 size)
+{
+	return size >= static_cast<int64>(c_manifest_header_size + block_count(c_min_filesize)*c_manifest_entry_size)
+		&& (size - c_manifest_header_size) % c_manifest_entry_size == 0;
+}
+
+bool BlockDedupStore::storeFile(const std::string & path, const std::string & hash_path, int64 filesize)
+{
+	if (!enabled
+		|| filesize < c_min_filesize)
+	{
+		return false;
+	}
+
+	std::unique_ptr<IFile> hash_f(Server->openFile(os_file_prefix(hash_path), MODE_READ));
+	if (hash_f.get() == NULL
+		|| read_hashdata_size(hash_f.get()) != filesize)
+	{
+		return false;
+	}
+
+	std::unique_ptr<IFsFile> data_f(openManifest(Server->openFile(os_file_prefix(path), MODE_READ_SEQUENTIAL)));
+	if (data_f.get() == NULL
+		|| data_f->Size() != filesize
+		|| dynamic_cast<BlockStoreFile*>(data_f.get()) != NULL)
+	{
+		return false;
+	}
+
+	size_t n_blocks = block_count(filesize);
+	std::vector<SBlockHash> blocks;
+	blocks.reserve(n_blocks);
+	std::vector<char> buf(c_checkpoint_dist);
+
+	IDatabase* db = getDatabase();
+	bool has_error = false;
+	bool collision = false;
+	for (size_t i = 0; i < n_blocks && !has_error && !collision;)
+	{
+		IScopedLock lock(mutex.get());
+		DBScopedWriteTransaction transaction(db);
+
+		size_t batch_end = (std::min)(n_blocks, i + c_batch_blocks);
+		for (; i < batch_end; ++i)
+		{
+			SBlockHash hash;
+			int64 block_pos = static_cast<int64>(i)*c_checkpoint_dist;
+			if (hash_f->Read(chunkhash_file_off + static_cast<int64>(i)*chunkhash_single_size, hash.hash, big_hash_size) != big_hash_size)
+			{
+				Server->Log("Error reading block hash from \"" + hash_path + "\"", LL_ERROR);
+				has_error = true;
+				break;
+			}
+
+			_u32 bsize = static_cast<_u32>((std::min)(c_checkpoint_dist, filesize - block_pos));
+			if (data_f->Read(block_pos, buf.data(), bsize) != bsize)
+			{
+				Server->Log("Error reading block from \"" + path + "\". " + os_last_error_str(), LL_ERROR);
+				has_error = true;
+				break;
+			}
+
+			if (!addBlock(db, hash, buf.data(), bsize, collision))
+			{
+				has_error = !collision;
+				break;
+			}
+
+			blocks.push_back(hash);
+		}
+	}
+
+	data_f.reset();
+	hash_f.reset();
+
+	if (collision)
+	{
+		Server->Log("Block hash collision in \"" + path + "\". Keeping file outside of block store.", LL_WARNING);
+	}
+
+	if (has_error || collision)
+	{
+		releaseBlocks(blocks);
+		return false;
+	}
+
+	std::string manifest;
+	manifest.resize(c_manifest_header_size + blocks.size()*c_manifest_entry_size);
+	memcpy(&manifest[0], c_manifest_magic, c_magic_size);
+	memcpy(&manifest[c_magic_size], store_id.data(), c_store_id_size);
+	int64 filesize_le = little_endian(filesize);
+	memcpy(&manifest[c_magic_size + c_store_id_size], &filesize_le, sizeof(filesize_le));
+	for (size_t i = 0; i < blocks.size(); ++i)
+	{
+		memcpy(&manifest[c_manifest_header_size + i*c_manifest_entry_size], blocks[i].hash, c_manifest_entry_size);
+	}
+
+	std::string tmp_path = path + ".blockstore_new";
+	std::unique_ptr<IFile> manifest_f(Server->openFile(os_file_prefix(tmp_path), MODE_WRITE));
+	if (manifest_f.get() == NULL
+		|| manifest_f->Write(manifest) != manifest.size())
+	{
+		Server->Log("Error writing block manifest \"" + tmp_path + "\". " + os_last_error_str(), LL_ERROR);
+		manifest_f.reset();
+		Server->deleteFile(os_file_prefix(tmp_path));
+		releaseBlocks(blocks);
+		return false;
+	}
+	manifest_f.reset();
+
+	if (!os_rename_file(os_file_prefix(tmp_path), os_file_prefix(path)))
+	{
+		Server->Log("Error replacing \"" + path + "\" with block manifest. " + os_last_error_str(), LL_ERROR);
+		Server->deleteFile(os_file_prefix(tmp_path));
+		releaseBlocks(blocks);
+		return false;
+	}
+
+	return true;
+}
+
+bool BlockDedupStore::addBlock(IDatabase* db, const SBlockHash & hash, const char * data, _u32 bsize, bool& collision)
+{
+	std::string path = block_path(store_path, hash);
+
+	ScopedQuery q_get(db, "SELECT size FROM blocks WHERE hash=?");
+	q_get->Bind(hash.hash, big_hash_size);
+	db_results res = q_get->Read();
+	q_get->Reset();
+
+	bool write_block = res.empty();
+
+	if (!res.empty())
+	{
+		if (watoi64(res[0]["size"]) != bsize)
+		{
+			collision = true;
+			return false;
+		}
+
+		std::unique_ptr<IFile> block_f(Server->openFile(os_file_prefix(path), MODE_READ));
+		if (block_f.get() == NULL)
+		{
+			Server->Log("Block \"" + path + "\" is missing. Restoring it.", LL_WARNING);
+			write_block = true;
+		}
+		else
+		{
+			std::vector<char> existing(bsize);
+			if (block_f->Read(static_cast<int64>(0), existing.data(), bsize) != bsize
+				|| memcmp(existing.data(), data, bsize) != 0)
+			{
+				collision = true;
+				return false;
+			}
+		}
+	}
+
+	if (write_block)
+	{
+		std::string dir = ExtractFilePath(path, os_file_sep());
+		if (!os_directory_exists(os_file_prefix(dir))
+			&& !os_create_dir(os_file_prefix(dir)))
+		{
+			Server->Log("Error creating block store directory \"" + dir + "\". " + os_last_error_str(), LL_ERROR);
+			return false;
+		}
+
+		std::unique_ptr<IFile> block_f(Server->openFile(os_file_prefix(path + ".new"), MODE_WRITE));
+		if (block_f.get() == NULL
+			|| block_f->Write(data, bsize) != bsize)
+		{
+			Server->Log("Error writing block \"" + path + "\". " + os_last_error_str(), LL_ERROR);
+			block_f.reset();
+			Server->deleteFile(os_file_prefix(path + ".new"));
+			return false;
+		}
+		block_f.reset();
+
+		if (!os_rename_file(os_file_prefix(path + ".new"), os_file_prefix(path)))
+		{
+			Server->Log("Error renaming block \"" + path + "\". " + os_last_error_str(), LL_ERROR);
+			Server->deleteFile(os_file_prefix(path + ".new"));
+			return false;
+		}
+	}
+
+	if (res.empty())
+	{
+		ScopedQuery q_add(db, "INSERT INTO blocks (hash, size, refcount) VALUES (?, ?, 1)");
+		q_add->Bind(hash.hash, big_hash_size);
+		q_add->Bind(static_cast<int64>(bsize));
+		if (!q_add->Write())
+		{
+			Server->deleteFile(os_file_prefix(path));
+			return false;
+		}
+	}
+	else
+	{
+		ScopedQuery q_incr(db, "UPDATE blocks SET refcount=refcount+1 WHERE hash=?");
+		q_incr->Bind(hash.hash, big_hash_size);
+		if (!q_incr->Write())
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
+
+void BlockDedupStore::releaseBlocks(const std::vector<SBlockHash>& blocks)
+{
+	if (blocks.empty())
+	{
+		return;
+	}
+
+	IDatabase* db = getDatabase();
+
+	IScopedLock lock(mutex.get());
+	DBScopedWriteTransaction transaction(db);
+
+	ScopedQuery q_get(db, "SELECT refcount FROM blocks WHERE hash=?");
+	ScopedQuery q_decr(db, "UPDATE blocks SET refcount=refcount-1 WHERE hash=?");
+	ScopedQuery q_del(db, "DELETE FROM blocks WHERE hash=?");
+
+	std::vector<std::string> del_blocks;
+	for (size_t i = 0; i < blocks.size(); ++i)
+	{
+		q_get->Bind(blocks[i].hash, big_hash_size);
+		db_results res = q_get->Read();
+		q_get->Reset();
+
+		if (res.empty())
+		{
+			Server->Log("Released block " + bytesToHex(reinterpret_cast<const unsigned char*>(blocks[i].hash), big_hash_size) + " is not in block store index", LL_WARNING);
+			continue;
+		}
+
+		if (watoi64(res[0]["refcount"]) <= 1)
+		{
+			q_del->Bind(blocks[i].hash, big_hash_size);
+			q_del->Write();
+			q_del->Reset();
+			del_blocks.push_back(block_path(store_path, blocks[i]));
+		}
+		else
+		{
+			q_decr->Bind(blocks[i].hash, big_hash_size);
+			q_decr->Write();
+			q_decr->Reset();
+		}
+	}
+
+	transaction.end();
+
+	//Still locked, so the blocks cannot be added again in the meantime
+	for (size_t i = 0; i < del_blocks.size(); ++i)
+	{
+		if (!Server->deleteFile(os_file_prefix(del_blocks[i])))
+		{
+			Server->Log("Error deleting block \"" + del_blocks[i] + "\". " + os_last_error_str(), LL_WARNING);
+		}
+	}
+}
+
+bool BlockDedupStore::releaseFile(const std::string & path)
+{
+	std::unique_ptr<IFsFile> f(openManifest(Server->openFile(os_file_prefix(path), MODE_READ)));
+	BlockStoreFile* block_file = dynamic_cast<BlockStoreFile*>(f.get());
+	if (block_file == NULL)
+	{
+		return false;
+	}
+
+	std::vector<SBlockHash> blocks = block_file->getBlocks();
+
+	//Only release the blocks if this was the last link to the manifest. Removing
+	//another link to the same inode in the meantime would corrupt the link count check
+#ifdef _WIN32
+	BY_HANDLE_FILE_INFORMATION fi;
+	if (!GetFileInformationByHandle(block_file->getManifest()->getOsHandle(), &fi))
+	{
+		return false;
+	}
+
+	IScopedLock lock(getReleaseMutex((static_cast<uint64>(fi.nFileIndexHigh) << 32 | fi.nFileIndexLow) ^ fi.dwVolumeSerialNumber));
+
+	if (!GetFileInformationByHandle(block_file->getManifest()->getOsHandle(), &fi))
+	{
+		return false;
+	}
+	int64 links_left = static_cast<int64>(fi.nNumberOfLinks) - 1;
+
+	f.reset();
+
+	if (!Server->deleteFile(os_file_prefix(path)))
+	{
+		return false;
+	}
+#else
+	struct stat st;
+	if (fstat(block_file->getManifest()->getOsHandle(), &st) != 0)
+	{
+		return false;
+	}
+
+	IScopedLock lock(getReleaseMutex(static_cast<uint64>(st.st_ino) ^ static_cast<uint64>(st.st_dev)));
+
+	if (!Server->deleteFile(os_file_prefix(path)))
+	{
+		return false;
+	}
+
+	if (fstat(block_file->getManifest()->getOsHandle(), &st) != 0)
+	{
+		return false;
+	}
+	int64 links_left = st.st_nlink;
+
+	f.reset();
+#endif
+
+	if (links_left == 0)
+	{
+		releaseBlocks(blocks);
+	}
+
+	return true;
+}
+
+void BlockDedupStore::releaseDirectory(const std::string & path)
+{
+	std::vector<SFile> files = getFiles(os_file_prefix(path));
+
+	for (size_t i = 0; i < files.size(); ++i)
+	{
+		const SFile& f = files[i];
+		if (f.issym)
+		{
+			continue;
+		}
+
+		if (f.isdir)
+		{
+			if (f.name != ".hashes")
+			{
+				releaseDirectory(path + os_file_sep() + f.name);
+			}
+		}
+		else if (isManifestSize(f.size))
+		{
+			releaseFile(path + os_file_sep() + f.name);
+		}
+	}
+}
+
+void BlockDedupStore::removeUnreferencedBlocks()
+{
+	IDatabase* db = getDatabase();
+	ScopedQuery q_get(db, "SELECT size FROM blocks WHERE hash=?");
+
+	std::vector<SFile> dirs = getFiles(os_file_prefix(store_path));
+	for (size_t i = 0; i < dirs.size(); ++i)
+	{
+		if (!dirs[i].isdir
+			|| dirs[i].name.size() != 2)
+		{
+			continue;
+		}
+
+		std::string dir = store_path + os_file_sep() + dirs[i].name;
+		std::vector<SFile> files = getFiles(os_file_prefix(dir));
+
+		for (size_t j = 0; j < files.size(); ++j)
+		{
+			if (files[j].isdir)
+			{
+				continue;
+			}
+
+			IScopedLock lock(mutex.get());
+
+			std::string hash = hexToBytes(files[j].name);
+			bool del;
+			if (hash.size() != big_hash_size)
+			{
+				del = true;
+			}
+			else
+			{
+				q_get->Bind(hash.data(), static_cast<_u32>(hash.size()));
+				del = q_get->Read().empty();
+				q_get->Reset();
+			}
+
+			if (del)
+			{
+				Server->Log("Removing unreferenced block \"" + files[j].name + "\" from block store", LL_INFO);
+				Server->deleteFile(os_file_prefix(dir + os_file_sep() + files[j].name));
+			}
+		}
+	}
+}
+
+BlockDedupStore::SStats BlockDedupStore::getStats()
+{
+	SStats ret;
+	db_results res = getDatabase()->Read("SELECT COUNT(*) AS n, SUM(size) AS stored, SUM(size*refcount) AS referenced FROM blocks");
+	if (!res.empty())
+	{
+		ret.n_blocks = watoi64(res[0]["n"]);
+		ret.stored_bytes = watoi64(res[0]["stored"]);
+		ret.referenced_bytes = watoi64(res[0]["referenced"]);
+	}
+	return ret;
+}
+
+IMutex * BlockDedupStore::getReleaseMutex(uint64 file_id)
+{
+	return release_mutexes[static_cast<size_t>(file_id % release_mutexes.size())].get();
+}
+
+IFsFile * BlockDedupStore::openManifest(IFsFile * file)
+{
+	if (file == NULL)
+	{
+		return NULL;
+	}
+
+	int64 fsize = file->Size();
+	if (!isManifestSize(fsize))
+	{
+		return file;
+	}
+
+	std::string fn = file->getFilename();
+	if (next(fn, 0, store_path)
+		|| next(fn, 0, os_file_prefix(store_path)))
+	{
+		return file;
+	}
+
+	char header[c_manifest_header_size];
+	if (file->Read(static_cast<int64>(0), header, c_manifest_header_size) != c_manifest_header_size
+		|| memcmp(header, c_manifest_magic, c_magic_size) != 0
+		|| memcmp(header + c_magic_size, store_id.data(), c_store_id_size) != 0)
+	{
+		file->Seek(0);
+		return file;
+	}
+
+	int64 filesize;
+	memcpy(&filesize, header + c_magic_size + c_store_id_size, sizeof(filesize));
+	filesize = little_endian(filesize);
+
+	size_t n_blocks = block_count(filesize);
+	if (filesize < 0
+		|| fsize != static_cast<int64>(c_manifest_header_size + n_blocks*c_manifest_entry_size))
+	{
+		Server->Log("Block manifest \"" + fn + "\" has wrong size", LL_ERROR);
+		file->Seek(0);
+		return file;
+	}
+
+	std::vector<SBlockHash> blocks(n_blocks);
+	_u32 entries_size = static_cast<_u32>(n_blocks*c_manifest_entry_size);
+	if (file->Read(static_cast<int64>(c_manifest_header_size), reinterpret_cast<char*>(blocks.data()), entries_size) != entries_size)
+	{
+		Server->Log("Error reading block manifest \"" + fn + "\". " + os_last_error_str(), LL_ERROR);
+		file->Seek(0);
+		return file;
+	}
+
+	return new BlockStoreFile(file, store_path, filesize, blocks);
+}
+
+IFile * BlockDedupStore::redirectRead(const std::string & path, int64 filesize)
+{
+	if (!isManifestSize(filesize))
+	{
+		return NULL;
+	}
+
+	IFsFile* f = openManifest(Server->openFile(path, MODE_READ));
+	if (dynamic_cast<BlockStoreFile*>(f) != NULL)
+	{
+		return f;
+	}
+
+	Server->destroy(f);
+	return NULL;
+}
+
+IDatabase * BlockDedupStore::getDatabase()
+{
+	return Server->getDatabase(Server->getThreadID(), URBACKUPDB_SERVER_BLOCKS);
+}
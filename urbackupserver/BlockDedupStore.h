@@ -0,0 +1,103 @@
+#pragma once
+
+#include "../Interface/Server.h"
+#include "../Interface/File.h"
+#include "../Interface/Mutex.h"
+#include "../fileservplugin/IFileServ.h"
+#include <string>
+#include <vector>
+#include <memory>
+
+class IDatabase;
+
+/*
+* Optional cross-file block store for file backups on storage without
+* reflinks. Files are split into the 512KiB checkpoint blocks of the chunk
+* hash files and each distinct block (keyed by its big_hash) is stored once
+* in <backupfolder>/urbackup_block_store. The backup file is replaced by a
+* small manifest listing its blocks. A refcounted index (blocks.db in the
+* store) tracks how many manifests reference each block.
+*
+* Server-side readers of backup files (copies, patches, downloads, hash
+* verification) pass the opened file through openRead, which returns the
+* reassembled file for a manifest. The store is registered as read redirect
+* callback with the file server for restores and block diff transfers.
+*
+* A manifest holds one reference per listed block for its inode. Hardlinks
+* to a manifest share the references. References are only dropped once the
+* last link to the manifest was removed. Removing a link and checking the
+* remaining link count is serialized per manifest inode, which keeps the refcounts from ever
+* being too low (leaks after crashes are possible, lost blocks are not).
+* A block that is already in the store is compared byte-by-byte before it
+* is referenced, so a big_hash collision cannot mix up file contents.
+*/
+class BlockDedupStore : public IFileServ::IReadRedirectCallback
+{
+public:
+	static void init(const std::string& backupfolder, bool enabled, IFileServ* fileserv);
+
+	//NULL if there is no block store
+	static BlockDedupStore* getInstance();
+
+	//Takes ownership of file (may be NULL). Returns the reassembled file if it is a manifest, otherwise file
+	static IFsFile* openRead(IFsFile* file);
+
+	//Whether new files should be moved into the store
+	bool isEnabled();
+
+	//Replaces the file at path with a manifest. Needs the chunk hashes of the file in hash_path
+	bool storeFile(const std::string& path, const std::string& hash_path, int64 filesize);
+
+	//Removes all manifests in the directory (not following symlinks) and releases their blocks
+	void releaseDirectory(const std::string& path);
+
+	//Removes block files without index entry (e.g. after a crash)
+	void removeUnreferencedBlocks();
+
+	struct SStats
+	{
+		SStats()
+			: n_blocks(0), stored_bytes(0), referenced_bytes(0)
+		{}
+
+		int64 n_blocks;
+		int64 stored_bytes;
+		int64 referenced_bytes;
+	};
+
+	SStats getStats();
+
+	virtual IFile* redirectRead(const std::string& path, int64 filesize);
+
+	struct SBlockHash
+	{
+		char hash[16];
+	};
+
+private:
+	BlockDedupStore(const std::string& store_path, const std::string& store_id, bool enabled);
+
+	static bool isManifestSize(int64 size);
+
+	bool addBlock(IDatabase* db, const SBlockHash& hash, const char* data, _u32 bsize, bool& collision);
+
+	void releaseBlocks(const std::vector<SBlockHash>& blocks);
+
+	bool releaseFile(const std::string& path);
+
+	IFsFile* openManifest(IFsFile* file);
+
+	IMutex* getReleaseMutex(uint64 file_id);
+
+	IDatabase* getDatabase();
+
+	std::string store_path;
+	std::string store_id;
+	bool enabled;
+
+	std::unique_ptr<IMutex> mutex;
+
+	std::vector<std::unique_ptr<IMutex> > release_mutexes;
+
+	static BlockDedupStore* instance;
+};
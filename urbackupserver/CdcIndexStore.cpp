@@ -0,0 +1,359 @@
+/*************************************************************************
+*    UrBackup - Client/Server backup system
+*    Copyright (C) 2011-2016 Martin Raiber
+*
+*    This program is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU Affero General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU Affero General Public License for more details.
+*
+*    You should have received a copy of the GNU Affero General Public License
+*    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**************************************************************************/
+
+#include "CdcIndexStore.h"
+#include "../Interface/File.h"
+#include "../urbackupcommon/os_functions.h"
+#include "../stringtools.h"
+#include "../md5.h"
+#include <memory>
+#include <memory.h>
+
+CdcIndexStore* CdcIndexStore::instance = NULL;
+
+namespace
+{
+	const char* tmp_dirname = "tmp";
+
+	const size_t c_index_entry_size = c_cdc_hash_size + sizeof(_u32);
+
+	//Files which did not change for this long are transferred with the fixed-size chunks
+	//again and their index is rebuilt from the data
+	const int64 c_max_unused_s = 90 * 24 * 60 * 60;
+
+	//Temporary indexes are committed while the backup runs
+	const int64 c_tmp_max_age_s = 7 * 24 * 60 * 60;
+}
+
+void CdcIndexStore::init(const std::string& backupfolder)
+{
+	std::string store_path = backupfolder + os_file_sep() + "urbackup_cdc_index";
+
+	if (!os_directory_exists(os_file_prefix(store_path))
+		&& !os_create_dir(os_file_prefix(store_path)))
+	{
+		Server->Log("Error creating chunk index store at \"" + store_path + "\". " + os_last_error_str(), LL_ERROR);
+		return;
+	}
+
+	std::string tmp_path = store_path + os_file_sep() + tmp_dirname;
+	if (!os_directory_exists(os_file_prefix(tmp_path))
+		&& !os_create_dir(os_file_prefix(tmp_path)))
+	{
+		Server->Log("Error creating temporary directory of chunk index store at \"" + tmp_path + "\". " + os_last_error_str(), LL_ERROR);
+		return;
+	}
+
+	instance = new CdcIndexStore(store_path);
+}
+
+CdcIndexStore* CdcIndexStore::getInstance()
+{
+	return instance;
+}
+
+CdcIndexStore::CdcIndexStore(const std::string& store_path)
+	: store_path(store_path)
+{
+}
+
+std::string CdcIndexStore::indexPath(const std::string& file_hash, int64 filesize)
+{
+	std::string hex = bytesToHex(file_hash);
+	return store_path + os_file_sep() + hex.substr(0, 2) + os_file_sep() + hex + "_" + convert(filesize);
+}
+
+bool CdcIndexStore::load(const std::string& file_hash, int64 filesize, std::vector<SCdcChunk>& chunks)
+{
+	if (file_hash.empty())
+	{
+		return false;
+	}
+
+	std::string fn = indexPath(file_hash, filesize);
+	std::unique_ptr<IFile> f(Server->openFile(os_file_prefix(fn), MODE_READ));
+	if (f.get() == NULL)
+	{
+		return false;
+	}
+
+	int64 fsize = f->Size();
+	if (fsize < static_cast<int64>(sizeof(int64))
+		|| (fsize - sizeof(int64)) % c_index_entry_size != 0
+		|| (fsize - sizeof(int64)) / c_index_entry_size > c_cdc_max_index_size)
+	{
+		Server->Log("Chunk index \"" + fn + "\" has wrong size " + convert(fsize), LL_WARNING);
+		return false;
+	}
+
+	std::string data = f->Read(static_cast<int64>(0), static_cast<_u32>(fsize));
+	if (data.size() != static_cast<size_t>(fsize))
+	{
+		Server->Log("Error reading chunk index \"" + fn + "\". " + os_last_error_str(), LL_ERROR);
+		return false;
+	}
+
+	int64 index_filesize;
+	memcpy(&index_filesize, data.data(), sizeof(index_filesize));
+	index_filesize = little_endian(index_filesize);
+
+	if (index_filesize != filesize)
+	{
+		Server->Log("Chunk index \"" + fn + "\" is for file size " + convert(index_filesize) + " instead of " + convert(filesize), LL_WARNING);
+		return false;
+	}
+
+	size_t n_chunks = (data.size() - sizeof(int64)) / c_index_entry_size;
+	chunks.resize(n_chunks);
+	int64 chunk_pos = 0;
+	for (size_t i = 0; i < n_chunks; ++i)
+	{
+		const char* entry = data.data() + sizeof(int64) + i*c_index_entry_size;
+		memcpy(chunks[i].hash.hash, entry, c_cdc_hash_size);
+		_u32 len;
+		memcpy(&len, entry + c_cdc_hash_size, sizeof(len));
+		chunks[i].len = little_endian(len);
+
+		if (chunks[i].len == 0
+			|| chunks[i].len > c_cdc_max_size)
+		{
+			Server->Log("Chunk index \"" + fn + "\" has chunk with wrong size " + convert(chunks[i].len), LL_WARNING);
+			chunks.clear();
+			return false;
+		}
+
+		chunk_pos += chunks[i].len;
+	}
+
+	if (chunk_pos != filesize)
+	{
+		Server->Log("Chunks in chunk index \"" + fn + "\" do not cover the file (" + convert(chunk_pos) + "!=" + convert(filesize) + ")", LL_WARNING);
+		chunks.clear();
+		return false;
+	}
+
+	f.reset();
+
+	int64 ctime = Server->getTimeSeconds();
+	os_set_file_time(os_file_prefix(fn), ctime, ctime, ctime);
+
+	return true;
+}
+
+std::string CdcIndexStore::storeTemporary(const std::vector<SCdcChunk>& chunks, int64 filesize)
+{
+	if (chunks.size() > c_cdc_max_index_size)
+	{
+		return std::string();
+	}
+
+	std::string data;
+	data.resize(sizeof(int64) + chunks.size()*c_index_entry_size);
+
+	int64 endian_filesize = little_endian(filesize);
+	memcpy(&data[0], &endian_filesize, sizeof(endian_filesize));
+
+	for (size_t i = 0; i < chunks.size(); ++i)
+	{
+		char* entry = &data[sizeof(int64) + i*c_index_entry_size];
+		memcpy(entry, chunks[i].hash.hash, c_cdc_hash_size);
+		_u32 len = little_endian(static_cast<_u32>(chunks[i].len));
+		memcpy(entry + c_cdc_hash_size, &len, sizeof(len));
+	}
+
+	std::string tmp_fn = store_path + os_file_sep() + tmp_dirname + os_file_sep() + Server->secureRandomString(20);
+
+	std::unique_ptr<IFile> f(Server->openFile(os_file_prefix(tmp_fn), MODE_WRITE));
+	if (f.get() == NULL)
+	{
+		Server->Log("Error creating temporary chunk index \"" + tmp_fn + "\". " + os_last_error_str(), LL_ERROR);
+		return std::string();
+	}
+
+	if (f->Write(data) != data.size())
+	{
+		Server->Log("Error writing temporary chunk index \"" + tmp_fn + "\". " + os_last_error_str(), LL_ERROR);
+		f.reset();
+		Server->deleteFile(os_file_prefix(tmp_fn));
+		return std::string();
+	}
+
+	return tmp_fn;
+}
+
+bool CdcIndexStore::commitTemporary(const std::string& tmp_fn, const std::string& file_hash, int64 filesize)
+{
+	if (file_hash.empty())
+	{
+		Server->deleteFile(os_file_prefix(tmp_fn));
+		return false;
+	}
+
+	std::string fn = indexPath(file_hash, filesize);
+	std::string dir = ExtractFilePath(fn, os_file_sep());
+
+	if (!os_directory_exists(os_file_prefix(dir))
+		&& !os_create_dir(os_file_prefix(dir))
+		&& !os_directory_exists(os_file_prefix(dir)))
+	{
+		Server->Log("Error creating chunk index directory \"" + dir + "\". " + os_last_error_str(), LL_ERROR);
+		Server->deleteFile(os_file_prefix(tmp_fn));
+		return false;
+	}
+
+	if (!os_rename_file(os_file_prefix(tmp_fn), os_file_prefix(fn)))
+	{
+		//Another backup may have stored the same index in the meantime
+		Server->deleteFile(os_file_prefix(tmp_fn));
+		return Server->fileExists(os_file_prefix(fn));
+	}
+
+	return true;
+}
+
+bool CdcIndexStore::store(const std::string& file_hash, int64 filesize, const std::vector<SCdcChunk>& chunks)
+{
+	std::string tmp_fn = storeTemporary(chunks, filesize);
+	if (tmp_fn.empty())
+	{
+		return false;
+	}
+
+	return commitTemporary(tmp_fn, file_hash, filesize);
+}
+
+void CdcIndexStore::removeUnused()
+{
+	int64 ctime = Server->getTimeSeconds();
+
+	std::vector<SFile> dirs = getFiles(os_file_prefix(store_path));
+	for (size_t i = 0; i < dirs.size(); ++i)
+	{
+		if (!dirs[i].isdir)
+		{
+			continue;
+		}
+
+		bool is_tmp = dirs[i].name == tmp_dirname;
+		if (!is_tmp
+			&& dirs[i].name.size() != 2)
+		{
+			continue;
+		}
+
+		std::string dir = store_path + os_file_sep() + dirs[i].name;
+		std::vector<SFile> files = getFiles(os_file_prefix(dir));
+
+		for (size_t j = 0; j < files.size(); ++j)
+		{
+			if (files[j].isdir)
+			{
+				continue;
+			}
+
+			if (ctime - files[j].last_modified > (is_tmp ? c_tmp_max_age_s : c_max_unused_s))
+			{
+				Server->deleteFile(os_file_prefix(dir + os_file_sep() + files[j].name));
+			}
+		}
+	}
+}
+
+CdcIndexBuilder::CdcIndexBuilder()
+	: buf(c_cdc_max_size * 2), buf_fill(0), failed(false)
+{
+}
+
+void CdcIndexBuilder::add(const char* data, size_t bsize)
+{
+	while (!failed && bsize > 0)
+	{
+		size_t tocopy = (std::min)(bsize, buf.size() - buf_fill);
+		if (data != NULL)
+		{
+			memcpy(buf.data() + buf_fill, data, tocopy);
+			data += tocopy;
+		}
+		else
+		{
+			memset(buf.data() + buf_fill, 0, tocopy);
+		}
+		buf_fill += tocopy;
+		bsize -= tocopy;
+
+		if (buf_fill == buf.size())
+		{
+			chunkBuffered(false);
+		}
+	}
+}
+
+void CdcIndexBuilder::abort()
+{
+	failed = true;
+	chunks.clear();
+}
+
+bool CdcIndexBuilder::finalize(std::vector<SCdcChunk>& ret)
+{
+	if (!failed)
+	{
+		chunkBuffered(true);
+	}
+
+	if (failed)
+	{
+		return false;
+	}
+
+	ret.swap(chunks);
+	return true;
+}
+
+void CdcIndexBuilder::chunkBuffered(bool eof)
+{
+	size_t buf_start = 0;
+	while (buf_start < buf_fill
+		&& (eof || buf_fill - buf_start >= c_cdc_max_size))
+	{
+		if (chunks.size() >= c_cdc_max_index_size)
+		{
+			abort();
+			return;
+		}
+
+		size_t chunk_len = fastcdc_next_chunk(buf.data() + buf_start, buf_fill - buf_start);
+
+		MD5 chunk_hash;
+		chunk_hash.update(reinterpret_cast<unsigned char*>(buf.data() + buf_start), static_cast<unsigned int>(chunk_len));
+		chunk_hash.finalize();
+
+		SCdcChunk chunk;
+		memcpy(chunk.hash.hash, chunk_hash.raw_digest_int(), c_cdc_hash_size);
+		chunk.len = static_cast<unsigned int>(chunk_len);
+		chunks.push_back(chunk);
+
+		buf_start += chunk_len;
+	}
+
+	if (buf_start > 0)
+	{
+		memmove(buf.data(), buf.data() + buf_start, buf_fill - buf_start);
+		buf_fill -= buf_start;
+	}
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+#include "../Interface/Server.h"
+#include "../common/fastcdc.h"
+#include <string>
+#include <vector>
+
+/*
+* Persistent content-defined chunk indexes of backed up files. Patch
+* transfers with content-defined chunks send the chunk hashes of the previous
+* version of a file to the client. Instead of reading and chunking the
+* previous version again each time, its index is written once while the file
+* is hashed (or taken from the chunks of the transfer) and loaded from here.
+*
+* Indexes are addressed by the file hash (as stored in the .hash file metadata)
+* and the file size and are stored in <backupfolder>/urbackup_cdc_index, so
+* identical files share one index. They are only a cache. Loading an index
+* updates its modification time and indexes unused for a while are removed
+* during cleanup.
+*/
+class CdcIndexStore
+{
+public:
+	static void init(const std::string& backupfolder);
+
+	//NULL if there is no index store
+	static CdcIndexStore* getInstance();
+
+	bool load(const std::string& file_hash, int64 filesize, std::vector<SCdcChunk>& chunks);
+
+	//Writes the index to a temporary file in the store and returns its path (empty on error)
+	std::string storeTemporary(const std::vector<SCdcChunk>& chunks, int64 filesize);
+
+	//Moves a temporary index from storeTemporary to its final location
+	bool commitTemporary(const std::string& tmp_fn, const std::string& file_hash, int64 filesize);
+
+	bool store(const std::string& file_hash, int64 filesize, const std::vector<SCdcChunk>& chunks);
+
+	//Removes indexes which were not used for a while and stale temporary files
+	void removeUnused();
+
+private:
+	CdcIndexStore(const std::string& store_path);
+
+	std::string indexPath(const std::string& file_hash, int64 filesize);
+
+	std::string store_path;
+
+	static CdcIndexStore* instance;
+};
+
+/*
+* Computes the content-defined chunk index of a file from its data, which is
+* passed in file order in pieces of arbitrary size
+*/
+class CdcIndexBuilder
+{
+public:
+	CdcIndexBuilder();
+
+	//buf==NULL adds bsize zero bytes (sparse extents)
+	void add(const char* buf, size_t bsize);
+
+	//Part of the file is not available. No index is built
+	void abort();
+
+	bool finalize(std::vector<SCdcChunk>& chunks);
+
+private:
+	void chunkBuffered(bool eof);
+
+	std::vector<char> buf;
+	size_t buf_fill;
+	std::vector<SCdcChunk> chunks;
+	bool failed;
+};
@@ -1875,6 +1875,11 @@ bool ClientMain::updateCapabilities(bool* needs_restart)
 		{
 			protocol_versions.filesrvtunnel = watoi(it->second);
 		}
+		it = params.find("CDC");
+		if (it != params.end())
+		{
+			protocol_versions.cdc_version = watoi(it->second);
+		}
 		it = params.find("BACKUP");
 		if (it != params.end())
 		{
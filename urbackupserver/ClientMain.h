@@ -53,7 +53,7 @@ struct SProtocolVersions
 				wtokens_version(0), update_vols(0),
 				update_capa_interval(0), require_previous_cbitmap(0),
 				async_index_version(0), restore_version(0),
-				filesrvtunnel(0)
+				filesrvtunnel(0), cdc_version(0)
 			{
 
 			}
@@ -80,6 +80,7 @@ struct SProtocolVersions
 	std::string os_simple;
 	int restore_version;
 	int filesrvtunnel;
+	int cdc_version;
 };
 
 struct SRunningBackup
@@ -41,6 +41,7 @@
 #include "../common/data.h"
 #include "PhashLoad.h"
 #include "../urbackupcommon/glob.h"
+#include "FileManifest.h"
 
 #ifndef NAME_MAX
 #define NAME_MAX _POSIX_NAME_MAX
@@ -215,7 +216,7 @@ bool FileBackup::request_filelist_construct(bool full, bool resume, int group,
 	bool has_total_timeout;
 	while( !(has_total_timeout=Server->getTimeMS()-starttime>timeout_time) )
 	{
-		if (ServerStatus::getProcess(clientname, status_id).stop)
+		if (status_handle->isStopped())
 		{
 			ServerLogger::Log(logid, "Sever admin stopped backup during indexing", LL_WARNING);
 			break;
@@ -235,7 +236,7 @@ bool FileBackup::request_filelist_construct(bool full, bool resume, int group,
 				ServerLogger::Log(logid, clientname + ": Connecting for filelist (async)...", LL_DEBUG);
 				cc = client_main->getClientCommandConnection(server_settings.get(), 10000);
 
-				if (ServerStatus::getProcess(clientname, status_id).stop)
+				if (status_handle->isStopped())
 				{
 					Server->destroy(cc);
 					cc = NULL;
@@ -252,7 +253,7 @@ bool FileBackup::request_filelist_construct(bool full, bool resume, int group,
 
 			if (cc == NULL)
 			{
-				if (!ServerStatus::getProcess(clientname, status_id).stop)
+				if (!status_handle->isStopped())
 				{
 					ServerLogger::Log(logid, "Connecting to ClientService of \"" + clientname + "\" failed - CONNECT error during filelist construction (2)", LL_ERROR);
 					has_timeout_error = true;
@@ -410,7 +411,7 @@ bool FileBackup::wait_for_async(const std::string& async_id, int64 timeout_time)
 				ServerLogger::Log(logid, clientname + ": Connecting for async...", LL_DEBUG);
 				cc.reset(client_main->getClientCommandConnection(server_settings.get(), 60000));
 
-				if (ServerStatus::getProcess(clientname, status_id).stop)
+				if (status_handle->isStopped())
 				{
 					cc.reset();
 					ServerLogger::Log(logid, "Sever admin stopped backup)", LL_WARNING);
@@ -426,7 +427,7 @@ bool FileBackup::wait_for_async(const std::string& async_id, int64 timeout_time)
 
 			if (cc.get() == NULL)
 			{
-				if (!ServerStatus::getProcess(clientname, status_id).stop)
+				if (!status_handle->isStopped())
 				{
 					ServerLogger::Log(logid, "Connecting to ClientService of \"" + clientname + "\" failed - CONNECT error during async (2)", LL_ERROR);
 					has_timeout_error = true;
@@ -593,7 +594,7 @@ void FileBackup::createHashThreads(bool use_reflink, bool ignore_hash_mismatches
 	for (size_t i = 0; i < h_cnt; ++i)
 	{
 		BackupServerHash* curr_bsh = new BackupServerHash(hashpipe, clientid, use_snapshots, use_reflink, use_tmpfiles, logid, use_snapshots, max_file_id);
-		BackupServerPrepareHash* curr_bsh_prepare = new BackupServerPrepareHash(hashpipe_prepare, hashpipe, clientid, logid, ignore_hash_mismatches);
+		BackupServerPrepareHash* curr_bsh_prepare = new BackupServerPrepareHash(hashpipe_prepare, hashpipe, clientid, logid, ignore_hash_mismatches, max_file_id);
 		bsh.push_back(curr_bsh);
 		bsh_prepare.push_back(curr_bsh_prepare);
 		bsh_ticket.push_back(Server->getThreadPool()->execute(curr_bsh, "fbackup write" + convert(i)));
@@ -606,9 +607,12 @@ void FileBackup::destroyHashThreads()
 {
 	if (!bsh_prepare.empty())
 	{
+		//Stop the hash workers only once all prepare workers are finished,
+		//as those may still be adding files to hashpipe
 		hashpipe_prepare->Write("exit");
-		Server->getThreadPool()->waitFor(bsh_ticket);
 		Server->getThreadPool()->waitFor(bsh_prepare_ticket);
+		hashpipe->Write("exit");
+		Server->getThreadPool()->waitFor(bsh_ticket);
 		Server->destroy(hashpipe_prepare);
 		Server->destroy(hashpipe);
 	}
@@ -621,6 +625,26 @@ void FileBackup::destroyHashThreads()
 	bsh_prepare.clear();
 }
 
+void FileBackup::updateHashQueuesize(size_t& prepare_hashqueuesize, size_t& hashqueuesize)
+{
+	//Queued files plus the ones the workers are currently processing
+	size_t bsh_waiting = (std::min)(bsh.size(), hashpipe->getNumWaiters());
+	size_t bsh_prepare_waiting = (std::min)(bsh_prepare.size(), hashpipe_prepare->getNumWaiters());
+
+	hashqueuesize = hashpipe->getNumElements() + bsh.size() - bsh_waiting;
+	prepare_hashqueuesize = hashpipe_prepare->getNumElements() + bsh_prepare.size() - bsh_prepare_waiting;
+
+	status_handle->setQueuesize(static_cast<unsigned int>(prepare_hashqueuesize),
+		static_cast<unsigned int>(hashqueuesize));
+}
+
+void FileBackup::updateHashQueuesize()
+{
+	size_t prepare_hashqueuesize;
+	size_t hashqueuesize;
+	updateHashQueuesize(prepare_hashqueuesize, hashqueuesize);
+}
+
 _i64 FileBackup::getIncrementalSize(IFile *f, const std::vector<size_t> &diffs, bool& backup_with_components, bool all)
 {
 	f->Seek(0);
@@ -644,9 +668,9 @@ _i64 FileBackup::getIncrementalSize(IFile *f, const std::vector<size_t> &diffs,
 
 	while( (read=f->Read(buffer, 4096))>0 )
 	{
-		for(size_t i=0;i<read;++i)
+		for(size_t i=0;i<read;)
 		{
-			bool b=list_parser.nextEntry(buffer[i], cf, NULL);
+			bool b=list_parser.nextEntry(buffer, read, i, cf, NULL);
 			if(b)
 			{
 				if(cf.isdir==true)
@@ -737,8 +761,7 @@ void FileBackup::calculateDownloadSpeed(int64 ctime, FileClient & fc, FileClient
 
 			if (last_speed_received_bytes > 0)
 			{
-				ServerStatus::setProcessSpeed(clientname, status_id,
-					speed_bpms);
+				status_handle->setSpeed(speed_bpms);
 			}
 
 			last_speed_received_bytes = received_data_bytes;
@@ -773,8 +796,7 @@ void FileBackup::calculateEtaFileBackup( int64 &last_eta_update, int64& eta_set_
 
 		if (last_eta_received_bytes > 0 && eta_estimated_speed > 0)
 		{
-			ServerStatus::setProcessEta(clientname, status_id,
-				static_cast<int64>((files_size - received_data_bytes) / eta_estimated_speed + 0.5),
+			status_handle->setEta(static_cast<int64>((files_size - received_data_bytes) / eta_estimated_speed + 0.5),
 				eta_set_time);
 		}
 
@@ -860,6 +882,17 @@ bool FileBackup::doBackup()
 
 	stopPhashDownloadThread(filelist_async_id);
 
+	if (backupid != -1)
+	{
+		destroyHashThreads();
+
+		ServerFilesDao filesdao(Server->getDatabase(Server->getThreadID(), URBACKUPDB_SERVER_FILES));
+		if (!FileManifest::finishBackup(backupid, filesdao))
+		{
+			ServerLogger::Log(logid, "Error writing file manifest of backup", LL_ERROR);
+		}
+	}
+
 	if(disk_error)
 	{
 		ServerLogger::Log(logid, "FATAL: Backup failed because of disk problems (see previous messages)", LL_ERROR);
@@ -1172,24 +1205,7 @@ bool FileBackup::link_file(const std::string &fn, const std::string &short_fn, c
 	std::string hashpath=backuppath_hashes+os_curr_hash_path;
 	std::string filepath_old;
 
-	bool tries_once;
-	std::string ff_last;
-	bool hardlink_limit;
-	bool copied_file;
-	int64 entryid=0;
-	int entryclientid = 0;
-	int64 rsize = 0;
-	int64 next_entryid = 0;
-	bool ok=local_hash->findFileAndLink(dstpath, NULL, hashpath, sha2, filesize, std::string(), true,
-		tries_once, ff_last, hardlink_limit, copied_file, entryid, entryclientid, rsize, next_entryid,
-		metadata, true, NULL);
-
-	if(ok && add_sql)
-	{
-		local_hash->addFileSQL(backupid, clientid, 0, dstpath, hashpath, sha2, filesize,
-			(rsize>0 && rsize!=filesize)?rsize:(copied_file?filesize:0), entryid, entryclientid, next_entryid,
-			copied_file);
-	}
+	bool ok=local_hash->linkFile(backupid, dstpath, hashpath, sha2, filesize, add_sql, metadata, true);
 
 	if(ok)
 	{
@@ -1273,15 +1289,10 @@ void FileBackup::waitForFileThreads(void)
 	{
 		if (hashqueuesize != std::string::npos)
 		{
-			ServerStatus::setProcessQueuesize(clientname, status_id, prepare_hashqueuesize, hashqueuesize);
 			Server->wait(1000);
 		}
 
-		size_t bsh_working = bsh.size() - hashpipe->getNumWaiters();
-		size_t bsh_prepare_working = bsh_prepare.size() - hashpipe_prepare->getNumWaiters();
-		
-		hashqueuesize = hashpipe->getNumElements() + bsh_working;
-		prepare_hashqueuesize = hashpipe_prepare->getNumElements() + bsh_prepare_working;
+		updateHashQueuesize(prepare_hashqueuesize, hashqueuesize);
 	}
 	{
 		Server->wait(10);
@@ -1292,7 +1303,7 @@ void FileBackup::waitForFileThreads(void)
 		}
 	}	
 
-	ServerStatus::setProcessQueuesize(clientname, status_id, 0, 0);
+	status_handle->setQueuesize(0, 0);
 }
 
 bool FileBackup::verify_file_backup(IFile *fileentries)
@@ -1324,10 +1335,10 @@ bool FileBackup::verify_file_backup(IFile *fileentries)
 			ServerLogger::Log(logid, "Error reading from file " + fileentries->getFilename() + ". " + os_last_error_str(), LL_ERROR);
 			return false;
 		}
-		for(size_t i=0;i<read;++i)
+		for(size_t i=0;i<read;)
 		{
 			std::map<std::string, std::string> extras;
-			bool b=list_parser.nextEntry(buffer[i], cf, &extras);
+			bool b=list_parser.nextEntry(buffer, read, i, cf, &extras);
 			if(b)
 			{
 				std::string cfn;
@@ -1761,10 +1772,10 @@ std::vector<size_t> FileBackup::findIdenticalPermissionRoots(IFile* file_list_f,
 
 	while((bread=file_list_f->Read(buffer, 4096))>0)
 	{
-		for(_u32 i=0;i<bread;++i)
+		for(size_t i=0;i<bread;)
 		{
 			std::map<std::string, std::string> extra;
-			if(file_list_parser.nextEntry(buffer[i], data, &extra))
+			if(file_list_parser.nextEntry(buffer, bread, i, data, &extra))
 			{
 
 				std::string osspecific_name;
@@ -1939,10 +1950,10 @@ bool FileBackup::createUserView(IFile* file_list_f, const std::vector<int64>& id
 			ServerLogger::Log(logid, "Error reading from file " + file_list_f->getFilename() + ". " + os_last_error_str(), LL_ERROR);
 			return false;
 		}
-		for(_u32 i=0;i<bread;++i)
+		for(size_t i=0;i<bread;)
 		{
 			std::map<std::string, std::string> extra;
-			if(file_list_parser.nextEntry(buffer[i], data, &extra))
+			if(file_list_parser.nextEntry(buffer, bread, i, data, &extra))
 			{
 				if(skip>0)
 				{
@@ -11,6 +11,7 @@
 #include "server_log.h"
 #include "FileMetadataDownloadThread.h"
 #include <set>
+#include <deque>
 
 class ClientMain;
 class BackupServerHash;
@@ -88,31 +89,46 @@ public:
 		min_downloaded = id+1;
 	}
 
+	//File was queued for hashing. The hash workers may finish files in a
+	//different order, so setMaxDownloaded is applied in queue order.
+	//Copies only hold back the files queued after them and do not
+	//advance max_downloaded themselves
+	void startHashing(size_t id, bool is_copy=false)
+	{
+		IScopedLock lock(mutex.get());
+		SHashing item = { id, is_copy, false };
+		hashing.push_back(item);
+	}
+
 	void setMaxDownloaded(size_t id)
 	{
 		IScopedLock lock(mutex.get());
 
-		for (size_t i = 0; i < postponed.size();)
+		std::deque<SHashing>::iterator it;
+		for (it = hashing.begin(); it != hashing.end(); ++it)
 		{
-			if (postponed[i] == id)
-			{
-				postponed.erase(postponed.begin() + i);
-			}
-			else if (id > postponed[i])
+			if (it->id == id && !it->done)
 			{
-				id = postponed[i] - 1;
-				++i;
-			}
-			else
-			{
-				++i;
+				break;
 			}
 		}
 
-		max_downloaded = id + 1;
-		if (max_downloaded >= min_downloaded)
+		if (it == hashing.end())
 		{
-			max_downloaded = std::string::npos;
+			setMaxDownloadedInt(id);
+			return;
+		}
+
+		it->done = true;
+
+		while (!hashing.empty()
+			&& hashing.front().done)
+		{
+			if (!hashing.front().is_copy)
+			{
+				setMaxDownloadedInt(hashing.front().id);
+			}
+			hashing.pop_front();
 		}
 	}
 
@@ -138,7 +154,8 @@ public:
 		IScopedLock lock(mutex.get());
 		std::string ret= "max_downloaded="+convert(max_downloaded)
 			+" max_preprocessed="+convert(max_preprocessed)
-			+" min_downloaded="+convert(min_downloaded)+" postponed.size="+convert(postponed.size());
+			+" min_downloaded="+convert(min_downloaded)+" postponed.size="+convert(postponed.size())
+			+" hashing.size="+convert(hashing.size());
 
 		if (!postponed.empty())
 		{
@@ -163,13 +180,46 @@ public:
 	}
 
 private:
+	struct SHashing
+	{
+		size_t id;
+		bool is_copy;
+		bool done;
+	};
+
+	void setMaxDownloadedInt(size_t id)
+	{
+		for (size_t i = 0; i < postponed.size();)
+		{
+			if (postponed[i] == id)
+			{
+				postponed.erase(postponed.begin() + i);
+			}
+			else if (id > postponed[i])
+			{
+				id = postponed[i] - 1;
+				++i;
+			}
+			else
+			{
+				++i;
+			}
+		}
+
+		max_downloaded = id + 1;
+		if (max_downloaded >= min_downloaded)
+		{
+			max_downloaded = std::string::npos;
+		}
+	}
+
 	std::unique_ptr<IMutex> mutex;
 	size_t max_downloaded;
 	size_t max_preprocessed;
 	size_t min_downloaded;
 	std::vector<size_t> postponed;
+	std::deque<SHashing> hashing;
 };
-
 class FileBackup : public Backup, public FileClient::ProgressLogCallback, public FileClient::NoFreeSpaceCallback,
 	public FileClientChunked::NoFreeSpaceCallback
 {
@@ -218,6 +268,8 @@ protected:
 	std::string clientlistName(int ref_backupid);
 	void createHashThreads(bool use_reflink, bool ignore_hash_mismatches);
 	void destroyHashThreads();
+	void updateHashQueuesize(size_t& prepare_hashqueuesize, size_t& hashqueuesize);
+	void updateHashQueuesize();
 	_i64 getIncrementalSize(IFile *f, const std::vector<size_t> &diffs, bool& backup_with_components, bool all=false);
 	void calculateDownloadSpeed(int64 ctime, FileClient &fc, FileClientChunked* fc_chunked);
 	void calculateEtaFileBackup( int64 &last_eta_update, int64& eta_set_time, int64 ctime, FileClient &fc, FileClientChunked* fc_chunked,
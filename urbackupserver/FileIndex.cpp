@@ -19,6 +19,10 @@
 #include "FileIndex.h"
 #include "../Interface/Server.h"
 #include "create_files_index.h"
+#include "../urbackupcommon/os_functions.h"
+#include "../common/data.h"
+#include <algorithm>
+#include <memory>
 
 const size_t max_buffer_size=100000;
 #ifdef _DEBUG
@@ -28,6 +32,108 @@ const unsigned int max_wait_time=30000;
 #endif
 const size_t min_size_no_wait=10000;
 
+namespace
+{
+	enum EDurability
+	{
+		//Changes not yet committed to LMDB are lost on crash
+		EDurability_None = 0,
+		//Changes are written to a journal before being buffered
+		EDurability_Journal = 1,
+		//Like EDurability_Journal, but the journal is synced after each change
+		EDurability_Sync = 2
+	};
+
+	const char* journal_fn_1 = "urbackup/fileindex/backup_server_files_index.journal1";
+	const char* journal_fn_2 = "urbackup/fileindex/backup_server_files_index.journal2";
+
+	struct SJournalItem
+	{
+		FileIndex::SIndexKey key;
+		int64 value;
+		int64 seq;
+	};
+
+	//hash, filesize, clientid, value, seq
+	const size_t c_journal_item_size = bytes_in_index + sizeof(int64) + sizeof(int) + sizeof(int64) + sizeof(int64);
+
+	bool journal_item_seq_less(const SJournalItem& a, const SJournalItem& b)
+	{
+		return a.seq < b.seq;
+	}
+
+	void serialize_journal_item(const FileIndex::SIndexKey& key, int64 value, int64 seq, std::string& out)
+	{
+		CWData data;
+		data.addBuffer(key.getHash(), bytes_in_index);
+		data.addInt64(key.getFilesize());
+		data.addInt(key.getClientid());
+		data.addInt64(value);
+		data.addInt64(seq);
+		out.append(data.getDataPtr(), data.getDataSize());
+	}
+
+	bool deserialize_journal_item(const char* buf, SJournalItem& item)
+	{
+		CRData data(buf + bytes_in_index, c_journal_item_size - bytes_in_index);
+		int64 filesize;
+		int clientid;
+		if (!data.getInt64(&filesize)
+			|| !data.getInt(&clientid)
+			|| !data.getInt64(&item.value)
+			|| !data.getInt64(&item.seq)
+			|| filesize < 0
+			|| clientid < 0)
+		{
+			return false;
+		}
+
+		item.key = FileIndex::SIndexKey(buf, filesize, clientid);
+		return true;
+	}
+
+	bool read_journal(const std::string& fn, std::vector<SJournalItem>& items)
+	{
+		std::unique_ptr<IFile> f(Server->openFile(fn, MODE_READ));
+		if (f.get() == NULL)
+		{
+			return true;
+		}
+
+		std::vector<char> buf(c_journal_item_size * 1000);
+		int64 pos = 0;
+		int64 fsize = f->Size();
+		while (pos + static_cast<int64>(c_journal_item_size) <= fsize)
+		{
+			_u32 toread = static_cast<_u32>((std::min)(static_cast<int64>(buf.size()),
+				((fsize - pos) / static_cast<int64>(c_journal_item_size))*static_cast<int64>(c_journal_item_size)));
+			bool has_read_error = false;
+			_u32 read = f->Read(pos, buf.data(), toread, &has_read_error);
+			if (has_read_error || read != toread)
+			{
+				Server->Log("Error reading file entry index journal " + fn + ". " + os_last_error_str(), LL_ERROR);
+				return false;
+			}
+
+			for (_u32 i = 0; i < read; i += c_journal_item_size)
+			{
+				SJournalItem item;
+				if (!deserialize_journal_item(buf.data() + i, item))
+				{
+					Server->Log("File entry index journal " + fn + " is corrupt", LL_ERROR);
+					return false;
+				}
+				items.push_back(item);
+			}
+
+			pos += read;
+		}
+
+		//An incomplete item at the end was never buffered
+		return true;
+	}
+}
+
 std::map<FileIndex::SIndexKey, int64> FileIndex::cache_buffer_1;
 std::map<FileIndex::SIndexKey, int64> FileIndex::cache_buffer_2;
 std::map<FileIndex::SIndexKey, int64>* FileIndex::active_cache_buffer=&cache_buffer_1;
@@ -40,12 +146,22 @@ ICondition *FileIndex::cond=NULL;
 bool FileIndex::do_shutdown=false;
 bool FileIndex::do_flush=false;
 bool FileIndex::do_accept = true;
+IFsFile* FileIndex::journal_1 = NULL;
+IFsFile* FileIndex::journal_2 = NULL;
+std::string FileIndex::journal_pending_1;
+std::string FileIndex::journal_pending_2;
+IMutex* FileIndex::journal_mutex = NULL;
+int64 FileIndex::journal_seq = 0;
+int64 FileIndex::journal_written_seq = -1;
+bool FileIndex::journal_keep = false;
+int FileIndex::durability = EDurability_None;
 
 
 void FileIndex::operator()(void)
 {
 	mutex=Server->createMutex();
 	cond=Server->createCondition();
+	journal_mutex=Server->createMutex();
 
 	while(true)
 	{
@@ -112,10 +228,36 @@ void FileIndex::operator()(void)
 
 		commit_transaction();
 
+		//The journal may only be dropped once the changes are on disk
+		bool committed = !has_error()
+			&& (journal_1==NULL || sync());
+
 		{
-			IScopedLock lock(mutex);
-			local_buf->clear();
-			do_flush=false;
+			IScopedLock journal_lock(journal_mutex);
+
+			bool truncate = false;
+			{
+				IScopedLock lock(mutex);
+				if(!committed && !journal_keep && journal_1!=NULL)
+				{
+					Server->Log("Committing file entry index changes failed. Keeping the journal to replay them on the next start.", LL_ERROR);
+					journal_keep=true;
+				}
+				else if(committed && !journal_keep)
+				{
+					//Not yet written items of this buffer are committed as well
+					(local_buf==&cache_buffer_1 ? journal_pending_1 : journal_pending_2).clear();
+					truncate=true;
+				}
+				local_buf->clear();
+				do_flush=false;
+				cond->notify_all();
+			}
+
+			if(truncate)
+			{
+				truncate_journal(local_buf);
+			}
 		}
 	}
 
@@ -124,17 +266,25 @@ void FileIndex::operator()(void)
 
 void FileIndex::put_delayed(const SIndexKey& key, int64 value)
 {
-	IScopedLock lock(mutex);
-
-	while(active_cache_buffer->size()>=max_buffer_size || !do_accept)
+	int64 seq;
 	{
-		lock.relock(NULL);
-		Server->wait(10);
-		lock.relock(mutex);
+		IScopedLock lock(mutex);
+
+		while(active_cache_buffer->size()>=max_buffer_size || !do_accept)
+		{
+			cond->wait(&lock, 100);
+		}
+
+		seq = append_journal(key, value);
+
+		(*active_cache_buffer)[key]=value;
+		cond->notify_all();
 	}
 
-	(*active_cache_buffer)[key]=value;
-	cond->notify_all();
+	if(seq>=0)
+	{
+		write_journal(seq);
+	}
 }
 
 void FileIndex::del_delayed(const SIndexKey& key)
@@ -334,3 +484,163 @@ void FileIndex::stop_accept()
 	IScopedLock lock(mutex);
 	do_accept = false;
 }
+
+bool FileIndex::replay_journal(FileIndex* index)
+{
+	std::string s_durability = Server->getServerParameter("fileindex_durability", "journal");
+	if (s_durability == "none")
+	{
+		durability = EDurability_None;
+	}
+	else if (s_durability == "sync")
+	{
+		durability = EDurability_Sync;
+	}
+	else
+	{
+		durability = EDurability_Journal;
+	}
+
+	std::vector<SJournalItem> items;
+	if (!read_journal(journal_fn_1, items)
+		|| !read_journal(journal_fn_2, items))
+	{
+		return false;
+	}
+
+	if (!items.empty())
+	{
+		Server->Log("Replaying " + convert(items.size()) + " file entry index changes from journal...", LL_INFO);
+
+		std::stable_sort(items.begin(), items.end(), journal_item_seq_less);
+
+		index->start_transaction();
+		for (size_t i = 0; i < items.size(); ++i)
+		{
+			int64 value = items[i].value;
+			if (value != 0)
+			{
+				index->put(items[i].key, value);
+			}
+			else
+			{
+				index->del(items[i].key);
+			}
+		}
+		index->commit_transaction();
+
+		if (index->has_error())
+		{
+			Server->Log("Error replaying file entry index journal", LL_ERROR);
+			return false;
+		}
+
+		journal_seq = items[items.size() - 1].seq + 1;
+	}
+
+	if (durability == EDurability_None)
+	{
+		Server->deleteFile(journal_fn_1);
+		Server->deleteFile(journal_fn_2);
+		return true;
+	}
+
+	journal_1 = Server->openFile(journal_fn_1, MODE_RW_CREATE);
+	journal_2 = Server->openFile(journal_fn_2, MODE_RW_CREATE);
+
+	if (journal_1 == NULL
+		|| journal_2 == NULL)
+	{
+		Server->Log("Error opening file entry index journal. " + os_last_error_str(), LL_ERROR);
+		Server->destroy(journal_1);
+		Server->destroy(journal_2);
+		journal_1 = NULL;
+		journal_2 = NULL;
+		return false;
+	}
+
+	if (!journal_1->Resize(0)
+		|| !journal_2->Resize(0))
+	{
+		Server->Log("Error truncating file entry index journal. " + os_last_error_str(), LL_ERROR);
+		return false;
+	}
+
+	journal_1->Seek(0);
+	journal_2->Seek(0);
+
+	return true;
+}
+
+int64 FileIndex::append_journal(const SIndexKey& key, int64 value)
+{
+	if (journal_1 == NULL)
+	{
+		return -1;
+	}
+
+	int64 seq = journal_seq++;
+	serialize_journal_item(key, value, seq,
+		active_cache_buffer == &cache_buffer_1 ? journal_pending_1 : journal_pending_2);
+
+	return seq;
+}
+
+void FileIndex::write_journal(int64 seq)
+{
+	IScopedLock journal_lock(journal_mutex);
+
+	//Written together with the items of another producer
+	if (journal_written_seq >= seq)
+	{
+		return;
+	}
+
+	std::string data_1;
+	std::string data_2;
+	int64 last_seq;
+	{
+		IScopedLock lock(mutex);
+		data_1.swap(journal_pending_1);
+		data_2.swap(journal_pending_2);
+		last_seq = journal_seq - 1;
+	}
+
+	IFsFile* journals[2] = { journal_1, journal_2 };
+	std::string* datas[2] = { &data_1, &data_2 };
+	for (size_t i = 0; i < 2; ++i)
+	{
+		if (datas[i]->empty())
+		{
+			continue;
+		}
+
+		if (journals[i]->Write(*datas[i]) != datas[i]->size())
+		{
+			Server->Log("Error writing to file entry index journal. " + os_last_error_str(), LL_ERROR);
+		}
+		else if (durability == EDurability_Sync)
+		{
+			journals[i]->Sync();
+		}
+	}
+
+	journal_written_seq = last_seq;
+}
+
+void FileIndex::truncate_journal(std::map<SIndexKey, int64>* buf)
+{
+	IFsFile* journal = buf == &cache_buffer_1 ? journal_1 : journal_2;
+
+	if (journal == NULL)
+	{
+		return;
+	}
+
+	if (!journal->Resize(0))
+	{
+		Server->Log("Error truncating file entry index journal. " + os_last_error_str(), LL_ERROR);
+	}
+
+	journal->Seek(0);
+}
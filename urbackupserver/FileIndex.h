@@ -5,6 +5,7 @@
 #include "../Interface/Mutex.h"
 #include "../Interface/Condition.h"
 #include "../Interface/Thread.h"
+#include "../Interface/File.h"
 #include <memory.h>
 #include "../stringtools.h"
 #include <assert.h>
@@ -126,6 +127,9 @@ public:
 
 	virtual void commit_transaction(void)=0;
 
+	//Makes the committed transactions durable
+	virtual bool sync(void)=0;
+
 	virtual void start_iteration()=0;
 
 	virtual std::map<int, int64> get_next_entries_iteration(bool& has_next)=0;
@@ -140,8 +144,17 @@ public:
 
 	static void stop_accept();
 
+	//Applies changes from the journal of a previous run and opens the journal for writing
+	static bool replay_journal(FileIndex* index);
+
 private:
 
+	static int64 append_journal(const SIndexKey& key, int64 value);
+
+	static void write_journal(int64 seq);
+
+	static void truncate_journal(std::map<SIndexKey, int64>* buf);
+
 	bool get_from_cache( const FileIndex::SIndexKey &key, const std::map<SIndexKey, int64>& cache, int64& res );
 
 	bool get_from_cache_prefer_client( const SIndexKey &key, const std::map<SIndexKey, int64>& cache, int64& res);
@@ -161,4 +174,14 @@ private:
 
 	static bool do_flush;
 	static bool do_accept;
+
+	static IFsFile* journal_1;
+	static IFsFile* journal_2;
+	static std::string journal_pending_1;
+	static std::string journal_pending_2;
+	static IMutex* journal_mutex;
+	static int64 journal_seq;
+	static int64 journal_written_seq;
+	static bool journal_keep;
+	static int durability;
 };
\ No newline at end of file
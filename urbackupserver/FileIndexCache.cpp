@@ -0,0 +1,213 @@
+/*************************************************************************
+*    UrBackup - Client/Server backup system
+*    Copyright (C) 2011-2016 Martin Raiber
+*
+*    This program is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU Affero General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU Affero General Public License for more details.
+*
+*    You should have received a copy of the GNU Affero General Public License
+*    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**************************************************************************/
+
+#include "FileIndexCache.h"
+#include "../Interface/Server.h"
+#include <memory.h>
+
+namespace
+{
+	const size_t c_n_shards = 64;
+
+	//Approximate size of a cached group without entries (hash map node, LRU list node, vector)
+	const size_t c_group_overhead = 128;
+}
+
+FileIndexCache::SGroupKey::SGroupKey(const FileIndex::SIndexKey & key)
+	: filesize(key.getFilesize())
+{
+	memcpy(hash, key.getHash(), bytes_in_index);
+}
+
+bool FileIndexCache::SGroupKey::operator==(const SGroupKey & other) const
+{
+	return filesize == other.filesize
+		&& memcmp(hash, other.hash, bytes_in_index) == 0;
+}
+
+size_t FileIndexCache::SGroupKeyHash::operator()(const SGroupKey & key) const
+{
+	//The key already is a cryptographic hash
+	size_t ret;
+	memcpy(&ret, key.hash, sizeof(ret));
+	return ret ^ static_cast<size_t>(key.filesize);
+}
+
+FileIndexCache::FileIndexCache(size_t mem_budget)
+	: shards(c_n_shards), shard_budget(mem_budget / c_n_shards)
+{
+	for (size_t i = 0; i < shards.size(); ++i)
+	{
+		shards[i].mutex.reset(Server->createMutex());
+	}
+}
+
+FileIndexCache::~FileIndexCache()
+{
+}
+
+bool FileIndexCache::get(const FileIndex::SIndexKey & key, ELookup lookup, int64 & res, int64& generation)
+{
+	SGroupKey group_key(key);
+	SShard& shard = getShard(group_key);
+	int clientid = key.getClientid();
+
+	IScopedLock lock(shard.mutex.get());
+
+	std::unordered_map<SGroupKey, SGroup, SGroupKeyHash>::iterator it = shard.groups.find(group_key);
+	if (it != shard.groups.end())
+	{
+		std::vector<SEntry>& entries = it->second.entries;
+		for (size_t i = 0; i < entries.size(); ++i)
+		{
+			if (entries[i].clientid == clientid
+				&& entries[i].lookup == lookup)
+			{
+				res = entries[i].res;
+				shard.lru.splice(shard.lru.end(), shard.lru, it->second.lru_it);
+				++shard.hits;
+				return true;
+			}
+		}
+	}
+
+	++shard.misses;
+	generation = shard.generation;
+	return false;
+}
+
+void FileIndexCache::put(const FileIndex::SIndexKey & key, ELookup lookup, int64 res, int64 generation)
+{
+	if (shard_budget == 0)
+	{
+		return;
+	}
+
+	SGroupKey group_key(key);
+	SShard& shard = getShard(group_key);
+
+	IScopedLock lock(shard.mutex.get());
+
+	if (shard.generation != generation)
+	{
+		//Index was modified while looking up the result
+		return;
+	}
+
+	std::unordered_map<SGroupKey, SGroup, SGroupKeyHash>::iterator it = shard.groups.find(group_key);
+	if (it == shard.groups.end())
+	{
+		it = shard.groups.insert(std::make_pair(group_key, SGroup())).first;
+		it->second.lru_it = shard.lru.insert(shard.lru.end(), group_key);
+		shard.mem_used += c_group_overhead;
+	}
+	else
+	{
+		shard.lru.splice(shard.lru.end(), shard.lru, it->second.lru_it);
+
+		std::vector<SEntry>& entries = it->second.entries;
+		for (size_t i = 0; i < entries.size(); ++i)
+		{
+			if (entries[i].clientid == key.getClientid()
+				&& entries[i].lookup == lookup)
+			{
+				entries[i].res = res;
+				return;
+			}
+		}
+	}
+
+	SEntry entry = { key.getClientid(), lookup, res };
+	it->second.entries.push_back(entry);
+	shard.mem_used += sizeof(SEntry);
+
+	evict(shard);
+}
+
+void FileIndexCache::invalidate(const FileIndex::SIndexKey & key)
+{
+	SGroupKey group_key(key);
+	SShard& shard = getShard(group_key);
+
+	IScopedLock lock(shard.mutex.get());
+
+	++shard.generation;
+
+	std::unordered_map<SGroupKey, SGroup, SGroupKeyHash>::iterator it = shard.groups.find(group_key);
+	if (it != shard.groups.end())
+	{
+		shard.mem_used -= c_group_overhead + it->second.entries.size() * sizeof(SEntry);
+		shard.lru.erase(it->second.lru_it);
+		shard.groups.erase(it);
+		++shard.invalidations;
+	}
+}
+
+void FileIndexCache::clear()
+{
+	for (size_t i = 0; i < shards.size(); ++i)
+	{
+		SShard& shard = shards[i];
+		IScopedLock lock(shard.mutex.get());
+		++shard.generation;
+		shard.groups.clear();
+		shard.lru.clear();
+		shard.mem_used = 0;
+	}
+}
+
+FileIndexCache::SStats FileIndexCache::getStats()
+{
+	SStats ret;
+	ret.mem_budget = shard_budget * shards.size();
+
+	for (size_t i = 0; i < shards.size(); ++i)
+	{
+		SShard& shard = shards[i];
+		IScopedLock lock(shard.mutex.get());
+		ret.hits += shard.hits;
+		ret.misses += shard.misses;
+		ret.invalidations += shard.invalidations;
+		ret.evictions += shard.evictions;
+		ret.n_groups += shard.groups.size();
+		ret.mem_used += shard.mem_used;
+	}
+
+	return ret;
+}
+
+FileIndexCache::SShard & FileIndexCache::getShard(const SGroupKey & key)
+{
+	//Use different bytes of the hash than the hash map
+	unsigned char idx;
+	memcpy(&idx, key.hash + sizeof(size_t), sizeof(idx));
+	return shards[idx % shards.size()];
+}
+
+void FileIndexCache::evict(SShard & shard)
+{
+	while (shard.mem_used > shard_budget
+		&& !shard.lru.empty())
+	{
+		std::unordered_map<SGroupKey, SGroup, SGroupKeyHash>::iterator it = shard.groups.find(shard.lru.front());
+		shard.mem_used -= c_group_overhead + it->second.entries.size() * sizeof(SEntry);
+		shard.groups.erase(it);
+		shard.lru.pop_front();
+		++shard.evictions;
+	}
+}
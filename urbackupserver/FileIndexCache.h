@@ -0,0 +1,113 @@
+#pragma once
+
+#include "FileIndex.h"
+#include "../Interface/Mutex.h"
+#include <unordered_map>
+#include <list>
+#include <vector>
+#include <memory>
+
+/*
+* In-memory cache of LMDBFileIndex lookup results (including "not found").
+* Entries are grouped by (hash, filesize), since get_prefer_client depends on
+* all entries with the same hash and size. The cache is split into shards,
+* each with its own lock, LRU list and share of the memory budget.
+*
+* Lookups remember the shard generation before reading from LMDB and the
+* result is only inserted if no invalidation happened in the meantime. The
+* LMDB writer invalidates all groups in its transaction log after a
+* successful commit.
+*/
+class FileIndexCache
+{
+public:
+	enum ELookup
+	{
+		ELookup_Exact = 0,
+		ELookup_PreferClient = 1
+	};
+
+	struct SStats
+	{
+		SStats()
+			: hits(0), misses(0), invalidations(0), evictions(0),
+			n_groups(0), mem_used(0), mem_budget(0)
+		{}
+
+		int64 hits;
+		int64 misses;
+		int64 invalidations;
+		int64 evictions;
+		size_t n_groups;
+		size_t mem_used;
+		size_t mem_budget;
+	};
+
+	FileIndexCache(size_t mem_budget);
+	~FileIndexCache();
+
+	//Returns true and sets res on hit. Otherwise sets generation to pass to put()
+	bool get(const FileIndex::SIndexKey& key, ELookup lookup, int64& res, int64& generation);
+
+	void put(const FileIndex::SIndexKey& key, ELookup lookup, int64 res, int64 generation);
+
+	void invalidate(const FileIndex::SIndexKey& key);
+
+	void clear();
+
+	SStats getStats();
+
+private:
+	struct SGroupKey
+	{
+		SGroupKey(const FileIndex::SIndexKey& key);
+
+		bool operator==(const SGroupKey& other) const;
+
+		char hash[bytes_in_index];
+		int64 filesize;
+	};
+
+	struct SGroupKeyHash
+	{
+		size_t operator()(const SGroupKey& key) const;
+	};
+
+	struct SEntry
+	{
+		int clientid;
+		int lookup;
+		int64 res;
+	};
+
+	struct SGroup
+	{
+		std::vector<SEntry> entries;
+		std::list<SGroupKey>::iterator lru_it;
+	};
+
+	struct SShard
+	{
+		SShard()
+			: generation(0), mem_used(0), hits(0), misses(0),
+			invalidations(0), evictions(0)
+		{}
+
+		std::unique_ptr<IMutex> mutex;
+		std::unordered_map<SGroupKey, SGroup, SGroupKeyHash> groups;
+		std::list<SGroupKey> lru;
+		int64 generation;
+		size_t mem_used;
+		int64 hits;
+		int64 misses;
+		int64 invalidations;
+		int64 evictions;
+	};
+
+	SShard& getShard(const SGroupKey& key);
+
+	void evict(SShard& shard);
+
+	std::vector<SShard> shards;
+	size_t shard_budget;
+};
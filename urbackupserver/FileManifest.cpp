@@ -0,0 +1,855 @@
+/*************************************************************************
+*    UrBackup - Client/Server backup system
+*    Copyright (C) 2011-2016 Martin Raiber
+*
+*    This program is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU Affero General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU Affero General Public License for more details.
+*
+*    You should have received a copy of the GNU Affero General Public License
+*    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**************************************************************************/
+
+#include "FileManifest.h"
+#include "../Interface/Server.h"
+#include "../Interface/Mutex.h"
+#include "../common/data.h"
+#include "../urbackupcommon/os_functions.h"
+#include "../stringtools.h"
+#include <algorithm>
+#include <map>
+#include <memory.h>
+#ifndef NO_ZSTD_COMPRESSION
+#include <zstd.h>
+#endif
+
+namespace
+{
+	const char c_magic[] = "URBMANI1";
+	const size_t c_magic_size = 8;
+	const size_t c_footer_size = 4 * sizeof(int64) + 2 * sizeof(int) + c_magic_size;
+
+	//Uncompressed size of a manifest block
+	const size_t c_block_size = 64 * 1024;
+	const char c_mode_raw = 0;
+	const char c_mode_zstd = 1;
+	const int c_zstd_level = 3;
+
+	const size_t c_run_read_size = 512 * 1024;
+
+	const std::string c_manifest_prefix = "file_manifest_";
+	const std::string c_manifest_ext = ".ummf";
+
+	IMutex* writers_mutex = NULL;
+
+	std::string manifest_dir()
+	{
+		return Server->getServerWorkingDir() + os_file_sep() + "urbackup";
+	}
+
+	void serialize_entry(CWData& data, const ServerFilesDao::SFileEntry& entry)
+	{
+		data.addString(entry.fullpath);
+		data.addString(entry.hashpath);
+		data.addString(entry.shahash);
+		data.addVarInt(entry.filesize);
+	}
+
+	bool parse_entry(CRData& data, ServerFilesDao::SFileEntry& entry)
+	{
+		entry.exists = data.getStr(&entry.fullpath)
+			&& data.getStr(&entry.hashpath)
+			&& data.getStr(&entry.shahash)
+			&& data.getVarInt(&entry.filesize);
+		return entry.exists;
+	}
+
+	bool entry_less(const ServerFilesDao::SFileEntry& a, const ServerFilesDao::SFileEntry& b)
+	{
+		return a.fullpath < b.fullpath;
+	}
+
+	class RunReader
+	{
+	public:
+		RunReader(IFile* f)
+			: f(f), pos(0), fpos(0)
+		{}
+
+		bool next(ServerFilesDao::SFileEntry& entry)
+		{
+			entry.exists = false;
+
+			_u32 len;
+			if (!fill(sizeof(len)))
+			{
+				return false;
+			}
+			memcpy(&len, buf.data() + pos, sizeof(len));
+			len = little_endian(len);
+
+			if (!fill(sizeof(len) + len))
+			{
+				return false;
+			}
+
+			CRData data(buf.data() + pos + sizeof(len), len);
+			pos += sizeof(len) + len;
+			return parse_entry(data, entry);
+		}
+
+	private:
+		bool fill(size_t n)
+		{
+			if (buf.size() - pos >= n)
+			{
+				return true;
+			}
+
+			buf.erase(buf.begin(), buf.begin() + pos);
+			pos = 0;
+
+			size_t off = buf.size();
+			size_t toread = (std::max)(n, c_run_read_size) - off;
+			buf.resize(off + toread);
+			_u32 read = f->Read(fpos, buf.data() + off, static_cast<_u32>(toread));
+			fpos += read;
+			buf.resize(off + read);
+
+			return buf.size() >= n;
+		}
+
+		std::unique_ptr<IFile> f;
+		std::vector<char> buf;
+		size_t pos;
+		int64 fpos;
+	};
+
+	class ManifestOutput
+	{
+	public:
+		ManifestOutput(IFile* f)
+			: f(f), pos(0), has_error(false), num_files(0), total_size(0)
+		{
+			write(c_magic, c_magic_size);
+		}
+
+		void add(const ServerFilesDao::SFileEntry& entry)
+		{
+			if (block.getDataSize() == 0)
+			{
+				block_first_path = entry.fullpath;
+			}
+
+			serialize_entry(block, entry);
+			++num_files;
+			total_size += entry.filesize;
+
+			if (block.getDataSize() >= c_block_size)
+			{
+				flushBlock();
+			}
+		}
+
+		bool finish(int clientid, int incremental)
+		{
+			flushBlock();
+
+			CWData index;
+			for (size_t i = 0; i < blocks.size(); ++i)
+			{
+				index.addString(blocks[i].first_path);
+				index.addInt64(blocks[i].offset);
+				index.addUInt(blocks[i].csize);
+				index.addUInt(blocks[i].size);
+				index.addChar(blocks[i].mode);
+			}
+
+			int64 index_offset = pos;
+			write(index.getDataPtr(), index.getDataSize());
+
+			CWData footer;
+			footer.addInt64(index_offset);
+			footer.addInt64(index.getDataSize());
+			footer.addInt64(num_files);
+			footer.addInt64(total_size);
+			footer.addInt(clientid);
+			footer.addInt(incremental);
+			footer.addBuffer(c_magic, c_magic_size);
+			write(footer.getDataPtr(), footer.getDataSize());
+
+			return !has_error;
+		}
+
+		int64 getNumFiles() { return num_files; }
+		int64 getTotalSize() { return total_size; }
+
+	private:
+		struct SBlock
+		{
+			std::string first_path;
+			int64 offset;
+			_u32 csize;
+			_u32 size;
+			char mode;
+		};
+
+		void flushBlock()
+		{
+			if (block.getDataSize() == 0)
+			{
+				return;
+			}
+
+			SBlock new_block;
+			new_block.first_path = block_first_path;
+			new_block.offset = pos;
+			new_block.size = static_cast<_u32>(block.getDataSize());
+			new_block.mode = c_mode_raw;
+			new_block.csize = new_block.size;
+
+#ifndef NO_ZSTD_COMPRESSION
+			cbuf.resize(ZSTD_compressBound(block.getDataSize()));
+			size_t rc = ZSTD_compress(cbuf.data(), cbuf.size(), block.getDataPtr(), block.getDataSize(), c_zstd_level);
+			if (!ZSTD_isError(rc) && rc < block.getDataSize())
+			{
+				new_block.mode = c_mode_zstd;
+				new_block.csize = static_cast<_u32>(rc);
+				write(cbuf.data(), rc);
+			}
+			else
+#endif
+			{
+				write(block.getDataPtr(), block.getDataSize());
+			}
+
+			blocks.push_back(new_block);
+			block.clear();
+		}
+
+		void write(const char* data, size_t size)
+		{
+			if (f->Write(pos, data, static_cast<_u32>(size)) != size)
+			{
+				has_error = true;
+			}
+			pos += size;
+		}
+
+		IFile* f;
+		int64 pos;
+		bool has_error;
+		int64 num_files;
+		int64 total_size;
+
+		CWData block;
+		std::string block_first_path;
+		std::vector<char> cbuf;
+		std::vector<SBlock> blocks;
+	};
+
+	class ManifestWriter
+	{
+	public:
+		ManifestWriter(int backupid, int clientid, int incremental)
+			: backupid(backupid), clientid(clientid), incremental(incremental),
+			mutex(Server->createMutex()), buffer_bytes(0), n_runs(0), has_error(false)
+		{
+			max_buffer_bytes = static_cast<size_t>(watoi64(Server->getServerParameter("file_manifest_run_mb", "64"))) * 1024 * 1024;
+		}
+
+		~ManifestWriter()
+		{
+			removeRuns();
+		}
+
+		void add(const ServerFilesDao::SFileEntry& entry)
+		{
+			IScopedLock lock(mutex.get());
+
+			buffer.push_back(entry);
+			buffer_bytes += sizeof(entry) + entry.fullpath.size() + entry.hashpath.size() + entry.shahash.size();
+
+			if (buffer_bytes >= max_buffer_bytes)
+			{
+				spill();
+			}
+		}
+
+		bool finish(int64& num_files, int64& total_size)
+		{
+			IScopedLock lock(mutex.get());
+
+			std::string tmp_name = FileManifest::manifestName(backupid) + ".new";
+			std::unique_ptr<IFile> out(Server->openFile(tmp_name, MODE_WRITE));
+			if (out.get() == NULL)
+			{
+				Server->Log("Error creating file manifest \"" + tmp_name + "\". " + os_last_error_str(), LL_ERROR);
+				return false;
+			}
+
+			ManifestOutput output(out.get());
+
+			if (n_runs == 0)
+			{
+				std::stable_sort(buffer.begin(), buffer.end(), entry_less);
+				for (size_t i = 0; i < buffer.size(); ++i)
+				{
+					output.add(buffer[i]);
+				}
+			}
+			else
+			{
+				spill();
+				merge(output);
+			}
+
+			buffer.clear();
+			buffer_bytes = 0;
+
+			bool ok = !has_error
+				&& output.finish(clientid, incremental)
+				&& out->Sync();
+			out.reset();
+
+			if (ok)
+			{
+				Server->deleteFile(FileManifest::manifestName(backupid));
+				ok = os_rename_file(tmp_name, FileManifest::manifestName(backupid));
+			}
+
+			if (!ok)
+			{
+				Server->Log("Error writing file manifest of backup " + convert(backupid) + ". " + os_last_error_str(), LL_ERROR);
+				Server->deleteFile(tmp_name);
+				return false;
+			}
+
+			removeRuns();
+
+			num_files = output.getNumFiles();
+			total_size = output.getTotalSize();
+			return true;
+		}
+
+		void removeRuns()
+		{
+			for (size_t i = 0; i < n_runs; ++i)
+			{
+				Server->deleteFile(runName(i));
+			}
+			n_runs = 0;
+		}
+
+		int getClientid() { return clientid; }
+		int getIncremental() { return incremental; }
+
+	private:
+		std::string runName(size_t i)
+		{
+			return FileManifest::manifestName(backupid) + ".run" + convert(i);
+		}
+
+		void spill()
+		{
+			if (buffer.empty())
+			{
+				return;
+			}
+
+			std::stable_sort(buffer.begin(), buffer.end(), entry_less);
+
+			std::string fn = runName(n_runs);
+			std::unique_ptr<IFile> f(Server->openFile(fn, MODE_WRITE));
+			if (f.get() == NULL)
+			{
+				Server->Log("Error creating file manifest run \"" + fn + "\". " + os_last_error_str(), LL_ERROR);
+				has_error = true;
+			}
+			else
+			{
+				++n_runs;
+
+				CWData data;
+				for (size_t i = 0; i < buffer.size(); ++i)
+				{
+					CWData entry;
+					serialize_entry(entry, buffer[i]);
+					data.addUInt(entry.getDataSize());
+					data.addBuffer(entry.getDataPtr(), entry.getDataSize());
+
+					if (data.getDataSize() >= c_run_read_size
+						|| i + 1 == buffer.size())
+					{
+						if (f->Write(data.getDataPtr(), static_cast<_u32>(data.getDataSize())) != data.getDataSize())
+						{
+							Server->Log("Error writing file manifest run \"" + fn + "\". " + os_last_error_str(), LL_ERROR);
+							has_error = true;
+							break;
+						}
+						data.clear();
+					}
+				}
+			}
+
+			buffer.clear();
+			buffer_bytes = 0;
+		}
+
+		void merge(ManifestOutput& output)
+		{
+			std::vector<std::unique_ptr<RunReader> > readers;
+			std::vector<ServerFilesDao::SFileEntry> heads;
+			for (size_t i = 0; i < n_runs; ++i)
+			{
+				IFile* f = Server->openFile(runName(i), MODE_READ_SEQUENTIAL);
+				if (f == NULL)
+				{
+					Server->Log("Error opening file manifest run \"" + runName(i) + "\". " + os_last_error_str(), LL_ERROR);
+					has_error = true;
+					return;
+				}
+				readers.push_back(std::unique_ptr<RunReader>(new RunReader(f)));
+				heads.push_back(ServerFilesDao::SFileEntry());
+				readers[i]->next(heads[i]);
+			}
+
+			while (true)
+			{
+				size_t min_idx = heads.size();
+				for (size_t i = 0; i < heads.size(); ++i)
+				{
+					if (heads[i].exists
+						&& (min_idx == heads.size()
+							|| entry_less(heads[i], heads[min_idx])))
+					{
+						min_idx = i;
+					}
+				}
+
+				if (min_idx == heads.size())
+				{
+					break;
+				}
+
+				output.add(heads[min_idx]);
+				readers[min_idx]->next(heads[min_idx]);
+			}
+		}
+
+		int backupid;
+		int clientid;
+		int incremental;
+
+		std::unique_ptr<IMutex> mutex;
+		std::vector<ServerFilesDao::SFileEntry> buffer;
+		size_t buffer_bytes;
+		size_t max_buffer_bytes;
+		size_t n_runs;
+		bool has_error;
+	};
+
+	std::map<int, std::shared_ptr<ManifestWriter> > writers;
+
+	std::shared_ptr<ManifestWriter> get_writer(int backupid, bool remove)
+	{
+		IScopedLock lock(writers_mutex);
+
+		std::map<int, std::shared_ptr<ManifestWriter> >::iterator it = writers.find(backupid);
+		if (it == writers.end())
+		{
+			return std::shared_ptr<ManifestWriter>();
+		}
+
+		std::shared_ptr<ManifestWriter> ret = it->second;
+		if (remove)
+		{
+			writers.erase(it);
+		}
+		return ret;
+	}
+}
+
+void FileManifest::init_mutex()
+{
+	writers_mutex = Server->createMutex();
+}
+
+void FileManifest::removeTemporaryFiles()
+{
+	std::vector<SFile> files = getFiles(manifest_dir());
+	for (size_t i = 0; i < files.size(); ++i)
+	{
+		if (::next(files[i].name, 0, c_manifest_prefix)
+			&& files[i].name.find(c_manifest_ext + ".") != std::string::npos)
+		{
+			Server->deleteFile(manifest_dir() + os_file_sep() + files[i].name);
+		}
+	}
+}
+
+bool FileManifest::isEnabled()
+{
+	return Server->getServerParameter("file_manifest") == "true";
+}
+
+std::string FileManifest::manifestName(int backupid)
+{
+	return "urbackup/" + c_manifest_prefix + convert(backupid) + c_manifest_ext;
+}
+
+std::vector<int> FileManifest::getBackupIds()
+{
+	std::vector<int> ret;
+	std::vector<SFile> files = getFiles(manifest_dir());
+	for (size_t i = 0; i < files.size(); ++i)
+	{
+		const std::string& name = files[i].name;
+		if (::next(name, 0, c_manifest_prefix)
+			&& name.size() > c_manifest_ext.size()
+			&& name.find(c_manifest_ext) == name.size() - c_manifest_ext.size())
+		{
+			ret.push_back(watoi(getbetween(c_manifest_prefix, c_manifest_ext, name)));
+		}
+	}
+	return ret;
+}
+
+void FileManifest::startBackup(int backupid, int clientid, int incremental)
+{
+	if (!isEnabled())
+	{
+		return;
+	}
+
+	Server->deleteFile(manifestName(backupid));
+
+	IScopedLock lock(writers_mutex);
+	writers[backupid] = std::make_shared<ManifestWriter>(backupid, clientid, incremental);
+}
+
+bool FileManifest::addFile(int backupid, const std::string & fullpath, const std::string & hashpath,
+	const std::string & shahash, int64 filesize)
+{
+	std::shared_ptr<ManifestWriter> writer = get_writer(backupid, false);
+	if (!writer)
+	{
+		return false;
+	}
+
+	ServerFilesDao::SFileEntry entry;
+	entry.exists = true;
+	entry.fullpath = fullpath;
+	entry.hashpath = hashpath;
+	entry.shahash = shahash;
+	entry.filesize = filesize;
+	writer->add(entry);
+	return true;
+}
+
+bool FileManifest::finishBackup(int backupid, ServerFilesDao& filesdao)
+{
+	std::shared_ptr<ManifestWriter> writer = get_writer(backupid, true);
+	if (!writer)
+	{
+		return true;
+	}
+
+	int64 num_files;
+	int64 total_size;
+	if (!writer->finish(num_files, total_size))
+	{
+		return false;
+	}
+
+	filesdao.addIncomingFile(total_size, writer->getClientid(), backupid, std::string(),
+		ServerFilesDao::c_direction_incoming, writer->getIncremental());
+
+	Server->Log("Wrote file manifest of backup " + convert(backupid) + " with " + convert(num_files)
+		+ " files (" + PrettyPrintBytes(total_size) + ")", LL_DEBUG);
+
+	return true;
+}
+
+void FileManifest::removeBackup(int backupid, ServerFilesDao& filesdao)
+{
+	get_writer(backupid, true);
+
+	std::unique_ptr<FileManifest> manifest(open(backupid));
+	if (manifest.get() == NULL)
+	{
+		return;
+	}
+
+	filesdao.addIncomingFile(manifest->getTotalSize(), manifest->getClientid(), backupid, convert(manifest->getClientid()),
+		ServerFilesDao::c_direction_outgoing, manifest->getIncremental());
+
+	manifest.reset();
+
+	if (!Server->deleteFile(manifestName(backupid)))
+	{
+		Server->Log("Error deleting file manifest \"" + manifestName(backupid) + "\". " + os_last_error_str(), LL_ERROR);
+	}
+}
+
+FileManifest * FileManifest::open(int backupid)
+{
+	IFile* f = Server->openFile(manifestName(backupid), MODE_READ);
+	if (f == NULL)
+	{
+		return NULL;
+	}
+
+	FileManifest* ret = new FileManifest(f);
+	if (!ret->readIndex())
+	{
+		Server->Log("File manifest \"" + manifestName(backupid) + "\" is damaged", LL_ERROR);
+		delete ret;
+		return NULL;
+	}
+
+	return ret;
+}
+
+FileManifest::FileManifest(IFile * file)
+	: file(file), num_files(0), total_size(0), clientid(0), incremental(0),
+	curr_block(std::string::npos), iter_block(0), iter_pos(0)
+{
+}
+
+bool FileManifest::readIndex()
+{
+	int64 fsize = file->Size();
+	if (fsize < static_cast<int64>(c_magic_size + c_footer_size))
+	{
+		return false;
+	}
+
+	std::string footer_data = file->Read(fsize - c_footer_size, static_cast<_u32>(c_footer_size));
+	if (footer_data.size() != c_footer_size
+		|| memcmp(footer_data.data() + c_footer_size - c_magic_size, c_magic, c_magic_size) != 0)
+	{
+		return false;
+	}
+
+	CRData footer(&footer_data);
+	int64 index_offset;
+	int64 index_size;
+	if (!footer.getInt64(&index_offset)
+		|| !footer.getInt64(&index_size)
+		|| !footer.getInt64(&num_files)
+		|| !footer.getInt64(&total_size)
+		|| !footer.getInt(&clientid)
+		|| !footer.getInt(&incremental)
+		|| index_offset < static_cast<int64>(c_magic_size)
+		|| index_offset + index_size + static_cast<int64>(c_footer_size) != fsize)
+	{
+		return false;
+	}
+
+	std::string index_data = file->Read(index_offset, static_cast<_u32>(index_size));
+	if (index_data.size() != static_cast<size_t>(index_size))
+	{
+		return false;
+	}
+
+	CRData index(&index_data);
+	while (index.getLeft() > 0)
+	{
+		SBlockIndex block;
+		if (!index.getStr(&block.first_path)
+			|| !index.getInt64(&block.offset)
+			|| !index.getUInt(&block.csize)
+			|| !index.getUInt(&block.size)
+			|| !index.getChar(&block.mode))
+		{
+			return false;
+		}
+		blocks.push_back(block);
+	}
+
+	return true;
+}
+
+bool FileManifest::loadBlock(size_t idx)
+{
+	if (curr_block == idx)
+	{
+		return true;
+	}
+
+	curr_block = std::string::npos;
+	curr_entries.clear();
+
+	const SBlockIndex& block = blocks[idx];
+	std::string cdata = file->Read(block.offset, block.csize);
+	if (cdata.size() != block.csize)
+	{
+		Server->Log("Error reading block of file manifest \"" + file->getFilename() + "\"", LL_ERROR);
+		return false;
+	}
+
+	std::string data;
+	if (block.mode == c_mode_raw)
+	{
+		data.swap(cdata);
+	}
+#ifndef NO_ZSTD_COMPRESSION
+	else if (block.mode == c_mode_zstd)
+	{
+		data.resize(block.size);
+		size_t rc = ZSTD_decompress(&data[0], data.size(), cdata.data(), cdata.size());
+		if (ZSTD_isError(rc) || rc != block.size)
+		{
+			Server->Log("Error decompressing block of file manifest \"" + file->getFilename() + "\"", LL_ERROR);
+			return false;
+		}
+	}
+#endif
+	else
+	{
+		Server->Log("Unknown block mode in file manifest \"" + file->getFilename() + "\"", LL_ERROR);
+		return false;
+	}
+
+	CRData rdata(&data);
+	while (rdata.getLeft() > 0)
+	{
+		ServerFilesDao::SFileEntry entry;
+		if (!parse_entry(rdata, entry))
+		{
+			Server->Log("Damaged block in file manifest \"" + file->getFilename() + "\"", LL_ERROR);
+			curr_entries.clear();
+			return false;
+		}
+		curr_entries.push_back(entry);
+	}
+
+	curr_block = idx;
+	return true;
+}
+
+ServerFilesDao::SFileEntry FileManifest::lookup(const std::string & fullpath)
+{
+	ServerFilesDao::SFileEntry ret;
+	ret.exists = false;
+	ret.filesize = 0;
+
+	//Last block starting with a path not after fullpath
+	size_t idx = blocks.size();
+	size_t lo = 0, hi = blocks.size();
+	while (lo < hi)
+	{
+		size_t mid = lo + (hi - lo) / 2;
+		if (blocks[mid].first_path <= fullpath)
+		{
+			idx = mid;
+			lo = mid + 1;
+		}
+		else
+		{
+			hi = mid;
+		}
+	}
+
+	if (idx == blocks.size()
+		|| !loadBlock(idx))
+	{
+		return ret;
+	}
+
+	ServerFilesDao::SFileEntry key;
+	key.fullpath = fullpath;
+	std::vector<ServerFilesDao::SFileEntry>::iterator it = std::lower_bound(curr_entries.begin(), curr_entries.end(), key, entry_less);
+	if (it != curr_entries.end()
+		&& it->fullpath == fullpath)
+	{
+		ret = *it;
+	}
+
+	return ret;
+}
+
+std::vector<ServerFilesDao::SFileEntry> FileManifest::findPrefix(const std::string & prefix)
+{
+	std::vector<ServerFilesDao::SFileEntry> ret;
+
+	//Entries with the prefix may start in the block before the first one starting with it
+	size_t idx = 0;
+	while (idx + 1 < blocks.size()
+		&& blocks[idx + 1].first_path < prefix)
+	{
+		++idx;
+	}
+
+	ServerFilesDao::SFileEntry key;
+	key.fullpath = prefix;
+
+	for (; idx < blocks.size(); ++idx)
+	{
+		if (!loadBlock(idx))
+		{
+			break;
+		}
+
+		std::vector<ServerFilesDao::SFileEntry>::iterator it = std::lower_bound(curr_entries.begin(), curr_entries.end(), key, entry_less);
+		for (; it != curr_entries.end(); ++it)
+		{
+			if (!::next(it->fullpath, 0, prefix))
+			{
+				return ret;
+			}
+			ret.push_back(*it);
+		}
+	}
+
+	return ret;
+}
+
+bool FileManifest::next(ServerFilesDao::SFileEntry & entry)
+{
+	while (iter_block < blocks.size())
+	{
+		if (!loadBlock(iter_block))
+		{
+			return false;
+		}
+
+		if (iter_pos < curr_entries.size())
+		{
+			entry = curr_entries[iter_pos++];
+			return true;
+		}
+
+		++iter_block;
+		iter_pos = 0;
+	}
+
+	return false;
+}
+
+int64 FileManifest::getNumFiles()
+{
+	return num_files;
+}
+
+int64 FileManifest::getTotalSize()
+{
+	return total_size;
+}
+
+int FileManifest::getClientid()
+{
+	return clientid;
+}
+
+int FileManifest::getIncremental()
+{
+	return incremental;
+}
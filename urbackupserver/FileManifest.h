@@ -0,0 +1,100 @@
+#pragma once
+
+#include "../Interface/Types.h"
+#include "../Interface/File.h"
+#include "dao/ServerFilesDao.h"
+#include <string>
+#include <vector>
+#include <memory>
+
+/*
+* Per-backup file manifest for files smaller than link_file_min_size. Those
+* files are never linked to entries of other backups, so the only things
+* needed from them are lookups by path (resumed backups, hash verification)
+* and their total size once the backup is deleted. Instead of adding one row
+* per file to the files table they are written to
+* urbackup/file_manifest_<backupid>.ummf, an immutable file sorted by path,
+* consisting of (zstd) compressed blocks of entries followed by an index with
+* the first path of each block.
+*
+* While the backup runs entries are collected in memory and spilled as sorted
+* runs, which are merged into the manifest when the backup is finished. File
+* statistics are recorded as one aggregated incoming entry when the manifest
+* is written and one aggregated outgoing entry when it is removed.
+*
+* Larger files still get rows in the files table, as the file entry index
+* links them across backups and clients for deduplication.
+*/
+class FileManifest
+{
+public:
+	static void init_mutex();
+
+	//Removes leftovers of manifests that were being written when the server stopped
+	static void removeTemporaryFiles();
+
+	static bool isEnabled();
+
+	static std::string manifestName(int backupid);
+
+	//Ids of all backups with a manifest
+	static std::vector<int> getBackupIds();
+
+	//Starts collecting entries for a new backup (if manifests are enabled)
+	static void startBackup(int backupid, int clientid, int incremental);
+
+	//Returns false if no manifest is being collected for the backup
+	static bool addFile(int backupid, const std::string& fullpath, const std::string& hashpath,
+		const std::string& shahash, int64 filesize);
+
+	//Writes the manifest and adds the incoming file statistics for it
+	static bool finishBackup(int backupid, ServerFilesDao& filesdao);
+
+	//Removes the manifest (or the entries still being collected) and adds the outgoing file statistics for it
+	static void removeBackup(int backupid, ServerFilesDao& filesdao);
+
+	//NULL if the backup has no manifest
+	static FileManifest* open(int backupid);
+
+	ServerFilesDao::SFileEntry lookup(const std::string& fullpath);
+
+	//All entries with paths starting with prefix
+	std::vector<ServerFilesDao::SFileEntry> findPrefix(const std::string& prefix);
+
+	//Iterates over all entries ordered by path
+	bool next(ServerFilesDao::SFileEntry& entry);
+
+	int64 getNumFiles();
+	int64 getTotalSize();
+	int getClientid();
+	int getIncremental();
+
+private:
+	FileManifest(IFile* file);
+
+	struct SBlockIndex
+	{
+		std::string first_path;
+		int64 offset;
+		_u32 csize;
+		_u32 size;
+		char mode;
+	};
+
+	bool readIndex();
+	bool loadBlock(size_t idx);
+
+	std::unique_ptr<IFile> file;
+
+	std::vector<SBlockIndex> blocks;
+	int64 num_files;
+	int64 total_size;
+	int clientid;
+	int incremental;
+
+	size_t curr_block;
+	std::vector<ServerFilesDao::SFileEntry> curr_entries;
+
+	size_t iter_block;
+	size_t iter_pos;
+};
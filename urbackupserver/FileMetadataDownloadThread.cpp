@@ -687,25 +687,11 @@ bool FileMetadataDownloadThread::applyMetadata( const std::string& backup_metada
 			if (output_f_size > 4096
 				&& local_hash!=NULL)
 			{
-				bool tries_once;
-				std::string ff_last;
-				bool hardlink_limit;
-				bool copied_file;
-				int64 entryid = 0;
-				int entryclientid = 0;
-				int64 rsize = 0;
-				int64 next_entryid = 0;
 				FileMetadata metadata;
-				bool ok = local_hash->findFileAndLink(os_path, NULL, os_path_metadata, checksum, output_f_size, std::string(), true,
-					tries_once, ff_last, hardlink_limit, copied_file, entryid, entryclientid, rsize, next_entryid,
-					metadata, true, NULL);
+				bool ok = local_hash->linkFile(backupid, os_path, os_path_metadata, checksum, output_f_size, true, metadata, true);
 
 				if (ok)
 				{
-					local_hash->addFileSQL(backupid, clientid, 0, os_path, os_path_metadata, checksum, output_f_size,
-						(rsize>0 && rsize != output_f_size) ? rsize : (copied_file ? output_f_size : 0), entryid, entryclientid, next_entryid,
-						copied_file);
-
 					copy_file = false;
 
 					ServerLogger::Log(logid, "META: Linked file: \"" + os_path + "\"", LL_DEBUG);
@@ -801,8 +787,8 @@ bool FileMetadataDownloadThread::applyMetadata( const std::string& backup_metada
 				if (output_f_size > 4096
 					&& local_hash!=NULL)
 				{
-					local_hash->addFileSQL(backupid, clientid, 0, os_path, os_path_metadata, checksum, output_f_size,
-						output_f_size, 0, 0, 0, true);
+					local_hash->addStoredFileSQL(backupid, 0, os_path, os_path_metadata, checksum, output_f_size,
+						output_f_size, true);
 				}
 
 				FileMetadata metadata;
@@ -33,6 +33,7 @@
 #include <stack>
 #include "PhashLoad.h"
 #include "server.h"
+#include "FileManifest.h"
 
 extern std::string server_identity;
 
@@ -69,7 +70,7 @@ bool FullFileBackup::doFileBackup()
 	SBackup last_backup_info = getLastFullDurations();
 
 	int64 eta_set_time = Server->getTimeMS();
-	ServerStatus::setProcessEta(clientname, status_id, last_backup_info.backup_time_ms + last_backup_info.indexing_time_ms, eta_set_time);
+	status_handle->setEta(last_backup_info.backup_time_ms + last_backup_info.indexing_time_ms, eta_set_time);
 
 	int64 indexing_start_time = Server->getTimeMS();
 
@@ -168,6 +169,8 @@ bool FullFileBackup::doFileBackup()
 
 	backupid = static_cast<int>(db->getLastInsertID());
 
+	FileManifest::startBackup(backupid, clientid, 0);
+
 	tmp_filelist->Seek(0);
 
 	FileListParser list_parser;
@@ -183,7 +186,7 @@ bool FullFileBackup::doFileBackup()
 		return false;
 	}
 
-	if(ServerStatus::getProcess(clientname, status_id).stop)
+	if(status_handle->isStopped())
 	{
 		ServerLogger::Log(logid, "Server admin stopped backup. -1", LL_ERROR);
 		has_early_error=true;
@@ -235,7 +238,7 @@ bool FullFileBackup::doFileBackup()
 
 	bool queue_downloads = client_main->getProtocolVersions().filesrv_protocol_version>2;
 
-	ServerStatus::setProcessTotalBytes(clientname, status_id, files_size);
+	status_handle->setTotalBytes(files_size);
 
 	fc.resetReceivedDataBytes(true);
 	tmp_filelist->Seek(0);
@@ -262,10 +265,10 @@ bool FullFileBackup::doFileBackup()
 			break;
 		}
 
-		for(size_t i=0;i<read;++i)
+		for(size_t i=0;i<read;)
 		{
 			std::map<std::string, std::string> extra_params;
-			bool b=list_parser.nextEntry(buffer[i], cf, &extra_params);
+			bool b=list_parser.nextEntry(buffer, read, i, cf, &extra_params);
 			if(b)
 			{
 				FileMetadata metadata;
@@ -288,7 +291,7 @@ bool FullFileBackup::doFileBackup()
 					int64 ctime = Server->getTimeMS();
 					if (ctime - laststatsupdate > status_update_intervall)
 					{
-						if (ServerStatus::getProcess(clientname, status_id).stop)
+						if (status_handle->isStopped())
 						{
 							r_offline = true;
 							should_backoff = false;
@@ -300,18 +303,16 @@ bool FullFileBackup::doFileBackup()
 						laststatsupdate = ctime;
 						if (files_size == 0)
 						{
-							ServerStatus::setProcessPcDone(clientname, status_id, 100);
+							status_handle->setPcDone(100);
 						}
 						else
 						{
 							int64 done_bytes = fc.getReceivedDataBytes(true) + linked_bytes;
-							ServerStatus::setProcessDoneBytes(clientname, status_id, done_bytes);
-							ServerStatus::setProcessPcDone(clientname, status_id,
-								(std::min)(100, (int)(((float)done_bytes) / ((float)files_size / 100.f) + 0.5f)));
+							status_handle->setDoneBytes(done_bytes);
+							status_handle->setPcDone((std::min)(100, (int)(((float)done_bytes) / ((float)files_size / 100.f) + 0.5f)));
 						}
 
-						ServerStatus::setProcessQueuesize(clientname, status_id,
-							(_u32)hashpipe->getNumElements(), (_u32)hashpipe_prepare->getNumElements());
+						updateHashQueuesize();
 					}
 
 					if (ctime - last_eta_update > eta_update_intervall)
@@ -622,18 +623,16 @@ bool FullFileBackup::doFileBackup()
 	{
 		if(files_size==0)
 		{
-			ServerStatus::setProcessPcDone(clientname, status_id, 100);
+			status_handle->setPcDone(100);
 		}
 		else
 		{
 			int64 done_bytes = fc.getReceivedDataBytes(true) + linked_bytes;
-			ServerStatus::setProcessDoneBytes(clientname, status_id, done_bytes);
-			ServerStatus::setProcessPcDone(clientname, status_id,
-				(std::min)(100,(int)(((float)done_bytes)/((float)files_size/100.f)+0.5f)));
+			status_handle->setDoneBytes(done_bytes);
+			status_handle->setPcDone((std::min)(100,(int)(((float)done_bytes)/((float)files_size/100.f)+0.5f)));
 		}
 
-		ServerStatus::setProcessQueuesize(clientname, status_id,
-			(_u32)hashpipe->getNumElements(), (_u32)hashpipe_prepare->getNumElements());
+		updateHashQueuesize();
 
 		int64 ctime = Server->getTimeMS();
 		if(ctime-last_eta_update>eta_update_intervall)
@@ -644,7 +643,7 @@ bool FullFileBackup::doFileBackup()
 		calculateDownloadSpeed(ctime, fc, NULL);
 	}
 
-	ServerStatus::setProcessSpeed(clientname, status_id, 0);
+	status_handle->setSpeed(0);
 
 	if(server_download->isOffline() && !r_offline)
 	{
@@ -724,9 +723,9 @@ bool FullFileBackup::doFileBackup()
 			break;
 		}
 
-		for(size_t i=0;i<read;++i)
+		for(size_t i=0;i<read;)
 		{
-			bool b=list_parser.nextEntry(buffer[i], cf, NULL);
+			bool b=list_parser.nextEntry(buffer, read, i, cf, NULL);
 			if(b)
 			{
 				if(cf.isdir)
@@ -34,6 +34,7 @@
 #include <stdlib.h>
 #include "../Interface/Types.h"
 #include <cstring>
+#include <atomic>
 #include "../urbackupcommon/sha2/sha2.h"
 #include "../Interface/Pipe.h"
 #include "../urbackupcommon/fileclient/tcpstack.h"
@@ -78,12 +79,16 @@ namespace
 		ESendErr_Send
 	};
 
-	ESendErr sendFileToPipe(IFile* file, IPipe* outputpipe, logid_t logid)
+	ESendErr sendFileToPipe(IFile* file, IPipe* outputpipe, logid_t logid, int64 offset=0, int64 size=-1)
 	{
-		file->Seek(0);
+		if(size<0)
+		{
+			size=file->Size()-offset;
+		}
+		file->Seek(offset);
 		const unsigned int c_send_buffer_size=8192;
 		char send_buffer[c_send_buffer_size];
-		for(size_t i=0,hsize=(size_t)file->Size();i<hsize;i+=c_send_buffer_size)
+		for(size_t i=0,hsize=(size_t)size;i<hsize;i+=c_send_buffer_size)
 		{
 			size_t tsend=(std::min)((size_t)c_send_buffer_size, hsize-i);
 			if(file->Read(send_buffer, (_u32)tsend)!=tsend)
@@ -106,8 +111,190 @@ namespace
 
 		return ESendErr_Ok;
 	}
+
+	const int64 cbitmap_header_size = 8 + sizeof(_u32);
+
+	//Sends the bitmap bytes [data_start, data_end) of a client bitmap file as
+	//a client bitmap file of its own (with its own checksum)
+	ESendErr sendBitmapRangeToPipe(IFile* file, int64 data_start, int64 data_end, IPipe* outputpipe, logid_t logid)
+	{
+		std::string header = file->Read(static_cast<int64>(0), static_cast<_u32>(cbitmap_header_size));
+		if (header.size() != static_cast<size_t>(cbitmap_header_size))
+		{
+			ServerLogger::Log(logid, "Reading bitmap header failed. " + os_last_error_str(), LL_ERROR);
+			return ESendErr_Read;
+		}
+
+		sha256_ctx shactx;
+		sha256_init(&shactx);
+		sha256_update(&shactx, reinterpret_cast<const unsigned char*>(header.data()) + 8, sizeof(_u32));
+
+		if (!outputpipe->Write(header.data(), header.size(), 120000, false))
+		{
+			ServerLogger::Log(logid, "Sending bitmap header failed", LL_DEBUG);
+			return ESendErr_Send;
+		}
+
+		file->Seek(cbitmap_header_size + data_start);
+		const unsigned int c_send_buffer_size = 8192;
+		char send_buffer[c_send_buffer_size];
+		for (int64 pos = data_start; pos < data_end; pos += c_send_buffer_size)
+		{
+			_u32 tsend = static_cast<_u32>((std::min)(static_cast<int64>(c_send_buffer_size), data_end - pos));
+			if (file->Read(send_buffer, tsend) != tsend)
+			{
+				ServerLogger::Log(logid, "Reading from bitmap file failed. " + os_last_error_str(), LL_ERROR);
+				return ESendErr_Read;
+			}
+
+			sha256_update(&shactx, reinterpret_cast<unsigned char*>(send_buffer), tsend);
+
+			if (!outputpipe->Write(send_buffer, tsend, 120000, false))
+			{
+				ServerLogger::Log(logid, "Sending bitmap data failed", LL_DEBUG);
+				return ESendErr_Send;
+			}
+		}
+
+		unsigned char dig[sha_size];
+		sha256_final(&shactx, dig);
+
+		if (!outputpipe->Write(reinterpret_cast<char*>(dig), sha_size, 120000, false)
+			|| !outputpipe->Flush(120000))
+		{
+			ServerLogger::Log(logid, "Sending bitmap checksum failed", LL_DEBUG);
+			return ESendErr_Send;
+		}
+
+		return ESendErr_Ok;
+	}
+
+	//Buffered reads from an image transfer connection. Fails on connection errors, timeouts or if stop is set
+	class ImageRangeReader
+	{
+	public:
+		ImageRangeReader(IPipe* pipe, std::atomic<bool>& stop)
+			: pipe(pipe), stop(stop), buffer(32768), pos(0), len(0)
+		{}
+
+		bool read(char* data, size_t size)
+		{
+			int64 last_data = Server->getTimeMS();
+			while (size > 0)
+			{
+				if (pos == len)
+				{
+					if (stop)
+					{
+						return false;
+					}
+
+					pos = 0;
+					len = pipe->Read(buffer.data(), buffer.size(), 1000);
+					if (len == 0)
+					{
+						if (pipe->hasError()
+							|| Server->getTimeMS() - last_data > image_recv_timeout_after_first)
+						{
+							return false;
+						}
+						continue;
+					}
+					last_data = Server->getTimeMS();
+				}
+
+				size_t toread = (std::min)(size, len - pos);
+				memcpy(data, &buffer[pos], toread);
+				data += toread;
+				size -= toread;
+				pos += toread;
+			}
+			return true;
+		}
+
+		std::string remaining()
+		{
+			return std::string(buffer.data() + pos, len - pos);
+		}
+
+	private:
+		IPipe* pipe;
+		std::atomic<bool>& stop;
+		std::vector<char> buffer;
+		size_t pos;
+		size_t len;
+	};
 }
 
+/*
+* State shared between the main image transfer connection, which receives the
+* first block range, and the threads receiving the other ranges via additional
+* connections. Ranges consist of whole vhd blocks, so every stream writes the
+* hashes of its range to the hash file on its own.
+*/
+struct SImageTransferRanges
+{
+	SImageTransferRanges()
+		: n_streams(1), transfer_prev_cbitmap(false), blocksize(0), vhd_blocksize(0), blocks(0),
+		totalblocks(0), mbr_offset(0), vhdfile(NULL), stop(false), failed(false), numblocks(0),
+		passed_blocks(0), transferred_bytes(0), transferred_bytes_real(0)
+	{}
+
+	struct SRange
+	{
+		int64 start;
+		//Exclusive. The last range ends at the total number of blocks
+		int64 end;
+		bool last;
+	};
+
+	size_t n_streams;
+	std::string letter;
+	std::string imagefn;
+	std::string parentvhd;
+	bool transfer_prev_cbitmap;
+	unsigned int blocksize;
+	int64 vhd_blocksize;
+	int64 blocks;
+	int64 totalblocks;
+	int64 mbr_offset;
+	ServerVHDWriter* vhdfile;
+	std::vector<SRange> ranges;
+	std::vector<THREADPOOL_TICKET> tickets;
+
+	std::atomic<bool> stop;
+	std::atomic<bool> failed;
+	//Progress of the additional ranges
+	std::atomic<int64> numblocks;
+	std::atomic<int64> passed_blocks;
+	std::atomic<int64> transferred_bytes;
+	std::atomic<int64> transferred_bytes_real;
+};
+
+class ImageRangeThread : public IThread
+{
+public:
+	ImageRangeThread(ImageBackup* image_backup, SImageTransferRanges* ranges, size_t range_idx)
+		: image_backup(image_backup), ranges(ranges), range_idx(range_idx)
+	{}
+
+	virtual ~ImageRangeThread() {}
+
+	void operator()()
+	{
+		if (!image_backup->receiveImageRange(ranges, range_idx))
+		{
+			ranges->failed = true;
+		}
+		delete this;
+	}
+
+private:
+	ImageBackup* image_backup;
+	SImageTransferRanges* ranges;
+	size_t range_idx;
+};
+
 ImageBackup::ImageBackup(ClientMain* client_main, int clientid, std::string clientname,
 	std::string clientsubname, LogAction log_action, bool incremental, std::string letter, std::string server_token, std::string details,
 	bool set_complete, int64 snapshot_id, std::string snapshot_group_loginfo, int64 backup_starttime, bool scheduled)
@@ -585,6 +772,12 @@ bool ImageBackup::doImage(const std::string &pLetter, const std::string &pParent
 
 	chksum_str += "&zero_skipped=1";
 
+	size_t image_streams = getImageTransferStreams(pLetter, with_checksum);
+	if (image_streams > 1)
+	{
+		chksum_str += "&streams=" + convert(image_streams);
+	}
+
 	if(pParentvhd.empty())
 	{
 		tcpstack.Send(cc, identity+"FULL IMAGE letter="+pLetter+"&token="+server_token+chksum_str);
@@ -692,6 +885,7 @@ bool ImageBackup::doImage(const std::string &pLetter, const std::string &pParent
 	unsigned char verify_checksum[sha_size];
 	bool warned_about_parenthashfile_error=false;
 	bool internet_connection = client_main->isOnInternetConnection();
+	std::unique_ptr<SImageTransferRanges> transfer_ranges;
 
 	bool has_parent=false;
 	if(!pParentvhd.empty())
@@ -713,7 +907,7 @@ bool ImageBackup::doImage(const std::string &pLetter, const std::string &pParent
 	int64 eta_set_time = Server->getTimeMS();
 	int64 speed_set_time = eta_set_time;
 	int64 last_speed_received_bytes = 0;
-	ServerStatus::setProcessEtaSetTime(clientname, status_id, eta_set_time);
+	status_handle->setEtaSetTime(eta_set_time);
 	ETransferState transfer_state = ETransferState_First;
 	unsigned char image_flags=0;
 	size_t bitmap_read = 0;
@@ -723,7 +917,7 @@ bool ImageBackup::doImage(const std::string &pLetter, const std::string &pParent
 
 	while(Server->getTimeMS()-starttime<=image_timeout)
 	{
-		if(ServerStatus::getProcess(clientname, status_id).stop)
+		if(status_handle->isStopped())
 		{
 			ServerLogger::Log(logid, "Server admin stopped backup.", LL_ERROR);
 			goto do_image_cleanup;
@@ -740,8 +934,8 @@ bool ImageBackup::doImage(const std::string &pLetter, const std::string &pParent
 		if(r==0 )
 		{
 			curr_image_recv_timeout = image_recv_timeout;
-			ServerStatus::setProcessSpeed(clientname, status_id, 0);
-			ServerStatus::setProcessEta(clientname, status_id, -1);
+			status_handle->setSpeed(0);
+			status_handle->setEta(-1);
 			if(persistent && nextblock!=0)
 			{
 				int64 continue_block=nextblock;
@@ -760,7 +954,7 @@ bool ImageBackup::doImage(const std::string &pLetter, const std::string &pParent
 				bool reconnected=false;
 				while(Server->getTimeMS()-starttime<=image_timeout)
 				{
-					if(ServerStatus::getProcess(clientname, status_id).stop)
+					if(status_handle->isStopped())
 					{
 						ServerLogger::Log(logid, "Server admin stopped backup. (2)", LL_ERROR);
 						ServerStatus::setROnline(clientname, true);
@@ -829,6 +1023,10 @@ bool ImageBackup::doImage(const std::string &pLetter, const std::string &pParent
 				{
 					std::string cmd = identity+"FULL IMAGE letter="+pLetter+"&start="+convert(continue_block)
 						+"&shadowid="+convert(snapshot_id)+ "&status_id=" + convert(status_id)+"&token="+ server_token;
+					if (transfer_ranges.get() != NULL)
+					{
+						cmd += "&end=" + convert(transfer_ranges->ranges[0].end);
+					}
 					if(transfer_bitmap)
 					{
 						cmd+="&bitmap=1";
@@ -857,6 +1055,10 @@ bool ImageBackup::doImage(const std::string &pLetter, const std::string &pParent
 				{
 					std::string ts = "INCR IMAGE letter="+pLetter+"&start=" + convert(continue_block) + "&shadowid=" + convert(snapshot_id) + "&hashsize="
 						+ convert(parenthashfile->Size()) + "&status_id=" + convert(status_id) + "&token=" + server_token;
+					if (transfer_ranges.get() != NULL)
+					{
+						ts += "&end=" + convert(transfer_ranges->ranges[0].end);
+					}
 					if(transfer_bitmap)
 					{
 						ts+="&bitmap=1";
@@ -1130,11 +1332,11 @@ bool ImageBackup::doImage(const std::string &pLetter, const std::string &pParent
 							ServerLogger::Log(logid, "Error opening Parenthashfile \""+pParentvhd+".hash\"", LL_ERROR);
 							goto do_image_cleanup;
 						}
-						ServerStatus::setProcessTotalBytes(clientname, status_id, totalblocks*blocksize);
+						status_handle->setTotalBytes(totalblocks*blocksize);
 					}
 					else
 					{
-						ServerStatus::setProcessTotalBytes(clientname, status_id, blockcnt*blocksize);
+						status_handle->setTotalBytes(blockcnt*blocksize);
 					}
 
 					if (!disk_backup)
@@ -1184,7 +1386,7 @@ bool ImageBackup::doImage(const std::string &pLetter, const std::string &pParent
 							goto do_image_cleanup;
 						}
 
-						ServerStatus::setProcessTotalBytes(clientname, status_id, (blockcnt<0 ? -blockcnt : blockcnt)*blocksize);
+						status_handle->setTotalBytes((blockcnt<0 ? -blockcnt : blockcnt)*blocksize);
 					}
 
 					off+=sizeof(int64);
@@ -1280,6 +1482,28 @@ bool ImageBackup::doImage(const std::string &pLetter, const std::string &pParent
 
 				curr_image_recv_timeout=image_recv_timeout_after_first;
 
+				if (image_streams > 1 && persistent)
+				{
+					transfer_ranges.reset(new SImageTransferRanges);
+					transfer_ranges->n_streams = image_streams;
+					transfer_ranges->letter = pLetter;
+					transfer_ranges->imagefn = imagefn;
+					transfer_ranges->parentvhd = pParentvhd;
+					transfer_ranges->transfer_prev_cbitmap = transfer_prev_cbitmap;
+					transfer_ranges->blocksize = blocksize;
+					transfer_ranges->vhd_blocksize = vhd_blocksize;
+					transfer_ranges->blocks = blocks;
+					transfer_ranges->totalblocks = totalblocks;
+					transfer_ranges->mbr_offset = mbr_offset;
+					transfer_ranges->vhdfile = vhdfile;
+					startImageRanges(transfer_ranges.get());
+
+					if (transfer_ranges->ranges.size() <= 1)
+					{
+						transfer_ranges.reset();
+					}
+				}
+
 				if(r==off)
 				{
 					off=0;
@@ -1363,6 +1587,13 @@ bool ImageBackup::doImage(const std::string &pLetter, const std::string &pParent
 						{
 							++numblocks;
 							int64 ctime=Server->getTimeMS();
+							int64 done_blocks = numblocks;
+							int64 passed_blocks = currblock;
+							if (transfer_ranges.get() != NULL)
+							{
+								done_blocks += transfer_ranges->numblocks;
+								passed_blocks += transfer_ranges->passed_blocks;
+							}
 							if(ctime-last_status_update>status_update_intervall)
 							{
 								last_status_update = ctime;
@@ -1370,15 +1601,13 @@ bool ImageBackup::doImage(const std::string &pLetter, const std::string &pParent
 								{
 									if(has_parent && blockcnt>0)
 									{
-										ServerStatus::setProcessDoneBytes(clientname, status_id, currblock*blocksize);
-										ServerStatus::setProcessPcDone(clientname, status_id, 
-											(int)(((double)currblock/(double)totalblocks)*100.0+0.5) );
+										status_handle->setDoneBytes(passed_blocks*blocksize);
+										status_handle->setPcDone((int)(((double)passed_blocks/(double)totalblocks)*100.0+0.5) );
 									}
 									else
 									{
-										ServerStatus::setProcessDoneBytes(clientname, status_id, numblocks*blocksize);
-										ServerStatus::setProcessPcDone(clientname, status_id,
-											(int)(((double)numblocks/(double)((blockcnt>0 ? blockcnt : -blockcnt)))*100.0+0.5) );
+										status_handle->setDoneBytes(done_blocks*blocksize);
+										status_handle->setPcDone((int)(((double)done_blocks/(double)((blockcnt>0 ? blockcnt : -blockcnt)))*100.0+0.5) );
 									}
 								}
 							}
@@ -1387,7 +1616,7 @@ bool ImageBackup::doImage(const std::string &pLetter, const std::string &pParent
 							{
 								last_eta_update = ctime;
 
-								int64 rel_blocks = (has_parent && blockcnt>=0) ? currblock : numblocks;
+								int64 rel_blocks = (has_parent && blockcnt>=0) ? passed_blocks : done_blocks;
 								if (rel_blocks > 1000)
 								{									
 									int64 new_blocks = rel_blocks - last_eta_update_blocks;
@@ -1420,8 +1649,7 @@ bool ImageBackup::doImage(const std::string &pLetter, const std::string &pParent
 										{
 											int64 remaining_blocks = ((has_parent && blockcnt >= 0) ? totalblocks : 
 												((blockcnt>0 ? blockcnt : -blockcnt)) - rel_blocks);
-											ServerStatus::setProcessEta(clientname, status_id,
-												static_cast<int64>(remaining_blocks / speed_bpms + 0.5), eta_set_time);
+											status_handle->setEta(static_cast<int64>(remaining_blocks / speed_bpms + 0.5), eta_set_time);
 										}
 									}									
 								}
@@ -1432,7 +1660,13 @@ bool ImageBackup::doImage(const std::string &pLetter, const std::string &pParent
 								transferred_bytes += cc->getTransferedBytes();
 								cc->resetTransferedBytes();
 
-								int64 new_bytes = transferred_bytes - last_speed_received_bytes;
+								int64 all_transferred_bytes = transferred_bytes;
+								if (transfer_ranges.get() != NULL)
+								{
+									all_transferred_bytes += transfer_ranges->transferred_bytes;
+								}
+
+								int64 new_bytes = all_transferred_bytes - last_speed_received_bytes;
 								int64 passed_time = ctime - speed_set_time;
 
 								if (passed_time > 0)
@@ -1443,11 +1677,10 @@ bool ImageBackup::doImage(const std::string &pLetter, const std::string &pParent
 
 									if (last_speed_received_bytes > 0)
 									{
-										ServerStatus::setProcessSpeed(clientname, status_id,
-											speed_bpms);
+										status_handle->setSpeed(speed_bpms);
 									}
 
-									last_speed_received_bytes = transferred_bytes;
+									last_speed_received_bytes = all_transferred_bytes;
 								}
 							}
 
@@ -1505,12 +1738,45 @@ bool ImageBackup::doImage(const std::string &pLetter, const std::string &pParent
 						currblock = little_endian(currblock);
 						if(currblock==-123)
 						{
-							ServerStatus::setProcessPcDone(clientname, status_id,
-								100);
-							ServerStatus::setProcessEta(clientname, status_id, -1);
-							ServerStatus::setProcessSpeed(clientname, status_id, 0);
+							bool multi_stream = transfer_ranges.get() != NULL;
+							if (multi_stream)
+							{
+								if (nextblock <= transfer_ranges->ranges[0].end)
+								{
+									nextblock = updateNextblock(nextblock, transfer_ranges->ranges[0].end, &shactx, zeroblockdata.data(), has_parent,
+										hashfile, parenthashfile, blocksize, mbr_offset, vhd_blocksize, warned_about_parenthashfile_error,
+										-1, vhdfile, 0);
+								}
+
+								while (!Server->getThreadPool()->waitFor(transfer_ranges->tickets, 1000))
+								{
+									if (status_handle->isStopped())
+									{
+										ServerLogger::Log(logid, "Server admin stopped backup. (3)", LL_ERROR);
+										goto do_image_cleanup;
+									}
+									status_handle->setDoneBytes((numblocks + transfer_ranges->numblocks)*blocksize);
+								}
+								transfer_ranges->tickets.clear();
+
+								if (transfer_ranges->failed)
+								{
+									ServerLogger::Log(logid, "Transferring image range failed. Stopping image backup.", LL_ERROR);
+									goto do_image_cleanup;
+								}
 
-							if(nextblock<=totalblocks)
+								finishImageRanges(transfer_ranges.get(), false);
+
+								transferred_bytes += transfer_ranges->transferred_bytes;
+								transferred_bytes_real += transfer_ranges->transferred_bytes_real;
+								transfer_ranges.reset();
+							}
+
+							status_handle->setPcDone(100);
+							status_handle->setEta(-1);
+							status_handle->setSpeed(0);
+
+							if(!multi_stream && nextblock<=totalblocks)
 							{
 								nextblock=updateNextblock(nextblock, totalblocks, &shactx, zeroblockdata.data(), has_parent,
 									hashfile, parenthashfile, blocksize, mbr_offset, vhd_blocksize, warned_about_parenthashfile_error,
@@ -1672,6 +1938,11 @@ bool ImageBackup::doImage(const std::string &pLetter, const std::string &pParent
 								ServerLogger::Log(logid, "Error on client occurred: "+err, LL_ERROR);
 							}
 							Server->destroy(cc);
+							if (transfer_ranges.get() != NULL)
+							{
+								waitForImageRanges(transfer_ranges.get(), true);
+								finishImageRanges(transfer_ranges.get(), true);
+							}
 							if(vhdfile!=NULL)
 							{
 								vhdfile->freeBuffer(blockdata);
@@ -1865,7 +2136,15 @@ bool ImageBackup::doImage(const std::string &pLetter, const std::string &pParent
 
 do_image_cleanup:
 
-	ServerStatus::setProcessSpeed(clientname, status_id, 0);
+	status_handle->setSpeed(0);
+
+	if (transfer_ranges.get() != NULL)
+	{
+		waitForImageRanges(transfer_ranges.get(), true);
+		finishImageRanges(transfer_ranges.get(), true);
+		transferred_bytes += transfer_ranges->transferred_bytes;
+		transferred_bytes_real += transfer_ranges->transferred_bytes_real;
+	}
 
 	if(cc!=NULL)
 	{
@@ -2097,6 +2376,472 @@ int64 ImageBackup::updateNextblock(int64 nextblock, int64 currblock, sha256_ctx
 	return nextblock+1;
 }
 
+size_t ImageBackup::getImageTransferStreams(const std::string &pLetter, bool with_checksum)
+{
+	//Broken ranges are retried from the last verified vhd block, which needs the checksums
+	if (!with_checksum
+		|| pLetter == "SYSVOL"
+		|| pLetter == "ESP"
+		|| client_main->isOnInternetConnection()
+		|| client_main->getProtocolVersions().image_protocol_version < 2)
+	{
+		return 1;
+	}
+
+	int streams = watoi(Server->getServerParameter("image_transfer_streams", "1"));
+
+	//More streams write to too many places in the image at once for the
+	//block cache of compressed images
+	return static_cast<size_t>((std::max)(1, (std::min)(streams, 4)));
+}
+
+void ImageBackup::startImageRanges(SImageTransferRanges* ranges)
+{
+	//Has to match ImageThread::getRangeEnd on the client
+	int64 n_streams = static_cast<int64>(ranges->n_streams);
+	int64 range_blocks = (ranges->blocks + n_streams - 1) / n_streams;
+	range_blocks = ((range_blocks + ranges->vhd_blocksize - 1) / ranges->vhd_blocksize)*ranges->vhd_blocksize;
+	if (range_blocks == 0)
+	{
+		range_blocks = ranges->vhd_blocksize;
+	}
+
+	ranges->ranges.clear();
+	for (int64 start = 0;; start += range_blocks)
+	{
+		SImageTransferRanges::SRange range;
+		range.start = start;
+		range.end = start + range_blocks;
+		range.last = range.end >= ranges->blocks;
+		if (range.last)
+		{
+			range.end = ranges->totalblocks;
+		}
+		ranges->ranges.push_back(range);
+
+		if (range.last)
+		{
+			break;
+		}
+	}
+
+	if (ranges->ranges.size() > 1)
+	{
+		ServerLogger::Log(logid, "Transferring image in " + convert(ranges->ranges.size()) + " parallel streams", LL_INFO);
+	}
+
+	for (size_t i = 1; i < ranges->ranges.size(); ++i)
+	{
+		ranges->tickets.push_back(Server->getThreadPool()->execute(new ImageRangeThread(this, ranges, i), "image range transfer"));
+	}
+}
+
+void ImageBackup::waitForImageRanges(SImageTransferRanges* ranges, bool stop)
+{
+	if (stop)
+	{
+		ranges->stop = true;
+	}
+
+	Server->getThreadPool()->waitFor(ranges->tickets);
+	ranges->tickets.clear();
+}
+
+IPipe* ImageBackup::connectImageRange(SImageTransferRanges* ranges, int64 start, int64 end, bool abort)
+{
+	IPipe* cc = client_main->getClientCommandConnection(server_settings.get(), 60000);
+	if (cc == NULL)
+	{
+		ServerLogger::Log(logid, "Connecting to \"" + clientname + "\" for image range transfer failed", LL_DEBUG);
+		return NULL;
+	}
+
+	std::string params = "letter=" + ranges->letter + "&start=" + convert(start)
+		+ "&shadowid=" + convert(snapshot_id) + "&status_id=" + convert(status_id) + "&token=" + server_token
+		+ "&checksum=1&end=" + convert(end);
+	if (!clientsubname.empty())
+	{
+		params += "&clientsubname=" + EscapeParamString(clientsubname);
+	}
+	params += "&zero_skipped=1";
+	if (abort)
+	{
+		params += "&abort=1";
+	}
+
+	CTCPStack tcpstack(client_main->isOnInternetConnection());
+	std::string identity = client_main->getIdentity();
+
+	if (ranges->parentvhd.empty())
+	{
+		if (tcpstack.Send(cc, identity + "FULL IMAGE " + params) == 0)
+		{
+			ServerLogger::Log(logid, "Sending 'FULL IMAGE' command for image range failed", LL_DEBUG);
+			Server->destroy(cc);
+			return NULL;
+		}
+		return cc;
+	}
+
+	std::unique_ptr<IFile> parenthashfile(Server->openFile(os_file_prefix(ranges->parentvhd + ".hash"), MODE_READ));
+	if (parenthashfile.get() == NULL)
+	{
+		ServerLogger::Log(logid, "Error opening Parenthashfile \"" + ranges->parentvhd + ".hash\". " + os_last_error_str(), LL_ERROR);
+		Server->destroy(cc);
+		return NULL;
+	}
+
+	//Only the hashes and the client bitmap of the blocks in the range are
+	//sent. The client puts them at their offset in its copy of the files
+	int64 hash_size = parenthashfile->Size();
+	int64 hash_start = (std::min)((start / ranges->vhd_blocksize)*sha_size, hash_size);
+	int64 hash_end = (std::min)(((end + ranges->vhd_blocksize - 1) / ranges->vhd_blocksize)*sha_size, hash_size);
+	if (hash_end - hash_start < sha_size)
+	{
+		//The client needs hash data, also for the (empty) finishing range
+		hash_start = (std::max)(static_cast<int64>(0), hash_end - sha_size);
+	}
+
+	params += "&hashsize=" + convert(hash_end - hash_start) + "&hashoffset=" + convert(hash_start);
+
+	std::unique_ptr<IFile> prevbitmap;
+	int64 bitmap_start = 0;
+	int64 bitmap_end = -1;
+	if (ranges->transfer_prev_cbitmap)
+	{
+		prevbitmap.reset(Server->openFile(os_file_prefix(ranges->parentvhd + ".cbitmap")));
+		if (prevbitmap.get() != NULL)
+		{
+			int64 bitmap_data_size = prevbitmap->Size() - cbitmap_header_size - sha_size;
+			_u32 bitmap_blocksize = 0;
+			if (bitmap_data_size >= 0
+				&& prevbitmap->Read(8, reinterpret_cast<char*>(&bitmap_blocksize), sizeof(bitmap_blocksize)) == sizeof(bitmap_blocksize)
+				&& little_endian(bitmap_blocksize) == ranges->blocksize)
+			{
+				bitmap_start = (std::min)(start / 8, bitmap_data_size);
+				bitmap_end = (std::min)((end + 7) / 8, bitmap_data_size);
+				params += "&cbitmapsize=" + convert(cbitmap_header_size + (bitmap_end - bitmap_start) + sha_size)
+					+ "&cbitmapstart=" + convert(bitmap_start * 8);
+			}
+			else
+			{
+				params += "&cbitmapsize=" + convert(prevbitmap->Size());
+			}
+		}
+	}
+
+	if (tcpstack.Send(cc, identity + "INCR IMAGE " + params) == 0
+		|| sendFileToPipe(parenthashfile.get(), cc, logid, hash_start, hash_end - hash_start) != ESendErr_Ok
+		|| (prevbitmap.get() != NULL
+			&& (bitmap_end >= 0 ? sendBitmapRangeToPipe(prevbitmap.get(), bitmap_start, bitmap_end, cc, logid)
+				: sendFileToPipe(prevbitmap.get(), cc, logid)) != ESendErr_Ok))
+	{
+		ServerLogger::Log(logid, "Sending 'INCR IMAGE' command for image range failed", LL_DEBUG);
+		Server->destroy(cc);
+		return NULL;
+	}
+
+	return cc;
+}
+
+bool ImageBackup::receiveImageRange(SImageTransferRanges* ranges, size_t range_idx)
+{
+	const SImageTransferRanges::SRange range = ranges->ranges[range_idx];
+	const unsigned int blocksize = ranges->blocksize;
+	const int64 vhd_blocksize = ranges->vhd_blocksize;
+	const int64 mbr_offset = ranges->mbr_offset;
+	ServerVHDWriter* vhdfile = ranges->vhdfile;
+	bool has_parent = !ranges->parentvhd.empty();
+
+	std::unique_ptr<IFile> hashfile(Server->openFile(os_file_prefix(ranges->imagefn + ".hash"), MODE_RW));
+	if (hashfile.get() == NULL)
+	{
+		ServerLogger::Log(logid, "Error opening Hashfile \"" + ranges->imagefn + ".hash\" for image range. " + os_last_error_str(), LL_ERROR);
+		return false;
+	}
+
+	std::unique_ptr<IFile> parenthashfile;
+	if (has_parent)
+	{
+		parenthashfile.reset(Server->openFile(os_file_prefix(ranges->parentvhd + ".hash"), MODE_READ));
+		if (parenthashfile.get() == NULL)
+		{
+			ServerLogger::Log(logid, "Error opening Parenthashfile \"" + ranges->parentvhd + ".hash\" for image range. " + os_last_error_str(), LL_ERROR);
+			return false;
+		}
+	}
+
+	std::vector<unsigned char> zeroblockdata(blocksize);
+	sha256_ctx shactx;
+	unsigned char verify_checksum[sha_size];
+	bool warned_about_parenthashfile_error = false;
+	int64 nextblock = range.start;
+	int64 last_verified_block = range.start;
+	int64 passed_blocks = 0;
+	int num_errors = 0;
+	char* blockdata = NULL;
+	bool done = false;
+	bool fatal_error = false;
+
+	while (!done && !fatal_error && !ranges->stop)
+	{
+		if (num_errors > max_num_hash_errors)
+		{
+			ServerLogger::Log(logid, "Too many errors while transferring image range starting at block " + convert(range.start) + ". Stopping backup.", LL_ERROR);
+			break;
+		}
+
+		nextblock = last_verified_block;
+		hashfile->Seek((nextblock / vhd_blocksize)*sha_size);
+		sha256_init(&shactx);
+
+		IPipe* cc = connectImageRange(ranges, nextblock, range.end, false);
+		if (cc == NULL)
+		{
+			++num_errors;
+			Server->wait(10000);
+			continue;
+		}
+
+		ImageRangeReader reader(cc, ranges->stop);
+		int64 last_bytes_update = Server->getTimeMS();
+		bool retry = false;
+		while (!retry && !done && !fatal_error)
+		{
+			int64 currblock;
+			if (!reader.read(reinterpret_cast<char*>(&currblock), sizeof(currblock)))
+			{
+				if (!ranges->stop)
+				{
+					ServerLogger::Log(logid, "Connection for image range starting at block " + convert(range.start) + " broke. Retrying...", LL_WARNING);
+				}
+				retry = true;
+				break;
+			}
+			currblock = little_endian(currblock);
+
+			if (currblock == -123)
+			{
+				if (nextblock <= range.end)
+				{
+					nextblock = updateNextblock(nextblock, range.end, &shactx, zeroblockdata.data(), has_parent,
+						hashfile.get(), parenthashfile.get(), blocksize, mbr_offset, vhd_blocksize, warned_about_parenthashfile_error,
+						-1, vhdfile, 0);
+
+					if (range.last && nextblock != 0)
+					{
+						sha256_final(&shactx, verify_checksum);
+						hashfile->Write((char*)verify_checksum, sha_size);
+					}
+				}
+				done = true;
+			}
+			else if (currblock == -124 ||
+				currblock == 0xFFFFFFFFFFFFFFFFLLU)
+			{
+				std::string err = reader.remaining();
+				if (err.find("|#|") != std::string::npos)
+				{
+					err = getuntil("|#|", err);
+				}
+				ServerLogger::Log(logid, "Error on client occurred: " + err, LL_ERROR);
+				fatal_error = true;
+			}
+			else if (currblock == -125) //ping
+			{
+			}
+			else if (currblock == -126) //checksum
+			{
+				char hdata[sizeof(int64) + sha_size];
+				if (!reader.read(hdata, sizeof(hdata)))
+				{
+					retry = true;
+					break;
+				}
+
+				int64 hblock;
+				unsigned char dig[sha_size];
+				memcpy(&hblock, hdata, sizeof(int64));
+				hblock = little_endian(hblock);
+				memcpy(dig, &hdata[sizeof(int64)], sha_size);
+
+				if ((nextblock < hblock || (hblock == ranges->blocks && nextblock%vhd_blocksize != 0)) && hblock > 0)
+				{
+					if (nextblock < hblock)
+					{
+						nextblock = updateNextblock(nextblock, hblock - 1, &shactx, zeroblockdata.data(), has_parent,
+							hashfile.get(), parenthashfile.get(), blocksize, mbr_offset,
+							vhd_blocksize, warned_about_parenthashfile_error, -1, vhdfile, 1);
+						sha256_update(&shactx, zeroblockdata.data(), blocksize);
+					}
+					if ((nextblock%vhd_blocksize == 0 || hblock == ranges->blocks) && nextblock != 0)
+					{
+						sha256_final(&shactx, verify_checksum);
+						hashfile->Write((char*)verify_checksum, sha_size);
+						sha256_init(&shactx);
+					}
+				}
+
+				if (memcmp(verify_checksum, dig, sha_size) != 0)
+				{
+					Server->Log("Client hash=" + base64_encode(dig, sha_size) + " Server hash=" + base64_encode(verify_checksum, sha_size) + " hblock=" + convert(hblock), LL_DEBUG);
+					ServerLogger::Log(logid, "Checksum for image block wrong. Retrying image range...", LL_WARNING);
+					retry = true;
+				}
+				else
+				{
+					last_verified_block = (std::max)(range.start, hblock >= vhd_blocksize ? hblock - vhd_blocksize : hblock);
+				}
+			}
+			else if (currblock == -127) //Empty VHD block
+			{
+				int64 vhdblock;
+				if (!reader.read(reinterpret_cast<char*>(&vhdblock), sizeof(vhdblock)))
+				{
+					retry = true;
+					break;
+				}
+				vhdblock = little_endian(vhdblock);
+				nextblock = updateNextblock(nextblock, vhdblock + vhd_blocksize, &shactx, zeroblockdata.data(), has_parent,
+					hashfile.get(), parenthashfile.get(), blocksize, mbr_offset, vhd_blocksize, warned_about_parenthashfile_error,
+					vhdblock, vhdfile, 0);
+			}
+			else if (currblock == -128) //Number of skipped blocks
+			{
+				int64 zero_skipped;
+				if (!reader.read(reinterpret_cast<char*>(&zero_skipped), sizeof(zero_skipped)))
+				{
+					retry = true;
+					break;
+				}
+				ranges->numblocks += little_endian(zero_skipped);
+			}
+			else if (currblock < range.start
+				|| currblock >= range.end)
+			{
+				ServerLogger::Log(logid, "Received unknown block number: " + convert(currblock) + " (range: " + convert(range.start)
+					+ "-" + convert(range.end) + "). Retrying image range...", LL_WARNING);
+				retry = true;
+			}
+			else
+			{
+				if (blockdata == NULL)
+				{
+					blockdata = vhdfile->getBuffer();
+				}
+
+				if (!reader.read(blockdata, blocksize))
+				{
+					retry = true;
+					break;
+				}
+
+				if (nextblock <= currblock)
+				{
+					++ranges->numblocks;
+
+					nextblock = updateNextblock(nextblock, currblock, &shactx, zeroblockdata.data(),
+						has_parent, hashfile.get(), parenthashfile.get(),
+						blocksize, mbr_offset, vhd_blocksize, warned_about_parenthashfile_error,
+						-1, vhdfile, 0);
+
+					sha256_update(&shactx, (unsigned char *)blockdata, blocksize);
+
+					vhdfile->writeBuffer(mbr_offset + currblock*blocksize, blockdata, blocksize);
+					blockdata = NULL;
+
+					if (nextblock%vhd_blocksize == 0 && nextblock != 0)
+					{
+						sha256_final(&shactx, verify_checksum);
+						hashfile->Write((char*)verify_checksum, sha_size);
+						sha256_init(&shactx);
+					}
+
+					if (nextblock - range.start > passed_blocks)
+					{
+						ranges->passed_blocks += nextblock - range.start - passed_blocks;
+						passed_blocks = nextblock - range.start;
+					}
+
+					if (vhdfile->hasError())
+					{
+						ServerLogger::Log(logid, "FATAL ERROR: Could not write to VHD-File", LL_ERROR);
+						fatal_error = true;
+					}
+				}
+				else if (nextblock - currblock > vhd_blocksize)
+				{
+					ServerLogger::Log(logid, "Block sent out of sequence. Expected block >=" + convert(nextblock - vhd_blocksize - 1) + " got " + convert(currblock) + ". Retrying image range...", LL_WARNING);
+					retry = true;
+				}
+
+				int64 ctime = Server->getTimeMS();
+				if (ctime - last_bytes_update > 10000)
+				{
+					ranges->transferred_bytes += cc->getTransferedBytes();
+					cc->resetTransferedBytes();
+					last_bytes_update = ctime;
+				}
+			}
+		}
+
+		ranges->transferred_bytes += cc->getTransferedBytes();
+		ranges->transferred_bytes_real += cc->getRealTransferredBytes();
+		Server->destroy(cc);
+
+		if (retry)
+		{
+			++num_errors;
+		}
+	}
+
+	if (blockdata != NULL)
+	{
+		vhdfile->freeBuffer(blockdata);
+	}
+
+	return done;
+}
+
+void ImageBackup::finishImageRanges(SImageTransferRanges* ranges, bool abort)
+{
+	//Requests the empty range after the last block, so that the client
+	//releases the snapshot and records the backup once all ranges are done.
+	//With abort the client only releases the snapshot
+	if (abort)
+	{
+		//The range threads are stopped at this point
+		ranges->stop = false;
+	}
+
+	IPipe* cc = connectImageRange(ranges, ranges->blocks, ranges->totalblocks, abort);
+	if (cc == NULL)
+	{
+		ServerLogger::Log(logid, "Could not connect to client to finish image transfer. Snapshot may not be released.", LL_WARNING);
+		return;
+	}
+
+	ImageRangeReader reader(cc, ranges->stop);
+	int64 currblock = 0;
+	while (reader.read(reinterpret_cast<char*>(&currblock), sizeof(currblock)))
+	{
+		currblock = little_endian(currblock);
+		if (currblock != -125)
+		{
+			break;
+		}
+	}
+
+	if (currblock != -123)
+	{
+		ServerLogger::Log(logid, "Finishing image transfer on client failed. Snapshot may not be released.", LL_WARNING);
+	}
+
+	ranges->transferred_bytes += cc->getTransferedBytes();
+	ranges->transferred_bytes_real += cc->getRealTransferredBytes();
+	Server->destroy(cc);
+}
+
 std::string ImageBackup::constructImagePath(const std::string &letter, std::string image_file_format, std::string pParentvhd)
 {
 	bool full_backup = pParentvhd.empty();
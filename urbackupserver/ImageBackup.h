@@ -10,6 +10,8 @@ class IFile;
 class ServerPingThread;
 class ScopedLockImageFromCleanup;
 class ServerRunningUpdater;
+class IPipe;
+struct SImageTransferRanges;
 
 class ImageBackup : public Backup
 {
@@ -64,6 +66,14 @@ protected:
 		int incremental, int incremental_ref, const std::string& imagefn, ScopedLockImageFromCleanup& cleanup_lock,
 		ServerRunningUpdater *running_updater);
 	bool readShadowData(const std::string& shadowdata);
+	size_t getImageTransferStreams(const std::string &pLetter, bool with_checksum);
+	void startImageRanges(SImageTransferRanges* ranges);
+	void waitForImageRanges(SImageTransferRanges* ranges, bool stop);
+	bool receiveImageRange(SImageTransferRanges* ranges, size_t range_idx);
+	IPipe* connectImageRange(SImageTransferRanges* ranges, int64 start, int64 end, bool abort);
+	void finishImageRanges(SImageTransferRanges* ranges, bool abort);
+
+	friend class ImageRangeThread;
 
 	std::string letter;
 
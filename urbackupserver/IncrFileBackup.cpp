@@ -37,6 +37,8 @@
 #include "database.h"
 #include <algorithm>
 #include "PhashLoad.h"
+#include "FileManifest.h"
+#include "BlockDedupStore.h"
 
 extern std::string server_identity;
 
@@ -97,8 +99,7 @@ bool IncrFileBackup::doFileBackup()
 	}
 
 	int64 eta_set_time=Server->getTimeMS();
-	ServerStatus::setProcessEta(clientname, status_id, 
-		last.backup_time_ms + last.indexing_time_ms,
+	status_handle->setEta(last.backup_time_ms + last.indexing_time_ms,
 		eta_set_time);
 
 
@@ -236,6 +237,8 @@ bool IncrFileBackup::doFileBackup()
 	}
 	backupid=static_cast<int>(db->getLastInsertID());
 
+	FileManifest::startBackup(backupid, clientid, incremental_num);
+
 	std::string backupfolder=server_settings->getSettings()->backupfolder;
 	std::string last_backuppath=backupfolder+os_file_sep()+clientname+os_file_sep()+last.path;
 	std::string last_backuppath_hashes=backupfolder+os_file_sep()+clientname+os_file_sep()+last.path+os_file_sep()+".hashes";
@@ -494,6 +497,7 @@ bool IncrFileBackup::doFileBackup()
 	size_t num_readded_entries = 0;
 
 	bool copy_last_file_entries = resumed_backup;
+	std::unique_ptr<FileManifest> last_manifest;
 
 	size_t num_copied_file_entries = 0;
 
@@ -507,6 +511,7 @@ bool IncrFileBackup::doFileBackup()
 		copy_last_file_entries = copy_last_file_entries && filesdao->createTemporaryLastFilesTable();
 		copy_last_file_entries = copy_last_file_entries && filesdao->copyToTemporaryLastFilesTable(last.backupid);
 		filesdao->createTemporaryLastFilesTableIndex();
+		last_manifest.reset(FileManifest::open(last.backupid));
 	}
 
 	if(copy_last_file_entries && resumed_full)
@@ -561,7 +566,7 @@ bool IncrFileBackup::doFileBackup()
 		fc_chunked->resetReceivedDataBytes(true);
 	}
 
-	ServerStatus::setProcessTotalBytes(clientname, status_id, files_size);
+	status_handle->setTotalBytes(files_size);
 
 	tmp_filelist->Seek(0);
 
@@ -600,10 +605,10 @@ bool IncrFileBackup::doFileBackup()
 
 		filelist_currpos+=read;
 
-		for(size_t i=0;i<read;++i)
+		for(size_t i=0;i<read;)
 		{
 			std::map<std::string, std::string> extra_params;
-			bool b=list_parser.nextEntry(buffer[i], cf, &extra_params);
+			bool b=list_parser.nextEntry(buffer, read, i, cf, &extra_params);
 			if(b)
 			{
 				std::string osspecific_name;
@@ -680,7 +685,7 @@ bool IncrFileBackup::doFileBackup()
 					{
 						if (!backup_stopped)
 						{
-							if (ServerStatus::getProcess(clientname, status_id).stop)
+							if (status_handle->isStopped())
 							{
 								r_offline = true;
 								backup_stopped = true;
@@ -693,19 +698,17 @@ bool IncrFileBackup::doFileBackup()
 						laststatsupdate = ctime;
 						if (files_size == 0)
 						{
-							ServerStatus::setProcessPcDone(clientname, status_id, 100);
+							status_handle->setPcDone(100);
 						}
 						else
 						{
 							int64 done_bytes = fc.getReceivedDataBytes(true)
 								+ (fc_chunked.get() ? fc_chunked->getReceivedDataBytes(true) : 0) + linked_bytes;
-							ServerStatus::setProcessDoneBytes(clientname, status_id, done_bytes);
-							ServerStatus::setProcessPcDone(clientname, status_id,
-								(std::min)(100, (int)(((float)done_bytes) / ((float)files_size / 100.f) + 0.5f)));
+							status_handle->setDoneBytes(done_bytes);
+							status_handle->setPcDone((std::min)(100, (int)(((float)done_bytes) / ((float)files_size / 100.f) + 0.5f)));
 						}
 
-						ServerStatus::setProcessQueuesize(clientname, status_id,
-							(_u32)hashpipe->getNumElements(), (_u32)hashpipe_prepare->getNumElements());
+						updateHashQueuesize();
 					}
 
 					if (ctime - last_eta_update > eta_update_intervall)
@@ -793,6 +796,11 @@ bool IncrFileBackup::doFileBackup()
 									if (copy_last_file_entries)
 									{
 										std::vector<ServerFilesDao::SFileEntry> file_entries = filesdao->getFileEntriesFromTemporaryTableGlob(escape_glob_sql(srcpath) + os_file_sep() + "*");
+										if (last_manifest.get() != NULL)
+										{
+											std::vector<ServerFilesDao::SFileEntry> manifest_entries = last_manifest->findPrefix(srcpath + os_file_sep());
+											file_entries.insert(file_entries.end(), manifest_entries.begin(), manifest_entries.end());
+										}
 										for (size_t i = 0; i < file_entries.size(); ++i)
 										{
 											if (file_entries[i].fullpath.size() > srcpath.size())
@@ -1315,6 +1323,12 @@ bool IncrFileBackup::doFileBackup()
 					{
 						ServerFilesDao::SFileEntry fileEntry = filesdao->getFileEntryFromTemporaryTable(srcpath);
 
+						if (!fileEntry.exists
+							&& last_manifest.get() != NULL)
+						{
+							fileEntry = last_manifest->lookup(srcpath);
+						}
+
 						if (fileEntry.exists)
 						{
 							addFileEntrySQLWithExisting(backuppath + local_curr_os_path, backuppath_hashes + local_curr_os_path,
@@ -1376,19 +1390,17 @@ bool IncrFileBackup::doFileBackup()
 	{
 		if(files_size==0)
 		{
-			ServerStatus::setProcessPcDone(clientname, status_id, 100);
+			status_handle->setPcDone(100);
 		}
 		else
 		{
 			int64 done_bytes = fc.getReceivedDataBytes(true)
 				+ (fc_chunked.get() ? fc_chunked->getReceivedDataBytes(true) : 0) + linked_bytes;
-			ServerStatus::setProcessDoneBytes(clientname, status_id, done_bytes);
-			ServerStatus::setProcessPcDone(clientname, status_id,
-				(std::min)(100,(int)(((float)done_bytes)/((float)files_size/100.f)+0.5f)) );
+			status_handle->setDoneBytes(done_bytes);
+			status_handle->setPcDone((std::min)(100,(int)(((float)done_bytes)/((float)files_size/100.f)+0.5f)) );
 		}
 
-		ServerStatus::setProcessQueuesize(clientname, status_id,
-			(_u32)hashpipe->getNumElements(), (_u32)hashpipe_prepare->getNumElements());
+		updateHashQueuesize();
 
 		int64 ctime = Server->getTimeMS();
 		if(ctime-last_eta_update>eta_update_intervall)
@@ -1399,7 +1411,7 @@ bool IncrFileBackup::doFileBackup()
 		calculateDownloadSpeed(ctime, fc, fc_chunked.get());
 	}
 
-	ServerStatus::setProcessSpeed(clientname, status_id, 0);
+	status_handle->setSpeed(0);
 
 	if(server_download->isOffline() && !r_offline)
 	{
@@ -1493,10 +1505,10 @@ bool IncrFileBackup::doFileBackup()
 			{
 				break;
 			}
-			for(size_t i=0;i<read;++i)
+			for(size_t i=0;i<read;)
 			{
 				str_map extra_params;
-				bool b=list_parser.nextEntry(buffer[i], cf, &extra_params);
+				bool b=list_parser.nextEntry(buffer, read, i, cf, &extra_params);
 				if(b)
 				{
 					if(cf.isdir)
@@ -1926,9 +1938,9 @@ bool IncrFileBackup::deleteFilesInSnapshot(const std::string clientlist_fn, cons
 
 	while( (read=tmp->Read(buffer, 4096))>0 )
 	{
-		for(size_t i=0;i<read;++i)
+		for(size_t i=0;i<read;)
 		{
-			if(list_parser.nextEntry(buffer[i], curr_file, NULL))
+			if(list_parser.nextEntry(buffer, read, i, curr_file, NULL))
 			{
 				if(curr_file.isdir && curr_file.name=="..")
 				{
@@ -2129,7 +2141,7 @@ void IncrFileBackup::addSparseFileEntry( std::string curr_path, SFile &cf, int c
 	if( (*md5ptr>=0 ? *md5ptr : -1* *md5ptr ) % copy_file_entries_sparse_modulo == incremental_num % copy_file_entries_sparse_modulo )
 	{
 		FileMetadata metadata;
-		std::unique_ptr<IFile> last_file(Server->openFile(os_file_prefix(backuppath+local_curr_os_path), MODE_READ));
+		std::unique_ptr<IFile> last_file(BlockDedupStore::openRead(Server->openFile(os_file_prefix(backuppath+local_curr_os_path), MODE_READ)));
 		if(!read_metadata(backuppath_hashes+local_curr_os_path, metadata) || last_file.get()==NULL)
 		{
 			ServerLogger::Log(logid, "Error adding sparse file entry. Could not read metadata from "+backuppath_hashes+local_curr_os_path, LL_WARNING);
@@ -2166,6 +2178,8 @@ void IncrFileBackup::copyFile(size_t fileid, const std::string& source, const st
 	data.addString((hash_dest));
 	metadata.serialize(data);
 
+	max_file_id.startHashing(fileid, true);
+
 	hashpipe->Write(data.getDataPtr(), data.getDataSize());
 }
 
@@ -30,26 +30,47 @@
 #include <memory>
 #include "../Interface/Server.h"
 #include "create_files_index.h"
+#include "FileIndexCache.h"
 
 MDB_env *LMDBFileIndex::env=NULL;
 MDB_dbi LMDBFileIndex::dbi;
 ISharedMutex* LMDBFileIndex::mutex=NULL;
 LMDBFileIndex* LMDBFileIndex::fileindex=NULL;
 THREADPOOL_TICKET LMDBFileIndex::fileindex_ticket = ILLEGAL_THREADPOOL_TICKET;
+FileIndexCache* LMDBFileIndex::cache = NULL;
 
 
 const size_t c_initial_map_size=1*1024*1024;
 const size_t c_create_commit_n = 10000;
+const size_t c_default_cache_mb = 64;
 
 
 bool LMDBFileIndex::initFileIndex()
 {
 	mutex = Server->createSharedMutex();
 
+	size_t cache_mb = c_default_cache_mb;
+	std::string fileindex_cache_mb = Server->getServerParameter("fileindex_cache_mb");
+	if (!fileindex_cache_mb.empty())
+	{
+		cache_mb = static_cast<size_t>(watoi64(fileindex_cache_mb));
+	}
+	if (cache_mb > 0)
+	{
+		cache = new FileIndexCache(cache_mb * 1024 * 1024);
+	}
+
 	fileindex=new LMDBFileIndex;
+
+	bool journal_ok = true;
+	if (!fileindex->has_error())
+	{
+		journal_ok = replay_journal(fileindex);
+	}
+
 	fileindex_ticket = Server->getThreadPool()->execute(fileindex, "fileindex writer");
 
-	return !fileindex->has_error();
+	return !fileindex->has_error() && journal_ok;
 }
 
 
@@ -57,6 +78,24 @@ void LMDBFileIndex::shutdownFileIndex()
 {
 	fileindex->shutdown();
 	Server->getThreadPool()->waitFor(fileindex_ticket);
+
+	if (cache != NULL)
+	{
+		FileIndexCache::SStats stats = cache->getStats();
+		Server->Log("File entry index cache: " + convert(stats.hits) + " hits, " + convert(stats.misses) + " misses, "
+			+ convert(stats.invalidations) + " invalidations, " + convert(stats.evictions) + " evictions, "
+			+ PrettyPrintBytes(stats.mem_used) + " of " + PrettyPrintBytes(stats.mem_budget) + " used", LL_INFO);
+	}
+}
+
+FileIndexCache::SStats LMDBFileIndex::get_cache_stats()
+{
+	if (cache == NULL)
+	{
+		return FileIndexCache::SStats();
+	}
+
+	return cache->getStats();
 }
 
 
@@ -206,6 +245,26 @@ void LMDBFileIndex::create(get_data_callback_t get_data_callback, void *userdata
 }
 
 int64 LMDBFileIndex::get(const LMDBFileIndex::SIndexKey& key)
+{
+	int64 ret;
+	int64 generation = 0;
+	if (cache != NULL
+		&& cache->get(key, FileIndexCache::ELookup_Exact, ret, generation))
+	{
+		return ret;
+	}
+
+	ret = get_internal(key);
+
+	if (cache != NULL && !_has_error)
+	{
+		cache->put(key, FileIndexCache::ELookup_Exact, ret, generation);
+	}
+
+	return ret;
+}
+
+int64 LMDBFileIndex::get_internal(const SIndexKey& key)
 {
 	begin_txn(MDB_RDONLY);
 
@@ -483,11 +542,40 @@ void LMDBFileIndex::commit_transaction_internal(bool handle_enosp)
 		Server->Log("LMDB: Failed to commit transaction ("+(std::string)mdb_strerror(rc)+")", LL_ERROR);
 		_has_error=true;
 	}
+	else if(cache!=NULL)
+	{
+		for(size_t i=0;i<transaction_log.size();++i)
+		{
+			cache->invalidate(transaction_log[i].key);
+		}
+	}
 
 	read_transaction_lock.reset();
 	transaction_log.clear();
 }
 
+bool LMDBFileIndex::sync(void)
+{
+	IScopedReadLock lock(mutex);
+
+	//The env is shared with the index used during creation, which might have opened it without syncing
+	unsigned int flags = 0;
+	mdb_env_get_flags(env, &flags);
+	if (!(flags & MDB_NOSYNC))
+	{
+		return true;
+	}
+
+	int rc = mdb_env_sync(env, 1);
+	if (rc)
+	{
+		Server->Log("LMDB: Failed to sync env (" + (std::string)mdb_strerror(rc) + ")", LL_ERROR);
+		return false;
+	}
+
+	return true;
+}
+
 bool LMDBFileIndex::create_env()
 {
 	int rc;
@@ -689,6 +777,26 @@ std::map<int, int64> LMDBFileIndex::get_all_clients( const SIndexKey& key )
 }
 
 int64 LMDBFileIndex::get_prefer_client( const SIndexKey& key )
+{
+	int64 ret;
+	int64 generation = 0;
+	if (cache != NULL
+		&& cache->get(key, FileIndexCache::ELookup_PreferClient, ret, generation))
+	{
+		return ret;
+	}
+
+	ret = get_prefer_client_internal(key);
+
+	if (cache != NULL && !_has_error)
+	{
+		cache->put(key, FileIndexCache::ELookup_PreferClient, ret, generation);
+	}
+
+	return ret;
+}
+
+int64 LMDBFileIndex::get_prefer_client_internal( const SIndexKey& key )
 {
 	begin_txn(MDB_RDONLY);
 
@@ -6,6 +6,7 @@
 #include "lmdb/lmdb.h"
 #endif
 #include "FileIndex.h"
+#include "FileIndexCache.h"
 #include "../Interface/SharedMutex.h"
 #include <memory>
 
@@ -15,6 +16,8 @@ public:
 	static bool initFileIndex();
 	static void shutdownFileIndex();
 
+	static FileIndexCache::SStats get_cache_stats();
+
 	LMDBFileIndex(bool no_sync=false);
 
 	bool create_env();
@@ -45,6 +48,8 @@ public:
 
 	virtual void commit_transaction(void);
 
+	virtual bool sync(void);
+
 	virtual void start_iteration();
 
 	virtual std::map<int, int64> get_next_entries_iteration(bool& has_next);
@@ -58,6 +63,10 @@ private:
 
 	void begin_txn(unsigned int flags);
 
+	int64 get_internal(const SIndexKey& key);
+
+	int64 get_prefer_client_internal(const SIndexKey& key);
+
 	static MDB_env *env;
 	static MDB_dbi dbi;
 	size_t map_size;
@@ -89,6 +98,7 @@ private:
 	static ISharedMutex* mutex;
 	static LMDBFileIndex* fileindex;
 	static THREADPOOL_TICKET fileindex_ticket;
+	static FileIndexCache* cache;
 
 	bool no_sync;
 };
\ No newline at end of file
@@ -35,7 +35,12 @@ bool LocalBackup::doBackup()
 		{
 			status_id = ServerStatus::startProcess(clientname, sa_full_image, details, logid, true);
 		}
-		ServerStatus::setProcessPcDone(clientname, status_id, 0);
+	}
+	status_handle = ServerStatus::getProcessHandle(clientname, status_id);
+
+	if (!is_file_backup)
+	{
+		status_handle->setPcDone(0);
 	}
 
 	IDatabase* db = Server->getDatabase(Server->getThreadID(), URBACKUPDB_SERVER);
@@ -134,7 +139,7 @@ bool LocalBackup::doBackup()
 
 	while (!(has_total_timeout = Server->getTimeMS() - starttime > timeout_time))
 	{
-		if (ServerStatus::getProcess(clientname, status_id).stop)
+		if (status_handle->isStopped())
 		{
 			ServerLogger::Log(logid, "Sever admin stopped backup during start", LL_WARNING);
 			return false;
@@ -237,7 +242,7 @@ bool LocalBackup::queryBackupFinished(int64 timeout_time, bool& finished)
 				ServerLogger::Log(logid, clientname + ": Connecting for getting backup status...", LL_DEBUG);
 				cc.reset(client_main->getClientCommandConnection(server_settings.get(), 60000));
 
-				if (ServerStatus::getProcess(clientname, status_id).stop)
+				if (status_handle->isStopped())
 				{
 					cc.reset();
 					ServerLogger::Log(logid, "Sever admin stopped backup)", LL_WARNING);
@@ -253,7 +258,7 @@ bool LocalBackup::queryBackupFinished(int64 timeout_time, bool& finished)
 
 			if (cc.get() == NULL)
 			{
-				if (!ServerStatus::getProcess(clientname, status_id).stop)
+				if (!status_handle->isStopped())
 				{
 					ServerLogger::Log(logid, "Connecting to ClientService of \"" + clientname + "\" failed - CONNECT error while getting backup status(2)", LL_ERROR);
 					has_timeout_error = true;
@@ -459,7 +464,7 @@ bool LocalBackup::finishLocalBackup(std::vector<std::string>& del_files)
 				ServerLogger::Log(logid, clientname + ": Connecting for finishing backup...", LL_DEBUG);
 				cc.reset(client_main->getClientCommandConnection(server_settings.get(), 60000));
 
-				if (ServerStatus::getProcess(clientname, status_id).stop)
+				if (status_handle->isStopped())
 				{
 					cc.reset();
 					ServerLogger::Log(logid, "Sever admin stopped backup", LL_WARNING);
@@ -475,7 +480,7 @@ bool LocalBackup::finishLocalBackup(std::vector<std::string>& del_files)
 
 			if (cc.get() == NULL)
 			{
-				if (!ServerStatus::getProcess(clientname, status_id).stop)
+				if (!status_handle->isStopped())
 				{
 					ServerLogger::Log(logid, "Connecting to ClientService of \"" + clientname + "\" failed - CONNECT error while getting backup status(2)", LL_ERROR);
 					has_timeout_error = true;
@@ -32,6 +32,8 @@
 #include "../urbackupcommon/os_functions.h"
 #include "server.h"
 #include "FileMetadataDownloadThread.h"
+#include "BlockDedupStore.h"
+#include "CdcIndexStore.h"
 
 namespace
 {
@@ -39,6 +41,12 @@ namespace
 	const size_t queue_items_full = 1;
 	const size_t queue_items_chunked = 4;
 
+	//Files need to be at least this large to be transferred with content-defined chunks
+	const int64 c_cdc_min_filesize = 4*1024*1024;
+
+	//The chunk index of files up to this size always fits into a request
+	const int64 c_cdc_max_filesize = static_cast<int64>(c_cdc_max_index_size)*c_cdc_min_size;
+
 	const char* tmpfile_dirname = ".b68xO+K9SCOF35cLk4Bf9Q";
 }
 
@@ -667,7 +675,7 @@ bool ServerDownloadThread::load_file(SQueueItem todl)
 		}
 
 		hashFile(todl.id, dstpath, hashpath, fd, NULL, filepath_old, fd->Size(), todl.metadata, todl.is_script, todl.sha_dig, fc.releaseSparseExtendsFile(),
-			todl.is_script ? HASH_FUNC_SHA512_NO_SPARSE : default_hashing_method, fileHasSnapshot(todl));
+			todl.is_script ? HASH_FUNC_SHA512_NO_SPARSE : default_hashing_method, fileHasSnapshot(todl), std::string());
 	}
 	else
 	{
@@ -736,7 +744,7 @@ bool ServerDownloadThread::link_or_copy_file(const SQueueItem& todl)
 			pfd_destroy.release();
 			hashFile(todl.id, dstpath, dlfiles.hashpath, dlfiles.patchfile, dlfiles.hashoutput,
 			    (dlfiles.filepath_old), orig_filesize, todl.metadata, todl.is_script, std::string(), NULL,
-				todl.is_script ? HASH_FUNC_SHA512_NO_SPARSE : default_hashing_method, fileHasSnapshot(todl));
+				todl.is_script ? HASH_FUNC_SHA512_NO_SPARSE : default_hashing_method, fileHasSnapshot(todl), std::string());
 			return true;
 		}
 		else
@@ -801,8 +809,18 @@ bool ServerDownloadThread::load_file_patch(SQueueItem todl)
 	int64 script_start_time = Server->getTimeSeconds()-60;
 
 	IFile* sparse_extents_f=NULL;
-	_u32 rc=fc_chunked->GetFilePatch((cfn), dlfiles.orig_file, dlfiles.patchfile, dlfiles.chunkhashes, dlfiles.hashoutput,
-		todl.predicted_filesize, with_metadata ? (todl.id+1) : 0, todl.is_script, &sparse_extents_f);
+	std::vector<SCdcChunk> new_cdc_index;
+	_u32 rc;
+	if(useCdcTransfer(todl))
+	{
+		rc=fc_chunked->GetFilePatchCdc((cfn), dlfiles.orig_file, *dlfiles.cdc_index, dlfiles.patchfile, dlfiles.chunkhashes, dlfiles.hashoutput,
+			todl.predicted_filesize, with_metadata ? (todl.id+1) : 0, &new_cdc_index);
+	}
+	else
+	{
+		rc=fc_chunked->GetFilePatch((cfn), dlfiles.orig_file, dlfiles.patchfile, dlfiles.chunkhashes, dlfiles.hashoutput,
+			todl.predicted_filesize, with_metadata ? (todl.id+1) : 0, todl.is_script, &sparse_extents_f);
+	}
 
 	int64 download_filesize = todl.predicted_filesize;
 
@@ -827,6 +845,7 @@ bool ServerDownloadThread::load_file_patch(SQueueItem todl)
 		}
 		hash_tmp_destroy.reset(dlfiles.hashoutput);
 		dlfiles.chunkhashes->Seek(0);
+		new_cdc_index.clear();
 		download_filesize = todl.predicted_filesize;
 		rc=fc_chunked->GetFilePatch((cfn), dlfiles.orig_file, dlfiles.patchfile, dlfiles.chunkhashes, dlfiles.hashoutput,
 			download_filesize, with_metadata ? (todl.id+1) : 0, todl.is_script, &sparse_extents_f);
@@ -967,12 +986,22 @@ bool ServerDownloadThread::load_file_patch(SQueueItem todl)
 		std::string os_curr_path=FileBackup::convertToOSPathFromFileClient(todl.os_path+"/"+todl.short_fn);		
 		std::string dstpath=backuppath+os_curr_path;
 
+		std::string cdc_index_fn;
+		CdcIndexStore* cdc_index_store = CdcIndexStore::getInstance();
+		if(rc==ERR_SUCCESS
+			&& !new_cdc_index.empty()
+			&& cdc_index_store!=NULL)
+		{
+			//Chunks of the new version are known from the transfer. Stored once its hash is known
+			cdc_index_fn = cdc_index_store->storeTemporary(new_cdc_index, download_filesize);
+		}
+
 		pfd_destroy.release();
 		hash_tmp_destroy.release();
 		sparse_extents_f_delete.release();
 		hashFile(todl.id, dstpath, dlfiles.hashpath, dlfiles.patchfile, dlfiles.hashoutput,
 			dlfiles.filepath_old, download_filesize, todl.metadata, todl.is_script, todl.sha_dig, sparse_extents_f,
-			todl.is_script ? HASH_FUNC_SHA512_NO_SPARSE : default_hashing_method, fileHasSnapshot(todl));
+			todl.is_script ? HASH_FUNC_SHA512_NO_SPARSE : default_hashing_method, fileHasSnapshot(todl), cdc_index_fn);
 	}
 
 	if(todl.is_script && (rc!=ERR_SUCCESS || !script_ok) )
@@ -990,8 +1019,16 @@ bool ServerDownloadThread::load_file_patch(SQueueItem todl)
 
 void ServerDownloadThread::hashFile(int64 fileid, std::string dstpath, std::string hashpath, IFile *fd, IFile *hashoutput, std::string old_file,
 	int64 t_filesize, const FileMetadata& metadata, bool is_script, std::string sha_dig, IFile* sparse_extents_f, char hashing_method,
-	bool has_snapshot)
+	bool has_snapshot, const std::string& cdc_index_fn)
 {
+	//Chunk index of the file for the next patch transfer, unless it came with the transfer
+	bool build_cdc_index = cdc_index_fn.empty()
+		&& !is_script
+		&& client_main->getProtocolVersions().cdc_version>0
+		&& CdcIndexStore::getInstance()!=NULL
+		&& t_filesize>=c_cdc_min_filesize
+		&& t_filesize<=c_cdc_max_filesize;
+
 	int l_backup_id=backupid;
 
 	CWData data;
@@ -1017,6 +1054,8 @@ void ServerDownloadThread::hashFile(int64 fileid, std::string dstpath, std::stri
 	data.addString(sparse_extents_f!=NULL ? sparse_extents_f->getFilename() : "");
 	data.addChar(hashing_method);
 	data.addChar(has_snapshot ? 1 : 0);
+	data.addString(cdc_index_fn);
+	data.addChar(build_cdc_index ? 1 : 0);
 	metadata.serialize(data);
 
 	ServerLogger::Log(logid, "GT: Loaded file \""+ExtractFileName((dstpath))+"\"", LL_DEBUG);
@@ -1045,6 +1084,7 @@ void ServerDownloadThread::hashFile(int64 fileid, std::string dstpath, std::stri
 		}
 		
 	}
+	max_file_id.startHashing(fileid);
 	hashpipe_prepare->Write(data.getDataPtr(), data.getDataSize() );
 }
 
@@ -1279,6 +1319,12 @@ bool ServerDownloadThread::getQueuedFileChunked( std::string& remotefn, IFile*&
 
 				if(it->patch_dl_files.prepared)
 				{
+					if(useCdcTransfer(*it))
+					{
+						//Content-defined chunk transfers are not pipelined
+						return false;
+					}
+
 					it->queued=true;
 					orig_file = it->patch_dl_files.orig_file;
 					patchfile = it->patch_dl_files.patchfile;
@@ -1309,6 +1355,14 @@ void ServerDownloadThread::resetQueueChunked()
 	}
 }
 
+bool ServerDownloadThread::useCdcTransfer(const SQueueItem& todl)
+{
+	return client_main->getProtocolVersions().cdc_version>0
+		&& !todl.is_script
+		&& todl.patch_dl_files.orig_file!=NULL
+		&& todl.patch_dl_files.cdc_index.get()!=NULL;
+}
+
 SPatchDownloadFiles ServerDownloadThread::preparePatchDownloadFiles( const SQueueItem& todl, bool& full_dl )
 {
 	SPatchDownloadFiles dlfiles = {};
@@ -1334,7 +1388,7 @@ SPatchDownloadFiles ServerDownloadThread::preparePatchDownloadFiles( const SQueu
 	std::string hashpath_old=last_backuppath+os_file_sep()+".hashes"+os_file_sep()+FileBackup::convertToOSPathFromFileClient(cfn_short);
 	std::string filepath_old=last_backuppath+os_file_sep()+FileBackup::convertToOSPathFromFileClient(cfn_short);
 
-	std::unique_ptr<IFsFile> file_old(Server->openFile(os_file_prefix(filepath_old), MODE_READ));
+	std::unique_ptr<IFsFile> file_old(BlockDedupStore::openRead(Server->openFile(os_file_prefix(filepath_old), MODE_READ)));
 
 	if(file_old.get()==NULL)
 	{
@@ -1342,7 +1396,7 @@ SPatchDownloadFiles ServerDownloadThread::preparePatchDownloadFiles( const SQueu
 		if(!last_backuppath_complete.empty())
 		{
 			filepath_old=last_backuppath_complete+os_file_sep()+FileBackup::convertToOSPathFromFileClient(cfn_short);
-			file_old.reset(Server->openFile(os_file_prefix(filepath_old), MODE_READ));
+			file_old.reset(BlockDedupStore::openRead(Server->openFile(os_file_prefix(filepath_old), MODE_READ)));
 		}
 		if(file_old.get()==NULL)
 		{
@@ -1394,6 +1448,23 @@ SPatchDownloadFiles ServerDownloadThread::preparePatchDownloadFiles( const SQueu
 		hashfile_old->Seek(0);
 	}
 
+	CdcIndexStore* cdc_index_store = CdcIndexStore::getInstance();
+	if(cdc_index_store!=NULL
+		&& !dlfiles.delete_chunkhashes
+		&& !todl.is_script
+		&& client_main->getProtocolVersions().cdc_version>0
+		&& file_old->Size()>=c_cdc_min_filesize)
+	{
+		FileMetadata old_metadata;
+		std::shared_ptr<std::vector<SCdcChunk> > cdc_index(new std::vector<SCdcChunk>);
+		if(read_metadata(hashfile_old.get(), old_metadata)
+			&& cdc_index_store->load(old_metadata.shahash, file_old->Size(), *cdc_index))
+		{
+			dlfiles.cdc_index = cdc_index;
+		}
+		hashfile_old->Seek(0);
+	}
+
 	dlfiles.orig_file=file_old.release();
 	dlfiles.patchfile=pfd;
 	pfd_delete.release();
@@ -5,6 +5,7 @@
 #include <algorithm>
 #include <assert.h>
 #include <set>
+#include <memory>
 
 #include "../Interface/Mutex.h"
 #include "../Interface/Condition.h"
@@ -54,6 +55,7 @@ namespace
 		IFsFile* hashoutput;
 		std::string hashpath;
 		std::string filepath_old;
+		std::shared_ptr<std::vector<SCdcChunk> > cdc_index;
 	};
 
 	struct SQueueItem
@@ -232,7 +234,8 @@ public:
 	bool isOffline();
 
 	void hashFile(int64 fileid, std::string dstpath, std::string hashpath, IFile *fd, IFile *hashoutput, std::string old_file, int64 t_filesize,
-		const FileMetadata& metadata, bool is_script, std::string sha_dig, IFile* sparse_extents_f, char hashing_method, bool has_snapshot);
+		const FileMetadata& metadata, bool is_script, std::string sha_dig, IFile* sparse_extents_f, char hashing_method, bool has_snapshot,
+		const std::string& cdc_index_fn);
 
 	virtual bool getQueuedFileChunked(std::string& remotefn, IFile*& orig_file, IFile*& patchfile, IFile*& chunkhashes, IFsFile*& hashoutput, _i64& predicted_filesize, int64& file_id, bool& is_script);
 
@@ -270,6 +273,8 @@ private:
 
 	SPatchDownloadFiles preparePatchDownloadFiles(const SQueueItem& todl, bool& full_dl);
 
+	bool useCdcTransfer(const SQueueItem& todl);
+
 	bool start_shadowcopy(std::string path);
 
 	bool stop_shadowcopy(std::string path);
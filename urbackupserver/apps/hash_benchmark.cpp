@@ -0,0 +1,239 @@
+/*************************************************************************
+*    UrBackup - Client/Server backup system
+*    Copyright (C) 2011-2016 Martin Raiber
+*
+*    This program is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU Affero General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU Affero General Public License for more details.
+*
+*    You should have received a copy of the GNU Affero General Public License
+*    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**************************************************************************/
+
+#include "hash_benchmark.h"
+#include "../../Interface/Server.h"
+#include "../../Interface/File.h"
+#include "../../stringtools.h"
+#include "../../md5.h"
+#include "../../common/adler32.h"
+#include "../../urbackupcommon/sha2/sha2.h"
+#include "../../urbackupcommon/chunk_hasher.h"
+#include "../../urbackupcommon/TreeHash.h"
+#include "../../fileservplugin/chunk_settings.h"
+#include <memory>
+#include <vector>
+#include <iostream>
+#include <iomanip>
+
+namespace
+{
+	struct SBenchResult
+	{
+		SBenchResult()
+			: ms(0) {}
+
+		int64 ms;
+		std::string digest;
+	};
+
+	SBenchResult bench_adler32(const std::vector<char>& data)
+	{
+		SBenchResult ret;
+		int64 starttime = Server->getTimeMS();
+		unsigned int combined = urb_adler32(0, NULL, 0);
+		for (size_t pos = 0; pos < data.size(); pos += c_small_hash_dist)
+		{
+			unsigned int tohash = static_cast<unsigned int>((std::min)(data.size() - pos, static_cast<size_t>(c_small_hash_dist)));
+			unsigned int adler = urb_adler32(urb_adler32(0, NULL, 0), data.data() + pos, tohash);
+			combined = urb_adler32_combine(combined, adler, tohash);
+		}
+		ret.ms = Server->getTimeMS() - starttime;
+		ret.digest = convert(combined);
+		return ret;
+	}
+
+	SBenchResult bench_md5(const std::vector<char>& data)
+	{
+		SBenchResult ret;
+		int64 starttime = Server->getTimeMS();
+		MD5 md5;
+		for (size_t pos = 0; pos < data.size(); pos += c_small_hash_dist)
+		{
+			unsigned int tohash = static_cast<unsigned int>((std::min)(data.size() - pos, static_cast<size_t>(c_small_hash_dist)));
+			md5.update(reinterpret_cast<unsigned char*>(const_cast<char*>(data.data() + pos)), tohash);
+		}
+		md5.finalize();
+		ret.ms = Server->getTimeMS() - starttime;
+		ret.digest = bytesToHex(md5.raw_digest_int(), 16);
+		return ret;
+	}
+
+	template<typename T>
+	SBenchResult bench_sha(const std::vector<char>& data)
+	{
+		SBenchResult ret;
+		int64 starttime = Server->getTimeMS();
+		T hashf;
+		for (size_t pos = 0; pos < data.size(); pos += c_checkpoint_dist)
+		{
+			_u32 tohash = static_cast<_u32>((std::min)(data.size() - pos, static_cast<size_t>(c_checkpoint_dist)));
+			hashf.hash(data.data() + pos, tohash);
+		}
+		ret.digest = base64_encode_dash(hashf.finalize());
+		ret.ms = Server->getTimeMS() - starttime;
+		return ret;
+	}
+
+	SBenchResult bench_chunk_hashs(IFile* input, bool with_treehash)
+	{
+		SBenchResult ret;
+
+		std::unique_ptr<IFsFile> hashoutput(Server->openMemoryFile("hash_benchmark_output", false));
+		if (hashoutput.get() == NULL)
+		{
+			Server->Log("Error opening memory file for hash output", LL_ERROR);
+			return ret;
+		}
+
+		TreeHash treehash(NULL);
+		HashSha512 sha512;
+
+		IHashFunc* hashf;
+		if (with_treehash)
+			hashf = &treehash;
+		else
+			hashf = &sha512;
+
+		int64 starttime = Server->getTimeMS();
+		if (!build_chunk_hashs(input, hashoutput.get(), NULL, NULL, false, NULL, NULL, false, hashf))
+		{
+			Server->Log("Error building chunk hashes", LL_ERROR);
+			return ret;
+		}
+		std::string file_hash = hashf->finalize();
+		ret.ms = Server->getTimeMS() - starttime;
+
+		MD5 output_md5;
+		std::vector<char> buf(32768);
+		hashoutput->Seek(0);
+		_u32 read;
+		while ((read = hashoutput->Read(buf.data(), static_cast<_u32>(buf.size()))) > 0)
+		{
+			output_md5.update(reinterpret_cast<unsigned char*>(buf.data()), read);
+		}
+		output_md5.finalize();
+
+		ret.digest = base64_encode_dash(file_hash) + "-" + bytesToHex(output_md5.raw_digest_int(), 16);
+		return ret;
+	}
+
+	std::string format_speed(int64 bytes, int64 ms)
+	{
+		if (ms <= 0)
+		{
+			ms = 1;
+		}
+		return convert(static_cast<int64>(bytes / 1024.0 / 1024.0 / (ms / 1000.0))) + " MB/s";
+	}
+
+	void set_accel(bool enabled)
+	{
+		urb_adler32_set_simd(enabled);
+		sha2_set_accel(enabled);
+	}
+}
+
+/*
+* Compares the portable hash implementations against the runtime-dispatched
+* accelerated ones on the same random data and checks that the digests
+* (including the output of build_chunk_hashs) are identical.
+*
+* MD5 has only one implementation (there is no runtime switch back to the
+* previous code), so it is only benchmarked once and listed separately.
+*/
+int hash_benchmark()
+{
+	init_chunk_hasher();
+
+	int64 size_mb = watoi64(Server->getServerParameter("benchmark_size_mb", "256"));
+	if (size_mb <= 0 || size_mb>=4096)
+	{
+		size_mb = 256;
+	}
+
+	size_t data_size = static_cast<size_t>(size_mb * 1024 * 1024 + 1234);
+
+	Server->Log("Generating " + PrettyPrintBytes(data_size) + " of random data...", LL_INFO);
+
+	std::vector<char> data(data_size);
+	Server->randomFill(data.data(), data.size());
+
+	std::unique_ptr<IMemFile> input(Server->openMemoryFile("hash_benchmark_input", false));
+	if (input.get() == NULL
+		|| input->Write(data.data(), static_cast<_u32>(data.size())) != data.size())
+	{
+		Server->Log("Error writing benchmark data to memory file", LL_ERROR);
+		return 1;
+	}
+
+	const size_t n_benchs = 5;
+	const char* bench_names[n_benchs] = { "adler32 (4KiB blocks)", "sha256", "sha512", "chunk hashes (sha512)", "chunk hashes (treehash)" };
+	SBenchResult results[2][n_benchs];
+	std::string impls[2];
+
+	for (size_t accel = 0; accel < 2; ++accel)
+	{
+		set_accel(accel == 1);
+
+		impls[accel] = std::string("adler32=") + urb_adler32_impl() + " sha256=" + sha256_impl();
+
+		results[accel][0] = bench_adler32(data);
+		results[accel][1] = bench_sha<HashSha256>(data);
+		results[accel][2] = bench_sha<HashSha512>(data);
+		results[accel][3] = bench_chunk_hashs(input.get(), false);
+		results[accel][4] = bench_chunk_hashs(input.get(), true);
+	}
+
+	set_accel(true);
+
+	SBenchResult md5_result = bench_md5(data);
+
+	std::cout << "Baseline:    " << impls[0] << std::endl;
+	std::cout << "Accelerated: " << impls[1] << std::endl;
+	std::cout << std::endl;
+	std::cout << std::left << std::setw(26) << "" << std::setw(14) << "Baseline" << std::setw(14) << "Accelerated" << "Output" << std::endl;
+
+	bool has_mismatch = false;
+	for (size_t i = 0; i < n_benchs; ++i)
+	{
+		bool same = results[0][i].digest == results[1][i].digest;
+		if (!same)
+		{
+			has_mismatch = true;
+		}
+
+		std::cout << std::left << std::setw(26) << bench_names[i]
+			<< std::setw(14) << format_speed(data_size, results[0][i].ms)
+			<< std::setw(14) << format_speed(data_size, results[1][i].ms)
+			<< (same ? "identical" : "MISMATCH") << std::endl;
+	}
+
+	std::cout << std::left << std::setw(26) << "md5 (single implementation)"
+		<< std::setw(14) << "-"
+		<< std::setw(14) << format_speed(data_size, md5_result.ms)
+		<< "-" << std::endl;
+
+	if (has_mismatch)
+	{
+		Server->Log("Accelerated hash output differs from baseline", LL_ERROR);
+		return 2;
+	}
+
+	return 0;
+}
@@ -31,6 +31,8 @@
 #include "server_dir_links.h"
 #include "server_log.h"
 #include "server_status.h"
+#include "BlockDedupStore.h"
+#include <memory>
 
 #ifndef _WIN32
 #include <sys/types.h>
@@ -251,6 +253,27 @@ namespace
 		return ret;
 	}
 
+	//Files replaced by a manifest are copied with their content, because
+	//the block store is not copied to the destination storage
+	bool copy_backup_file(const std::string& src, const std::string& dst, std::string* error_str)
+	{
+		std::unique_ptr<IFile> fsrc(BlockDedupStore::openRead(Server->openFile(src, MODE_READ_SEQUENTIAL)));
+		if (fsrc.get() == NULL)
+		{
+			*error_str = os_last_error_str();
+			return false;
+		}
+
+		std::unique_ptr<IFile> fdst(Server->openFile(dst, MODE_WRITE));
+		if (fdst.get() == NULL)
+		{
+			*error_str = os_last_error_str();
+			return false;
+		}
+
+		return copy_file(fsrc.get(), fdst.get(), error_str);
+	}
+
 	bool copy_filebackup(const std::string& src_folder, const std::string& dst_folder, const std::string& pool_dest, MDB_txn* txn, MDB_dbi dbi, bool ignore_copy_errors)
 	{
 		bool has_error = false;
@@ -372,7 +395,7 @@ namespace
 					std::string hl_source = dst_folder + os_file_sep() + files[i].name;
 
 					std::string error_str;
-					if (!copy_file(os_file_prefix(src_folder + os_file_sep() + files[i].name), os_file_prefix(hl_source), false, &error_str))
+					if (!copy_backup_file(os_file_prefix(src_folder + os_file_sep() + files[i].name), os_file_prefix(hl_source), &error_str))
 					{
 						Server->Log("Error copying file from \"" + src_folder + os_file_sep() + files[i].name + "\" to \"" + dst_folder + os_file_sep() + files[i].name + "\". " + error_str, LL_ERROR);
 						if (!ignore_copy_errors)
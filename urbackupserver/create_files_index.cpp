@@ -252,6 +252,9 @@ void delete_file_index(void)
 {
 	Server->deleteFile("urbackup/fileindex/backup_server_files_index.lmdb");
 	Server->deleteFile("urbackup/fileindex/backup_server_files_index.lmdb-lock");
+	//Index is recreated from the database, so pending changes are obsolete
+	Server->deleteFile("urbackup/fileindex/backup_server_files_index.journal1");
+	Server->deleteFile("urbackup/fileindex/backup_server_files_index.journal2");
 }
 
 bool create_files_index(SStartupStatus& status)
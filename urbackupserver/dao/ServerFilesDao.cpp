@@ -18,6 +18,7 @@
 
 #include "ServerFilesDao.h"
 #include "../../stringtools.h"
+#include "../../Interface/DatabaseCursor.h"
 #include <assert.h>
 #include <string.h>
 
@@ -148,14 +149,15 @@ ServerFilesDao::CondInt64 ServerFilesDao::getPointedTo(int64 id)
 		q_getPointedTo=db->Prepare("SELECT pointed_to FROM files WHERE id=?", false);
 	}
 	q_getPointedTo->Bind(id);
-	db_results res=q_getPointedTo->Read();
-	q_getPointedTo->Reset();
+	IDatabaseCursor* cur=q_getPointedTo->Cursor();
 	CondInt64 ret = { false, 0 };
-	if(!res.empty())
+	if(cur->nextRow())
 	{
 		ret.exists=true;
-		ret.value=watoi64(res[0]["pointed_to"]);
+		ret.value=cur->getInt64(0);
 	}
+	cur->shutdown();
+	q_getPointedTo->Reset();
 	return ret;
 }
 
@@ -191,25 +193,26 @@ ServerFilesDao::SFindFileEntry ServerFilesDao::getFileEntry(int64 id)
 		q_getFileEntry=db->Prepare("SELECT id, shahash, backupid, clientid, fullpath, hashpath, filesize, next_entry, prev_entry, rsize, incremental, pointed_to FROM files WHERE id=?", false);
 	}
 	q_getFileEntry->Bind(id);
-	db_results res=q_getFileEntry->Read();
-	q_getFileEntry->Reset();
+	IDatabaseCursor* cur=q_getFileEntry->Cursor();
 	SFindFileEntry ret = { false, 0, "", 0, 0, "", "", 0, 0, 0, 0, 0, 0 };
-	if(!res.empty())
+	if(cur->nextRow())
 	{
 		ret.exists=true;
-		ret.id=watoi64(res[0]["id"]);
-		ret.shahash=res[0]["shahash"];
-		ret.backupid=watoi(res[0]["backupid"]);
-		ret.clientid=watoi(res[0]["clientid"]);
-		ret.fullpath=res[0]["fullpath"];
-		ret.hashpath=res[0]["hashpath"];
-		ret.filesize=watoi64(res[0]["filesize"]);
-		ret.next_entry=watoi64(res[0]["next_entry"]);
-		ret.prev_entry=watoi64(res[0]["prev_entry"]);
-		ret.rsize=watoi64(res[0]["rsize"]);
-		ret.incremental=watoi(res[0]["incremental"]);
-		ret.pointed_to=watoi(res[0]["pointed_to"]);
-	}
+		ret.id=cur->getInt64(0);
+		ret.shahash=cur->getString(1);
+		ret.backupid=cur->getInt(2);
+		ret.clientid=cur->getInt(3);
+		ret.fullpath=cur->getString(4);
+		ret.hashpath=cur->getString(5);
+		ret.filesize=cur->getInt64(6);
+		ret.next_entry=cur->getInt64(7);
+		ret.prev_entry=cur->getInt64(8);
+		ret.rsize=cur->getInt64(9);
+		ret.incremental=cur->getInt(10);
+		ret.pointed_to=cur->getInt(11);
+	}
+	cur->shutdown();
+	q_getFileEntry->Reset();
 	return ret;
 }
 
@@ -228,21 +231,22 @@ ServerFilesDao::SStatFileEntry ServerFilesDao::getStatFileEntry(int64 id)
 		q_getStatFileEntry=db->Prepare("SELECT id, backupid, clientid, filesize, rsize, shahash, next_entry, prev_entry FROM files WHERE id=?", false);
 	}
 	q_getStatFileEntry->Bind(id);
-	db_results res=q_getStatFileEntry->Read();
-	q_getStatFileEntry->Reset();
+	IDatabaseCursor* cur=q_getStatFileEntry->Cursor();
 	SStatFileEntry ret = { false, 0, 0, 0, 0, 0, "", 0, 0 };
-	if(!res.empty())
+	if(cur->nextRow())
 	{
 		ret.exists=true;
-		ret.id=watoi64(res[0]["id"]);
-		ret.backupid=watoi(res[0]["backupid"]);
-		ret.clientid=watoi(res[0]["clientid"]);
-		ret.filesize=watoi64(res[0]["filesize"]);
-		ret.rsize=watoi64(res[0]["rsize"]);
-		ret.shahash=res[0]["shahash"];
-		ret.next_entry=watoi64(res[0]["next_entry"]);
-		ret.prev_entry=watoi64(res[0]["prev_entry"]);
-	}
+		ret.id=cur->getInt64(0);
+		ret.backupid=cur->getInt(1);
+		ret.clientid=cur->getInt(2);
+		ret.filesize=cur->getInt64(3);
+		ret.rsize=cur->getInt64(4);
+		ret.shahash=cur->getString(5);
+		ret.next_entry=cur->getInt64(6);
+		ret.prev_entry=cur->getInt64(7);
+	}
+	cur->shutdown();
+	q_getStatFileEntry->Reset();
 	return ret;
 }
 
@@ -370,14 +374,15 @@ ServerFilesDao::CondInt64 ServerFilesDao::lookupEntryIdByPath(const std::string&
 		q_lookupEntryIdByPath=db->Prepare("SELECT entryid FROM files_cont_path_lookup WHERE fullpath=?", false);
 	}
 	q_lookupEntryIdByPath->Bind(fullpath);
-	db_results res=q_lookupEntryIdByPath->Read();
-	q_lookupEntryIdByPath->Reset();
+	IDatabaseCursor* cur=q_lookupEntryIdByPath->Cursor();
 	CondInt64 ret = { false, 0 };
-	if(!res.empty())
+	if(cur->nextRow())
 	{
 		ret.exists=true;
-		ret.value=watoi64(res[0]["entryid"]);
+		ret.value=cur->getInt64(0);
 	}
+	cur->shutdown();
+	q_lookupEntryIdByPath->Reset();
 	return ret;
 }
 
@@ -418,13 +423,14 @@ ServerFilesDao::CondInt64 ServerFilesDao::getIncomingStatsCount(void)
 	{
 		q_getIncomingStatsCount=db->Prepare("SELECT COUNT(*) AS c FROM files_incoming_stat", false);
 	}
-	db_results res=q_getIncomingStatsCount->Read();
+	IDatabaseCursor* cur=q_getIncomingStatsCount->Cursor();
 	CondInt64 ret = { false, 0 };
-	if(!res.empty())
+	if(cur->nextRow())
 	{
 		ret.exists=true;
-		ret.value=watoi64(res[0]["c"]);
+		ret.value=cur->getInt64(0);
 	}
+	cur->shutdown();
 	return ret;
 }
 
@@ -459,19 +465,21 @@ std::vector<ServerFilesDao::SIncomingStat> ServerFilesDao::getIncomingStats(void
 	{
 		q_getIncomingStats=db->Prepare("SELECT id, filesize, clientid, backupid, existing_clients, direction, incremental FROM files_incoming_stat LIMIT 10000", false);
 	}
-	db_results res=q_getIncomingStats->Read();
+	IDatabaseCursor* cur=q_getIncomingStats->Cursor();
 	std::vector<ServerFilesDao::SIncomingStat> ret;
-	ret.resize(res.size());
-	for(size_t i=0;i<res.size();++i)
-	{
-		ret[i].id=watoi64(res[i]["id"]);
-		ret[i].filesize=watoi64(res[i]["filesize"]);
-		ret[i].clientid=watoi(res[i]["clientid"]);
-		ret[i].backupid=watoi(res[i]["backupid"]);
-		ret[i].existing_clients=res[i]["existing_clients"];
-		ret[i].direction=watoi(res[i]["direction"]);
-		ret[i].incremental=watoi(res[i]["incremental"]);
-	}
+	while(cur->nextRow())
+	{
+		ret.push_back(ServerFilesDao::SIncomingStat());
+		ServerFilesDao::SIncomingStat& row=ret.back();
+		row.id=cur->getInt64(0);
+		row.filesize=cur->getInt64(1);
+		row.clientid=cur->getInt(2);
+		row.backupid=cur->getInt(3);
+		row.existing_clients=cur->getString(4);
+		row.direction=cur->getInt(5);
+		row.incremental=cur->getInt(6);
+	}
+	cur->shutdown();
 	return ret;
 }
 
@@ -492,6 +500,24 @@ void ServerFilesDao::deleteFiles(int backupid)
 	q_deleteFiles->Reset();
 }
 
+/**
+* @-SQLGenAccess
+* @func void ServerFilesDao::deleteFilesUpTo
+* @sql
+*	DELETE FROM files WHERE backupid=:backupid(int) AND id<=:max_id(int64)
+*/
+void ServerFilesDao::deleteFilesUpTo(int backupid, int64 max_id)
+{
+	if(q_deleteFilesUpTo==NULL)
+	{
+		q_deleteFilesUpTo=db->Prepare("DELETE FROM files WHERE backupid=? AND id<=?", false);
+	}
+	q_deleteFilesUpTo->Bind(backupid);
+	q_deleteFilesUpTo->Bind(max_id);
+	q_deleteFilesUpTo->Write();
+	q_deleteFilesUpTo->Reset();
+}
+
 /**
 * @-SQLGenAccess
 * @func void ServerFilesDao::removeDanglingFiles
@@ -605,17 +631,18 @@ ServerFilesDao::SFileEntry ServerFilesDao::getFileEntryFromTemporaryTable(const
 		q_getFileEntryFromTemporaryTable=db->Prepare("SELECT fullpath, hashpath, shahash, filesize FROM files_last WHERE fullpath = ?", false);
 	}
 	q_getFileEntryFromTemporaryTable->Bind(fullpath);
-	db_results res=q_getFileEntryFromTemporaryTable->Read();
-	q_getFileEntryFromTemporaryTable->Reset();
+	IDatabaseCursor* cur=q_getFileEntryFromTemporaryTable->Cursor();
 	SFileEntry ret = { false, "", "", "", 0 };
-	if(!res.empty())
+	if(cur->nextRow())
 	{
 		ret.exists=true;
-		ret.fullpath=res[0]["fullpath"];
-		ret.hashpath=res[0]["hashpath"];
-		ret.shahash=res[0]["shahash"];
-		ret.filesize=watoi64(res[0]["filesize"]);
+		ret.fullpath=cur->getString(0);
+		ret.hashpath=cur->getString(1);
+		ret.shahash=cur->getString(2);
+		ret.filesize=cur->getInt64(3);
 	}
+	cur->shutdown();
+	q_getFileEntryFromTemporaryTable->Reset();
 	return ret;
 }
 
@@ -635,18 +662,20 @@ std::vector<ServerFilesDao::SFileEntry> ServerFilesDao::getFileEntriesFromTempor
 		q_getFileEntriesFromTemporaryTableGlob=db->Prepare("SELECT fullpath, hashpath, shahash, filesize FROM files_last WHERE fullpath GLOB ?", false);
 	}
 	q_getFileEntriesFromTemporaryTableGlob->Bind(fullpath_glob);
-	db_results res=q_getFileEntriesFromTemporaryTableGlob->Read();
-	q_getFileEntriesFromTemporaryTableGlob->Reset();
+	IDatabaseCursor* cur=q_getFileEntriesFromTemporaryTableGlob->Cursor();
 	std::vector<ServerFilesDao::SFileEntry> ret;
-	ret.resize(res.size());
-	for(size_t i=0;i<res.size();++i)
+	while(cur->nextRow())
 	{
-		ret[i].exists=true;
-		ret[i].fullpath=res[i]["fullpath"];
-		ret[i].hashpath=res[i]["hashpath"];
-		ret[i].shahash=res[i]["shahash"];
-		ret[i].filesize=watoi64(res[i]["filesize"]);
+		ret.push_back(ServerFilesDao::SFileEntry());
+		ServerFilesDao::SFileEntry& row=ret.back();
+		row.exists=true;
+		row.fullpath=cur->getString(0);
+		row.hashpath=cur->getString(1);
+		row.shahash=cur->getString(2);
+		row.filesize=cur->getInt64(3);
 	}
+	cur->shutdown();
+	q_getFileEntriesFromTemporaryTableGlob->Reset();
 	return ret;
 }
 
@@ -664,15 +693,16 @@ ServerFilesDao::SBackupIdMinMax ServerFilesDao::getBackupIdMinMax(int backupid)
 		q_getBackupIdMinMax=db->Prepare("SELECT MIN(id) AS tmin, MAX(id) AS tmax FROM files WHERE backupid=?", false);
 	}
 	q_getBackupIdMinMax->Bind(backupid);
-	db_results res=q_getBackupIdMinMax->Read();
-	q_getBackupIdMinMax->Reset();
+	IDatabaseCursor* cur=q_getBackupIdMinMax->Cursor();
 	SBackupIdMinMax ret = { false, 0, 0 };
-	if(!res.empty())
+	if(cur->nextRow())
 	{
 		ret.exists=true;
-		ret.tmin=watoi64(res[0]["tmin"]);
-		ret.tmax=watoi64(res[0]["tmax"]);
+		ret.tmin=cur->getInt64(0);
+		ret.tmax=cur->getInt64(1);
 	}
+	cur->shutdown();
+	q_getBackupIdMinMax->Reset();
 	return ret;
 }
 
@@ -698,6 +728,7 @@ void ServerFilesDao::prepareQueries()
 	q_delIncomingStatEntry=NULL;
 	q_getIncomingStats=NULL;
 	q_deleteFiles=NULL;
+	q_deleteFilesUpTo=NULL;
 	q_removeDanglingFiles=NULL;
 	q_createTemporaryLastFilesTable=NULL;
 	q_dropTemporaryLastFilesTable=NULL;
@@ -731,6 +762,7 @@ void ServerFilesDao::destroyQueries()
 	db->destroyQuery(q_delIncomingStatEntry);
 	db->destroyQuery(q_getIncomingStats);
 	db->destroyQuery(q_deleteFiles);
+	db->destroyQuery(q_deleteFilesUpTo);
 	db->destroyQuery(q_removeDanglingFiles);
 	db->destroyQuery(q_createTemporaryLastFilesTable);
 	db->destroyQuery(q_dropTemporaryLastFilesTable);
@@ -18,6 +18,7 @@
 
 #include "ServerLinkDao.h"
 #include "../../stringtools.h"
+#include "../../Interface/DatabaseCursor.h"
 #include <assert.h>
 #include <string.h>
 
@@ -152,10 +153,19 @@ int ServerLinkDao::getDirectoryRefcount(int clientid, const std::string& name)
 	}
 	q_getDirectoryRefcount->Bind(clientid);
 	q_getDirectoryRefcount->Bind(name);
-	db_results res=q_getDirectoryRefcount->Read();
+	IDatabaseCursor* cur=q_getDirectoryRefcount->Cursor();
+	int ret=0;
+	if(cur->nextRow())
+	{
+		ret=cur->getInt(0);
+	}
+	else
+	{
+		assert(false);
+	}
+	cur->shutdown();
 	q_getDirectoryRefcount->Reset();
-	assert(!res.empty());
-	return watoi(res[0]["c"]);
+	return ret;
 }
 
 /**
@@ -178,10 +188,19 @@ int ServerLinkDao::getDirectoryRefcountWithTarget(int clientid, const std::strin
 	q_getDirectoryRefcountWithTarget->Bind(clientid);
 	q_getDirectoryRefcountWithTarget->Bind(name);
 	q_getDirectoryRefcountWithTarget->Bind(target);
-	db_results res=q_getDirectoryRefcountWithTarget->Read();
+	IDatabaseCursor* cur=q_getDirectoryRefcountWithTarget->Cursor();
+	int ret=0;
+	if(cur->nextRow())
+	{
+		ret=cur->getInt(0);
+	}
+	else
+	{
+		assert(false);
+	}
+	cur->shutdown();
 	q_getDirectoryRefcountWithTarget->Reset();
-	assert(!res.empty());
-	return watoi(res[0]["c"]);
+	return ret;
 }
 
 /**
@@ -201,15 +220,17 @@ std::vector<ServerLinkDao::DirectoryLinkEntry> ServerLinkDao::getLinksInDirector
 	}
 	q_getLinksInDirectory->Bind(clientid);
 	q_getLinksInDirectory->Bind(dir);
-	db_results res=q_getLinksInDirectory->Read();
-	q_getLinksInDirectory->Reset();
+	IDatabaseCursor* cur=q_getLinksInDirectory->Cursor();
 	std::vector<ServerLinkDao::DirectoryLinkEntry> ret;
-	ret.resize(res.size());
-	for(size_t i=0;i<res.size();++i)
+	while(cur->nextRow())
 	{
-		ret[i].name=res[i]["name"];
-		ret[i].target=res[i]["target"];
+		ret.push_back(ServerLinkDao::DirectoryLinkEntry());
+		ServerLinkDao::DirectoryLinkEntry& row=ret.back();
+		row.name=cur->getString(0);
+		row.target=cur->getString(1);
 	}
+	cur->shutdown();
+	q_getLinksInDirectory->Reset();
 	return ret;
 }
 
@@ -230,15 +251,17 @@ std::vector<ServerLinkDao::DirectoryLinkEntry> ServerLinkDao::getLinksByPoolName
 	}
 	q_getLinksByPoolName->Bind(clientid);
 	q_getLinksByPoolName->Bind(name);
-	db_results res=q_getLinksByPoolName->Read();
-	q_getLinksByPoolName->Reset();
+	IDatabaseCursor* cur=q_getLinksByPoolName->Cursor();
 	std::vector<ServerLinkDao::DirectoryLinkEntry> ret;
-	ret.resize(res.size());
-	for(size_t i=0;i<res.size();++i)
+	while(cur->nextRow())
 	{
-		ret[i].name=res[i]["name"];
-		ret[i].target=res[i]["target"];
+		ret.push_back(ServerLinkDao::DirectoryLinkEntry());
+		ServerLinkDao::DirectoryLinkEntry& row=ret.back();
+		row.name=cur->getString(0);
+		row.target=cur->getString(1);
 	}
+	cur->shutdown();
+	q_getLinksByPoolName->Reset();
 	return ret;
 }
 
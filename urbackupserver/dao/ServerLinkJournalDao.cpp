@@ -19,6 +19,7 @@
 
 #include "ServerLinkJournalDao.h"
 #include "../../stringtools.h"
+#include "../../Interface/DatabaseCursor.h"
 #include <assert.h>
 #include <string.h>
 
@@ -83,14 +84,16 @@ std::vector<ServerLinkJournalDao::JournalEntry> ServerLinkJournalDao::getDirecto
 	{
 		q_getDirectoryLinkJournalEntries=db->Prepare("SELECT linkname, linktarget FROM directory_link_journal", false);
 	}
-	db_results res=q_getDirectoryLinkJournalEntries->Read();
+	IDatabaseCursor* cur=q_getDirectoryLinkJournalEntries->Cursor();
 	std::vector<ServerLinkJournalDao::JournalEntry> ret;
-	ret.resize(res.size());
-	for(size_t i=0;i<res.size();++i)
+	while(cur->nextRow())
 	{
-		ret[i].linkname=res[i]["linkname"];
-		ret[i].linktarget=res[i]["linktarget"];
+		ret.push_back(ServerLinkJournalDao::JournalEntry());
+		ServerLinkJournalDao::JournalEntry& row=ret.back();
+		row.linkname=cur->getString(0);
+		row.linktarget=cur->getString(1);
 	}
+	cur->shutdown();
 	return ret;
 }
 
@@ -8,5 +8,6 @@ const DATABASE_ID URBACKUPDB_SERVER_LINKS = 24;
 const DATABASE_ID URBACKUPDB_SERVER_LINK_JOURNAL = 25;
 const DATABASE_ID URBACKUPDB_SERVER_SETTINGS=30;
 const DATABASE_ID URBACKUPDB_SERVER_FILES_NEW = 26;
+const DATABASE_ID URBACKUPDB_SERVER_BLOCKS = 32;
 
 #endif //DATABASE_H
\ No newline at end of file
@@ -81,6 +81,7 @@ SStartupStatus startup_status;
 #include "apps/export_auth_log.h"
 #include "apps/skiphash_copy.h"
 #include "apps/patch.h"
+#include "apps/hash_benchmark.h"
 #include "create_files_index.h"
 #include "server_dir_links.h"
 #include "server_channel.h"
@@ -101,6 +102,9 @@ SStartupStatus startup_status;
 #include "../urbackupcommon/chunk_hasher.h"
 #include "LogReport.h"
 #include "WebSocketConnector.h"
+#include "BlockDedupStore.h"
+#include "CdcIndexStore.h"
+#include "FileManifest.h"
 
 #define MINIZ_NO_ZLIB_COMPATIBLE_NAMES
 #include "../common/miniz.h"
@@ -461,6 +465,7 @@ DLLEXPORT void LoadActions(IServer* pServer)
 	ServerLogger::init_mutex();
 	init_dir_link_mutex();
 	WalCheckpointThread::init_mutex();
+	FileManifest::init_mutex();
 
 	std::string app=Server->getServerParameter("app", "");
 
@@ -529,10 +534,14 @@ DLLEXPORT void LoadActions(IServer* pServer)
 		{
 			rc = blockalign();
 		}
+		else if (app == "hash_benchmark")
+		{
+			rc = hash_benchmark();
+		}
 		else
 		{
 			rc=100;
-			Server->Log("App not found. Available apps: cleanup, remove_unknown, cleanup_database, repair_database, defrag_database, export_auth_log, check_fileindex, skiphash_copy, md5sum_check, hash, blockalign");
+			Server->Log("App not found. Available apps: cleanup, remove_unknown, cleanup_database, repair_database, defrag_database, export_auth_log, check_fileindex, skiphash_copy, md5sum_check, hash, blockalign, hash_benchmark");
 		}
 		exit(rc);
 	}
@@ -667,9 +676,20 @@ DLLEXPORT void LoadActions(IServer* pServer)
 	ClientMain::init_mutex();
 	DataplanDb::init();
 	init_log_report();
+	FileManifest::removeTemporaryFiles();
 	ServerChannelThread::init_mutex();
 
 	open_settings_database();
+
+	{
+		IDatabase *db=Server->getDatabase(Server->getThreadID(), URBACKUPDB_SERVER);
+		db_results res=db->Read("SELECT value FROM settings_db.settings WHERE key='backupfolder' AND clientid=0");
+		if(!res.empty() && !res[0]["value"].empty())
+		{
+			BlockDedupStore::init(res[0]["value"], Server->getServerParameter("block_dedup_store")=="true", fileserv);
+			CdcIndexStore::init(res[0]["value"]);
+		}
+	}
 	
 	std::string arg_verify_hashes=Server->getServerParameter("verify_hashes");
 	if(!arg_verify_hashes.empty())
@@ -839,6 +859,7 @@ DLLEXPORT void LoadActions(IServer* pServer)
 	ADD_ACTION(scripts);
 	ADD_ACTION(status_check);
 	ADD_ACTION(restore_image);
+	ADD_ACTION(metrics);
 
 	if(Server->getServerParameter("allow_shutdown")=="true")
 	{
@@ -917,6 +938,17 @@ DLLEXPORT void LoadActions(IServer* pServer)
 	}
 
 	init_chunk_hasher();
+
+	std::string chunk_hash_threads = Server->getServerParameter("chunk_hash_threads");
+	if (!chunk_hash_threads.empty())
+	{
+		set_chunk_hasher_threads(watoi(chunk_hash_threads));
+	}
+	else
+	{
+		set_chunk_hasher_threads((std::min)(os_get_num_cpus(), static_cast<size_t>(4)));
+	}
+
 	ServerCleanupThread::initMutex();
 	ServerAutomaticArchive::initMutex();
 	ServerCleanupThread *server_cleanup=new ServerCleanupThread(CleanupAction());
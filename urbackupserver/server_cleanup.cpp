@@ -47,6 +47,11 @@
 #include "../clouddrive/IClouddriveFactory.h"
 #include "../urbackupcommon/backup_url_parser.h"
 #include "copy_storage.h"
+#include "BlockDedupStore.h"
+#include "CdcIndexStore.h"
+#include "BackupDeletion.h"
+#include "server_metrics.h"
+#include "FileManifest.h"
 #include <assert.h>
 #include <set>
 
@@ -73,6 +78,7 @@ void ServerCleanupThread::initMutex(void)
 	cond=Server->createCondition();
 	a_mutex=Server->createMutex();
 	cleanup_lock_mutex = Server->createMutex();
+	BackupDeletion::init_mutex();
 }
 
 void ServerCleanupThread::destroyMutex(void)
@@ -81,6 +87,7 @@ void ServerCleanupThread::destroyMutex(void)
 	Server->destroy(cond);
 	Server->destroy(a_mutex);
 	Server->destroy(cleanup_lock_mutex);
+	BackupDeletion::destroy_mutex();
 }
 
 ServerCleanupThread::ServerCleanupThread(CleanupAction cleanup_action)
@@ -771,6 +778,16 @@ void ServerCleanupThread::do_remove_unknown(void)
 
 	files_db->Write("DROP TABLE backups");
 
+	std::vector<int> manifest_backupids = FileManifest::getBackupIds();
+	for (size_t i = 0; i < manifest_backupids.size(); ++i)
+	{
+		if (!cleanupdao->getFileBackupClientId(manifest_backupids[i]).exists)
+		{
+			Server->Log("Removing dangling file manifest of backup " + convert(manifest_backupids[i]), LL_INFO);
+			FileManifest::removeBackup(manifest_backupids[i], *filesdao);
+		}
+	}
+
 	FileIndex::flush();
 }
 
@@ -824,25 +841,46 @@ bool ServerCleanupThread::deleteImage(logid_t logid, std::string clientname, std
 	if (image_extension != "raw"
 		|| !BackupServer::isImageSnapshotsEnabled())
 	{
+		std::vector<std::string> image_files;
+		image_files.push_back(path);
+		image_files.push_back(path + ".hash");
+		image_files.push_back(path + ".mbr");
+		image_files.push_back(path + ".cbitmap");
+		image_files.push_back(path + ".sync");
+		image_files.push_back(path + ".bitmap");
+
+		//Unlinking large images takes a while on some file systems, so remove the image and its hash file concurrently.
+		//Files that could not be removed are truncated below
+		std::vector<char> removed(image_files.size(), 0);
+		if (BackupDeletion::isEnabled())
+		{
+			BackupDeletion deletion(logid, 0);
+			deletion.removeFiles(image_files, removed);
+		}
+
 		bool b = true;
-		if (!deleteAndTruncateFile(logid, path))
+		if (!removed[0] && !deleteAndTruncateFile(logid, path))
 		{
 			b = false;
 		}
-		if (!deleteAndTruncateFile(logid, path + ".hash"))
+		if (!removed[1] && !deleteAndTruncateFile(logid, path + ".hash"))
 		{
 			b = false;
 		}
-		if (!deleteAndTruncateFile(logid, path + ".mbr"))
+		if (!removed[2] && !deleteAndTruncateFile(logid, path + ".mbr"))
 		{
 			if (os_get_file_type(os_file_prefix(path + ".mbr")) & EFileType_File)
 			{
 				b = false;
 			}
 		}
-		deleteAndTruncateFile(logid, path + ".cbitmap");
-		deleteAndTruncateFile(logid, path + ".sync");
-		deleteAndTruncateFile(logid, path + ".bitmap");
+		for (size_t i = 3; i < image_files.size(); ++i)
+		{
+			if (!removed[i])
+			{
+				deleteAndTruncateFile(logid, image_files[i]);
+			}
+		}
 
 		if (b && ExtractFileName(ExtractFilePath(path)) != clientname)
 		{
@@ -1605,7 +1643,7 @@ bool ServerCleanupThread::deleteFileBackup(const std::string &backupfolder, int
 		{
 			ServerLinkDao link_dao(Server->getDatabase(Server->getThreadID(), URBACKUPDB_SERVER_LINKS));
 
-			b=remove_directory_link_dir(path, link_dao, clientid);
+			b=removeBackupDir(path, link_dao, clientid);
 
 			if(!b && SnapshotHelper::isSubvolume(false, clientname, backuppath) )
 			{
@@ -1627,7 +1665,7 @@ bool ServerCleanupThread::deleteFileBackup(const std::string &backupfolder, int
 	{
 		ServerLinkDao link_dao(Server->getDatabase(Server->getThreadID(), URBACKUPDB_SERVER_LINKS));
 
-		b=remove_directory_link_dir(path, link_dao, clientid);
+		b=removeBackupDir(path, link_dao, clientid);
 	}
 
 	bool del=true;
@@ -1667,6 +1705,28 @@ bool ServerCleanupThread::deleteFileBackup(const std::string &backupfolder, int
 	return !err;
 }
 
+bool ServerCleanupThread::removeBackupDir(const std::string& path, ServerLinkDao& link_dao, int clientid)
+{
+	if (BackupDeletion::isEnabled())
+	{
+		BackupDeletion deletion(logid, clientid);
+		if (deletion.removeTree(path, link_dao))
+		{
+			return true;
+		}
+
+		if (deletion.isAborted())
+		{
+			ServerLogger::Log(logid, "Deleting \"" + path + "\" was interrupted. Continuing with next cleanup.", LL_WARNING);
+			return false;
+		}
+
+		ServerLogger::Log(logid, "Deleting \"" + path + "\" with multiple threads failed. Retrying with one thread...", LL_WARNING);
+	}
+
+	return remove_directory_link_dir(path, link_dao, clientid);
+}
+
 void ServerCleanupThread::removeClient(int clientid)
 {
 	std::string clientname=cleanupdao->getClientName(clientid).value;
@@ -2014,6 +2074,7 @@ void ServerCleanupThread::doQuit(void)
 {
 	do_quit=true;
 	cond->notify_all();
+	BackupDeletion::doQuit();
 }
 
 void ServerCleanupThread::lockImageFromCleanup(int backupid)
@@ -2637,12 +2698,29 @@ void ServerCleanupThread::cleanup_other()
 		"AND (strftime('%s', b.created)-strftime('%s', a.created)) > 15552000));");
 	ServerLogger::Log(logid, "Done cleaning up old client access tokens.", LL_INFO);
 
+	BlockDedupStore* block_store = BlockDedupStore::getInstance();
+	if (block_store != NULL)
+	{
+		ServerLogger::Log(logid, "Removing unreferenced blocks from block store...", LL_INFO);
+		block_store->removeUnreferencedBlocks();
+		BlockDedupStore::SStats stats = block_store->getStats();
+		ServerLogger::Log(logid, "Done removing unreferenced blocks. Block store has " + convert(stats.n_blocks) + " blocks using "
+			+ PrettyPrintBytes(stats.stored_bytes) + " for " + PrettyPrintBytes(stats.referenced_bytes) + " of file data.", LL_INFO);
+	}
+
+	CdcIndexStore* cdc_index_store = CdcIndexStore::getInstance();
+	if (cdc_index_store != NULL)
+	{
+		ServerLogger::Log(logid, "Removing unused chunk indexes...", LL_INFO);
+		cdc_index_store->removeUnused();
+		ServerLogger::Log(logid, "Done removing unused chunk indexes.", LL_INFO);
+	}
+
 }
 
 void ServerCleanupThread::removeFileBackupSql( int backupid )
 {
 	DBScopedSynchronous synchronous_files(filesdao->getDatabase());
-	filesdao->BeginWriteTransaction();
 
 	BackupServerHash::SInMemCorrection correction;
 
@@ -2651,102 +2729,179 @@ void ServerCleanupThread::removeFileBackupSql( int backupid )
 	correction.max_correct = minmax.tmax;
 	correction.min_correct = minmax.tmin;
 
-	IQuery* q_iterate = filesdao->getDatabase()->Prepare("SELECT id, shahash, filesize, rsize, clientid, backupid, incremental, next_entry, prev_entry, pointed_to FROM files WHERE backupid=?", false);
-	q_iterate->Bind(backupid);
-	IDatabaseCursor* cursor = q_iterate->Cursor();
+	//Entries are removed in batches of one transaction each, so other threads can write to the files database in between.
+	//Corrections and removed entries are written at the end of each batch, so an interrupted removal can be continued
+	size_t batch_size = BackupDeletion::getSqlBatchSize();
 
-	bool modified_file_entry_index = false;
+	std::string iterate_sql = "SELECT id, shahash, filesize, rsize, clientid, backupid, incremental, next_entry, prev_entry, pointed_to FROM files WHERE backupid=? AND id>? ORDER BY id";
+	if (batch_size > 0)
+	{
+		iterate_sql += " LIMIT ?";
+	}
 
-	db_single_result res;
-	while(cursor->next(res))
+	IQuery* q_iterate = filesdao->getDatabase()->Prepare(iterate_sql, false);
+
+	int64 last_id = minmax.tmin - 1;
+	int64 removed_entries = 0;
+	int64 starttime = Server->getTimeMS();
+	int64 last_log = starttime;
+
+	while (true)
 	{
-		int64 id = watoi64(res["id"]);
+		filesdao->BeginWriteTransaction();
+
+		q_iterate->Bind(backupid);
+		q_iterate->Bind(last_id);
+		if (batch_size > 0)
+		{
+			q_iterate->Bind(batch_size);
+		}
+		IDatabaseCursor* cursor = q_iterate->Cursor();
 
-		int64 filesize = watoi64(res["filesize"]);
-		int64 rsize = watoi64(res["rsize"]);
-		int clientid = watoi(res["clientid"]);
-		int backupid = watoi(res["backupid"]);
-		int incremental = watoi(res["incremental"]);
-		int64 next_entry = watoi64(res["next_entry"]);
-		int64 prev_entry = watoi64(res["prev_entry"]);
-		int pointed_to = watoi(res["pointed_to"]);
+		bool modified_file_entry_index = false;
+		size_t batch_entries = 0;
 
-		std::map<int64, int64>::iterator it_next = correction.next_entries.find(id);
-		if (it_next != correction.next_entries.end())
+		db_single_result res;
+		while(cursor->next(res))
 		{
-			if (it_next->second != next_entry)
+			int64 id = watoi64(res["id"]);
+
+			int64 filesize = watoi64(res["filesize"]);
+			int64 rsize = watoi64(res["rsize"]);
+			int clientid = watoi(res["clientid"]);
+			int backupid = watoi(res["backupid"]);
+			int incremental = watoi(res["incremental"]);
+			int64 next_entry = watoi64(res["next_entry"]);
+			int64 prev_entry = watoi64(res["prev_entry"]);
+			int pointed_to = watoi(res["pointed_to"]);
+
+			last_id = id;
+			++batch_entries;
+
+			std::map<int64, int64>::iterator it_next = correction.next_entries.find(id);
+			if (it_next != correction.next_entries.end())
+			{
+				if (it_next->second != next_entry)
+				{
+					int abc = 5;
+				}
+
+				next_entry = it_next->second;
+
+				correction.next_entries.erase(it_next);
+			}
+
+			std::map<int64, int64>::iterator it_prev= correction.prev_entries.find(id);
+			if (it_prev != correction.prev_entries.end())
 			{
-				int abc = 5;
+				if (it_prev->second != prev_entry)
+				{
+					int abc = 5;
+				}
+
+				prev_entry = it_prev->second;
+
+				correction.prev_entries.erase(it_prev);
 			}
 
-			next_entry = it_next->second;
+			std::map<int64, int>::iterator it_pointed_to = correction.pointed_to.find(id);
+			if (it_pointed_to != correction.pointed_to.end())
+			{
+				if (it_pointed_to->second != pointed_to)
+				{
+					int abc = 5;
+				}
 
-			correction.next_entries.erase(it_next);
-		}
+				pointed_to = it_pointed_to->second;
 
-		std::map<int64, int64>::iterator it_prev= correction.prev_entries.find(id);
-		if (it_prev != correction.prev_entries.end())
-		{
-			if (it_prev->second != prev_entry)
+				correction.pointed_to.erase(it_pointed_to);
+			}
+
+			if (pointed_to)
 			{
-				int abc = 5;
+				modified_file_entry_index = true;
 			}
 
-			prev_entry = it_prev->second;
+			BackupServerHash::deleteFileSQL(*filesdao, *fileindex.get(), res["shahash"].c_str(),
+				filesize, rsize, clientid, backupid, incremental, id, prev_entry, next_entry, pointed_to, false, false, false, true, &correction);
+		}
+		q_iterate->Reset();
 
-			correction.prev_entries.erase(it_prev);
+		for (std::map<int64, int64>::iterator it_next = correction.next_entries.begin();
+			 it_next != correction.next_entries.end(); ++it_next)
+		{
+			filesdao->setNextEntry(it_next->second, it_next->first);
 		}
 
-		std::map<int64, int>::iterator it_pointed_to = correction.pointed_to.find(id);
-		if (it_pointed_to != correction.pointed_to.end())
+		for (std::map<int64, int64>::iterator it_prev = correction.prev_entries.begin();
+			 it_prev != correction.prev_entries.end(); ++it_prev)
 		{
-			if (it_pointed_to->second != pointed_to)
-			{
-				int abc = 5;
-			}
+			filesdao->setPrevEntry(it_prev->second, it_prev->first);
+		}
+
+		for (std::map<int64, int>::iterator it_pointed_to = correction.pointed_to.begin();
+			 it_pointed_to != correction.pointed_to.end(); ++it_pointed_to)
+		{
+			filesdao->setPointedTo(it_pointed_to->second, it_pointed_to->first);
+		}
+
+		correction.next_entries.clear();
+		correction.prev_entries.clear();
+		correction.pointed_to.clear();
 
-			pointed_to = it_pointed_to->second;
+		bool finished = batch_size == 0 || batch_entries < batch_size;
 
-			correction.pointed_to.erase(it_pointed_to);
+		if (finished)
+		{
+			filesdao->deleteFiles(backupid);
+
+			FileManifest::removeBackup(backupid, *filesdao);
+		}
+		else
+		{
+			filesdao->deleteFilesUpTo(backupid, last_id);
 		}
 
-		if (pointed_to)
+		if (modified_file_entry_index)
 		{
-			modified_file_entry_index = true;
+			FileIndex::flush();
 		}
 
-		BackupServerHash::deleteFileSQL(*filesdao, *fileindex.get(), res["shahash"].c_str(),
-			filesize, rsize, clientid, backupid, incremental, id, prev_entry, next_entry, pointed_to, false, false, false, true, &correction);
-	}
-	filesdao->getDatabase()->destroyQuery(q_iterate);
+		filesdao->endTransaction();
 
-	for (std::map<int64, int64>::iterator it_next = correction.next_entries.begin();
-		 it_next != correction.next_entries.end(); ++it_next)
-	{
-		filesdao->setNextEntry(it_next->second, it_next->first);
-	}
+		removed_entries += batch_entries;
+		ServerMetrics::addDeletedFileEntries(batch_entries);
 
-	for (std::map<int64, int64>::iterator it_prev = correction.prev_entries.begin();
-		 it_prev != correction.prev_entries.end(); ++it_prev)
-	{
-		filesdao->setPrevEntry(it_prev->second, it_prev->first);
-	}
+		if (finished)
+		{
+			break;
+		}
 
-	for (std::map<int64, int>::iterator it_pointed_to = correction.pointed_to.begin();
-		 it_pointed_to != correction.pointed_to.end(); ++it_pointed_to)
-	{
-		filesdao->setPointedTo(it_pointed_to->second, it_pointed_to->first);
-	}
+		if (Server->getTimeMS() - last_log > 60000)
+		{
+			ServerStatus::updateActive();
+			ServerLogger::Log(logid, "Removed " + convert(removed_entries) + " file entries of backup " + convert(backupid) + " so far ("
+				+ convert(removed_entries * 1000 / (Server->getTimeMS() - starttime)) + " entries/s)", LL_DEBUG);
+			last_log = Server->getTimeMS();
+		}
 
-	filesdao->deleteFiles(backupid);
+		if (!BackupDeletion::waitWhilePaused())
+		{
+			filesdao->getDatabase()->destroyQuery(q_iterate);
+			ServerLogger::Log(logid, "Removing file entries of backup " + convert(backupid) + " was interrupted after "
+				+ convert(removed_entries) + " entries. Continuing with next cleanup.", LL_WARNING);
+			return;
+		}
+	}
+	filesdao->getDatabase()->destroyQuery(q_iterate);
 
-	if (modified_file_entry_index)
+	if (removed_entries > 0)
 	{
-		FileIndex::flush();
+		int64 passed_ms = (std::max)(static_cast<int64>(1), Server->getTimeMS() - starttime);
+		ServerLogger::Log(logid, "Removed " + convert(removed_entries) + " file entries of backup " + convert(backupid) + " in "
+			+ PrettyPrintTime(passed_ms) + " (" + convert(removed_entries * 1000 / passed_ms) + " entries/s)", LL_DEBUG);
 	}
 
-	filesdao->endTransaction();
-
 	cleanupdao->removeFileBackup(backupid);
 }
 
@@ -2764,7 +2919,9 @@ bool ServerCleanupThread::backup_clientlists()
 		bool has_error=false;
 		for(size_t i=0;i<files.size();++i)
 		{
-			if(files[i].name.find("clientlist_b_")==0)
+			if(files[i].name.find("clientlist_b_")==0
+				|| (files[i].name.find("file_manifest_")==0
+					&& findextension(files[i].name)=="ummf") )
 			{
 				std::string error_str;
 				if(!copy_file(os_file_prefix(srcfolder + os_file_sep() + files[i].name),
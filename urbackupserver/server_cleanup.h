@@ -7,6 +7,7 @@
 #include "dao/ServerCleanupDao.h"
 #include "dao/ServerBackupDao.h"
 #include "dao/ServerFilesDao.h"
+#include "dao/ServerLinkDao.h"
 #include <sstream>
 #include <memory>
 #include <set>
@@ -171,6 +172,8 @@ private:
 	bool deleteFileBackup(const std::string &backupfolder, int clientid, int backupid, bool force_remove, bool remove_references,
 		int del_incr_in_stack = 0);
 
+	bool removeBackupDir(const std::string& path, ServerLinkDao& link_dao, int clientid);
+
 	void removeFileBackupSql( int backupid );
 
 	void deletePendingClients(void);
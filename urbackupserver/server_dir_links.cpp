@@ -25,6 +25,7 @@
 #include "../Interface/Database.h"
 #include "../Interface/File.h"
 #include "database.h"
+#include "BlockDedupStore.h"
 #include <assert.h>
 
 namespace
@@ -498,6 +499,16 @@ bool remove_directory_link_dir(const std::string &path, ServerLinkDao& link_dao,
 	IScopedLock lock(NULL);
 	dir_link_lock_client_mutex(clientid, lock);
 
+	//A symlinked root is only unlinked if delete_root is set. Its target in the directory pool
+	//is still referenced elsewhere, so it must not be released. Without delete_root the pool
+	//directory itself is removed (last reference) and released.
+	BlockDedupStore* block_store = BlockDedupStore::getInstance();
+	if (block_store != NULL
+		&& !(delete_root && os_is_symlink(os_file_prefix(path))))
+	{
+		block_store->releaseDirectory(path);
+	}
+
 	SSymlinkCallbackData userdata(&link_dao, clientid, with_transaction);
 	return os_remove_nonempty_dir(os_file_prefix(path), symlink_callback, &userdata, delete_root);
 }
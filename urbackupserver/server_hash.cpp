@@ -34,6 +34,9 @@
 #include <memory.h>
 #include "../urbackupcommon/file_metadata.h"
 #include "FileBackup.h"
+#include "BlockDedupStore.h"
+#include "FileManifest.h"
+#include "server_metrics.h"
 #include <assert.h>
 #ifdef _WIN32
 #include <Windows.h>
@@ -44,14 +47,34 @@ const size_t BUFFER_SIZE=64*1024; //64KB
 
 IMutex * delete_mutex=NULL;
 
+namespace
+{
+	//Several hash workers may add the same file concurrently. Linking it and
+	//adding it to the per-client file entry list is serialized per hash so
+	//that the second worker sees the entry added by the first one
+	const size_t num_link_mutexes = 256;
+	IMutex* link_mutexes[num_link_mutexes] = {};
+
+}
+
 void init_mutex1(void)
 {
 	delete_mutex=Server->createMutex();
+
+	for (size_t i = 0; i < num_link_mutexes; ++i)
+	{
+		link_mutexes[i] = Server->createMutex();
+	}
 }
 
 void destroy_mutex1(void)
 {
 	Server->destroy(delete_mutex);
+
+	for (size_t i = 0; i < num_link_mutexes; ++i)
+	{
+		Server->destroy(link_mutexes[i]);
+	}
 }
 
 BackupServerHash::BackupServerHash(IPipe *pPipe, int pClientid, bool use_snapshots, bool use_reflink, bool use_tmpfiles, logid_t logid,
@@ -245,7 +268,7 @@ void BackupServerHash::operator()(void)
 					metadata.set_shahash(src_metadata.shahash);
 				}
 
-				std::unique_ptr<IFile> tf(Server->openFile(os_file_prefix(source), MODE_READ_SEQUENTIAL));
+				std::unique_ptr<IFile> tf(BlockDedupStore::openRead(Server->openFile(os_file_prefix(source), MODE_READ_SEQUENTIAL)));
 
 				if(!tf.get())
 				{
@@ -269,6 +292,8 @@ void BackupServerHash::operator()(void)
 						}
 					}
 				}
+
+				max_file_id.setMaxDownloaded(fileid);
 			}
 		}
 	}
@@ -287,6 +312,10 @@ void BackupServerHash::addFileSQL(ServerFilesDao& filesdao, FileIndex& fileindex
 		assert(prev_entry_clientid == 0);
 		assert(prev_entry == 0);
 		assert(next_entry == 0);
+		if (FileManifest::addFile(backupid, fp, hash_path, shahash, filesize))
+		{
+			return;
+		}
 		filesdao.addIncomingFile(filesize, clientid, backupid, std::string(), ServerFilesDao::c_direction_incoming, incremental);
 		filesdao.addFileEntryExternal(backupid, fp, hash_path, shahash, filesize, rsize, clientid, incremental, next_entry, prev_entry, 0);
 		return;
@@ -601,7 +630,8 @@ void BackupServerHash::deleteFileSQL(ServerFilesDao& filesdao, FileIndex& filein
 bool BackupServerHash::findFileAndLink(const std::string &tfn, IFile *tf, std::string hash_fn, const std::string &sha2,
 	_i64 t_filesize, const std::string &hashoutput_fn, bool copy_from_hardlink_if_failed,
 	bool &tries_once, std::string &ff_last, bool &hardlink_limit, bool &copied_file, int64& entryid, int& entryclientid
-	, int64& rsize, int64& next_entry, FileMetadata& metadata, bool detach_dbs, ExtentIterator* extent_iterator)
+	, int64& rsize, int64& next_entry, FileMetadata& metadata, bool detach_dbs, ExtentIterator* extent_iterator,
+	ServerFilesDao::SFindFileEntry* copy_source)
 {
 	hardlink_limit=false;
 	copied_file=false;
@@ -655,7 +685,7 @@ bool BackupServerHash::findFileAndLink(const std::string &tfn, IFile *tf, std::s
 				std::string errmsg;
 				int64 errcode = os_last_error(errmsg);
 
-				IFile *ctf=Server->openFile(os_file_prefix(existing_file.fullpath), MODE_READ);
+				IFile *ctf=BlockDedupStore::openRead(Server->openFile(os_file_prefix(existing_file.fullpath), MODE_READ));
 				if(ctf==NULL)
 				{
 					if(correctPath(existing_file.fullpath, existing_file.hashpath))
@@ -681,63 +711,23 @@ bool BackupServerHash::findFileAndLink(const std::string &tfn, IFile *tf, std::s
 
 					if(copy_from_hardlink_if_failed)
 					{
-						ServerLogger::Log(logid, "HT: Copying from file \""+existing_file.fullpath+"\"", LL_DEBUG);
-
-						if(!copyFile(ctf, tfn, extent_iterator))
+						if(copy_source!=NULL)
 						{
-							ServerLogger::Log(logid, "Error copying file to destination -3", LL_ERROR);
-							has_error=true;
+							//Caller copies the file (without holding the link lock)
+							*copy_source=existing_file;
 						}
 						else
 						{
-							copied_file=true;
-							entryid = existing_file.id;
-							entryclientid = existing_file.clientid;
-							next_entry=existing_file.next_entry;
-						}
-
-						assert(!hash_fn.empty());
-
-						if(!existing_file.hashpath.empty())
-						{
-							std::unique_ptr<IFile> ctf_hash(Server->openFile(os_file_prefix(existing_file.hashpath), MODE_READ));
-
-							bool write_metadata = true;
-
-							if(ctf_hash.get()!=NULL)
-							{
-								int64 hashfilesize = read_hashdata_size(ctf_hash.get());
-								assert(hashfilesize == -1 || hashfilesize == t_filesize);
-								if (hashfilesize != -1)
-								{
-									if (!copyFile(ctf_hash.get(), hash_fn, NULL))
-									{
-										ServerLogger::Log(logid, "Error copying hashfile to destination -3", LL_ERROR);
-										has_error = true;
-										write_metadata = false;
-									}
-									else
-									{
-										if (!os_file_truncate(os_file_prefix(hash_fn), get_hashdata_size(t_filesize)))
-										{
-											ServerLogger::Log(logid, "Error truncating hashdata file -2. " + os_last_error_str(), LL_ERROR);
-										}
-									}
-								}
-							}
-							else
+							if(copyFromExistingFile(ctf, existing_file, tfn, hash_fn, t_filesize, metadata, extent_iterator))
 							{
-								Server->Log("Error opening hash source file \""+existing_file.hashpath+"\". " + os_last_error_str(), LL_ERROR);
+								copied_file=true;
+								entryid = existing_file.id;
+								entryclientid = existing_file.clientid;
+								next_entry=existing_file.next_entry;
 							}
 
-							if (write_metadata && !write_file_metadata(hash_fn, this, metadata, false))
-							{
-								ServerLogger::Log(logid, "Error writing file metadata -2", LL_ERROR);
-								has_error = true;
-							}
+							copy=false;
 						}
-
-						copy=false;
 					}
 
 					Server->destroy(ctf);
@@ -843,6 +833,147 @@ bool BackupServerHash::findFileAndLink(const std::string &tfn, IFile *tf, std::s
 	return !copy;
 }
 
+bool BackupServerHash::copyFromExistingFile(IFile* ctf, const ServerFilesDao::SFindFileEntry& existing_file, const std::string &tfn,
+	const std::string &hash_fn, _i64 t_filesize, FileMetadata& metadata, ExtentIterator* extent_iterator)
+{
+	ServerLogger::Log(logid, "HT: Copying from file \""+existing_file.fullpath+"\"", LL_DEBUG);
+
+	bool ret=true;
+	if(!copyFile(ctf, tfn, extent_iterator))
+	{
+		ServerLogger::Log(logid, "Error copying file to destination -3", LL_ERROR);
+		has_error=true;
+		ret=false;
+	}
+
+	assert(!hash_fn.empty());
+
+	if(!existing_file.hashpath.empty())
+	{
+		std::unique_ptr<IFile> ctf_hash(Server->openFile(os_file_prefix(existing_file.hashpath), MODE_READ));
+
+		bool write_metadata = true;
+
+		if(ctf_hash.get()!=NULL)
+		{
+			int64 hashfilesize = read_hashdata_size(ctf_hash.get());
+			assert(hashfilesize == -1 || hashfilesize == t_filesize);
+			if (hashfilesize != -1)
+			{
+				if (!copyFile(ctf_hash.get(), hash_fn, NULL))
+				{
+					ServerLogger::Log(logid, "Error copying hashfile to destination -3", LL_ERROR);
+					has_error = true;
+					write_metadata = false;
+				}
+				else
+				{
+					if (!os_file_truncate(os_file_prefix(hash_fn), get_hashdata_size(t_filesize)))
+					{
+						ServerLogger::Log(logid, "Error truncating hashdata file -2. " + os_last_error_str(), LL_ERROR);
+					}
+				}
+			}
+		}
+		else
+		{
+			Server->Log("Error opening hash source file \""+existing_file.hashpath+"\". " + os_last_error_str(), LL_ERROR);
+		}
+
+		if (write_metadata && !write_file_metadata(hash_fn, this, metadata, false))
+		{
+			ServerLogger::Log(logid, "Error writing file metadata -2", LL_ERROR);
+			has_error = true;
+		}
+	}
+
+
+
+	return ret;
+}
+
+bool BackupServerHash::linkFile(int backupid, const std::string &tfn, const std::string &hash_fn, const std::string &sha2,
+	_i64 t_filesize, bool add_sql, FileMetadata& metadata, bool detach_dbs)
+{
+	bool tries_once;
+	std::string ff_last;
+	bool hardlink_limit;
+	bool copied_file;
+	int64 entryid=0;
+	int entryclientid = 0;
+	int64 rsize = 0;
+	int64 next_entryid = 0;
+	ServerFilesDao::SFindFileEntry copy_source;
+	copy_source.exists=false;
+
+	{
+		IScopedLock link_lock(getLinkMutex(sha2));
+		if(findFileAndLink(tfn, NULL, hash_fn, sha2, t_filesize, std::string(), true,
+			tries_once, ff_last, hardlink_limit, copied_file, entryid, entryclientid, rsize, next_entryid,
+			metadata, detach_dbs, NULL, &copy_source))
+		{
+			if(add_sql)
+			{
+				addFileSQL(backupid, clientid, 0, tfn, hash_fn, sha2, t_filesize,
+					(rsize>0 && rsize!=t_filesize)?rsize:0, entryid, entryclientid, next_entryid, false);
+			}
+			return true;
+		}
+	}
+
+	if(!copy_source.exists)
+	{
+		return false;
+	}
+
+	IFile *ctf=BlockDedupStore::openRead(Server->openFile(os_file_prefix(copy_source.fullpath), MODE_READ));
+	if(ctf==NULL)
+	{
+		ServerLogger::Log(logid, "HT: Error opening file to copy from ""+copy_source.fullpath+"". "+os_last_error_str(), LL_DEBUG);
+		return false;
+	}
+
+	bool copied=copyFromExistingFile(ctf, copy_source, tfn, hash_fn, t_filesize, metadata, NULL);
+	Server->destroy(ctf);
+
+	if(!copied)
+	{
+		return false;
+	}
+
+	if(add_sql)
+	{
+		addStoredFileSQL(backupid, 0, tfn, hash_fn, sha2, t_filesize, t_filesize, true);
+	}
+
+	return true;
+}
+
+void BackupServerHash::addStoredFileSQL(int backupid, int incremental, const std::string &fp, const std::string &hash_path,
+	const std::string &shahash, _i64 filesize, _i64 rsize, bool update_fileindex)
+{
+	if (filesize < link_file_min_size)
+	{
+		addFileSQL(backupid, clientid, incremental, fp, hash_path, shahash, filesize, rsize, 0, 0, 0, update_fileindex);
+		return;
+	}
+
+	IScopedLock link_lock(getLinkMutex(shahash));
+
+	//Another worker may have added the same file while it was stored
+	SFindState find_state;
+	ServerFilesDao::SFindFileEntry existing_file = findFileHash(shahash, filesize, clientid, find_state);
+	if (existing_file.exists)
+	{
+		addFileSQL(backupid, clientid, incremental, fp, hash_path, shahash, filesize, rsize,
+			existing_file.id, existing_file.clientid, existing_file.next_entry, update_fileindex);
+	}
+	else
+	{
+		addFileSQL(backupid, clientid, incremental, fp, hash_path, shahash, filesize, rsize, 0, 0, 0, update_fileindex);
+	}
+}
+
 void BackupServerHash::addFile(int backupid, int incremental, IFile *tf, const std::string &tfn,
 	std::string hash_fn, const std::string &sha2, const std::string &orig_fn, const std::string &hashoutput_fn, int64 t_filesize,
 	FileMetadata& metadata, bool with_hashes, ExtentIterator* extent_iterator, int64 fileid)
@@ -856,19 +987,24 @@ void BackupServerHash::addFile(int backupid, int incremental, IFile *tf, const s
 	int entryclientid = 0;
 	int64 next_entryid = 0;
 	int64 rsize = 0;
+
 	if(t_filesize>= link_file_min_size
-		&& (!snapshot_file_inplace || t_filesize<50*1024*1024 || tf->Size()>10*1024 || tf->Size()<=8)
-		&& findFileAndLink(tfn, tf, hash_fn, sha2, t_filesize,hashoutput_fn,
-		false, tries_once, ff_last, hardlink_limit, copied_file, entryid, entryclientid, rsize, next_entryid,
-		metadata, false, extent_iterator))
+		&& (!snapshot_file_inplace || t_filesize<50*1024*1024 || tf->Size()>10*1024 || tf->Size()<=8))
 	{
-		ServerLogger::Log(logid, "HT: Linked file: \""+tfn+"\" (id="+convert(fileid)+")", LL_DEBUG);
-		copy=false;
-		std::string temp_fn=tf->getFilename();
-		Server->destroy(tf);
-		tf=NULL;
-		Server->deleteFile(temp_fn);
-		addFileSQL(backupid, clientid, incremental, tfn, hash_fn, sha2, t_filesize, rsize, entryid, entryclientid, next_entryid, copied_file);
+		IScopedLock link_lock(getLinkMutex(sha2));
+		if(findFileAndLink(tfn, tf, hash_fn, sha2, t_filesize,hashoutput_fn,
+			false, tries_once, ff_last, hardlink_limit, copied_file, entryid, entryclientid, rsize, next_entryid,
+			metadata, false, extent_iterator))
+		{
+			ServerLogger::Log(logid, "HT: Linked file: \""+tfn+"\" (id="+convert(fileid)+")", LL_DEBUG);
+			ServerMetrics::addDedupHit(t_filesize);
+			copy=false;
+			std::string temp_fn=tf->getFilename();
+			Server->destroy(tf);
+			tf=NULL;
+			Server->deleteFile(temp_fn);
+			addFileSQL(backupid, clientid, incremental, tfn, hash_fn, sha2, t_filesize, rsize, entryid, entryclientid, next_entryid, copied_file);
+		}
 	}
 
 	if(tries_once && copy && !hardlink_limit)
@@ -891,6 +1027,10 @@ void BackupServerHash::addFile(int backupid, int incremental, IFile *tf, const s
 	if(copy)
 	{
 		ServerLogger::Log(logid, "HT: Copying file: \""+tfn+"\" (id=" + convert(fileid) + ")", LL_DEBUG);
+		if (t_filesize >= link_file_min_size)
+		{
+			ServerMetrics::addDedupMiss(t_filesize);
+		}
 		int64 fs=tf->Size();
 		if(!use_reflink)
 		{
@@ -1049,13 +1189,31 @@ void BackupServerHash::addFile(int backupid, int incremental, IFile *tf, const s
 						has_error=true;
 					}
 
-					addFileSQL(backupid, clientid, incremental, tfn, hash_fn, sha2, t_filesize, cow_filesize>0?cow_filesize:t_filesize, 0, 0, 0, tries_once || hardlink_limit);
+					BlockDedupStore* block_store = BlockDedupStore::getInstance();
+					if(block_store!=NULL && block_store->isEnabled()
+						&& !use_reflink && !use_snapshots
+						&& block_store->storeFile(tfn, hash_fn, t_filesize))
+					{
+						ServerLogger::Log(logid, "HT: Moved blocks of \""+tfn+"\" to block store", LL_DEBUG);
+					}
+
+					addStoredFileSQL(backupid, incremental, tfn, hash_fn, sha2, t_filesize, cow_filesize>0?cow_filesize:t_filesize, tries_once || hardlink_limit);
 				}
 			}
 		}
 	}
 }
 
+IMutex* BackupServerHash::getLinkMutex(const std::string& sha2)
+{
+	size_t idx = 0;
+	if (!sha2.empty())
+	{
+		idx = static_cast<unsigned char>(sha2[0]) % num_link_mutexes;
+	}
+	return link_mutexes[idx];
+}
+
 bool BackupServerHash::freeSpace(int64 fs, const std::string &fp)
 {
 	IScopedLock lock(delete_mutex);
@@ -1096,6 +1254,7 @@ ServerFilesDao::SFindFileEntry BackupServerHash::findFileHash(const std::string
 	bool switch_to_next_client=false;
 	if(state.state==0)
 	{
+		ScopedIndexLookupTimer lookup_timer;
 		entryid = fileindex->get_with_cache_prefer_client(FileIndex::SIndexKey(pHash.c_str(), filesize, clientid));
 		state.state=1;
 		save_orig=true;
@@ -1165,7 +1324,10 @@ ServerFilesDao::SFindFileEntry BackupServerHash::findFileHash(const std::string
 	if(switch_to_all_clients)
 	{
 		state.state=3;
-		state.entryids = fileindex->get_all_clients_with_cache(FileIndex::SIndexKey(pHash.c_str(), filesize, 0), false);
+		{
+			ScopedIndexLookupTimer lookup_timer;
+			state.entryids = fileindex->get_all_clients_with_cache(FileIndex::SIndexKey(pHash.c_str(), filesize, 0), false);
+		}
 		state.client = state.entryids.begin();
 		if(state.client!=state.entryids.end())
 		{
@@ -1503,7 +1665,7 @@ bool BackupServerHash::patchFile(IFile *patch, const std::string &source, const
 		}
 		ObjectScope dst_s(chunk_output_fn);
 
-		IFile *f_source=openFileRetry(source, MODE_READ, errstr);
+		IFile *f_source=BlockDedupStore::openRead(openFileRetry(source, MODE_READ, errstr));
 		if (f_source == NULL)
 		{
 			ServerLogger::Log(logid, "Error opening patch source file \"" + source + "\". "+errstr, LL_ERROR);
@@ -67,7 +67,18 @@ public:
 
 	bool findFileAndLink(const std::string &tfn, IFile *tf, std::string hash_fn, const std::string &sha2, _i64 t_filesize, const std::string &hashoutput_fn, 
 		bool copy_from_hardlink_if_failed, bool &tries_once, std::string &ff_last, bool &hardlink_limit, bool &copied_file, int64& entryid, int& entryclientid, int64& rsize, int64& next_entry,
-		FileMetadata& metadata, bool datch_dbs, ExtentIterator* extent_iterator);
+		FileMetadata& metadata, bool datch_dbs, ExtentIterator* extent_iterator, ServerFilesDao::SFindFileEntry* copy_source=NULL);
+
+	//Links (or copies) the file from an existing file with the same hash and
+	//optionally adds its file entry. Only the lookup, linking and adding the
+	//entry hold the link lock
+	bool linkFile(int backupid, const std::string &tfn, const std::string &hash_fn, const std::string &sha2,
+		_i64 t_filesize, bool add_sql, FileMetadata& metadata, bool detach_dbs);
+
+	//Adds the entry of a file stored without holding the link lock, after
+	//looking up entries added for the same hash in the meantime
+	void addStoredFileSQL(int backupid, int incremental, const std::string &fp, const std::string &hash_path,
+		const std::string &shahash, _i64 filesize, _i64 rsize, bool update_fileindex);
 
 	void addFileSQL(int backupid, int clientid, int incremental, const std::string &fp, const std::string &hash_path,
 		const std::string &shahash, _i64 filesize, _i64 rsize, int64 prev_entry, int64 prev_entry_clientid, int64 next_entry, bool update_fileindex);
@@ -115,7 +126,13 @@ private:
 
 	ServerFilesDao::SFindFileEntry findFileHash(const std::string &pHash, _i64 filesize, int clientid, SFindState& state);
 
+	//Hold while looking up, linking and adding the entry of a file, so that
+	//concurrent additions of the same file see each other's file entries
+	static IMutex* getLinkMutex(const std::string& sha2);
+
 	bool copyFile(IFile *tf, const std::string &dest, ExtentIterator* extent_iterator);
+	bool copyFromExistingFile(IFile* ctf, const ServerFilesDao::SFindFileEntry& existing_file, const std::string &tfn,
+		const std::string &hash_fn, _i64 t_filesize, FileMetadata& metadata, ExtentIterator* extent_iterator);
 	bool copyFileWithHashoutput(IFile *tf, const std::string &dest, const std::string hash_dest, ExtentIterator* extent_iterator);
 	bool freeSpace(int64 fs, const std::string &fp);
 	
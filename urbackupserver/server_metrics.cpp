@@ -0,0 +1,320 @@
+/*************************************************************************
+*    UrBackup - Client/Server backup system
+*    Copyright (C) 2011-2016 Martin Raiber
+*
+*    This program is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU Affero General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU Affero General Public License for more details.
+*
+*    You should have received a copy of the GNU Affero General Public License
+*    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**************************************************************************/
+
+#ifndef CLIENT_ONLY
+
+#include "server_metrics.h"
+#include "server_status.h"
+#include "BackupDeletion.h"
+#include "../Interface/Server.h"
+#include "../Interface/ThreadPool.h"
+#include "../stringtools.h"
+#include <chrono>
+#include <stdio.h>
+
+std::atomic<int64> ServerMetrics::dedup_hits(0);
+std::atomic<int64> ServerMetrics::dedup_hit_bytes(0);
+std::atomic<int64> ServerMetrics::dedup_misses(0);
+std::atomic<int64> ServerMetrics::dedup_miss_bytes(0);
+std::atomic<int64> ServerMetrics::hashed_files(0);
+std::atomic<int64> ServerMetrics::hashed_bytes(0);
+std::atomic<int64> ServerMetrics::deleted_files(0);
+std::atomic<int64> ServerMetrics::deleted_bytes(0);
+std::atomic<int64> ServerMetrics::deleted_file_entries(0);
+ServerMetrics::Histogram ServerMetrics::hash_latency;
+ServerMetrics::Histogram ServerMetrics::index_lookup_latency;
+
+namespace
+{
+	//Upper bounds of the histogram buckets in microseconds (last one is +Inf)
+	const int64 bucket_bounds_us[ServerMetrics::Histogram::num_buckets - 1] = {
+		100, 500, 1000, 5000, 10000, 50000, 100000, 500000, 1000000, 5000000, 10000000 };
+
+	std::string format_seconds(int64 us)
+	{
+		char buf[64];
+		snprintf(buf, sizeof(buf), "%.6g", us / 1000000.0);
+		return buf;
+	}
+
+	std::string format_double(double d)
+	{
+		char buf[64];
+		snprintf(buf, sizeof(buf), "%.6g", d);
+		return buf;
+	}
+
+	std::string escape_label(const std::string& val)
+	{
+		std::string ret;
+		ret.reserve(val.size());
+		for (size_t i = 0; i < val.size(); ++i)
+		{
+			switch (val[i])
+			{
+			case '\\': ret += "\\\\"; break;
+			case '"': ret += "\\\""; break;
+			case '\n': ret += "\\n"; break;
+			default: ret += val[i];
+			}
+		}
+		return ret;
+	}
+
+	void add_header(const std::string& name, const std::string& type, const std::string& help, std::string& out)
+	{
+		out += "# HELP " + name + " " + help + "\n";
+		out += "# TYPE " + name + " " + type + "\n";
+	}
+
+	void add_metric(const std::string& name, const std::string& type, const std::string& help,
+		int64 val, std::string& out)
+	{
+		add_header(name, type, help, out);
+		out += name + " " + convert(val) + "\n";
+	}
+
+	std::string action_name(SStatusAction action)
+	{
+		switch (action)
+		{
+		case sa_incr_file: return "incr_file";
+		case sa_full_file: return "full_file";
+		case sa_incr_image: return "incr_image";
+		case sa_full_image: return "full_image";
+		case sa_resume_incr_file: return "resume_incr_file";
+		case sa_resume_full_file: return "resume_full_file";
+		case sa_cdp_sync: return "cdp_sync";
+		case sa_restore_file: return "restore_file";
+		case sa_restore_image: return "restore_image";
+		case sa_update: return "update";
+		case sa_check_integrity: return "check_integrity";
+		case sa_backup_database: return "backup_database";
+		case sa_recalculate_statistics: return "recalculate_statistics";
+		case sa_nightly_cleanup: return "nightly_cleanup";
+		case sa_emergency_cleanup: return "emergency_cleanup";
+		case sa_storage_migration: return "storage_migration";
+		case sa_startup_recovery: return "startup_recovery";
+		default: return "none";
+		}
+	}
+
+	struct SProcessMetric
+	{
+		std::string labels;
+		SProcess proc;
+	};
+
+	void add_process_metric(const std::string& name, const std::string& help,
+		const std::vector<SProcessMetric>& procs, double (*get)(const SProcess&), std::string& out)
+	{
+		add_header(name, "gauge", help, out);
+		for (size_t i = 0; i < procs.size(); ++i)
+		{
+			out += name + "{" + procs[i].labels + "} " + format_double(get(procs[i].proc)) + "\n";
+		}
+	}
+
+	double proc_done_bytes(const SProcess& proc) { return static_cast<double>(proc.done_bytes); }
+	double proc_total_bytes(const SProcess& proc) { return static_cast<double>(proc.total_bytes); }
+	double proc_speed(const SProcess& proc) { return proc.speed_bpms*1000.0; }
+	double proc_pcdone(const SProcess& proc) { return proc.pcdone; }
+	double proc_hashqueuesize(const SProcess& proc) { return proc.hashqueuesize; }
+	double proc_prepare_hashqueuesize(const SProcess& proc) { return proc.prepare_hashqueuesize; }
+
+	double proc_eta(const SProcess& proc)
+	{
+		if (proc.eta_ms <= 0)
+		{
+			return -1;
+		}
+		int64 eta_ms = proc.eta_ms - (Server->getTimeMS() - proc.eta_set_time);
+		return eta_ms > 0 ? eta_ms / 1000.0 : 0;
+	}
+}
+
+ServerMetrics::Histogram::Histogram()
+	: sum_us(0)
+{
+	for (size_t i = 0; i < num_buckets; ++i)
+	{
+		buckets[i].store(0, std::memory_order_relaxed);
+	}
+}
+
+void ServerMetrics::Histogram::observe(int64 us)
+{
+	size_t idx = 0;
+	while (idx < num_buckets - 1
+		&& us > bucket_bounds_us[idx])
+	{
+		++idx;
+	}
+
+	buckets[idx].fetch_add(1, std::memory_order_relaxed);
+	sum_us.fetch_add(us, std::memory_order_relaxed);
+}
+
+void ServerMetrics::Histogram::render(const std::string& name, const std::string& help, std::string& out)
+{
+	add_header(name, "histogram", help, out);
+
+	int64 cumulative = 0;
+	for (size_t i = 0; i < num_buckets; ++i)
+	{
+		cumulative += buckets[i].load(std::memory_order_relaxed);
+		std::string le = i < num_buckets - 1 ? format_seconds(bucket_bounds_us[i]) : "+Inf";
+		out += name + "_bucket{le=\"" + le + "\"} " + convert(cumulative) + "\n";
+	}
+	out += name + "_sum " + format_seconds(sum_us.load(std::memory_order_relaxed)) + "\n";
+	out += name + "_count " + convert(cumulative) + "\n";
+}
+
+int64 ServerMetrics::getTimeUs()
+{
+	return std::chrono::duration_cast<std::chrono::microseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void ServerMetrics::addDedupHit(int64 filesize)
+{
+	dedup_hits.fetch_add(1, std::memory_order_relaxed);
+	dedup_hit_bytes.fetch_add(filesize, std::memory_order_relaxed);
+}
+
+void ServerMetrics::addDedupMiss(int64 filesize)
+{
+	dedup_misses.fetch_add(1, std::memory_order_relaxed);
+	dedup_miss_bytes.fetch_add(filesize, std::memory_order_relaxed);
+}
+
+void ServerMetrics::addHashed(int64 filesize, int64 duration_us)
+{
+	hashed_files.fetch_add(1, std::memory_order_relaxed);
+	hashed_bytes.fetch_add(filesize, std::memory_order_relaxed);
+	hash_latency.observe(duration_us);
+}
+
+void ServerMetrics::addIndexLookup(int64 duration_us)
+{
+	index_lookup_latency.observe(duration_us);
+}
+
+void ServerMetrics::addDeleted(int64 files, int64 bytes)
+{
+	deleted_files.fetch_add(files, std::memory_order_relaxed);
+	deleted_bytes.fetch_add(bytes, std::memory_order_relaxed);
+}
+
+void ServerMetrics::addDeletedFileEntries(int64 entries)
+{
+	deleted_file_entries.fetch_add(entries, std::memory_order_relaxed);
+}
+
+std::string ServerMetrics::render()
+{
+	std::string out;
+
+	add_metric("urbackup_dedup_linked_files_total", "counter",
+		"Files linked to an identical file already on the backup storage", dedup_hits.load(std::memory_order_relaxed), out);
+	add_metric("urbackup_dedup_linked_bytes_total", "counter",
+		"Bytes of files linked to an identical file already on the backup storage", dedup_hit_bytes.load(std::memory_order_relaxed), out);
+	add_metric("urbackup_dedup_copied_files_total", "counter",
+		"Files large enough for deduplication which had to be stored", dedup_misses.load(std::memory_order_relaxed), out);
+	add_metric("urbackup_dedup_copied_bytes_total", "counter",
+		"Bytes of files large enough for deduplication which had to be stored", dedup_miss_bytes.load(std::memory_order_relaxed), out);
+	add_metric("urbackup_hashed_files_total", "counter",
+		"Files hashed by the server", hashed_files.load(std::memory_order_relaxed), out);
+	add_metric("urbackup_hashed_bytes_total", "counter",
+		"Bytes hashed by the server", hashed_bytes.load(std::memory_order_relaxed), out);
+
+	add_metric("urbackup_deleted_files_total", "counter",
+		"Files removed while deleting backups", deleted_files.load(std::memory_order_relaxed), out);
+	add_metric("urbackup_deleted_bytes_total", "counter",
+		"Bytes of files removed while deleting backups", deleted_bytes.load(std::memory_order_relaxed), out);
+	add_metric("urbackup_deleted_file_entries_total", "counter",
+		"Entries removed from the files table while deleting backups", deleted_file_entries.load(std::memory_order_relaxed), out);
+	add_metric("urbackup_deletion_paused", "gauge",
+		"Whether deleting backups is paused", BackupDeletion::isPaused() ? 1 : 0, out);
+
+	hash_latency.render("urbackup_hash_duration_seconds", "Time to hash one file", out);
+	index_lookup_latency.render("urbackup_index_lookup_duration_seconds", "Time of one file entry index lookup", out);
+
+	SThreadPoolStats pool_stats = Server->getThreadPool()->getStats();
+	add_metric("urbackup_threadpool_threads", "gauge",
+		"Threads in the thread pool", pool_stats.n_threads, out);
+	add_metric("urbackup_threadpool_idle_threads", "gauge",
+		"Idle threads in the thread pool", pool_stats.n_idle_threads, out);
+	add_metric("urbackup_threadpool_queue_depth", "gauge",
+		"Tasks waiting for a thread pool thread", pool_stats.queue_depth, out);
+	add_metric("urbackup_threadpool_max_queue_depth", "gauge",
+		"Maximum number of tasks that waited for a thread pool thread", pool_stats.max_queue_depth, out);
+	add_metric("urbackup_threadpool_executed_total", "counter",
+		"Tasks executed by the thread pool", pool_stats.n_executed, out);
+	add_metric("urbackup_threadpool_steals_total", "counter",
+		"Tasks taken from the queue of another thread pool worker", pool_stats.n_steals, out);
+	add_header("urbackup_threadpool_wait_seconds_total", "counter",
+		"Time tasks waited for a thread pool thread", out);
+	out += "urbackup_threadpool_wait_seconds_total " + format_seconds(pool_stats.total_wait_us) + "\n";
+	add_header("urbackup_threadpool_max_wait_seconds", "gauge",
+		"Maximum time a task waited for a thread pool thread", out);
+	out += "urbackup_threadpool_max_wait_seconds " + format_seconds(pool_stats.max_wait_us) + "\n";
+
+	std::vector<SStatus> status = ServerStatus::getStatus();
+
+	int64 online_clients = 0;
+	std::vector<SProcessMetric> procs;
+	for (size_t i = 0; i < status.size(); ++i)
+	{
+		if (status[i].online)
+		{
+			++online_clients;
+		}
+
+		for (size_t j = 0; j < status[i].processes.size(); ++j)
+		{
+			SProcessMetric pm = { "client=\"" + escape_label(status[i].client) + "\",action=\""
+				+ action_name(status[i].processes[j].action) + "\",id=\"" + convert(status[i].processes[j].id) + "\"",
+				status[i].processes[j] };
+			procs.push_back(pm);
+		}
+	}
+
+	add_metric("urbackup_clients_online", "gauge", "Clients currently online", online_clients, out);
+	add_metric("urbackup_processes", "gauge", "Running backups and other server processes",
+		static_cast<int64>(procs.size()), out);
+
+	add_process_metric("urbackup_process_done_bytes", "Bytes processed by the process",
+		procs, proc_done_bytes, out);
+	add_process_metric("urbackup_process_total_bytes", "Bytes the process has to process (-1 if unknown)",
+		procs, proc_total_bytes, out);
+	add_process_metric("urbackup_process_speed_bytes_per_second", "Current transfer speed of the process",
+		procs, proc_speed, out);
+	add_process_metric("urbackup_process_percent_done", "Progress of the process (-1 if unknown)",
+		procs, proc_pcdone, out);
+	add_process_metric("urbackup_process_eta_seconds", "Estimated remaining time of the process (-1 if unknown)",
+		procs, proc_eta, out);
+	add_process_metric("urbackup_process_hash_queue_size", "Files in the hash queue of the process",
+		procs, proc_hashqueuesize, out);
+	add_process_metric("urbackup_process_prepare_hash_queue_size", "Files in the prepare hash queue of the process",
+		procs, proc_prepare_hashqueuesize, out);
+
+	return out;
+}
+
+#endif //CLIENT_ONLY
@@ -0,0 +1,83 @@
+#pragma once
+
+#include "../Interface/Types.h"
+#include <atomic>
+#include <string>
+
+/*
+* Process wide counters and latency histograms, rendered together with the
+* thread pool statistics and the progress of running processes in the
+* Prometheus text exposition format by the "metrics" action.
+*
+* Updating a metric is a relaxed atomic increment, so it can be done from the
+* hash and backup threads without any locking.
+*/
+class ServerMetrics
+{
+public:
+	class Histogram
+	{
+	public:
+		Histogram();
+
+		void observe(int64 us);
+
+		void render(const std::string& name, const std::string& help, std::string& out);
+
+		static const size_t num_buckets = 12;
+
+	private:
+		std::atomic<int64> buckets[num_buckets];
+		std::atomic<int64> sum_us;
+	};
+
+	static int64 getTimeUs();
+
+	//File linked to an already existing file (deduplicated)
+	static void addDedupHit(int64 filesize);
+
+	//File which could have been linked, but was copied
+	static void addDedupMiss(int64 filesize);
+
+	static void addHashed(int64 filesize, int64 duration_us);
+
+	static void addIndexLookup(int64 duration_us);
+
+	//Files removed while deleting backups
+	static void addDeleted(int64 files, int64 bytes);
+
+	//Entries removed from the files table while deleting backups
+	static void addDeletedFileEntries(int64 entries);
+
+	static std::string render();
+
+private:
+	static std::atomic<int64> dedup_hits;
+	static std::atomic<int64> dedup_hit_bytes;
+	static std::atomic<int64> dedup_misses;
+	static std::atomic<int64> dedup_miss_bytes;
+	static std::atomic<int64> hashed_files;
+	static std::atomic<int64> hashed_bytes;
+	static std::atomic<int64> deleted_files;
+	static std::atomic<int64> deleted_bytes;
+	static std::atomic<int64> deleted_file_entries;
+
+	static Histogram hash_latency;
+	static Histogram index_lookup_latency;
+};
+
+class ScopedIndexLookupTimer
+{
+public:
+	ScopedIndexLookupTimer()
+		: starttime(ServerMetrics::getTimeUs())
+	{}
+
+	~ScopedIndexLookupTimer()
+	{
+		ServerMetrics::addIndexLookup(ServerMetrics::getTimeUs() - starttime);
+	}
+
+private:
+	int64 starttime;
+};
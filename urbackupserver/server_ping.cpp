@@ -28,8 +28,9 @@ const int64 ping_intervall=10000;
 
 ServerPingThread::ServerPingThread(ClientMain *client_main, const std::string& clientname,
 	size_t status_id, bool with_eta, std::string server_token)
-	: client_main(client_main), clientname(clientname), status_id(status_id),
-	with_eta(with_eta), server_token(server_token)
+	: client_main(client_main), with_eta(with_eta), clientname(clientname), status_id(status_id),
+	status_handle(ServerStatus::getProcessHandle(clientname, status_id)),
+	server_token(server_token)
 {
 	stop=false;
 	is_timeout=false;
@@ -43,13 +44,14 @@ void ServerPingThread::operator()(void)
 	{
 		//Server->Log("Sending ping running...", LL_DEBUG);
 		std::string pcdone;
-		SProcess proc = ServerStatus::getProcess(clientname, status_id);
-
-		if(proc.action==sa_none)
+		if(!status_handle->isActive())
 		{
 			break;
 		}
 
+		SProcess proc(status_id, sa_none, std::string());
+		status_handle->read(proc);
+
 		int i_pcdone = proc.pcdone;
 		if(i_pcdone>=0)
 		{
@@ -143,7 +145,7 @@ void ServerPingThread::setPaused(SProcess* proc, bool b)
 {
 	if (proc==NULL || b != proc->paused)
 	{
-		ServerStatus::setProcessPaused(clientname, status_id, b);
+		status_handle->setPaused(b);
 	}
 }
 
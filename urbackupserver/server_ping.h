@@ -2,9 +2,9 @@
 
 #include "../Interface/Thread.h"
 #include "../Interface/Mutex.h"
+#include "server_status.h"
 
 class ClientMain;
-struct SProcess;
 
 class ServerPingThread : public IThread
 {
@@ -24,5 +24,6 @@ private:
 	bool with_eta;
 	std::string clientname;
 	size_t status_id;
+	ProcessHandle status_handle;
 	std::string server_token;
 };
\ No newline at end of file
@@ -30,6 +30,10 @@
 #include <memory.h>
 #include "../common/adler32.h"
 #include "../urbackupcommon/file_metadata.h"
+#include "server_metrics.h"
+#include "FileBackup.h"
+#include "BlockDedupStore.h"
+#include "CdcIndexStore.h"
 
 namespace
 {
@@ -50,8 +54,8 @@ namespace
 }
 
 BackupServerPrepareHash::BackupServerPrepareHash(IPipe *pPipe, IPipe *pOutput, int pClientid,
-	logid_t logid, bool ignore_hash_mismatch)
-	: logid(logid), ignore_hash_mismatch(ignore_hash_mismatch)
+	logid_t logid, bool ignore_hash_mismatch, MaxFileId& max_file_id)
+	: logid(logid), ignore_hash_mismatch(ignore_hash_mismatch), max_file_id(max_file_id)
 {
 	pipe=pPipe;
 	output=pOutput;
@@ -60,6 +64,7 @@ BackupServerPrepareHash::BackupServerPrepareHash(IPipe *pPipe, IPipe *pOutput, i
 	chunk_patcher.setCallback(this);
 	chunk_patcher.setWithSparse(true);
 	has_error=false;
+	cdc_index=NULL;
 }
 
 BackupServerPrepareHash::~BackupServerPrepareHash(void)
@@ -75,7 +80,6 @@ void BackupServerPrepareHash::operator()(void)
 		size_t rc=pipe->Read(&data);
 		if(data=="exit")
 		{
-			output->Write("exit");
 			pipe->Write("exit");
 			Server->Log("server_prepare_hash Thread finished (exit)");
 			delete this;
@@ -137,20 +141,35 @@ void BackupServerPrepareHash::operator()(void)
 			rd.getChar(&c_has_snapshot);
 
 			bool has_snapshot = c_has_snapshot == 1;
+
+			std::string cdc_index_fn;
+			rd.getStr(&cdc_index_fn);
+
+			char c_build_cdc_index;
+			rd.getChar(&c_build_cdc_index);
 			
 			FileMetadata metadata;
 			metadata.read(rd);
 
+			CdcIndexStore* cdc_index_store = CdcIndexStore::getInstance();
+			std::unique_ptr<CdcIndexBuilder> cdc_index_builder;
+			if (c_build_cdc_index == 1
+				&& cdc_index_store != NULL)
+			{
+				cdc_index_builder.reset(new CdcIndexBuilder);
+			}
+
 			IFile *tf=Server->openFile(os_file_prefix((temp_fn)), MODE_READ);
 			IFile *old_file=NULL;
 			if(diff_file)
 			{
-				old_file=Server->openFile(os_file_prefix((old_file_fn)), MODE_READ);
+				old_file=BlockDedupStore::openRead(Server->openFile(os_file_prefix((old_file_fn)), MODE_READ));
 				if(old_file==NULL)
 				{
 					ServerLogger::Log(logid, "Error opening file \""+old_file_fn+"\" for reading. File: old_file. "+os_last_error_str()+" Target path: \""+tfn+"\"", LL_ERROR);
 					has_error=true;
 					if(tf!=NULL) Server->destroy(tf);
+					max_file_id.setMaxDownloaded(fileid);
 					continue;
 				}
 			}
@@ -163,6 +182,11 @@ void BackupServerPrepareHash::operator()(void)
 				{
 					Server->destroy(old_file);
 				}
+				if (!cdc_index_fn.empty())
+				{
+					Server->deleteFile(os_file_prefix(cdc_index_fn));
+				}
+				max_file_id.setMaxDownloaded(fileid);
 			}
 			else
 			{
@@ -178,6 +202,7 @@ void BackupServerPrepareHash::operator()(void)
 				}
 
 				ServerLogger::Log(logid, "PT: Hashing file \""+ExtractFileName(tfn)+"\"", LL_DEBUG);
+				int64 hash_starttime = ServerMetrics::getTimeUs();
 				std::string h;
 				if(!diff_file)
 				{
@@ -185,7 +210,7 @@ void BackupServerPrepareHash::operator()(void)
 						|| c_hash_func == HASH_FUNC_SHA512)
 					{
 						HashSha512 hashsha;
-						if (hash_sha(tf, extent_iterator.get(), c_hash_func != HASH_FUNC_SHA512_NO_SPARSE, hashsha))
+						if (hash_sha(tf, extent_iterator.get(), c_hash_func != HASH_FUNC_SHA512_NO_SPARSE, hashsha, NULL, cdc_index_builder.get()))
 						{
 							h = hashsha.finalize();
 						}
@@ -193,7 +218,7 @@ void BackupServerPrepareHash::operator()(void)
 					else
 					{
 						TreeHash treehash(NULL);
-						if (hash_sha(tf, extent_iterator.get(), true, treehash))
+						if (hash_sha(tf, extent_iterator.get(), true, treehash, NULL, cdc_index_builder.get()))
 						{
 							h = treehash.finalize();
 						}
@@ -202,6 +227,7 @@ void BackupServerPrepareHash::operator()(void)
 				}
 				else
 				{
+					cdc_index = cdc_index_builder.get();
 					if (c_hash_func == HASH_FUNC_SHA512_NO_SPARSE
 						|| c_hash_func == HASH_FUNC_SHA512)
 					{
@@ -216,7 +242,12 @@ void BackupServerPrepareHash::operator()(void)
 					}
 					else
 					{
-						std::unique_ptr<IFile> l_hashoutput_f(Server->openFile(os_file_prefix(hashoutput_fn), MODE_READ));
+						std::unique_ptr<IFile> l_hashoutput_f;
+						if (cdc_index == NULL)
+						{
+							l_hashoutput_f.reset(Server->openFile(os_file_prefix(hashoutput_fn), MODE_READ));
+						}
+						//Otherwise unchanged data is read and hashed, as it is needed for the chunk index
 						hashoutput_f = l_hashoutput_f.get();
 						TreeHash treehash(NULL);
 						hashf = &treehash;
@@ -227,6 +258,12 @@ void BackupServerPrepareHash::operator()(void)
 						hashf = NULL;
 						hashoutput_f = NULL;
 					}
+					cdc_index = NULL;
+				}
+
+				if (!h.empty())
+				{
+					ServerMetrics::addHashed(tf->Size(), ServerMetrics::getTimeUs() - hash_starttime);
 				}
 
 				if (h.empty())
@@ -259,6 +296,28 @@ void BackupServerPrepareHash::operator()(void)
 					}
 				}
 
+				if (!cdc_index_fn.empty())
+				{
+					if (!h.empty()
+						&& cdc_index_store != NULL)
+					{
+						cdc_index_store->commitTemporary(cdc_index_fn, h, t_filesize);
+					}
+					else
+					{
+						Server->deleteFile(os_file_prefix(cdc_index_fn));
+					}
+				}
+				else if (cdc_index_builder.get() != NULL
+					&& !h.empty())
+				{
+					std::vector<SCdcChunk> cdc_chunks;
+					if (cdc_index_builder->finalize(cdc_chunks))
+					{
+						cdc_index_store->store(h, t_filesize, cdc_chunks);
+					}
+				}
+
 				Server->destroy(tf);
 				if(old_file!=NULL)
 				{
@@ -311,7 +370,8 @@ std::string BackupServerPrepareHash::calc_hash(IFsFile * f, std::string method)
 	return std::string();
 }
 
-bool BackupServerPrepareHash::hash_sha(IFile *f, IExtentIterator* extent_iterator, bool hash_with_sparse, IHashFunc& hashf, IHashProgressCallback* progress_callback)
+bool BackupServerPrepareHash::hash_sha(IFile *f, IExtentIterator* extent_iterator, bool hash_with_sparse, IHashFunc& hashf, IHashProgressCallback* progress_callback,
+	CdcIndexBuilder* cdc_index)
 {
 	f->Seek(0);
 	std::vector<char> buf;
@@ -346,6 +406,10 @@ bool BackupServerPrepareHash::hash_sha(IFile *f, IExtentIterator* extent_iterato
 			{
 				skip_start = fpos;
 			}
+			if (cdc_index != NULL)
+			{
+				cdc_index->add(NULL, hash_bsize);
+			}
 			fpos += hash_bsize;
 			rc = hash_bsize;
 			continue;
@@ -373,6 +437,10 @@ bool BackupServerPrepareHash::hash_sha(IFile *f, IExtentIterator* extent_iterato
 			{
 				skip_start = fpos;
 			}
+			if (cdc_index != NULL)
+			{
+				cdc_index->add(buf.data(), hash_bsize);
+			}
 			fpos += hash_bsize;
 			rc = hash_bsize;
 
@@ -398,6 +466,11 @@ bool BackupServerPrepareHash::hash_sha(IFile *f, IExtentIterator* extent_iterato
 		{
 			hashf.hash(buf.data(), rc);
 
+			if (cdc_index != NULL)
+			{
+				cdc_index->add(buf.data(), rc);
+			}
+
 			fpos += rc;
 
 			if (progress_callback != NULL)
@@ -498,6 +571,22 @@ void BackupServerPrepareHash::next_chunk_patcher_bytes(const char *buf, size_t b
 		addUnchangedHashes(file_pos, bsize, is_sparse);
 	}
 
+	if (cdc_index != NULL)
+	{
+		if (buf != NULL)
+		{
+			cdc_index->add(buf, bsize);
+		}
+		else if (is_sparse != NULL && *is_sparse)
+		{
+			cdc_index->add(NULL, bsize);
+		}
+		else
+		{
+			cdc_index->abort();
+		}
+	}
+
 	file_pos += bsize;
 }
 
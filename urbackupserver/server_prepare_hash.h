@@ -15,6 +15,9 @@ const char HASH_FUNC_SHA512_NO_SPARSE = 0;
 const char HASH_FUNC_SHA512 = 1;
 const char HASH_FUNC_TREE = 2;
 
+class MaxFileId;
+class CdcIndexBuilder;
+
 namespace
 {
 	std::string print_hash_func(const char hf)
@@ -32,7 +35,7 @@ namespace
 class BackupServerPrepareHash : public IThread, public IChunkPatcherCallback
 {
 public:
-	BackupServerPrepareHash(IPipe *pPipe, IPipe *pOutput, int pClientid, logid_t logid, bool ignore_hash_mismatch);
+	BackupServerPrepareHash(IPipe *pPipe, IPipe *pOutput, int pClientid, logid_t logid, bool ignore_hash_mismatch, MaxFileId& max_file_id);
 	~BackupServerPrepareHash(void);
 
 	void operator()(void);
@@ -56,7 +59,8 @@ public:
 
 	static std::string calc_hash(IFsFile *f, std::string method);
 
-	static bool hash_sha(IFile *f, IExtentIterator* extent_iterator, bool hash_with_sparse, IHashFunc& hashf, IHashProgressCallback* progress_callback=NULL);
+	static bool hash_sha(IFile *f, IExtentIterator* extent_iterator, bool hash_with_sparse, IHashFunc& hashf, IHashProgressCallback* progress_callback=NULL,
+		CdcIndexBuilder* cdc_index=NULL);
 
 private:
 	
@@ -73,6 +77,7 @@ private:
 
 	IHashFunc* hashf;
 	IFile* hashoutput_f;
+	CdcIndexBuilder* cdc_index;
 
 	int64 file_pos;
 
@@ -87,6 +92,7 @@ private:
 
 	bool ignore_hash_mismatch;
 
+	MaxFileId& max_file_id;
 };
 
 #endif //SERVER_PREPARE_HASH_H
\ No newline at end of file
@@ -25,6 +25,7 @@
 #include <time.h>
 #include <algorithm>
 #include <assert.h>
+#include <thread>
 
 IMutex *ServerStatus::mutex=NULL;
 std::map<std::string, SStatus> ServerStatus::status;
@@ -37,6 +38,195 @@ bool ServerStatus::server_nospc_fatal=false;
 
 const unsigned int inactive_time_const=30*60*1000;
 
+ProcessCounters::ProcessCounters()
+	: seq(0), prepare_hashqueuesize(0), hashqueuesize(0), pcdone(-1),
+	eta_ms(0), eta_set_time(0), speed_bpms(0), speed_set_time(0),
+	past_speed_start(0), past_speed_num(0), total_bytes(-1), done_bytes(0),
+	paused(false), stop(false), active(true)
+{
+	for (size_t i = 0; i < max_past_speeds; ++i)
+	{
+		past_speed_bpms[i].store(0, std::memory_order_relaxed);
+	}
+}
+
+void ProcessCounters::beginWrite()
+{
+	uint64 cseq = seq.load(std::memory_order_relaxed);
+	while (true)
+	{
+		if (cseq & 1)
+		{
+			std::this_thread::yield();
+			cseq = seq.load(std::memory_order_relaxed);
+			continue;
+		}
+
+		if (seq.compare_exchange_weak(cseq, cseq + 1, std::memory_order_acquire,
+			std::memory_order_relaxed))
+		{
+			break;
+		}
+	}
+	std::atomic_thread_fence(std::memory_order_release);
+}
+
+void ProcessCounters::endWrite()
+{
+	seq.fetch_add(1, std::memory_order_release);
+}
+
+void ProcessCounters::setQueuesize(unsigned int p_prepare_hashqueuesize, unsigned int p_hashqueuesize)
+{
+	beginWrite();
+	prepare_hashqueuesize.store(p_prepare_hashqueuesize, std::memory_order_relaxed);
+	hashqueuesize.store(p_hashqueuesize, std::memory_order_relaxed);
+	endWrite();
+}
+
+void ProcessCounters::setEta(int64 p_eta_ms, int64 p_eta_set_time)
+{
+	beginWrite();
+	eta_ms.store(p_eta_ms, std::memory_order_relaxed);
+	eta_set_time.store(p_eta_set_time, std::memory_order_relaxed);
+	endWrite();
+}
+
+void ProcessCounters::setEta(int64 p_eta_ms)
+{
+	beginWrite();
+	eta_ms.store(p_eta_ms, std::memory_order_relaxed);
+	endWrite();
+}
+
+void ProcessCounters::setEtaSetTime(int64 p_eta_set_time)
+{
+	beginWrite();
+	eta_set_time.store(p_eta_set_time, std::memory_order_relaxed);
+	endWrite();
+}
+
+void ProcessCounters::setSpeed(double p_speed_bpms)
+{
+	int64 ctime = Server->getTimeMS();
+
+	beginWrite();
+	size_t start = past_speed_start.load(std::memory_order_relaxed);
+	size_t num = past_speed_num.load(std::memory_order_relaxed);
+	past_speed_bpms[(start + num) % max_past_speeds].store(
+		speed_bpms.load(std::memory_order_relaxed), std::memory_order_relaxed);
+	if (num < max_past_speeds)
+	{
+		past_speed_num.store(num + 1, std::memory_order_relaxed);
+	}
+	else
+	{
+		past_speed_start.store((start + 1) % max_past_speeds, std::memory_order_relaxed);
+	}
+	speed_bpms.store(p_speed_bpms, std::memory_order_relaxed);
+	speed_set_time.store(ctime, std::memory_order_relaxed);
+	endWrite();
+}
+
+void ProcessCounters::setPcDone(int p_pcdone)
+{
+	beginWrite();
+	pcdone.store(p_pcdone, std::memory_order_relaxed);
+	endWrite();
+}
+
+void ProcessCounters::setTotalBytes(int64 p_total_bytes)
+{
+	beginWrite();
+	total_bytes.store(p_total_bytes, std::memory_order_relaxed);
+	endWrite();
+}
+
+void ProcessCounters::setDoneBytes(int64 p_done_bytes)
+{
+	beginWrite();
+	done_bytes.store(p_done_bytes, std::memory_order_relaxed);
+	endWrite();
+}
+
+void ProcessCounters::setDoneBytes(int64 p_done_bytes, int64 p_total_bytes)
+{
+	beginWrite();
+	done_bytes.store(p_done_bytes, std::memory_order_relaxed);
+	total_bytes.store(p_total_bytes, std::memory_order_relaxed);
+	endWrite();
+}
+
+void ProcessCounters::setPaused(bool b)
+{
+	beginWrite();
+	paused.store(b, std::memory_order_relaxed);
+	endWrite();
+}
+
+void ProcessCounters::setStop(bool b)
+{
+	stop.store(b, std::memory_order_release);
+}
+
+bool ProcessCounters::isStopped()
+{
+	return stop.load(std::memory_order_acquire);
+}
+
+bool ProcessCounters::isActive()
+{
+	return active.load(std::memory_order_acquire);
+}
+
+void ProcessCounters::setActive(bool b)
+{
+	active.store(b, std::memory_order_release);
+}
+
+void ProcessCounters::read(SProcess& proc)
+{
+	double past_speeds[max_past_speeds];
+	size_t num;
+	while (true)
+	{
+		uint64 cseq = seq.load(std::memory_order_acquire);
+		if (cseq & 1)
+		{
+			std::this_thread::yield();
+			continue;
+		}
+
+		proc.prepare_hashqueuesize = prepare_hashqueuesize.load(std::memory_order_relaxed);
+		proc.hashqueuesize = hashqueuesize.load(std::memory_order_relaxed);
+		proc.pcdone = pcdone.load(std::memory_order_relaxed);
+		proc.eta_ms = eta_ms.load(std::memory_order_relaxed);
+		proc.eta_set_time = eta_set_time.load(std::memory_order_relaxed);
+		proc.speed_bpms = speed_bpms.load(std::memory_order_relaxed);
+		proc.speed_set_time = speed_set_time.load(std::memory_order_relaxed);
+		proc.total_bytes = total_bytes.load(std::memory_order_relaxed);
+		proc.done_bytes = done_bytes.load(std::memory_order_relaxed);
+		proc.paused = paused.load(std::memory_order_relaxed);
+
+		size_t start = past_speed_start.load(std::memory_order_relaxed);
+		num = past_speed_num.load(std::memory_order_relaxed);
+		for (size_t i = 0; i < num && i < max_past_speeds; ++i)
+		{
+			past_speeds[i] = past_speed_bpms[(start + i) % max_past_speeds].load(std::memory_order_relaxed);
+		}
+
+		std::atomic_thread_fence(std::memory_order_acquire);
+
+		if (seq.load(std::memory_order_relaxed) == cseq)
+		{
+			break;
+		}
+	}
+
+	proc.past_speed_bpms.assign(past_speeds, past_speeds + (std::min)(num, max_past_speeds));
+	proc.stop = isStopped();
+}
+
 void ServerStatus::init_mutex(void)
 {
 	mutex=Server->createMutex();
@@ -129,7 +319,7 @@ void ServerStatus::stopProcess(const std::string &clientname, size_t id, bool b)
 	SProcess* proc = getProcessInt(clientname, id);
 	if(proc!=NULL)
 	{
-		proc->stop=true;
+		proc->counters->setStop(true);
 	}
 }
 
@@ -139,11 +329,22 @@ bool ServerStatus::isProcessStopped(const std::string &clientname, size_t id)
 	SProcess* proc = getProcessInt(clientname, id);
 	if(proc!=NULL)
 	{
-		return proc->stop;
+		return proc->counters->isStopped();
 	}
 	return false;
 }
 
+namespace
+{
+	void read_counters(SStatus& s)
+	{
+		for (size_t i = 0; i < s.processes.size(); ++i)
+		{
+			s.processes[i].counters->read(s.processes[i]);
+		}
+	}
+}
+
 std::vector<SStatus> ServerStatus::getStatus(void)
 {
 	IScopedLock lock(mutex);
@@ -151,6 +352,7 @@ std::vector<SStatus> ServerStatus::getStatus(void)
 	for(std::map<std::string, SStatus>::iterator it=status.begin();it!=status.end();++it)
 	{
 		ret.push_back(it->second);
+		read_counters(ret.back());
 	}
 	return ret;
 }
@@ -159,8 +361,12 @@ SStatus ServerStatus::getStatus(const std::string &clientname)
 {
 	IScopedLock lock(mutex);
 	std::map<std::string, SStatus>::iterator iter=status.find(clientname);
-	if(iter!=status.end())
-		return iter->second;
+	if (iter != status.end())
+	{
+		SStatus ret = iter->second;
+		read_counters(ret);
+		return ret;
+	}
 	else
 		return SStatus();
 }
@@ -259,6 +465,7 @@ size_t ServerStatus::startProcess( const std::string &clientname, SStatusAction
 	SProcess new_proc(++curr_process_id, action, details);
 	new_proc.logid = logid;
 	new_proc.can_stop = can_stop;
+	new_proc.counters.reset(new ProcessCounters);
 	s->processes.push_back(new_proc);
 
 	return new_proc.id;
@@ -273,6 +480,7 @@ bool ServerStatus::stopProcess( const std::string &clientname, size_t id )
 
 	if(it!=s->processes.end())
 	{
+		it->counters->setActive(false);
 		s->processes.erase(it);
 		return true;
 	}
@@ -318,14 +526,7 @@ SProcess* ServerStatus::getProcessInt( const std::string &clientname, size_t id
 
 void ServerStatus::setProcessQueuesize( const std::string &clientname, size_t id, unsigned int prepare_hashqueuesize, unsigned int hashqueuesize )
 {
-	IScopedLock lock(mutex);
-	SProcess* proc = getProcessInt(clientname, id);
-
-	if(proc!=NULL)
-	{
-		proc->prepare_hashqueuesize = prepare_hashqueuesize;
-		proc->hashqueuesize = hashqueuesize;
-	}
+	getProcessHandle(clientname, id)->setQueuesize(prepare_hashqueuesize, hashqueuesize);
 }
 
 void ServerStatus::setProcessStarttime( const std::string &clientname, size_t id, int64 starttime )
@@ -341,42 +542,17 @@ void ServerStatus::setProcessStarttime( const std::string &clientname, size_t id
 
 void ServerStatus::setProcessEta( const std::string &clientname, size_t id, int64 eta_ms, int64 eta_set_time )
 {
-	IScopedLock lock(mutex);
-	SProcess* proc = getProcessInt(clientname, id);
-
-	if(proc!=NULL)
-	{
-		proc->eta_ms = eta_ms;
-		proc->eta_set_time = eta_set_time;
-	}
+	getProcessHandle(clientname, id)->setEta(eta_ms, eta_set_time);
 }
 
 void ServerStatus::setProcessEta( const std::string &clientname, size_t id, int64 eta_ms )
 {
-	IScopedLock lock(mutex);
-	SProcess* proc = getProcessInt(clientname, id);
-
-	if(proc!=NULL)
-	{
-		proc->eta_ms = eta_ms;
-	}
+	getProcessHandle(clientname, id)->setEta(eta_ms);
 }
 
 void ServerStatus::setProcessSpeed(const std::string &clientname, size_t id, double speed_bpms)
 {
-	IScopedLock lock(mutex);
-	SProcess* proc = getProcessInt(clientname, id);
-
-	if (proc != NULL)
-	{
-		proc->past_speed_bpms.push_back(proc->speed_bpms);
-		while (proc->past_speed_bpms.size() >= 20)
-		{
-			proc->past_speed_bpms.pop_front();
-		}
-		proc->speed_bpms = speed_bpms;
-		proc->speed_set_time = Server->getTimeMS();
-	}
+	getProcessHandle(clientname, id)->setSpeed(speed_bpms);
 }
 
 bool ServerStatus::removeStatus( const std::string &clientname )
@@ -398,47 +574,22 @@ bool ServerStatus::removeStatus( const std::string &clientname )
 
 void ServerStatus::setProcessPcDone( const std::string &clientname, size_t id, int pcdone )
 {
-	IScopedLock lock(mutex);
-	SProcess* proc = getProcessInt(clientname, id);
-
-	if(proc!=NULL)
-	{
-		proc->pcdone = pcdone;
-	}
+	getProcessHandle(clientname, id)->setPcDone(pcdone);
 }
 
 void ServerStatus::setProcessTotalBytes(const std::string & clientname, size_t id, int64 total_bytes)
 {
-	IScopedLock lock(mutex);
-	SProcess* proc = getProcessInt(clientname, id);
-
-	if (proc != NULL)
-	{
-		proc->total_bytes = total_bytes;
-	}
+	getProcessHandle(clientname, id)->setTotalBytes(total_bytes);
 }
 
 void ServerStatus::setProcessDoneBytes(const std::string & clientname, size_t id, int64 done_bytes)
 {
-	IScopedLock lock(mutex);
-	SProcess* proc = getProcessInt(clientname, id);
-
-	if (proc != NULL)
-	{
-		proc->done_bytes = done_bytes;
-	}
+	getProcessHandle(clientname, id)->setDoneBytes(done_bytes);
 }
 
 void ServerStatus::setProcessDoneBytes(const std::string & clientname, size_t id, int64 done_bytes, int64 total_bytes)
 {
-	IScopedLock lock(mutex);
-	SProcess* proc = getProcessInt(clientname, id);
-
-	if (proc != NULL)
-	{
-		proc->done_bytes = done_bytes;
-		proc->total_bytes = total_bytes;
-	}
+	getProcessHandle(clientname, id)->setDoneBytes(done_bytes, total_bytes);
 }
 
 void ServerStatus::setProcessDetails(const std::string & clientname, size_t id,
@@ -456,13 +607,7 @@ void ServerStatus::setProcessDetails(const std::string & clientname, size_t id,
 
 void ServerStatus::setProcessPaused(const std::string & clientname, size_t id, bool b)
 {
-	IScopedLock lock(mutex);
-	SProcess* proc = getProcessInt(clientname, id);
-
-	if (proc != NULL)
-	{
-		proc->paused = b;
-	}
+	getProcessHandle(clientname, id)->setPaused(b);
 }
 
 SProcess ServerStatus::getProcess( const std::string &clientname, size_t id )
@@ -471,7 +616,9 @@ SProcess ServerStatus::getProcess( const std::string &clientname, size_t id )
 	SProcess* proc = getProcessInt(clientname, id);
 	if(proc!=NULL)
 	{
-		return *proc;
+		SProcess ret = *proc;
+		ret.counters->read(ret);
+		return ret;
 	}
 	else
 	{
@@ -479,15 +626,30 @@ SProcess ServerStatus::getProcess( const std::string &clientname, size_t id )
 	}
 }
 
-void ServerStatus::setProcessEtaSetTime( const std::string &clientname, size_t id, int64 eta_set_time )
+ProcessHandle ServerStatus::getProcessHandle(const std::string & clientname, size_t id)
 {
-	IScopedLock lock(mutex);
-	SProcess* proc = getProcessInt(clientname, id);
-
-	if(proc!=NULL)
 	{
-		proc->eta_set_time = eta_set_time;
+		IScopedLock lock(mutex);
+		std::map<std::string, SStatus>::iterator it = status.find(clientname);
+		if (it != status.end())
+		{
+			std::vector<SProcess>& processes = it->second.processes;
+			std::vector<SProcess>::iterator proc_it = std::find(processes.begin(), processes.end(), SProcess(id, sa_none, std::string()));
+			if (proc_it != processes.end())
+			{
+				return proc_it->counters;
+			}
+		}
 	}
+
+	ProcessHandle ret(new ProcessCounters);
+	ret->setActive(false);
+	return ret;
+}
+
+void ServerStatus::setProcessEtaSetTime( const std::string &clientname, size_t id, int64 eta_set_time )
+{
+	getProcessHandle(clientname, id)->setEtaSetTime(eta_set_time);
 }
 
 void ServerStatus::setClientId( const std::string &clientname, int clientid)
@@ -4,6 +4,8 @@
 #include <map>
 #include <vector>
 #include <deque>
+#include <atomic>
+#include <memory>
 
 #include "../Interface/Mutex.h"
 #include "../Interface/Thread.h"
@@ -55,6 +57,9 @@ enum ERestore
 };
 
 class IPipe;
+class ProcessCounters;
+
+typedef std::shared_ptr<ProcessCounters> ProcessHandle;
 
 struct SProcess
 {
@@ -89,6 +94,7 @@ struct SProcess
 	int64 done_bytes;
 	bool paused;
 	int backupid;
+	ProcessHandle counters;
 
 	bool operator==(const SProcess& other) const
 	{
@@ -96,6 +102,67 @@ struct SProcess
 	}
 };
 
+/*
+* Progress values of a process which are updated frequently by the backup,
+* hash and download threads. They are updated via the handle returned by
+* ServerStatus::getProcessHandle without taking the global status mutex.
+* Updates of one process are serialized via a sequence counter, which is odd
+* while an update is in progress. Readers retry until they saw an even and
+* unchanged sequence, so they get a consistent snapshot without blocking the
+* writers.
+*/
+class ProcessCounters
+{
+public:
+	ProcessCounters();
+
+	void setQueuesize(unsigned int prepare_hashqueuesize, unsigned int hashqueuesize);
+	void setEta(int64 eta_ms, int64 eta_set_time);
+	void setEta(int64 eta_ms);
+	void setEtaSetTime(int64 eta_set_time);
+	void setSpeed(double speed_bpms);
+	void setPcDone(int pcdone);
+	void setTotalBytes(int64 total_bytes);
+	void setDoneBytes(int64 done_bytes);
+	void setDoneBytes(int64 done_bytes, int64 total_bytes);
+	void setPaused(bool b);
+
+	void setStop(bool b);
+	bool isStopped();
+
+	//False once the process was removed from the status (or was never in it)
+	bool isActive();
+	void setActive(bool b);
+
+	//Copies the current values into proc
+	void read(SProcess& proc);
+
+private:
+	void beginWrite();
+	void endWrite();
+
+	static const size_t max_past_speeds = 19;
+
+	std::atomic<uint64> seq;
+
+	std::atomic<unsigned int> prepare_hashqueuesize;
+	std::atomic<unsigned int> hashqueuesize;
+	std::atomic<int> pcdone;
+	std::atomic<int64> eta_ms;
+	std::atomic<int64> eta_set_time;
+	std::atomic<double> speed_bpms;
+	std::atomic<int64> speed_set_time;
+	std::atomic<double> past_speed_bpms[max_past_speeds];
+	std::atomic<size_t> past_speed_start;
+	std::atomic<size_t> past_speed_num;
+	std::atomic<int64> total_bytes;
+	std::atomic<int64> done_bytes;
+	std::atomic<bool> paused;
+
+	std::atomic<bool> stop;
+	std::atomic<bool> active;
+};
+
 struct SStatus
 {
 	SStatus(void){ online=false; has_status=false;r_online=false; clientid=0; 
@@ -209,6 +276,10 @@ public:
 
 	static SProcess getProcess(const std::string &clientname, size_t id);
 
+	//Handle for updating the progress of the process without the status mutex.
+	//Never NULL. Updates via the handle are ignored once the process is stopped.
+	static ProcessHandle getProcessHandle(const std::string &clientname, size_t id);
+
 private:
 	static SProcess* getProcessInt(const std::string &clientname, size_t id);
 
@@ -39,6 +39,7 @@
 #include "../server.h"
 #include "../server_cleanup.h"
 #include "../dao/ServerCleanupDao.h"
+#include "../BlockDedupStore.h"
 
 extern ICryptoFactory *crypto_fak;
 extern IFileServ* fileserv;
@@ -73,7 +74,7 @@ namespace
 		Server->setContentType(tid, "application/octet-stream");
 		Server->addHeader(tid, "Cache-Control: no-cache");
 		Server->addHeader(tid, "Content-Disposition: attachment; filename=\""+(ExtractFileName(filename))+"\"");
-		IFile *in=Server->openFile(os_file_prefix(filename), MODE_READ);
+		IFile *in=BlockDedupStore::openRead(Server->openFile(os_file_prefix(filename), MODE_READ));
 		if(in!=NULL)
 		{
 			helper.releaseAll();
@@ -836,7 +837,7 @@ namespace backupaccess
 
 					if(path_info.is_file)
 					{
-						f.reset(Server->openFile(os_file_prefix(path_info.full_path), MODE_READ));
+						f.reset(BlockDedupStore::openRead(Server->openFile(os_file_prefix(path_info.full_path), MODE_READ)));
 					}
 
 					if( (path_info.is_file && f.get()) || os_directory_exists(os_file_prefix(path_info.full_path)) )
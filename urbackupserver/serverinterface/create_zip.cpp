@@ -22,19 +22,12 @@
 #include "../../urbackupcommon/os_functions.h"
 #include "../../Interface/File.h"
 #include "backups.h"
+#include "../BlockDedupStore.h"
 #include <memory>
 #include "../../common/data.h"
 
 #define MINIZ_NO_ZLIB_COMPATIBLE_NAMES
 #include "../../common/miniz.h"
-#ifndef _WIN32
-#define _fdopen fdopen
-#define _close close
-#include <unistd.h>
-#else
-#include <io.h>
-#include <fcntl.h>
-#endif
 
 namespace
 {
@@ -66,6 +59,18 @@ size_t my_mz_write_func(void *pOpaque, mz_uint64 file_ofs, const void *pBuf, siz
   return b?n:0;
 }
 
+size_t my_mz_file_read_func(void *pOpaque, mz_uint64 file_ofs, void *pBuf, size_t n)
+{
+	IFile* file = reinterpret_cast<IFile*>(pOpaque);
+	bool has_read_error = false;
+	_u32 read = file->Read(static_cast<int64>(file_ofs), reinterpret_cast<char*>(pBuf), static_cast<_u32>(n), &has_read_error);
+	if (has_read_error)
+	{
+		return 0;
+	}
+	return read;
+}
+
 mz_bool my_mz_needs_keepalive(void *pOpaque)
 {
 	MiniZFileInfo* fileInfo = reinterpret_cast<MiniZFileInfo*>(pOpaque);
@@ -279,45 +284,23 @@ bool add_dir(mz_zip_archive& zip_archive, const std::string& archivefoldername,
 		}
 		else
 		{	
-			std::unique_ptr<IFsFile> add_file(Server->openFile(os_file_prefix(filename), MODE_READ_SEQUENTIAL));
+			std::unique_ptr<IFsFile> add_file(BlockDedupStore::openRead(Server->openFile(os_file_prefix(filename), MODE_READ_SEQUENTIAL)));
 			if (add_file.get() == NULL)
 			{
 				Server->Log("Error opening file \"" + filename + "\" for ZIP file download. " + os_last_error_str(), LL_ERROR);
 				return false;
 			}
 			int64 fsize = add_file->Size();
-#ifndef _WIN32
-			int fd = add_file->getOsHandle(true);
-#else
-			int fd =_open_osfhandle(reinterpret_cast<intptr_t>(add_file->getOsHandle(true)), _O_RDONLY);
-			if (fd == -1)
-			{
-				Server->Log("Error opening file fd for \"" + filename + "\" for ZIP file download." + os_last_error_str(), LL_ERROR);
-				return false;
-			}
-#endif
-			add_file.reset();
-
-			FILE* file = _fdopen(fd, "r");
-			if (file != NULL)
-			{
-				rc = mz_zip_writer_add_cfile(&zip_archive, archivename.c_str(), file, fsize, last_modified, NULL, 0,
-					MZ_DEFAULT_LEVEL,
-					extra_data_local.getDataPtr(), extra_data_local.getDataSize(),
-					extra_data_central.getDataPtr(), extra_data_central.getDataSize());
 
-				if (rc == MZ_FALSE)
-				{
-					os_err = os_last_error_str();
-				}
+			//Read through the IFile (not the OS handle) so that files from the block store work as well
+			rc = mz_zip_writer_add_read_buf_callback(&zip_archive, archivename.c_str(), my_mz_file_read_func, add_file.get(), fsize, last_modified, NULL, 0,
+				MZ_DEFAULT_LEVEL,
+				extra_data_local.getDataPtr(), extra_data_local.getDataSize(),
+				extra_data_central.getDataPtr(), extra_data_central.getDataSize());
 
-				fclose(file);
-			}
-			else
+			if (rc == MZ_FALSE)
 			{
-				Server->Log("Error opening FILE handle for \"" + filename + "\" for ZIP file download." + os_last_error_str(), LL_ERROR);
-				_close(fd);
-				return false;
+				os_err = os_last_error_str();
 			}
 		}
 
@@ -20,6 +20,7 @@
 
 #include "action_header.h"
 #include "../server_status.h"
+#include "../BackupDeletion.h"
 
 void getLastActs(Helper &helper, JSON::Object &ret, std::vector<int> clientids);
 
@@ -62,6 +63,12 @@ ACTION_IMPL(progress)
 			}
 		}
 
+		if(all_stop_rights
+			&& POST.find("pause_deletion")!=POST.end())
+		{
+			BackupDeletion::setPaused(POST["pause_deletion"]=="1");
+		}
+
 		JSON::Array pg;
 		std::vector<SStatus> clients=ServerStatus::getStatus();
 		for(size_t i=0;i<clients.size();++i)
@@ -135,6 +142,7 @@ ACTION_IMPL(progress)
 			}
 		}
 		ret.set("progress", pg);
+		ret.set("deletion_paused", BackupDeletion::isPaused());
 	}
 	else if (session != NULL)
 	{
@@ -18,11 +18,507 @@
 
 #include "TreeDiff.h"
 #include "TreeReader.h"
+#include "TreeStream.h"
 #include <algorithm>
 #include <memory.h>
 #include <memory>
+#include <string.h>
+#include <limits>
 #include "../../Interface/Server.h"
 #include "../../Interface/File.h"
+#include "../../Interface/Thread.h"
+#include "../../Interface/ThreadPool.h"
+#include "../../stringtools.h"
+
+namespace
+{
+	int compareNodes(TreeNode* c1, TreeNode* c2)
+	{
+		if (c1->getType() == 'f'
+			&& c2->getType() == 'd')
+		{
+			return -1;
+		}
+		else if (c1->getType() == 'd'
+			&& c2->getType() == 'f')
+		{
+			return 1;
+		}
+		else
+		{
+			return c1->nameCompare(*c2);
+		}
+	}
+
+	//Trees this large are compared without loading them into memory
+	int64 streaming_min_size()
+	{
+		std::string str_min_size = Server->getServerParameter("treediff_streaming_min_size");
+		if (!str_min_size.empty())
+		{
+			return watoi64(str_min_size)*1024*1024;
+		}
+		return 512LL * 1024 * 1024;
+	}
+
+	//Trees with at least this many nodes are diffed on the task worker threads
+	size_t parallel_min_nodes()
+	{
+		std::string str_min_nodes = Server->getServerParameter("treediff_parallel_min_nodes");
+		if (!str_min_nodes.empty())
+		{
+			int64 min_nodes = watoi64(str_min_nodes);
+			return min_nodes > 0 ? static_cast<size_t>(min_nodes) : (std::numeric_limits<size_t>::max)();
+		}
+		return 200000;
+	}
+
+	//Directories with more nodes are split into their subdirectories
+	const size_t c_parallel_split_size = 50000;
+	//Smaller directories are diffed inline
+	const size_t c_parallel_min_task_size = 1000;
+
+	//Entry in the root directory of the old tree
+	struct SRootEntry
+	{
+		std::string node_str;
+		char type;
+		size_t id;
+		int64 children_offset;
+		bool mapped;
+
+		TreeNode node() const
+		{
+			return TreeNode(node_str.c_str(), type);
+		}
+	};
+
+	class StreamingTreeDiff
+	{
+	public:
+		StreamingTreeDiff(IFile* t1, IFile* t2, std::vector<size_t>& diffs,
+			std::vector<size_t>* deleted_ids, std::vector<size_t>* large_unchanged_subtrees,
+			std::vector<size_t>* modified_inplace_ids, std::vector<size_t>& dir_diffs,
+			std::vector<size_t>* deleted_inplace_ids, bool has_symbit, bool is_windows)
+			: s1(t1), s2(t2), diffs(diffs), deleted_ids(deleted_ids), large_unchanged_subtrees(large_unchanged_subtrees),
+			modified_inplace_ids(modified_inplace_ids), dir_diffs(dir_diffs), deleted_inplace_ids(deleted_inplace_ids),
+			has_symbit(has_symbit), is_windows(is_windows)
+		{}
+
+		bool diffRoot()
+		{
+			std::vector<SRootEntry> root1;
+			if (!readRoot(root1))
+			{
+				return false;
+			}
+
+			std::vector<size_t> unchanged;
+			size_t i1 = 0;
+			bool has2 = s2.next();
+			while (has2 && !s2.isDirEnd())
+			{
+				TreeNode* c2 = s2.getNode();
+
+				int cmp = 1;
+				if (i1 < root1.size())
+				{
+					TreeNode c1 = root1[i1].node();
+					cmp = compareNodes(&c1, c2);
+				}
+
+				//root may be unsorted
+				if (cmp != 0)
+				{
+					for (size_t j = 0; j < root1.size(); ++j)
+					{
+						TreeNode sn = root1[j].node();
+						if (c2->getType() == sn.getType()
+							&& c2->nameEquals(sn)
+							&& !root1[j].mapped)
+						{
+							cmp = 0;
+							i1 = j;
+							break;
+						}
+					}
+				}
+
+				if (cmp == 0)
+				{
+					SRootEntry& e1 = root1[i1];
+					if (e1.type == 'd'
+						&& !s1.seek(e1.children_offset, e1.id + 1))
+					{
+						return false;
+					}
+
+					TreeNode c1 = e1.node();
+					bool changed = false;
+					size_t t2_size = 0;
+					bool mapped;
+					if (!diffEntry(&c1, e1.id, changed, t2_size, unchanged, mapped))
+					{
+						return false;
+					}
+					e1.mapped = mapped;
+
+					++i1;
+					has2 = s2.next();
+				}
+				else if (cmp < 0)
+				{
+					++i1;
+				}
+				else
+				{
+					diffs.push_back(s2.getId());
+					if (!skipSubtree(s2, NULL, NULL))
+					{
+						return false;
+					}
+					has2 = s2.next();
+				}
+			}
+
+			if (s2.hasError())
+			{
+				return false;
+			}
+
+			if (deleted_ids != NULL)
+			{
+				for (size_t i = 0; i < root1.size(); ++i)
+				{
+					SRootEntry& e1 = root1[i];
+					if (e1.mapped)
+					{
+						continue;
+					}
+
+					deleted_ids->push_back(e1.id);
+
+					if (e1.type == 'd')
+					{
+						if (!s1.seek(e1.children_offset, e1.id + 1)
+							|| !skipChildren(s1, deleted_ids, NULL))
+						{
+							return false;
+						}
+					}
+				}
+			}
+
+			if (large_unchanged_subtrees != NULL)
+			{
+				*large_unchanged_subtrees = unchanged;
+			}
+
+			return true;
+		}
+
+	private:
+		bool readRoot(std::vector<SRootEntry>& root1)
+		{
+			size_t depth = 0;
+			while (s1.next())
+			{
+				if (s1.isDirEnd())
+				{
+					if (depth == 0)
+					{
+						break;
+					}
+					--depth;
+					continue;
+				}
+
+				TreeNode* n = s1.getNode();
+				if (depth == 0)
+				{
+					SRootEntry e;
+					e.node_str.assign(n->getDataPtr(), n->getDataSize() + strlen(n->getNamePtr()));
+					e.type = n->getType();
+					e.id = s1.getId();
+					e.children_offset = s1.getNextOffset();
+					e.mapped = false;
+					root1.push_back(e);
+				}
+
+				if (n->getType() == 'd')
+				{
+					++depth;
+				}
+			}
+
+			return !s1.hasError();
+		}
+
+		/**
+		* Compares the current entry of s2 with c1, which has the same type and name.
+		* For directories the children are compared and consumed from both streams
+		*/
+		bool diffEntry(TreeNode* c1, size_t c1_id, bool& changed, size_t& t2_size,
+			std::vector<size_t>& unchanged, bool& mapped)
+		{
+			TreeNode* c2 = s2.getNode();
+			size_t c2_id = s2.getId();
+
+			bool equal_dir = (c1->getType() == 'd' && c2->getType() == 'd');
+			bool data_equals = c1->dataEquals(*c2);
+			bool c2_symlink = TreeDiff::isSymlink(c2, has_symbit, is_windows);
+
+			if (equal_dir && !data_equals)
+			{
+				dir_diffs.push_back(c2_id);
+				changed = true;
+			}
+
+			mapped = equal_dir || data_equals;
+
+			if (mapped)
+			{
+				if (equal_dir)
+				{
+					bool child_changed = false;
+					size_t child_size = 1;
+					std::vector<size_t> child_unchanged;
+					if (!diffChildren(child_changed, child_size, child_unchanged))
+					{
+						return false;
+					}
+
+					if (child_changed)
+					{
+						changed = true;
+					}
+
+					t2_size += child_size;
+
+					if (!child_changed
+						&& child_size > 10)
+					{
+						unchanged.push_back(c2_id);
+					}
+					else
+					{
+						unchanged.insert(unchanged.end(), child_unchanged.begin(), child_unchanged.end());
+					}
+				}
+				else
+				{
+					++t2_size;
+				}
+			}
+			else
+			{
+				if (modified_inplace_ids != NULL
+					&& c1->getType() == c2->getType())
+				{
+					modified_inplace_ids->push_back(c2_id);
+				}
+
+				if (deleted_inplace_ids != NULL
+					&& c1->getType() == c2->getType()
+					&& TreeDiff::isSymlink(c1, has_symbit, is_windows) == c2_symlink)
+				{
+					deleted_inplace_ids->push_back(c1_id);
+				}
+
+				diffs.push_back(c2_id);
+				changed = true;
+				++t2_size;
+			}
+
+#ifndef _WIN32
+			//See TreeDiff::gatherDiffs
+			if (c2_symlink)
+			{
+				changed = true;
+			}
+#endif
+			return true;
+		}
+
+		//Merges the children of the current directories of both streams
+		bool diffChildren(bool& changed, size_t& t2_size, std::vector<size_t>& unchanged)
+		{
+			bool has1 = s1.next();
+			bool has2 = s2.next();
+			while (has2 && !s2.isDirEnd())
+			{
+				TreeNode* c2 = s2.getNode();
+
+				int cmp = 1;
+				if (has1 && !s1.isDirEnd())
+				{
+					cmp = compareNodes(s1.getNode(), c2);
+				}
+
+				if (cmp == 0)
+				{
+					size_t c1_id = s1.getId();
+					bool mapped;
+					if (!diffEntry(s1.getNode(), c1_id, changed, t2_size, unchanged, mapped))
+					{
+						return false;
+					}
+
+					if (!mapped && deleted_ids != NULL)
+					{
+						deleted_ids->push_back(c1_id);
+					}
+
+					has1 = s1.next();
+					has2 = s2.next();
+				}
+				else if (cmp < 0)
+				{
+					if (!deleteEntry())
+					{
+						return false;
+					}
+					changed = true;
+					has1 = s1.next();
+				}
+				else
+				{
+					diffs.push_back(s2.getId());
+					changed = true;
+					if (!skipSubtree(s2, NULL, &t2_size))
+					{
+						return false;
+					}
+					has2 = s2.next();
+				}
+			}
+
+			if (s2.hasError())
+			{
+				return false;
+			}
+
+			while (has1 && !s1.isDirEnd())
+			{
+				if (!deleteEntry())
+				{
+					return false;
+				}
+				has1 = s1.next();
+			}
+
+			return !s1.hasError();
+		}
+
+		bool deleteEntry()
+		{
+			if (deleted_ids != NULL)
+			{
+				deleted_ids->push_back(s1.getId());
+			}
+			return skipSubtree(s1, deleted_ids, NULL);
+		}
+
+		//Skips the subtree of the current entry, collecting the ids of its entries
+		bool skipSubtree(TreeStream& s, std::vector<size_t>* ids, size_t* count)
+		{
+			if (count != NULL)
+			{
+				++(*count);
+			}
+
+			if (s.getNode()->getType() != 'd')
+			{
+				return true;
+			}
+
+			return skipChildren(s, ids, count);
+		}
+
+		bool skipChildren(TreeStream& s, std::vector<size_t>* ids, size_t* count)
+		{
+			size_t depth = 1;
+			while (depth > 0)
+			{
+				if (!s.next())
+				{
+					return !s.hasError();
+				}
+
+				if (s.isDirEnd())
+				{
+					--depth;
+					continue;
+				}
+
+				if (ids != NULL)
+				{
+					ids->push_back(s.getId());
+				}
+
+				if (count != NULL)
+				{
+					++(*count);
+				}
+
+				if (s.getNode()->getType() == 'd')
+				{
+					++depth;
+				}
+			}
+			return true;
+		}
+
+		TreeStream s1;
+		TreeStream s2;
+
+		std::vector<size_t>& diffs;
+		std::vector<size_t>* deleted_ids;
+		std::vector<size_t>* large_unchanged_subtrees;
+		std::vector<size_t>* modified_inplace_ids;
+		std::vector<size_t>& dir_diffs;
+		std::vector<size_t>* deleted_inplace_ids;
+		bool has_symbit;
+		bool is_windows;
+	};
+}
+
+struct TreeDiff::SParallelDiff
+{
+	std::vector<std::unique_ptr<DiffTask> > tasks;
+	std::vector<THREADPOOL_TICKET> tickets;
+};
+
+//Diffs a subtree. Changes are propagated up to the subtree root only
+class TreeDiff::DiffTask : public IThread
+{
+public:
+	DiffTask(TreeNode* c1, TreeNode* c2, size_t depth, bool with_modified_inplace,
+		bool with_deleted_inplace, bool has_symbit, bool is_windows)
+		: c1(c1), c2(c2), depth(depth), with_modified_inplace(with_modified_inplace),
+		with_deleted_inplace(with_deleted_inplace), has_symbit(has_symbit), is_windows(is_windows)
+	{}
+
+	void operator()()
+	{
+		gatherDiffs(c1, c2, depth, diffs, with_modified_inplace ? &modified_inplace_ids : NULL,
+			dir_diffs, with_deleted_inplace ? &deleted_inplace_ids : NULL, has_symbit, is_windows,
+			c2, NULL);
+	}
+
+	TreeNode* c1;
+	TreeNode* c2;
+	size_t depth;
+	bool with_modified_inplace;
+	bool with_deleted_inplace;
+	bool has_symbit;
+	bool is_windows;
+
+	std::vector<size_t> diffs;
+	std::vector<size_t> modified_inplace_ids;
+	std::vector<size_t> dir_diffs;
+	std::vector<size_t> deleted_inplace_ids;
+};
 
 std::vector<size_t> TreeDiff::diffTrees(const std::string& t1, const std::string& t2, bool& error,
 	std::vector<size_t>* deleted_ids, std::vector<size_t>* large_unchanged_subtrees,
@@ -55,6 +551,12 @@ std::vector<size_t> TreeDiff::diffTrees(IFile* t1, IFile* t2, bool& error,
 {
 	std::vector<size_t> ret;
 
+	if (t1->Size() + t2->Size() >= streaming_min_size())
+	{
+		return diffTreesStreaming(t1, t2, error, deleted_ids, large_unchanged_subtrees,
+			modified_inplace_ids, dir_diffs, deleted_inplace_ids, has_symbit, is_windows);
+	}
+
 	TreeReader r1;
 	if(!r1.readTree(t1))
 	{
@@ -69,16 +571,66 @@ std::vector<size_t> TreeDiff::diffTrees(IFile* t1, IFile* t2, bool& error,
 		return ret;
 	}
 
+	std::unique_ptr<SParallelDiff> par;
+	if (r2.getNodes()->size() >= parallel_min_nodes())
+	{
+		par.reset(new SParallelDiff);
+	}
+
 	gatherDiffs(&(*r1.getNodes())[0], &(*r2.getNodes())[0], 0, ret, modified_inplace_ids, 
-		dir_diffs, deleted_inplace_ids, has_symbit, is_windows);
+		dir_diffs, deleted_inplace_ids, has_symbit, is_windows, NULL, par.get());
+
+	if (par.get() != NULL)
+	{
+		finishParallelDiff(*par, ret, modified_inplace_ids, dir_diffs, deleted_inplace_ids);
+	}
+
 	if(deleted_ids!=NULL)
 	{
 		gatherDeletes(&(*r1.getNodes())[0], *deleted_ids);
-		std::sort(deleted_ids->begin(), deleted_ids->end());
 	}
 	if(large_unchanged_subtrees!=NULL)
 	{
 		gatherLargeUnchangedSubtrees(&(*r2.getNodes())[0], *large_unchanged_subtrees);
+	}
+
+	sortResults(ret, deleted_ids, large_unchanged_subtrees, modified_inplace_ids,
+		dir_diffs, deleted_inplace_ids);
+
+	return ret;
+}
+
+std::vector<size_t> TreeDiff::diffTreesStreaming(IFile* t1, IFile* t2, bool& error,
+	std::vector<size_t>* deleted_ids, std::vector<size_t>* large_unchanged_subtrees,
+	std::vector<size_t>* modified_inplace_ids, std::vector<size_t>& dir_diffs,
+	std::vector<size_t>* deleted_inplace_ids, bool has_symbit, bool is_windows)
+{
+	std::vector<size_t> ret;
+
+	StreamingTreeDiff stream_diff(t1, t2, ret, deleted_ids, large_unchanged_subtrees,
+		modified_inplace_ids, dir_diffs, deleted_inplace_ids, has_symbit, is_windows);
+
+	if (!stream_diff.diffRoot())
+	{
+		error = true;
+		return std::vector<size_t>();
+	}
+
+	sortResults(ret, deleted_ids, large_unchanged_subtrees, modified_inplace_ids,
+		dir_diffs, deleted_inplace_ids);
+
+	return ret;
+}
+
+void TreeDiff::sortResults(std::vector<size_t>& ret, std::vector<size_t>* deleted_ids, std::vector<size_t>* large_unchanged_subtrees,
+	std::vector<size_t>* modified_inplace_ids, std::vector<size_t>& dir_diffs, std::vector<size_t>* deleted_inplace_ids)
+{
+	if(deleted_ids!=NULL)
+	{
+		std::sort(deleted_ids->begin(), deleted_ids->end());
+	}
+	if(large_unchanged_subtrees!=NULL)
+	{
 		std::sort(large_unchanged_subtrees->begin(), large_unchanged_subtrees->end());
 	}
 
@@ -94,13 +646,44 @@ std::vector<size_t> TreeDiff::diffTrees(IFile* t1, IFile* t2, bool& error,
 	{
 		std::sort(deleted_inplace_ids->begin(), deleted_inplace_ids->end());
 	}
+}
 
-	return ret;
+void TreeDiff::finishParallelDiff(SParallelDiff& par, std::vector<size_t> &diffs,
+	std::vector<size_t> *modified_inplace_ids, std::vector<size_t> &dir_diffs,
+	std::vector<size_t> *deleted_inplace_ids)
+{
+	Server->getThreadPool()->waitFor(par.tickets);
+
+	for (size_t i = 0; i < par.tasks.size(); ++i)
+	{
+		DiffTask* task = par.tasks[i].get();
+
+		diffs.insert(diffs.end(), task->diffs.begin(), task->diffs.end());
+		dir_diffs.insert(dir_diffs.end(), task->dir_diffs.begin(), task->dir_diffs.end());
+
+		if (modified_inplace_ids != NULL)
+		{
+			modified_inplace_ids->insert(modified_inplace_ids->end(),
+				task->modified_inplace_ids.begin(), task->modified_inplace_ids.end());
+		}
+
+		if (deleted_inplace_ids != NULL)
+		{
+			deleted_inplace_ids->insert(deleted_inplace_ids->end(),
+				task->deleted_inplace_ids.begin(), task->deleted_inplace_ids.end());
+		}
+
+		if (task->c2->getSubtreeChanged())
+		{
+			subtreeChangedParent(task->c2->getParent(), NULL);
+		}
+	}
 }
 
 void TreeDiff::gatherDiffs(TreeNode *t1, TreeNode *t2, size_t depth, std::vector<size_t> &diffs,
 	std::vector<size_t> *modified_inplace_ids, std::vector<size_t> &dir_diffs,
-	std::vector<size_t> *deleted_inplace_ids, bool has_symbit, bool is_windows)
+	std::vector<size_t> *deleted_inplace_ids, bool has_symbit, bool is_windows,
+	TreeNode* task_root, SParallelDiff* par)
 {
 	size_t nc_2=t2->getNumChildren();
 	size_t nc_1=t1->getNumChildren();
@@ -112,20 +695,7 @@ void TreeDiff::gatherDiffs(TreeNode *t1, TreeNode *t2, size_t depth, std::vector
 		int cmp = 1;
 		if(c1!=NULL)
 		{
-			if (c1->getType() == 'f'
-				&& c2->getType() == 'd')
-			{
-				cmp = -1;
-			}
-			else if (c1->getType() == 'd'
-				&& c2->getType() == 'f')
-			{
-				cmp = 1;
-			}
-			else
-			{
-				cmp = c1->nameCompare(*c2);
-			}
+			cmp = compareNodes(c1, c2);
 		}
 
 		//root may be unsorted
@@ -137,7 +707,7 @@ void TreeDiff::gatherDiffs(TreeNode *t1, TreeNode *t2, size_t depth, std::vector
 			{
 				if (c2->getType() == sn->getType()
 					&& c2->nameEquals(*sn)
-					&& sn->getMappedNode()==NULL)
+					&& !sn->isMapped())
 				{
 					cmp = 0;
 					c1 = sn;
@@ -155,16 +725,38 @@ void TreeDiff::gatherDiffs(TreeNode *t1, TreeNode *t2, size_t depth, std::vector
 			if(equal_dir && !data_equals)
 			{
 				dir_diffs.push_back(c2->getId());
-				subtreeChanged(c2);
+				subtreeChanged(c2, task_root);
 			}
 
 			if( equal_dir
 				|| data_equals )
 			{
-				gatherDiffs(c1, c2, depth+1, diffs, modified_inplace_ids, 
-					dir_diffs, deleted_inplace_ids, has_symbit, is_windows);
-				c2->setMappedNode(c1);
-				c1->setMappedNode(c2);
+				size_t treesize = 0;
+				if (par != NULL
+					&& equal_dir)
+				{
+					treesize = getTreesize(c2, c_parallel_split_size);
+				}
+
+				if (treesize > c_parallel_split_size)
+				{
+					gatherDiffs(c1, c2, depth+1, diffs, modified_inplace_ids,
+						dir_diffs, deleted_inplace_ids, has_symbit, is_windows, task_root, par);
+				}
+				else if (treesize > c_parallel_min_task_size)
+				{
+					DiffTask* task = new DiffTask(c1, c2, depth + 1, modified_inplace_ids != NULL,
+						deleted_inplace_ids != NULL, has_symbit, is_windows);
+					par->tasks.push_back(std::unique_ptr<DiffTask>(task));
+					par->tickets.push_back(Server->getThreadPool()->executeTask(task, "treediff"));
+				}
+				else
+				{
+					gatherDiffs(c1, c2, depth+1, diffs, modified_inplace_ids, 
+						dir_diffs, deleted_inplace_ids, has_symbit, is_windows, task_root, NULL);
+				}
+				c2->setMapped(true);
+				c1->setMapped(true);
 			}
 			else
 			{
@@ -182,7 +774,7 @@ void TreeDiff::gatherDiffs(TreeNode *t1, TreeNode *t2, size_t depth, std::vector
 				}
 				
 				diffs.push_back(c2->getId());
-				subtreeChanged(c2);				
+				subtreeChanged(c2, task_root);
 			}
 
 #ifndef _WIN32
@@ -196,7 +788,7 @@ void TreeDiff::gatherDiffs(TreeNode *t1, TreeNode *t2, size_t depth, std::vector
 			**/
 			if (isSymlink(c2, has_symbit, is_windows))
 			{
-				subtreeChanged(c2);
+				subtreeChanged(c2, task_root);
 			}
 #endif
 
@@ -206,12 +798,12 @@ void TreeDiff::gatherDiffs(TreeNode *t1, TreeNode *t2, size_t depth, std::vector
 		else if(cmp<0)
 		{
 			c1=c1->getNextSibling();
-			subtreeChangedParent(t2);
+			subtreeChangedParent(t2, task_root);
 		}
 		else
 		{
 			diffs.push_back(c2->getId());
-			subtreeChanged(c2);
+			subtreeChanged(c2, task_root);
 
 			c2=c2->getNextSibling();
 		}
@@ -223,7 +815,7 @@ void TreeDiff::gatherDeletes(TreeNode *t1, std::vector<size_t> &deleted_ids)
 	TreeNode *c1=t1->getFirstChild();
 	while(c1!=NULL)
 	{
-		if(c1->getMappedNode()==NULL)
+		if(!c1->isMapped())
 		{
 			deleted_ids.push_back(c1->getId());
 		}
@@ -232,15 +824,15 @@ void TreeDiff::gatherDeletes(TreeNode *t1, std::vector<size_t> &deleted_ids)
 	}
 }
 
-void TreeDiff::subtreeChanged(TreeNode* t2)
+void TreeDiff::subtreeChanged(TreeNode* t2, TreeNode* task_root)
 {
 	TreeNode* p = t2->getParent();
 	if(p==NULL) return;
 
-	subtreeChangedParent(p);
+	subtreeChangedParent(p, task_root);
 }
 
-void TreeDiff::subtreeChangedParent(TreeNode * p)
+void TreeDiff::subtreeChangedParent(TreeNode * p, TreeNode* task_root)
 {
 	do
 	{
@@ -250,6 +842,13 @@ void TreeDiff::subtreeChangedParent(TreeNode * p)
 		}
 
 		p->setSubtreeChanged(true);
+
+		//Nodes above are propagated after the task finished
+		if (p == task_root)
+		{
+			return;
+		}
+
 		p = p->getParent();
 	} while (p != NULL);
 }
@@ -260,7 +859,7 @@ void TreeDiff::gatherLargeUnchangedSubtrees( TreeNode *t2, std::vector<size_t> &
 	while(c2!=NULL)
 	{
 		if(!c2->getSubtreeChanged()
-			&& c2->getMappedNode()!=NULL
+			&& c2->isMapped()
 			&& getTreesize(c2,10)>10)
 		{
 			large_unchanged_subtrees.push_back(c2->getId());
@@ -17,14 +17,30 @@ public:
 		std::vector<size_t>* modified_inplace_ids, std::vector<size_t>& dir_diffs,
 		std::vector<size_t>* deleted_inplace_ids, bool has_symbit, bool is_windows);
 
+	//Compares the sorted file lists entry by entry without loading them into memory
+	static std::vector<size_t> diffTreesStreaming(IFile* t1, IFile* t2, bool& error,
+		std::vector<size_t>* deleted_ids, std::vector<size_t>* large_unchanged_subtrees,
+		std::vector<size_t>* modified_inplace_ids, std::vector<size_t>& dir_diffs,
+		std::vector<size_t>* deleted_inplace_ids, bool has_symbit, bool is_windows);
+
+	static bool isSymlink(TreeNode* n, bool has_symbit, bool is_window);
+
 private:
+	class DiffTask;
+	struct SParallelDiff;
+
 	static void gatherDiffs(TreeNode *t1, TreeNode *t2, size_t depth, std::vector<size_t> &diffs,
 		std::vector<size_t> *modified_inplace_ids, std::vector<size_t> &dir_diffs,
-		std::vector<size_t> *deleted_inplace_ids, bool has_symbit, bool is_window);
+		std::vector<size_t> *deleted_inplace_ids, bool has_symbit, bool is_window,
+		TreeNode* task_root, SParallelDiff* par);
+	static void finishParallelDiff(SParallelDiff& par, std::vector<size_t> &diffs,
+		std::vector<size_t> *modified_inplace_ids, std::vector<size_t> &dir_diffs,
+		std::vector<size_t> *deleted_inplace_ids);
 	static void gatherDeletes(TreeNode *t1, std::vector<size_t> &deleted_ids);
 	static void gatherLargeUnchangedSubtrees(TreeNode *t2, std::vector<size_t> &changed_subtrees);
-	static void subtreeChanged(TreeNode* t2);
-	static void subtreeChangedParent(TreeNode* p);
+	static void subtreeChanged(TreeNode* t2, TreeNode* task_root);
+	static void subtreeChangedParent(TreeNode* p, TreeNode* task_root);
 	static size_t getTreesize(TreeNode* t, size_t limit);
-	static bool isSymlink(TreeNode* n, bool has_symbit, bool is_window);
+	static void sortResults(std::vector<size_t>& ret, std::vector<size_t>* deleted_ids, std::vector<size_t>* large_unchanged_subtrees,
+		std::vector<size_t>* modified_inplace_ids, std::vector<size_t>& dir_diffs, std::vector<size_t>* deleted_inplace_ids);
 };
\ No newline at end of file
@@ -21,20 +21,33 @@
 #include <memory.h>
 #include <string.h>
 
-TreeNode::TreeNode(const char* name, const char* data, TreeNode *parent, char node_type)
-	: name(name), data(data), parent(parent), num_children(0), nextSibling(NULL), mapped_node(NULL),
-	  subtree_changed(false), node_type(node_type), id(0)
+TreeNode::TreeNode(const char* str, char node_type)
+	: str(str), next_sibling_off(0), parent_off(0), num_children(0), id(0),
+	  node_type(node_type), subtree_changed(false), mapped(false)
 {
 }
 
 TreeNode::TreeNode(void)
-	: num_children(0), nextSibling(NULL), mapped_node(NULL), subtree_changed(false), parent(NULL),
-	name(NULL), data(NULL), node_type(0), id(0)
+	: str(NULL), next_sibling_off(0), parent_off(0), num_children(0), id(0),
+	  node_type(0), subtree_changed(false), mapped(false)
 {
 }
 
+const char* TreeNode::namePtr() const
+{
+	if(str!=NULL)
+	{
+		return str+getDataSize();
+	}
+	else
+	{
+		return NULL;
+	}
+}
+
 std::string TreeNode::getName()
 {
+	const char* name=namePtr();
 	if(name)
 	{
 		return name;
@@ -47,9 +60,9 @@ std::string TreeNode::getName()
 
 std::string TreeNode::getData()
 {
-	if(data!=NULL)
+	if(str!=NULL)
 	{
-		return std::string(data, data+getDataSize());
+		return std::string(str, str+getDataSize());
 	}
 	else
 	{
@@ -57,19 +70,19 @@ std::string TreeNode::getData()
 	}
 }
 
-const char * TreeNode::getDataPtr()
+const char* TreeNode::getNamePtr()
 {
-	return data;
+	return namePtr();
 }
 
-void TreeNode::setName(const char* pName)
+const char * TreeNode::getDataPtr()
 {
-	name=pName;
+	return str;
 }
 
-void TreeNode::setData(const char* pData)
+void TreeNode::setStr(const char* pStr)
 {
-	data=pData;
+	str=pStr;
 }
 
 size_t TreeNode::getNumChildren()
@@ -91,7 +104,14 @@ TreeNode* TreeNode::getFirstChild(void)
 
 void TreeNode::setNextSibling(TreeNode *pNextSibling)
 {
-	nextSibling=pNextSibling;
+	if(pNextSibling!=NULL)
+	{
+		next_sibling_off=static_cast<_u32>(pNextSibling-this);
+	}
+	else
+	{
+		next_sibling_off=0;
+	}
 }
 
 void TreeNode::incrementNumChildren(void)
@@ -101,7 +121,7 @@ void TreeNode::incrementNumChildren(void)
 
 void TreeNode::setId(size_t pId)
 {
-	id=pId;
+	id=static_cast<_u32>(pId);
 }
 
 size_t TreeNode::getId(void) const
@@ -111,7 +131,14 @@ size_t TreeNode::getId(void) const
 
 TreeNode *TreeNode::getNextSibling(void)
 {
-	return nextSibling;
+	if(next_sibling_off!=0)
+	{
+		return this+next_sibling_off;
+	}
+	else
+	{
+		return NULL;
+	}
 }
 
 TreeNode* TreeNode::getChild(size_t n)
@@ -135,22 +162,36 @@ TreeNode* TreeNode::getChild(size_t n)
 
 void TreeNode::setParent(TreeNode *pParent)
 {
-	parent=pParent;
+	if(pParent!=NULL)
+	{
+		parent_off=static_cast<_u32>(this-pParent);
+	}
+	else
+	{
+		parent_off=0;
+	}
 }
 
 TreeNode *TreeNode::getParent(void)
 {
-	return parent;
+	if(parent_off!=0)
+	{
+		return this-parent_off;
+	}
+	else
+	{
+		return NULL;
+	}
 }
 
-TreeNode *TreeNode::getMappedNode()
+bool TreeNode::isMapped()
 {
-	return mapped_node;
+	return mapped;
 }
 
-void TreeNode::setMappedNode(TreeNode *pMappedNode)
+void TreeNode::setMapped(bool b)
 {
-	mapped_node=pMappedNode;
+	mapped=b;
 }
 
 void TreeNode::setSubtreeChanged( bool b )
@@ -165,13 +206,15 @@ bool TreeNode::getSubtreeChanged()
 
 int TreeNode::nameCompare(const TreeNode& other)
 {
-	if(name!=NULL && other.name!=NULL)
+	const char* name=namePtr();
+	const char* other_name=other.namePtr();
+	if(name!=NULL && other_name!=NULL)
 	{
-		return strcmp(name, other.name);
+		return strcmp(name, other_name);
 	}
 	else
 	{
-		if(name==other.name)
+		if(name==other_name)
 		{
 			return 0;
 		}
@@ -188,13 +231,15 @@ int TreeNode::nameCompare(const TreeNode& other)
 
 bool TreeNode::nameEquals( const TreeNode& other )
 {
-	if(name!=NULL && other.name!=NULL)
+	const char* name=namePtr();
+	const char* other_name=other.namePtr();
+	if(name!=NULL && other_name!=NULL)
 	{
-		return strcmp(name, other.name)==0;
+		return strcmp(name, other_name)==0;
 	}
 	else
 	{
-		return name==other.name;
+		return name==other_name;
 	}
 }
 
@@ -205,13 +250,13 @@ bool TreeNode::dataEquals( const TreeNode& other )
 		return false;
 	}
 
-	if(data!=NULL && other.data!=NULL)
+	if(str!=NULL && other.str!=NULL)
 	{
-		return memcmp(data, other.data, getDataSize())==0;
+		return memcmp(str, other.str, getDataSize())==0;
 	}
 	else
 	{
-		return data==other.data;
+		return str==other.str;
 	}
 }
 
@@ -221,19 +266,24 @@ bool TreeNode::equals( const TreeNode& other )
 		dataEquals(other);
 }
 
-size_t TreeNode::getDataSize()
+size_t TreeNode::getDataSize() const
 {
 	if(node_type=='d')
 	{
 		return c_treenode_data_size_dir;
 	}
-	else
+	else if(node_type=='f')
 	{
 		return c_treenode_data_size_file;
 	}
+	else
+	{
+		//Root node without data
+		return 0;
+	}
 }
 
-char TreeNode::getType()
+char TreeNode::getType() const
 {
 	return node_type;
 }
@@ -9,17 +9,22 @@
 const size_t c_treenode_data_size_file=2*sizeof(int64);
 const size_t c_treenode_data_size_dir=sizeof(int64);
 
+/**
+* Nodes are stored in pre-order in one vector. Links to the next sibling and the
+* parent are stored as 32-bit distances to this node. The node data is followed by
+* the zero terminated name in the string buffer of the tree
+*/
 class TreeNode
 {
 public:
-	TreeNode(const char* name, const char* data, TreeNode *parent, char node_type);
+	TreeNode(const char* str, char node_type);
 	TreeNode(void);
 
-	void setName(const char* pName);
-	void setData(const char* pData);
+	void setStr(const char* pStr);
 
 	std::string getName();
 	std::string getData();
+	const char* getNamePtr();
 	const char* getDataPtr();
 
 	bool equals(const TreeNode& other);
@@ -37,32 +42,32 @@ public:
 	TreeNode *getParent(void);
 
 	void setType(char t);
-	char getType();
+	char getType() const;
 
 	void setId(size_t pId);
 	size_t getId(void) const;
 
-	TreeNode *getMappedNode();
-	void setMappedNode(TreeNode *pMappedNode);
+	bool isMapped();
+	void setMapped(bool b);
 
 	void setSubtreeChanged(bool b);
 	bool getSubtreeChanged();
 
-	size_t getDataSize();
+	size_t getDataSize() const;
 
 private:
-	char node_type;
+	const char* namePtr() const;
 
-	const char* name;
-	const char* data;
+	const char* str;
 
-	TreeNode *nextSibling;
-	TreeNode *parent;
-	TreeNode *mapped_node;
-	size_t num_children;
-	bool subtree_changed;
+	_u32 next_sibling_off;
+	_u32 parent_off;
+	_u32 num_children;
+	_u32 id;
 
-	size_t id;
+	char node_type;
+	bool subtree_changed;
+	bool mapped;
 };
 
 
@@ -26,6 +26,7 @@
 #include "../../Interface/Server.h"
 #include "../../Interface/File.h"
 #include <assert.h>
+#include <limits.h>
 
 bool TreeReader::readTree(IFile* f)
 {
@@ -141,6 +142,12 @@ bool TreeReader::readTree(IFile* f)
 	}
 	while(read>0);
 
+	if(lines>=UINT_MAX)
+	{
+		Log("Too many entries in tree file "+f->getFilename()+" ("+convert(lines)+")");
+		return false;
+	}
+
 	name.clear();
 
 	f->Seek(0);
@@ -164,7 +171,7 @@ bool TreeReader::readTree(IFile* f)
 	memcpy(&stringbuffer[0], root_str.c_str(), root_str.size()+1);
 	stringbuffer_pos+=root_str.size()+1;
 
-	nodes[0].setName(&stringbuffer[0]);
+	nodes[0].setStr(&stringbuffer[0]);
 
 	parents.push(&nodes[0]);
 	lastNodes.push(&nodes[0]);
@@ -260,9 +267,7 @@ bool TreeReader::readTree(IFile* f)
 					{
 						if(name!="..")
 						{
-							memcpy(&stringbuffer[stringbuffer_pos], name.c_str(), name.size()+1);
-							nodes[idx].setName(&stringbuffer[stringbuffer_pos]);
-							stringbuffer_pos+=name.size()+1;
+							nodes[idx].setStr(&stringbuffer[stringbuffer_pos]);
 							nodes[idx].setId(lines);
 
 							char ch=data[0];
@@ -276,13 +281,10 @@ bool TreeReader::readTree(IFile* f)
 								_i64 ifilesize=os_atoi64(filesize);
 								_i64 ilast_mod=os_atoi64(last_mod);
 
-								char* ndata=&stringbuffer[stringbuffer_pos];
 								memcpy(&stringbuffer[stringbuffer_pos], &ifilesize, sizeof(_i64));
 								stringbuffer_pos+=sizeof(_i64);
 								memcpy(&stringbuffer[stringbuffer_pos], &ilast_mod, sizeof(_i64));
 								stringbuffer_pos+=sizeof(_i64);
-
-								nodes[idx].setData(ndata);
 							}
 							else
 							{
@@ -290,14 +292,15 @@ bool TreeReader::readTree(IFile* f)
 								std::string last_mod=getafter(" ", sdata);
 
 								_i64 ilast_mod=os_atoi64(last_mod);
-								char* ndata=&stringbuffer[stringbuffer_pos];
 
 								memcpy(&stringbuffer[stringbuffer_pos], &ilast_mod, sizeof(_i64));
 								stringbuffer_pos+=sizeof(_i64);
-
-								nodes[idx].setData(ndata);
 							}
 
+							//Data is followed by the name
+							memcpy(&stringbuffer[stringbuffer_pos], name.c_str(), name.size()+1);
+							stringbuffer_pos+=name.size()+1;
+
 							if(firstChild)
 							{
 								lastNodes.push(&nodes[idx]);
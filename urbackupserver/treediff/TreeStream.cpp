@@ -0,0 +1,119 @@
+/*************************************************************************
+*    UrBackup - Client/Server backup system
+*    Copyright (C) 2011-2016 Martin Raiber
+*
+*    This program is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU Affero General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU Affero General Public License for more details.
+*
+*    You should have received a copy of the GNU Affero General Public License
+*    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**************************************************************************/
+
+#include "TreeStream.h"
+#include "../../Interface/Server.h"
+#include "../../Interface/File.h"
+#include "../../stringtools.h"
+
+TreeStream::TreeStream(IFile* f)
+	: f(f), buffer(512 * 1024), buffer_pos(0), buffer_size(0), buffer_offset(0),
+	lines(0), curr_id(0), has_error(false)
+{
+	f->Seek(0);
+}
+
+bool TreeStream::next()
+{
+	while (true)
+	{
+		if (buffer_pos == buffer_size)
+		{
+			buffer_offset += buffer_size;
+			buffer_pos = 0;
+
+			bool has_read_error = false;
+			buffer_size = f->Read(buffer.data(), static_cast<_u32>(buffer.size()), &has_read_error);
+
+			if (has_read_error)
+			{
+				Server->Log("Error reading from tree file " + f->getFilename(), LL_ERROR);
+				has_error = true;
+				buffer_size = 0;
+				return false;
+			}
+
+			if (buffer_size == 0)
+			{
+				return false;
+			}
+		}
+
+		if (parser.nextEntry(buffer.data(), buffer_size, buffer_pos, data, NULL))
+		{
+			curr_id = lines;
+			++lines;
+
+			char type = data.isdir ? 'd' : 'f';
+
+			node_str.clear();
+			if (type == 'f')
+			{
+				node_str.append(reinterpret_cast<char*>(&data.size), sizeof(data.size));
+			}
+			node_str.append(reinterpret_cast<char*>(&data.last_modified), sizeof(data.last_modified));
+			node_str.append(data.name);
+
+			node = TreeNode(node_str.c_str(), type);
+
+			return true;
+		}
+	}
+}
+
+bool TreeStream::seek(int64 offset, size_t line)
+{
+	if (!f->Seek(offset))
+	{
+		Server->Log("Error seeking in tree file " + f->getFilename() + " to " + convert(offset), LL_ERROR);
+		has_error = true;
+		return false;
+	}
+
+	buffer_offset = offset;
+	buffer_pos = 0;
+	buffer_size = 0;
+	parser.reset();
+	lines = line;
+	return true;
+}
+
+bool TreeStream::isDirEnd()
+{
+	return data.isdir && data.name == "..";
+}
+
+TreeNode* TreeStream::getNode()
+{
+	return &node;
+}
+
+size_t TreeStream::getId()
+{
+	return curr_id;
+}
+
+int64 TreeStream::getNextOffset()
+{
+	return buffer_offset + buffer_pos;
+}
+
+bool TreeStream::hasError()
+{
+	return has_error;
+}
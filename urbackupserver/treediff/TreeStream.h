@@ -0,0 +1,45 @@
+#include "TreeNode.h"
+#include "../../urbackupcommon/filelist_utils.h"
+
+class IFile;
+
+/**
+* Reads the entries of a file list one at a time. Only the current entry
+* is kept in memory
+*/
+class TreeStream
+{
+public:
+	TreeStream(IFile* f);
+
+	//Returns false at the end of the file or on error
+	bool next();
+
+	//Continue reading at offset, which is the start of line number line
+	bool seek(int64 offset, size_t line);
+
+	bool isDirEnd();
+	TreeNode* getNode();
+	size_t getId();
+
+	//Offset of the entry after the current one
+	int64 getNextOffset();
+
+	bool hasError();
+
+private:
+	IFile* f;
+	std::vector<char> buffer;
+	size_t buffer_pos;
+	size_t buffer_size;
+	int64 buffer_offset;
+
+	FileListParser parser;
+	SFile data;
+	size_t lines;
+	size_t curr_id;
+	bool has_error;
+
+	std::string node_str;
+	TreeNode node;
+};
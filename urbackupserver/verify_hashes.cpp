@@ -35,6 +35,8 @@
 #include "serverinterface/helper.h"
 #include "server.h"
 #include "../urbackupcommon/TreeHash.h"
+#include "FileManifest.h"
+#include "BlockDedupStore.h"
 
 const _u32 c_read_blocksize=4096;
 const size_t draw_segments=30;
@@ -126,7 +128,7 @@ private:
 bool verify_file(db_single_result &res, _i64 &curr_verified, _i64 verify_size, bool& missing, const std::string& backuppath)
 {
 	std::string fp=res["fullpath"];
-	std::unique_ptr<IFsFile> f(Server->openFile(os_file_prefix(fp), MODE_READ));
+	std::unique_ptr<IFsFile> f(BlockDedupStore::openRead(Server->openFile(os_file_prefix(fp), MODE_READ)));
 	if( f.get()==NULL )
 	{
 		std::cout << std::endl;
@@ -366,6 +368,32 @@ bool verify_hashes(std::string arg)
 	_i64 verify_size=watoi64(res[0]["c"]);
 	_i64 curr_verified=0;
 
+	std::vector<int> manifest_backupids;
+	{
+		IQuery* q_filter = files_db->Prepare("SELECT 1 AS c FROM (SELECT ? AS backupid, ? AS clientid) WHERE "+filter, false);
+		std::vector<int> backupids = FileManifest::getBackupIds();
+		for (size_t i = 0; i < backupids.size(); ++i)
+		{
+			std::unique_ptr<FileManifest> manifest(FileManifest::open(backupids[i]));
+			if (manifest.get() == NULL)
+			{
+				continue;
+			}
+
+			q_filter->Bind(backupids[i]);
+			q_filter->Bind(manifest->getClientid());
+			db_results res_filter = q_filter->Read();
+			q_filter->Reset();
+
+			if (!res_filter.empty())
+			{
+				manifest_backupids.push_back(backupids[i]);
+				verify_size += manifest->getTotalSize();
+			}
+		}
+		files_db->destroyQuery(q_filter);
+	}
+
 	std::cout << "To be verified: " << PrettyPrintBytes(verify_size) << " of files" << std::endl;
 
 	_i64 crowid=0;
@@ -423,6 +451,43 @@ bool verify_hashes(std::string arg)
 		}
 	}
 
+	for (size_t i = 0; i < manifest_backupids.size(); ++i)
+	{
+		std::unique_ptr<FileManifest> manifest(FileManifest::open(manifest_backupids[i]));
+		if (manifest.get() == NULL)
+		{
+			continue;
+		}
+
+		std::string backuppath;
+		q_get_backuppath->Bind(manifest_backupids[i]);
+		db_results res_backuppath = q_get_backuppath->Read();
+		q_get_backuppath->Reset();
+		if (!res_backuppath.empty())
+		{
+			backuppath = res_backuppath[0]["path"];
+		}
+
+		ServerFilesDao::SFileEntry entry;
+		while (manifest->next(entry))
+		{
+			db_single_result res_entry;
+			res_entry["id"] = "0";
+			res_entry["fullpath"] = entry.fullpath;
+			res_entry["shahash"] = entry.shahash;
+			res_entry["filesize"] = convert(entry.filesize);
+			res_entry["backupid"] = convert(manifest_backupids[i]);
+
+			//Manifest entries cannot be deleted individually, so failures are only reported
+			bool is_missing = false;
+			if (!verify_file(res_entry, curr_verified, verify_size, is_missing, backuppath))
+			{
+				v_failure << "Verification of \"" << entry.fullpath << "\" failed" << (is_missing ? " (missing)" : "") << "\r\n";
+				is_okay = false;
+			}
+		}
+	}
+
 	std::cout << std::endl;
 	
 	if(v_failure.is_open() && is_okay)